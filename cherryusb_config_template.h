@@ -80,6 +80,11 @@
 #define CONFIG_USBDEV_MSC_MAX_BUFSIZE 512
 #endif
 
+/* number of msc data buffers, set 2 or more to overlap storage access with usb transfer */
+#ifndef CONFIG_USBDEV_MSC_BUFCOUNT
+#define CONFIG_USBDEV_MSC_BUFCOUNT 1
+#endif
+
 #ifndef CONFIG_USBDEV_MSC_MANUFACTURER_STRING
 #define CONFIG_USBDEV_MSC_MANUFACTURER_STRING ""
 #endif
@@ -98,6 +103,9 @@
 /* move msc read & write from isr to thread */
 // #define CONFIG_USBDEV_MSC_THREAD
 
+/* usbd_msc_sector_read & write only start the access, call usbd_msc_sector_read_done & write_done when finished */
+// #define CONFIG_USBDEV_MSC_ASYNC
+
 #ifndef CONFIG_USBDEV_MSC_PRIO
 #define CONFIG_USBDEV_MSC_PRIO 4
 #endif
@@ -145,9 +153,32 @@
 #define CONFIG_USBDEV_RNDIS_VENDOR_DESC "CherryUSB"
 #endif
 
+/* max bytes of one rndis bulk transfer, several packet messages are batched into one transfer */
+#ifndef CONFIG_USBDEV_RNDIS_MAX_TRANSFER_SIZE
+#define CONFIG_USBDEV_RNDIS_MAX_TRANSFER_SIZE 1580
+#endif
+
 #define CONFIG_USBDEV_RNDIS_USING_LWIP
 #define CONFIG_USBDEV_CDC_ECM_USING_LWIP
 
+/* ntb size of cdc ncm in transfers, several frames are packed into one ntb, max 65535 */
+#ifndef CONFIG_USBDEV_CDC_NCM_NTB_MAX_SIZE
+#define CONFIG_USBDEV_CDC_NCM_NTB_MAX_SIZE 2048
+#endif
+
+/* if enabled, a partly filled ntb is held up to this many ms to collect more frames, otherwise it is sent when bus is idle */
+// #define CONFIG_USBDEV_CDC_NCM_TX_FLUSH_TIMEOUT 1
+
+/* received ntbs are handed to lwip without copying, one ntb stays in use until all its pbufs are freed */
+#ifndef CONFIG_USBDEV_CDC_NCM_RX_NTB_NUM
+#define CONFIG_USBDEV_CDC_NCM_RX_NTB_NUM 2
+#endif
+
+/* max datagrams per received ntb reported to host, also the number of zero copy pbufs per ntb */
+#ifndef CONFIG_USBDEV_CDC_NCM_RX_MAX_DATAGRAMS
+#define CONFIG_USBDEV_CDC_NCM_RX_MAX_DATAGRAMS 16
+#endif
+
 /* ================ USB HOST Stack Configuration ================== */
 
 #define CONFIG_USBHOST_MAX_RHPORTS          1
@@ -172,9 +203,18 @@
 #ifndef CONFIG_USBHOST_PSC_STACKSIZE
 #define CONFIG_USBHOST_PSC_STACKSIZE 2048
 #endif
+/* threads per bus that finish enumeration after addressing, 0 enumerates in the hub thread */
+#ifndef CONFIG_USBHOST_ENUM_THREADS
+#define CONFIG_USBHOST_ENUM_THREADS 0
+#endif
 
 //#define CONFIG_USBHOST_GET_STRING_DESC
 
+/* devices whose parsed config descriptor is kept for the next connect, 0 is disable */
+#ifndef CONFIG_USBHOST_DESC_CACHE
+#define CONFIG_USBHOST_DESC_CACHE 0
+#endif
+
 // #define CONFIG_USBHOST_MSOS_ENABLE
 #ifndef CONFIG_USBHOST_MSOS_VENDOR_CODE
 #define CONFIG_USBHOST_MSOS_VENDOR_CODE 0x00
@@ -193,10 +233,42 @@
 #define CONFIG_USBHOST_SERIAL_RX_SIZE 2048
 #endif
 
+/* per serial device, writes are queued here and batched into bulk out transfers, must be a power of 2 */
+#ifndef CONFIG_USBHOST_SERIAL_TX_SIZE
+#define CONFIG_USBHOST_SERIAL_TX_SIZE 2048
+#endif
+
+/* bulk out urbs queued from the tx ring at once, each one has its own nocache bounce buffer */
+#ifndef CONFIG_USBHOST_SERIAL_TX_URB_NUM
+#define CONFIG_USBHOST_SERIAL_TX_URB_NUM 2
+#endif
+
 #ifndef CONFIG_USBHOST_MSC_TIMEOUT
 #define CONFIG_USBHOST_MSC_TIMEOUT 5000
 #endif
 
+/* per msc device, sequential reads are served from one larger command, 0 is disable */
+#ifndef CONFIG_USBHOST_MSC_READAHEAD_SIZE
+#define CONFIG_USBHOST_MSC_READAHEAD_SIZE 0
+#endif
+
+/* per msc device, reads and writes on unaligned buffers are copied through it in pieces of this size */
+#ifndef CONFIG_USBHOST_MSC_BOUNCE_SIZE
+#define CONFIG_USBHOST_MSC_BOUNCE_SIZE 4096
+#endif
+
+/* per msc device, lru cache of small reads and writes, dirty sectors are written back on sync, 0 is disable */
+#ifndef CONFIG_USBHOST_MSC_CACHE_SIZE
+#define CONFIG_USBHOST_MSC_CACHE_SIZE 0
+#endif
+
+/* drive msc devices with a uas alternate setting through usb attached scsi, high speed only */
+// #define CONFIG_USBHOST_MSC_UAS
+
+#ifndef CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH
+#define CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH 4
+#endif
+
 /* This parameter affects usb performance, and depends on (TCP_WND)tcp eceive windows size,
  * you can change to 2K ~ 16K and must be larger than TCP RX windows size in order to avoid being overflow.
  */
@@ -209,16 +281,27 @@
 #define CONFIG_USBHOST_RNDIS_ETH_MAX_TX_SIZE (2048)
 #endif
 
-/* This parameter affects usb performance, and depends on (TCP_WND)tcp eceive windows size,
- * you can change to 2K ~ 16K and must be larger than TCP RX windows size in order to avoid being overflow.
- */
+/* rx ntb size, the device is asked to send ntbs no larger than this, max 65535 */
 #ifndef CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE
 #define CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE (2048)
 #endif
-/* Because lwip do not support multi pbuf at a time, so increasing this variable has no performance improvement */
+/* tx ntb size, frames queued while the previous ntb is on the bus are packed into one ntb, max 65535 */
 #ifndef CONFIG_USBHOST_CDC_NCM_ETH_MAX_TX_SIZE
 #define CONFIG_USBHOST_CDC_NCM_ETH_MAX_TX_SIZE (2048)
 #endif
+/* number of rx ntb buffers, each one is CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE bytes */
+#ifndef CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM
+#define CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM 3
+#endif
+/* rx urbs on the bus at a time, must be less than CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM.
+ * A controller that refuses the extra urbs on an open pipe (dwc2) falls back to one,
+ * set it to 1 for controllers that would put a second urb on another channel instead.
+ */
+#ifndef CONFIG_USBHOST_CDC_NCM_RX_URB_NUM
+#define CONFIG_USBHOST_CDC_NCM_RX_URB_NUM 2
+#endif
+/* if enabled, a partly filled tx ntb is held up to this many ms to collect more frames, otherwise it is sent when bus is idle */
+// #define CONFIG_USBHOST_CDC_NCM_TX_FLUSH_TIMEOUT 1
 
 /* This parameter affects usb performance, and depends on (TCP_WND)tcp eceive windows size,
  * you can change to 2K ~ 16K and must be larger than TCP RX windows size in order to avoid being overflow.
@@ -242,6 +325,23 @@
 #define CONFIG_USBHOST_RTL8152_ETH_MAX_TX_SIZE (2048)
 #endif
 
+/* platform/lwip glue: class drivers receive into a shared buffer pool and frames go to lwip
+ * as custom pbufs without copying, needs LWIP_SUPPORT_CUSTOM_PBUF.
+ */
+// #define CONFIG_USBHOST_LWIP_RX_ZERO_COPY
+/* number of rx buffers, one per bulk in transfer or ntb, reused after lwip frees its pbufs */
+#ifndef CONFIG_USBHOST_LWIP_RX_BUF_NUM
+#define CONFIG_USBHOST_LWIP_RX_BUF_NUM 4
+#endif
+/* must not be less than the class rx size, e.g. CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE */
+#ifndef CONFIG_USBHOST_LWIP_RX_BUF_SIZE
+#define CONFIG_USBHOST_LWIP_RX_BUF_SIZE 2048
+#endif
+/* frames held by lwip at a time, when out of them frames are copied into PBUF_POOL */
+#ifndef CONFIG_USBHOST_LWIP_RX_PBUF_NUM
+#define CONFIG_USBHOST_LWIP_RX_PBUF_NUM 32
+#endif
+
 #define CONFIG_USBHOST_BLUETOOTH_HCI_H4
 // #define CONFIG_USBHOST_BLUETOOTH_HCI_LOG
 
@@ -284,12 +384,18 @@
 #define CONFIG_USB_EHCI_FRAME_LIST_SIZE 1024
 #define CONFIG_USB_EHCI_QH_NUM          10
 #define CONFIG_USB_EHCI_QTD_NUM         (CONFIG_USB_EHCI_QH_NUM * 3)
-#define CONFIG_USB_EHCI_ITD_NUM         4
+#define CONFIG_USB_EHCI_ITD_NUM         4 /* frames queued ahead per iso endpoint */
+// #define CONFIG_USB_EHCI_ITD_POOL_NUM 16 /* itds and sitds shared by the iso endpoints of a bus */
+#define CONFIG_USB_EHCI_QH_URB_NUM      4
 // #define CONFIG_USB_EHCI_HCOR_RESERVED_DISABLE
 // #define CONFIG_USB_EHCI_CONFIGFLAG
 // #define CONFIG_USB_EHCI_ISO
 // #define CONFIG_USB_EHCI_WITH_OHCI
 // #define CONFIG_USB_EHCI_DESC_DCACHE_ENABLE
+/* carve qh and qtd pools from memory returned by usb_ehci_pool_arena() instead of static arrays,
+ * CONFIG_USB_EHCI_QH_NUM qhs are taken first and the rest of the arena becomes qtds.
+ */
+// #define CONFIG_USB_EHCI_POOL_ARENA
 
 /* ---------------- OHCI Configuration ---------------- */
 #define CONFIG_USB_OHCI_HCOR_OFFSET (0x0)
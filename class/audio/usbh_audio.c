@@ -40,26 +40,33 @@ static int16_t volume_float2hex(float volume_db)
 static struct usbh_audio *usbh_audio_class_alloc(void)
 {
     uint8_t devno;
+    size_t flags;
 
+    flags = usb_osal_enter_critical_section();
     for (devno = 0; devno < CONFIG_USBHOST_MAX_AUDIO_CLASS; devno++) {
         if ((g_devinuse & (1U << devno)) == 0) {
             g_devinuse |= (1U << devno);
+            usb_osal_leave_critical_section(flags);
             memset(&g_audio_class[devno], 0, sizeof(struct usbh_audio));
             g_audio_class[devno].minor = devno;
             return &g_audio_class[devno];
         }
     }
+    usb_osal_leave_critical_section(flags);
     return NULL;
 }
 
 static void usbh_audio_class_free(struct usbh_audio *audio_class)
 {
     uint8_t devno = audio_class->minor;
+    size_t flags;
 
+    memset(audio_class, 0, sizeof(struct usbh_audio));
     if (devno < 32) {
+        flags = usb_osal_enter_critical_section();
         g_devinuse &= ~(1U << devno);
+        usb_osal_leave_critical_section(flags);
     }
-    memset(audio_class, 0, sizeof(struct usbh_audio));
 }
 
 /* INPUT --> FEATURE UNIT --> OUTPUT */
@@ -11,17 +11,74 @@
 #define CDC_NCM_IN_EP_IDX  1
 #define CDC_NCM_INT_EP_IDX 2
 
+#ifndef CONFIG_USBDEV_CDC_NCM_NTB_MAX_SIZE
+#define CONFIG_USBDEV_CDC_NCM_NTB_MAX_SIZE 2048U
+#endif
+
+#if CONFIG_USBDEV_CDC_NCM_NTB_MAX_SIZE > 65535
+#error "CONFIG_USBDEV_CDC_NCM_NTB_MAX_SIZE must fit in NTB16 wBlockLength"
+#endif
+
 #define CONFIG_CDC_NCM_ETH_MAX_SEGSZE 1514U
-#define CONFIG_CDC_NCM_NTB_MAX_SIZE   2048U
+#define CONFIG_CDC_NCM_NTB_MAX_SIZE   CONFIG_USBDEV_CDC_NCM_NTB_MAX_SIZE
 #define CDC_NCM_NTH16_LEN             12U
 #define CDC_NCM_NDP16_LEN             16U
 #define CDC_NCM_DATAGRAM_OFFSET       16U
 
+/* one datagram needs at least a 60 bytes frame and a 4 bytes ndp entry */
+#define CDC_NCM_TX_MAX_DATAGRAMS (CONFIG_CDC_NCM_NTB_MAX_SIZE / 64U)
+
+#ifndef CONFIG_USBDEV_CDC_NCM_RX_NTB_NUM
+#define CONFIG_USBDEV_CDC_NCM_RX_NTB_NUM 2
+#endif
+
+#ifndef CONFIG_USBDEV_CDC_NCM_RX_MAX_DATAGRAMS
+#define CONFIG_USBDEV_CDC_NCM_RX_MAX_DATAGRAMS 16
+#endif
+
+/* rx ntb state */
+#define CDC_NCM_RX_NTB_FREE    0 /* can be armed */
+#define CDC_NCM_RX_NTB_READING 1 /* queued on the bus with usbd_ep_submit */
+#define CDC_NCM_RX_NTB_FILLED  2 /* waiting in the rx queue or being parsed */
+#define CDC_NCM_RX_NTB_HELD    3 /* parsed, pbufs still point into it */
+
 static struct usbd_endpoint cdc_ncm_ep_data[3];
 
 #ifdef CONFIG_USBDEV_CDC_NCM_USING_LWIP
-static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_cdc_ncm_rx_buffer[USB_ALIGN_UP(CONFIG_CDC_NCM_NTB_MAX_SIZE, CONFIG_USB_ALIGN_SIZE)];
-static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_cdc_ncm_tx_buffer[USB_ALIGN_UP(CONFIG_CDC_NCM_NTB_MAX_SIZE, CONFIG_USB_ALIGN_SIZE)];
+/* received ntbs are parsed in place, the datagrams are handed to lwip without copying */
+static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_cdc_ncm_rx_buffer[CONFIG_USBDEV_CDC_NCM_RX_NTB_NUM][USB_ALIGN_UP(CONFIG_CDC_NCM_NTB_MAX_SIZE, CONFIG_USB_ALIGN_SIZE)];
+static struct cdc_ncm_rx_ntb {
+    uint32_t length; /* received length */
+    uint16_t ref;    /* pbufs pointing into this ntb */
+    uint8_t state;
+} g_cdc_ncm_rx_ntb[CONFIG_USBDEV_CDC_NCM_RX_NTB_NUM];
+/* every free ntb is queued on the out endpoint, so the host never waits for a refill */
+static struct usbd_request g_cdc_ncm_rx_req[CONFIG_USBDEV_CDC_NCM_RX_NTB_NUM];
+static uint8_t g_cdc_ncm_rx_queue[CONFIG_USBDEV_CDC_NCM_RX_NTB_NUM]; /* filled ntbs in bus order */
+static uint8_t g_cdc_ncm_rx_queue_head = 0;
+static uint8_t g_cdc_ncm_rx_queue_count = 0;
+static bool g_cdc_ncm_rx_parsing = false;
+#if LWIP_SUPPORT_CUSTOM_PBUF
+struct cdc_ncm_rx_pbuf {
+    struct pbuf_custom pc;
+    struct cdc_ncm_rx_pbuf *next;
+    uint8_t ntb;
+};
+static struct cdc_ncm_rx_pbuf g_cdc_ncm_rx_pbuf[CONFIG_USBDEV_CDC_NCM_RX_NTB_NUM * CONFIG_USBDEV_CDC_NCM_RX_MAX_DATAGRAMS];
+static struct cdc_ncm_rx_pbuf *g_cdc_ncm_rx_pbuf_free = NULL;
+static bool g_cdc_ncm_rx_pbuf_inited = false;
+#endif
+/* one ntb is on the bus while the other one collects datagrams */
+static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_cdc_ncm_tx_buffer[2][USB_ALIGN_UP(CONFIG_CDC_NCM_NTB_MAX_SIZE, CONFIG_USB_ALIGN_SIZE)];
+static struct cdc_ncm_ndp16_datagram g_cdc_ncm_tx_datagram[CDC_NCM_TX_MAX_DATAGRAMS];
+static uint8_t g_cdc_ncm_tx_fill = 0;          /* ntb collecting datagrams */
+static uint16_t g_cdc_ncm_tx_datagram_num = 0; /* datagrams in the collecting ntb */
+static uint32_t g_cdc_ncm_tx_offset = CDC_NCM_DATAGRAM_OFFSET;
+static bool g_cdc_ncm_tx_copying = false;      /* usbd_cdc_ncm_eth_tx is copying into the collecting ntb */
+static bool g_cdc_ncm_tx_flush_pending = false;
+#ifdef CONFIG_USBDEV_CDC_NCM_TX_FLUSH_TIMEOUT
+static struct usb_osal_timer *g_cdc_ncm_tx_timer = NULL;
+#endif
 #endif
 static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_cdc_ncm_ctrl_buf[USB_ALIGN_UP(32, CONFIG_USB_ALIGN_SIZE)];
 static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_cdc_ncm_notify_buf[USB_ALIGN_UP(16, CONFIG_USB_ALIGN_SIZE)];
@@ -38,6 +95,7 @@ static uint16_t g_cdc_ncm_tx_sequence = 0;
 static uint16_t g_cdc_ncm_max_datagram_size = CONFIG_CDC_NCM_ETH_MAX_SEGSZE;
 static uint32_t g_cdc_ncm_ntb_in_max_size = CONFIG_CDC_NCM_NTB_MAX_SIZE;
 static uint32_t g_cdc_ncm_ntb_out_max_size = CONFIG_CDC_NCM_NTB_MAX_SIZE;
+static uint16_t g_cdc_ncm_ntb_in_max_datagrams = 0;
 static uint16_t g_cdc_ncm_ntb_format = 0;
 static uint16_t g_cdc_ncm_packet_filter = 0;
 static volatile uint8_t g_current_net_status = 0;
@@ -95,7 +153,11 @@ static void usbd_cdc_ncm_fill_ntb_parameters(void)
     SET_LE16(&g_cdc_ncm_ctrl_buf[20], 4);                         /* wNdbOutDivisor */
     SET_LE16(&g_cdc_ncm_ctrl_buf[22], 0);                         /* wNdbOutPayloadRemainder */
     SET_LE16(&g_cdc_ncm_ctrl_buf[24], 4);                         /* wNdbOutAlignment */
+#ifdef CONFIG_USBDEV_CDC_NCM_USING_LWIP
+    SET_LE16(&g_cdc_ncm_ctrl_buf[26], CONFIG_USBDEV_CDC_NCM_RX_MAX_DATAGRAMS); /* wNtbOutMaxDatagrams */
+#else
     SET_LE16(&g_cdc_ncm_ctrl_buf[26], 1);                         /* one datagram preferred */
+#endif
 }
 
 static int cdc_ncm_class_interface_request_handler(uint8_t busid, struct usb_setup_packet *setup, uint8_t **data, uint32_t *len)
@@ -132,6 +194,12 @@ static int cdc_ncm_class_interface_request_handler(uint8_t busid, struct usb_set
             if (ntb_size >= (CDC_NCM_DATAGRAM_OFFSET + CDC_NCM_NDP16_LEN) && ntb_size <= CONFIG_CDC_NCM_NTB_MAX_SIZE) {
                 g_cdc_ncm_ntb_in_max_size = ntb_size;
             }
+            /* 8 bytes form also carries wNtbInMaxDatagrams, 0 means no limit */
+            if (setup->wLength >= 8) {
+                g_cdc_ncm_ntb_in_max_datagrams = GET_LE16(&(*data)[4]);
+            } else {
+                g_cdc_ncm_ntb_in_max_datagrams = 0;
+            }
         }
         break;
     case CDC_REQUEST_GET_MAX_DATAGRAM_SIZE:
@@ -186,11 +254,80 @@ static int cdc_ncm_class_interface_request_handler(uint8_t busid, struct usb_set
     return 0;
 }
 
+#ifdef CONFIG_USBDEV_CDC_NCM_USING_LWIP
+static void cdc_ncm_rx_kick(void);
+
+static void cdc_ncm_tx_reset(void)
+{
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    g_cdc_ncm_tx_ntb_length = 0;
+    g_cdc_ncm_tx_datagram_num = 0;
+    g_cdc_ncm_tx_offset = CDC_NCM_DATAGRAM_OFFSET;
+    g_cdc_ncm_tx_flush_pending = false;
+    usb_osal_leave_critical_section(flags);
+}
+
+static void cdc_ncm_rx_reset(void)
+{
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+#if LWIP_SUPPORT_CUSTOM_PBUF
+    if (!g_cdc_ncm_rx_pbuf_inited) {
+        g_cdc_ncm_rx_pbuf_inited = true;
+        for (uint16_t i = 0; i < sizeof(g_cdc_ncm_rx_pbuf) / sizeof(g_cdc_ncm_rx_pbuf[0]); i++) {
+            g_cdc_ncm_rx_pbuf[i].next = g_cdc_ncm_rx_pbuf_free;
+            g_cdc_ncm_rx_pbuf_free = &g_cdc_ncm_rx_pbuf[i];
+        }
+    }
+#endif
+    /* ntbs still referenced by lwip are released by the pbuf free callback, the ones
+     * still queued come back through cdc_ncm_rx_req_done when the core flushes them.
+     */
+    for (uint8_t i = 0; i < CONFIG_USBDEV_CDC_NCM_RX_NTB_NUM; i++) {
+        if (g_cdc_ncm_rx_ntb[i].state != CDC_NCM_RX_NTB_READING) {
+            g_cdc_ncm_rx_ntb[i].state = g_cdc_ncm_rx_ntb[i].ref ? CDC_NCM_RX_NTB_HELD : CDC_NCM_RX_NTB_FREE;
+        }
+    }
+    g_cdc_ncm_rx_queue_head = 0;
+    g_cdc_ncm_rx_queue_count = 0;
+    g_cdc_ncm_rx_parsing = false;
+    g_cdc_ncm_rx_ntb_length = 0;
+    g_cdc_ncm_rx_datagram_pos = 0;
+    g_cdc_ncm_rx_ndp_index = 0;
+    usb_osal_leave_critical_section(flags);
+}
+
+#ifdef CONFIG_USBDEV_CDC_NCM_TX_FLUSH_TIMEOUT
+static void cdc_ncm_tx_timeout(void *argument)
+{
+    (void)argument;
+    usbd_cdc_ncm_eth_tx_flush();
+}
+#endif
+#endif
+
 static void cdc_ncm_notify_handler(uint8_t busid, uint8_t event, void *arg)
 {
     (void)busid;
 
     switch (event) {
+#if defined(CONFIG_USBDEV_CDC_NCM_USING_LWIP) && defined(CONFIG_USBDEV_CDC_NCM_TX_FLUSH_TIMEOUT)
+    case USBD_EVENT_INIT:
+        /* control and data interfaces share this handler */
+        if (g_cdc_ncm_tx_timer == NULL) {
+            g_cdc_ncm_tx_timer = usb_osal_timer_create("ncm_tx", CONFIG_USBDEV_CDC_NCM_TX_FLUSH_TIMEOUT, cdc_ncm_tx_timeout, NULL, false);
+        }
+        break;
+    case USBD_EVENT_DEINIT:
+        if (g_cdc_ncm_tx_timer) {
+            usb_osal_timer_delete(g_cdc_ncm_tx_timer);
+            g_cdc_ncm_tx_timer = NULL;
+        }
+        break;
+#endif
     case USBD_EVENT_RESET:
     case USBD_EVENT_DISCONNECTED:
         g_current_net_status = 0;
@@ -199,6 +336,10 @@ static void cdc_ncm_notify_handler(uint8_t busid, uint8_t event, void *arg)
         g_cdc_ncm_data_alt_active = false;
         g_cdc_ncm_rx_datagram_pos = 0;
         g_cdc_ncm_rx_ndp_index = 0;
+#ifdef CONFIG_USBDEV_CDC_NCM_USING_LWIP
+        cdc_ncm_rx_reset();
+        cdc_ncm_tx_reset();
+#endif
         break;
     case USBD_EVENT_SET_INTERFACE: {
 #ifdef CONFIG_USBDEV_CDC_NCM_USING_LWIP
@@ -206,10 +347,12 @@ static void cdc_ncm_notify_handler(uint8_t busid, uint8_t event, void *arg)
 
         if (desc && desc->bAlternateSetting == 1) {
             g_cdc_ncm_data_alt_active = true;
-            usbd_cdc_ncm_start_read(g_cdc_ncm_rx_buffer, g_cdc_ncm_ntb_out_max_size);
+            cdc_ncm_rx_reset();
+            cdc_ncm_rx_kick();
         } else {
             g_cdc_ncm_data_alt_active = false;
-            g_cdc_ncm_tx_ntb_length = 0;
+            cdc_ncm_rx_reset();
+            cdc_ncm_tx_reset();
         }
 #else
         (void)arg;
@@ -221,8 +364,41 @@ static void cdc_ncm_notify_handler(uint8_t busid, uint8_t event, void *arg)
     }
 }
 
+#ifdef CONFIG_USBDEV_CDC_NCM_USING_LWIP
+static void cdc_ncm_rx_req_done(uint8_t busid, uint8_t ep, struct usbd_request *req)
+{
+    uint8_t ntb = req - g_cdc_ncm_rx_req;
+    size_t flags;
+
+    (void)busid;
+    (void)ep;
+
+    flags = usb_osal_enter_critical_section();
+    if ((req->status == 0) && req->actual) {
+        g_cdc_ncm_rx_ntb[ntb].length = req->actual;
+        g_cdc_ncm_rx_ntb[ntb].state = CDC_NCM_RX_NTB_FILLED;
+        g_cdc_ncm_rx_queue[(g_cdc_ncm_rx_queue_head + g_cdc_ncm_rx_queue_count) % CONFIG_USBDEV_CDC_NCM_RX_NTB_NUM] = ntb;
+        g_cdc_ncm_rx_queue_count++;
+    } else {
+        g_cdc_ncm_rx_ntb[ntb].state = CDC_NCM_RX_NTB_FREE;
+    }
+    usb_osal_leave_critical_section(flags);
+
+    /* flushed by a reset or an endpoint close, armed again by the next set interface */
+    if (req->status < 0) {
+        return;
+    }
+
+    cdc_ncm_rx_kick();
+    if (req->actual) {
+        usbd_cdc_ncm_data_recv_done(req->actual);
+    }
+}
+#endif
+
 static void cdc_ncm_bulk_out(uint8_t busid, uint8_t ep, uint32_t nbytes)
 {
+    /* with lwip every read goes through g_cdc_ncm_rx_req and ends in cdc_ncm_rx_req_done */
     (void)busid;
     (void)ep;
 
@@ -232,15 +408,26 @@ static void cdc_ncm_bulk_out(uint8_t busid, uint8_t ep, uint32_t nbytes)
     usbd_cdc_ncm_data_recv_done(g_cdc_ncm_rx_ntb_length);
 }
 
+#ifdef CONFIG_USBDEV_CDC_NCM_USING_LWIP
+static int cdc_ncm_tx_kick(void);
+#endif
+
 static void cdc_ncm_bulk_in(uint8_t busid, uint8_t ep, uint32_t nbytes)
 {
+    uint32_t ntb_length;
+
     (void)busid;
 
     if ((nbytes % usbd_get_ep_mps(0, ep)) == 0 && nbytes) {
         usbd_ep_start_write(0, ep, NULL, 0);
     } else {
-        usbd_cdc_ncm_data_send_done(g_cdc_ncm_tx_ntb_length);
+        ntb_length = g_cdc_ncm_tx_ntb_length;
         g_cdc_ncm_tx_ntb_length = 0;
+#ifdef CONFIG_USBDEV_CDC_NCM_USING_LWIP
+        /* datagrams collected while this ntb was on the bus go out right away */
+        cdc_ncm_tx_kick();
+#endif
+        usbd_cdc_ncm_data_send_done(ntb_length);
     }
 }
 
@@ -351,90 +538,296 @@ static bool cdc_ncm_prepare_rx_ndp(void)
     return true;
 }
 
-struct pbuf *usbd_cdc_ncm_eth_rx(void)
+static void cdc_ncm_rx_kick(void)
 {
-    struct cdc_ncm_ndp16 *ndp16;
-    uint16_t ndp_len;
-    uint16_t next_ndp_index;
+    uint8_t ntbs[CONFIG_USBDEV_CDC_NCM_RX_NTB_NUM];
+    uint8_t num = 0;
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    if (g_cdc_ncm_data_alt_active) {
+        for (uint8_t i = 0; i < CONFIG_USBDEV_CDC_NCM_RX_NTB_NUM; i++) {
+            if (g_cdc_ncm_rx_ntb[i].state == CDC_NCM_RX_NTB_FREE) {
+                g_cdc_ncm_rx_ntb[i].state = CDC_NCM_RX_NTB_READING;
+                ntbs[num++] = i;
+            }
+        }
+    }
+    usb_osal_leave_critical_section(flags);
+
+    for (uint8_t i = 0; i < num; i++) {
+        struct usbd_request *req = &g_cdc_ncm_rx_req[ntbs[i]];
+
+        req->buf = g_cdc_ncm_rx_buffer[ntbs[i]];
+        req->length = g_cdc_ncm_ntb_out_max_size;
+        req->zero = false;
+        req->complete = cdc_ncm_rx_req_done;
+        req->arg = NULL;
+        if (usbd_ep_submit(0, cdc_ncm_ep_data[CDC_NCM_OUT_EP_IDX].ep_addr, req) != 0) {
+            flags = usb_osal_enter_critical_section();
+            g_cdc_ncm_rx_ntb[ntbs[i]].state = CDC_NCM_RX_NTB_FREE;
+            usb_osal_leave_critical_section(flags);
+        }
+    }
+}
 
-    if (g_cdc_ncm_rx_ntb_length == 0 || g_cdc_ncm_rx_data_buffer == NULL) {
-        return NULL;
+/* all datagrams of the ntb at the queue head are handed out */
+static void cdc_ncm_rx_ntb_done(void)
+{
+    uint8_t ntb;
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    if (g_cdc_ncm_rx_parsing) {
+        ntb = g_cdc_ncm_rx_queue[g_cdc_ncm_rx_queue_head];
+        g_cdc_ncm_rx_ntb[ntb].state = g_cdc_ncm_rx_ntb[ntb].ref ? CDC_NCM_RX_NTB_HELD : CDC_NCM_RX_NTB_FREE;
+        g_cdc_ncm_rx_queue_head = (g_cdc_ncm_rx_queue_head + 1) % CONFIG_USBDEV_CDC_NCM_RX_NTB_NUM;
+        g_cdc_ncm_rx_queue_count--;
+        g_cdc_ncm_rx_parsing = false;
     }
+    g_cdc_ncm_rx_ntb_length = 0;
+    g_cdc_ncm_rx_datagram_pos = 0;
+    g_cdc_ncm_rx_ndp_index = 0;
+    usb_osal_leave_critical_section(flags);
+
+    cdc_ncm_rx_kick();
+}
 
-    if (g_cdc_ncm_rx_ndp_index == 0 && !cdc_ncm_prepare_rx_ndp()) {
-        usbd_cdc_ncm_start_read(g_cdc_ncm_rx_buffer, g_cdc_ncm_ntb_out_max_size);
+#if LWIP_SUPPORT_CUSTOM_PBUF
+static void cdc_ncm_rx_pbuf_free(struct pbuf *p)
+{
+    struct cdc_ncm_rx_pbuf *rx_pbuf = (struct cdc_ncm_rx_pbuf *)p;
+    struct cdc_ncm_rx_ntb *ntb;
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    ntb = &g_cdc_ncm_rx_ntb[rx_pbuf->ntb];
+    rx_pbuf->next = g_cdc_ncm_rx_pbuf_free;
+    g_cdc_ncm_rx_pbuf_free = rx_pbuf;
+    ntb->ref--;
+    if ((ntb->ref == 0) && (ntb->state == CDC_NCM_RX_NTB_HELD)) {
+        ntb->state = CDC_NCM_RX_NTB_FREE;
+    }
+    usb_osal_leave_critical_section(flags);
+
+    cdc_ncm_rx_kick();
+}
+#endif
+
+/* wrap one datagram of the ntb being parsed, falls back to a copy when no custom pbuf is left */
+static struct pbuf *cdc_ncm_rx_pbuf_alloc(uint8_t ntb, uint16_t index, uint16_t length)
+{
+    struct pbuf *p;
+#if LWIP_SUPPORT_CUSTOM_PBUF
+    struct cdc_ncm_rx_pbuf *rx_pbuf;
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    rx_pbuf = g_cdc_ncm_rx_pbuf_free;
+    if (rx_pbuf) {
+        g_cdc_ncm_rx_pbuf_free = rx_pbuf->next;
+        g_cdc_ncm_rx_ntb[ntb].ref++;
+    }
+    usb_osal_leave_critical_section(flags);
+
+    if (rx_pbuf) {
+        rx_pbuf->ntb = ntb;
+        rx_pbuf->pc.custom_free_function = cdc_ncm_rx_pbuf_free;
+        return pbuf_alloced_custom(PBUF_RAW, length, PBUF_REF, &rx_pbuf->pc, &g_cdc_ncm_rx_buffer[ntb][index], length);
+    }
+#endif
+
+    p = pbuf_alloc(PBUF_RAW, length, PBUF_POOL);
+    if (p == NULL) {
         return NULL;
     }
+    if (pbuf_take(p, &g_cdc_ncm_rx_buffer[ntb][index], length) != ERR_OK) {
+        pbuf_free(p);
+        return NULL;
+    }
+    return p;
+}
 
-    for (;;) {
-        ndp16 = (struct cdc_ncm_ndp16 *)&g_cdc_ncm_rx_data_buffer[g_cdc_ncm_rx_ndp_index];
-        ndp_len = GET_LE16((uint8_t *)&ndp16->wLength);
+/*
+ * Return the next datagram of the received ntbs, NULL once all of them are consumed.
+ * Datagrams reference the ntb buffer, which is reused after the last pbuf is freed.
+ */
+struct pbuf *usbd_cdc_ncm_eth_rx(void)
+{
+    struct cdc_ncm_ndp16 *ndp16;
+    uint16_t ndp_len;
+    uint16_t next_ndp_index;
+    uint8_t ntb;
+    size_t flags;
 
-        while ((8 + 4 * (g_cdc_ncm_rx_datagram_pos + 1)) <= ndp_len) {
-            struct cdc_ncm_ndp16_datagram *datagram;
-            uint16_t index;
-            uint16_t length;
-            struct pbuf *p;
+    for (;;) {
+        flags = usb_osal_enter_critical_section();
+        if (g_cdc_ncm_rx_queue_count == 0) {
+            usb_osal_leave_critical_section(flags);
+            return NULL;
+        }
+        ntb = g_cdc_ncm_rx_queue[g_cdc_ncm_rx_queue_head];
+        if (!g_cdc_ncm_rx_parsing) {
+            g_cdc_ncm_rx_parsing = true;
+            g_cdc_ncm_rx_data_buffer = g_cdc_ncm_rx_buffer[ntb];
+            g_cdc_ncm_rx_total_length = g_cdc_ncm_ntb_out_max_size;
+            g_cdc_ncm_rx_ntb_length = g_cdc_ncm_rx_ntb[ntb].length;
+            g_cdc_ncm_rx_datagram_pos = 0;
+            g_cdc_ncm_rx_ndp_index = 0;
+        }
+        usb_osal_leave_critical_section(flags);
 
-            datagram = (struct cdc_ncm_ndp16_datagram *)&g_cdc_ncm_rx_data_buffer[g_cdc_ncm_rx_ndp_index + 8 + 4 * g_cdc_ncm_rx_datagram_pos];
-            g_cdc_ncm_rx_datagram_pos++;
-            index = GET_LE16((uint8_t *)&datagram->wDatagramIndex);
-            length = GET_LE16((uint8_t *)&datagram->wDatagramLength);
+        if (g_cdc_ncm_rx_ndp_index == 0 && !cdc_ncm_prepare_rx_ndp()) {
+            cdc_ncm_rx_ntb_done();
+            continue;
+        }
 
-            if (index == 0 || length == 0) {
-                break;
-            }
-            if ((uint32_t)index + length > g_cdc_ncm_rx_ntb_length || length > g_cdc_ncm_max_datagram_size) {
-                USB_LOG_WRN("invalid ncm datagram index:%u len:%u\r\n", index, length);
-                continue;
+        for (;;) {
+            ndp16 = (struct cdc_ncm_ndp16 *)&g_cdc_ncm_rx_data_buffer[g_cdc_ncm_rx_ndp_index];
+            ndp_len = GET_LE16((uint8_t *)&ndp16->wLength);
+
+            while ((8 + 4 * (g_cdc_ncm_rx_datagram_pos + 1)) <= ndp_len) {
+                struct cdc_ncm_ndp16_datagram *datagram;
+                uint16_t index;
+                uint16_t length;
+                struct pbuf *p;
+
+                datagram = (struct cdc_ncm_ndp16_datagram *)&g_cdc_ncm_rx_data_buffer[g_cdc_ncm_rx_ndp_index + 8 + 4 * g_cdc_ncm_rx_datagram_pos];
+                g_cdc_ncm_rx_datagram_pos++;
+                index = GET_LE16((uint8_t *)&datagram->wDatagramIndex);
+                length = GET_LE16((uint8_t *)&datagram->wDatagramLength);
+
+                if (index == 0 || length == 0) {
+                    break;
+                }
+                if ((uint32_t)index + length > g_cdc_ncm_rx_ntb_length || length > g_cdc_ncm_max_datagram_size) {
+                    USB_LOG_WRN("invalid ncm datagram index:%u len:%u\r\n", index, length);
+                    continue;
+                }
+
+                p = cdc_ncm_rx_pbuf_alloc(ntb, index, length);
+                if (p == NULL) {
+                    /* drop the rest of this ntb, the others are still delivered */
+                    USB_LOG_WRN("ncm pbuf alloc failed\r\n");
+                    cdc_ncm_rx_ntb_done();
+                    return NULL;
+                }
+
+                USB_LOG_DBG("rxlen:%d\r\n", length);
+                return p;
             }
 
-            p = pbuf_alloc(PBUF_RAW, length, PBUF_POOL);
-            if (p == NULL) {
-                USB_LOG_WRN("ncm pbuf alloc failed\r\n");
-                usbd_cdc_ncm_start_read(g_cdc_ncm_rx_buffer, g_cdc_ncm_ntb_out_max_size);
-                return NULL;
-            }
-            if (pbuf_take(p, &g_cdc_ncm_rx_data_buffer[index], length) != ERR_OK) {
-                pbuf_free(p);
-                continue;
+            /* current ndp is exhausted, follow the ndp chain if present */
+            next_ndp_index = GET_LE16((uint8_t *)&ndp16->wNextNdpIndex);
+            if (next_ndp_index == 0 || !cdc_ncm_check_ndp16(next_ndp_index)) {
+                break;
             }
-
-            USB_LOG_DBG("rxlen:%d\r\n", length);
-            return p;
+            g_cdc_ncm_rx_ndp_index = next_ndp_index;
+            g_cdc_ncm_rx_datagram_pos = 0;
         }
 
-        /* current ndp is exhausted, follow the ndp chain if present */
-        next_ndp_index = GET_LE16((uint8_t *)&ndp16->wNextNdpIndex);
-        if (next_ndp_index == 0 || !cdc_ncm_check_ndp16(next_ndp_index)) {
-            break;
-        }
-        g_cdc_ncm_rx_ndp_index = next_ndp_index;
-        g_cdc_ncm_rx_datagram_pos = 0;
+        cdc_ncm_rx_ntb_done();
     }
-
-    usbd_cdc_ncm_start_read(g_cdc_ncm_rx_buffer, g_cdc_ncm_ntb_out_max_size);
-    return NULL;
 }
 
-int usbd_cdc_ncm_eth_tx(struct pbuf *p)
+/*
+ * Close the collecting ntb and send it if the bus is idle, must be called with
+ * interrupts disabled. Returns the ntb length to send or 0.
+ */
+static uint32_t cdc_ncm_tx_close_ntb(uint8_t **buf)
 {
     struct cdc_ncm_nth16 *nth16;
     struct cdc_ncm_ndp16 *ndp16;
     struct cdc_ncm_ndp16_datagram *datagram;
-    struct pbuf *q;
-    uint8_t *buffer;
-    uint16_t payload_len;
-    uint16_t aligned_payload_len;
+    uint8_t *ntb;
     uint16_t ndp_index;
+    uint16_t ndp_len;
     uint16_t block_len;
 
-    if (!usb_device_is_configured(0)) {
-        return -USB_ERR_NOTCONN;
+    if ((g_cdc_ncm_tx_ntb_length > 0) || g_cdc_ncm_tx_copying || (g_cdc_ncm_tx_datagram_num == 0)) {
+        return 0;
     }
 
-    if (g_cdc_ncm_tx_ntb_length > 0) {
-        return -USB_ERR_BUSY;
+    ntb = g_cdc_ncm_tx_buffer[g_cdc_ncm_tx_fill];
+    ndp_index = USB_ALIGN_UP(g_cdc_ncm_tx_offset, 4);
+    ndp_len = 8 + 4 * (g_cdc_ncm_tx_datagram_num + 1);
+    block_len = ndp_index + ndp_len;
+
+    nth16 = (struct cdc_ncm_nth16 *)&ntb[0];
+    SET_LE32((uint8_t *)&nth16->dwSignature, CDC_NCM_NTH16_SIGNATURE);
+    SET_LE16((uint8_t *)&nth16->wHeaderLength, CDC_NCM_NTH16_LEN);
+    SET_LE16((uint8_t *)&nth16->wSequence, g_cdc_ncm_tx_sequence++);
+    SET_LE16((uint8_t *)&nth16->wBlockLength, block_len);
+    SET_LE16((uint8_t *)&nth16->wNdpIndex, ndp_index);
+    memset(&ntb[CDC_NCM_NTH16_LEN], 0, CDC_NCM_DATAGRAM_OFFSET - CDC_NCM_NTH16_LEN);
+
+    ndp16 = (struct cdc_ncm_ndp16 *)&ntb[ndp_index];
+    SET_LE32((uint8_t *)&ndp16->dwSignature, CDC_NCM_NDP16_SIGNATURE_NCM0);
+    SET_LE16((uint8_t *)&ndp16->wLength, ndp_len);
+    SET_LE16((uint8_t *)&ndp16->wNextNdpIndex, 0);
+
+    datagram = (struct cdc_ncm_ndp16_datagram *)&ntb[ndp_index + 8];
+    for (uint16_t i = 0; i < g_cdc_ncm_tx_datagram_num; i++) {
+        SET_LE16((uint8_t *)&datagram[i].wDatagramIndex, g_cdc_ncm_tx_datagram[i].wDatagramIndex);
+        SET_LE16((uint8_t *)&datagram[i].wDatagramLength, g_cdc_ncm_tx_datagram[i].wDatagramLength);
+    }
+    datagram[g_cdc_ncm_tx_datagram_num].wDatagramIndex = 0;
+    datagram[g_cdc_ncm_tx_datagram_num].wDatagramLength = 0;
+
+    /* mark busy before submitting: the transfer may complete in interrupt
+       context before usbd_ep_start_write() returns */
+    g_cdc_ncm_tx_ntb_length = block_len;
+    g_cdc_ncm_tx_fill ^= 1;
+    g_cdc_ncm_tx_datagram_num = 0;
+    g_cdc_ncm_tx_offset = CDC_NCM_DATAGRAM_OFFSET;
+    g_cdc_ncm_tx_flush_pending = false;
+
+    *buf = ntb;
+    return block_len;
+}
+
+static int cdc_ncm_tx_kick(void)
+{
+    uint8_t *buf = NULL;
+    uint32_t len;
+    size_t flags;
+    int ret;
+
+    flags = usb_osal_enter_critical_section();
+    len = cdc_ncm_tx_close_ntb(&buf);
+    usb_osal_leave_critical_section(flags);
+
+    if (len == 0) {
+        return 0;
+    }
+
+    USB_LOG_DBG("txlen:%d\r\n", len);
+    ret = usbd_ep_start_write(0, cdc_ncm_ep_data[CDC_NCM_IN_EP_IDX].ep_addr, buf, len);
+    if (ret != 0) {
+        g_cdc_ncm_tx_ntb_length = 0;
+    }
+    return ret;
+}
+
+/*
+ * Queue one frame into the collecting ntb. Returns -USB_ERR_BUSY if both ntbs are
+ * in use, retry after usbd_cdc_ncm_data_send_done.
+ */
+int usbd_cdc_ncm_eth_tx(struct pbuf *p)
+{
+    struct pbuf *q;
+    uint8_t *buffer;
+    uint16_t payload_len;
+    uint32_t offset;
+    uint16_t max_datagrams;
+    bool send_now;
+#ifdef CONFIG_USBDEV_CDC_NCM_TX_FLUSH_TIMEOUT
+    bool start_timer;
+#endif
+    size_t flags;
+
+    if (!usb_device_is_configured(0) || !g_cdc_ncm_data_alt_active) {
+        return -USB_ERR_NOTCONN;
     }
 
     if (p->tot_len > g_cdc_ncm_max_datagram_size) {
@@ -443,15 +836,34 @@ int usbd_cdc_ncm_eth_tx(struct pbuf *p)
     }
 
     payload_len = p->tot_len;
-    aligned_payload_len = USB_ALIGN_UP(payload_len, 4);
-    ndp_index = CDC_NCM_DATAGRAM_OFFSET + aligned_payload_len;
-    block_len = ndp_index + CDC_NCM_NDP16_LEN;
-    if (block_len > sizeof(g_cdc_ncm_tx_buffer) || block_len > g_cdc_ncm_ntb_in_max_size) {
-        return -USB_ERR_INVAL;
+    max_datagrams = CDC_NCM_TX_MAX_DATAGRAMS;
+    if (g_cdc_ncm_ntb_in_max_datagrams && (g_cdc_ncm_ntb_in_max_datagrams < max_datagrams)) {
+        max_datagrams = g_cdc_ncm_ntb_in_max_datagrams;
+    }
+
+    flags = usb_osal_enter_critical_section();
+    if (g_cdc_ncm_tx_copying) {
+        usb_osal_leave_critical_section(flags);
+        return -USB_ERR_BUSY;
+    }
+
+    /* room for this datagram, its ndp entry and the terminating null entry */
+    offset = USB_ALIGN_UP(g_cdc_ncm_tx_offset, 4);
+    if ((g_cdc_ncm_tx_datagram_num == max_datagrams) ||
+        (USB_ALIGN_UP(offset + payload_len, 4) + 8 + 4 * (g_cdc_ncm_tx_datagram_num + 2) > g_cdc_ncm_ntb_in_max_size)) {
+        if ((g_cdc_ncm_tx_datagram_num == 0) || (g_cdc_ncm_tx_ntb_length > 0)) {
+            usb_osal_leave_critical_section(flags);
+            return (g_cdc_ncm_tx_datagram_num == 0) ? -USB_ERR_INVAL : -USB_ERR_BUSY;
+        }
+        /* collecting ntb is full and the bus is idle, send it and start over in the other one */
+        usb_osal_leave_critical_section(flags);
+        cdc_ncm_tx_kick();
+        return usbd_cdc_ncm_eth_tx(p);
     }
+    g_cdc_ncm_tx_copying = true;
+    usb_osal_leave_critical_section(flags);
 
-    memset(g_cdc_ncm_tx_buffer, 0, block_len);
-    buffer = &g_cdc_ncm_tx_buffer[CDC_NCM_DATAGRAM_OFFSET];
+    buffer = &g_cdc_ncm_tx_buffer[g_cdc_ncm_tx_fill][offset];
     for (q = p; q != NULL && payload_len > 0; q = q->next) {
         uint16_t copy_len = MIN(q->len, payload_len);
         usb_memcpy(buffer, q->payload, copy_len);
@@ -459,26 +871,46 @@ int usbd_cdc_ncm_eth_tx(struct pbuf *p)
         payload_len -= copy_len;
     }
     payload_len = p->tot_len;
+    memset(buffer, 0, USB_ALIGN_UP(payload_len, 4) - payload_len);
+
+    flags = usb_osal_enter_critical_section();
+    g_cdc_ncm_tx_datagram[g_cdc_ncm_tx_datagram_num].wDatagramIndex = offset;
+    g_cdc_ncm_tx_datagram[g_cdc_ncm_tx_datagram_num].wDatagramLength = payload_len;
+    g_cdc_ncm_tx_datagram_num++;
+    g_cdc_ncm_tx_offset = offset + payload_len;
+    g_cdc_ncm_tx_copying = false;
+#ifdef CONFIG_USBDEV_CDC_NCM_TX_FLUSH_TIMEOUT
+    /* hold datagrams until the ntb is full, the flush timer expires or the bus frees up */
+    send_now = g_cdc_ncm_tx_flush_pending || (g_cdc_ncm_tx_datagram_num == max_datagrams) ||
+               (USB_ALIGN_UP(g_cdc_ncm_tx_offset, 4) + g_cdc_ncm_max_datagram_size + 8 + 4 * (g_cdc_ncm_tx_datagram_num + 2) > g_cdc_ncm_ntb_in_max_size);
+    start_timer = !send_now && (g_cdc_ncm_tx_datagram_num == 1);
+#else
+    /* an idle bus takes the datagram at once, a busy one lets datagrams gather */
+    send_now = true;
+#endif
+    usb_osal_leave_critical_section(flags);
 
-    nth16 = (struct cdc_ncm_nth16 *)&g_cdc_ncm_tx_buffer[0];
-    SET_LE32((uint8_t *)&nth16->dwSignature, CDC_NCM_NTH16_SIGNATURE);
-    SET_LE16((uint8_t *)&nth16->wHeaderLength, CDC_NCM_NTH16_LEN);
-    SET_LE16((uint8_t *)&nth16->wSequence, g_cdc_ncm_tx_sequence++);
-    SET_LE16((uint8_t *)&nth16->wBlockLength, block_len);
-    SET_LE16((uint8_t *)&nth16->wNdpIndex, ndp_index);
+#ifdef CONFIG_USBDEV_CDC_NCM_TX_FLUSH_TIMEOUT
+    if (start_timer && g_cdc_ncm_tx_timer) {
+        usb_osal_timer_start(g_cdc_ncm_tx_timer);
+    }
+#endif
+    if (send_now) {
+        cdc_ncm_tx_kick();
+    }
+    return 0;
+}
 
-    ndp16 = (struct cdc_ncm_ndp16 *)&g_cdc_ncm_tx_buffer[ndp_index];
-    SET_LE32((uint8_t *)&ndp16->dwSignature, CDC_NCM_NDP16_SIGNATURE_NCM0);
-    SET_LE16((uint8_t *)&ndp16->wLength, CDC_NCM_NDP16_LEN);
-    SET_LE16((uint8_t *)&ndp16->wNextNdpIndex, 0);
+void usbd_cdc_ncm_eth_tx_flush(void)
+{
+    size_t flags;
 
-    datagram = (struct cdc_ncm_ndp16_datagram *)&g_cdc_ncm_tx_buffer[ndp_index + 8];
-    SET_LE16((uint8_t *)&datagram[0].wDatagramIndex, CDC_NCM_DATAGRAM_OFFSET);
-    SET_LE16((uint8_t *)&datagram[0].wDatagramLength, payload_len);
-    datagram[1].wDatagramIndex = 0;
-    datagram[1].wDatagramLength = 0;
+    flags = usb_osal_enter_critical_section();
+    /* the frame being copied is sent by usbd_cdc_ncm_eth_tx itself */
+    g_cdc_ncm_tx_flush_pending = g_cdc_ncm_tx_copying;
+    usb_osal_leave_critical_section(flags);
 
-    return usbd_cdc_ncm_start_write(g_cdc_ncm_tx_buffer, block_len);
+    cdc_ncm_tx_kick();
 }
 #endif
 
@@ -32,6 +32,7 @@ int usbd_cdc_ncm_start_read(uint8_t *buf, uint32_t len);
 #include "lwip/pbuf.h"
 struct pbuf *usbd_cdc_ncm_eth_rx(void);
 int usbd_cdc_ncm_eth_tx(struct pbuf *p);
+void usbd_cdc_ncm_eth_tx_flush(void);
 #endif
 
 #ifdef __cplusplus
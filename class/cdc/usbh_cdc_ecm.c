@@ -241,6 +241,7 @@ static int usbh_cdc_ecm_disconnect(struct usbh_hubport *hport, uint8_t intf)
 void usbh_cdc_ecm_rx_thread(CONFIG_USB_OSAL_THREAD_SET_ARGV)
 {
     uint32_t g_cdc_ecm_rx_length;
+    uint8_t *rx_buf;
     int ret;
 
     (void)CONFIG_USB_OSAL_THREAD_GET_ARGV;
@@ -264,9 +265,15 @@ find_class:
 
     g_cdc_ecm_rx_length = 0;
     while (1) {
-        usbh_bulk_urb_fill(&g_cdc_ecm_class.bulkin_urb, g_cdc_ecm_class.hport, g_cdc_ecm_class.bulkin, g_cdc_ecm_rx_buffer, CONFIG_USBHOST_CDC_ECM_ETH_MAX_SIZE, USB_OSAL_WAITING_FOREVER, NULL, NULL);
+        rx_buf = usbh_eth_rxbuf_alloc(CONFIG_USBHOST_CDC_ECM_ETH_MAX_SIZE);
+        if (rx_buf == NULL) {
+            rx_buf = g_cdc_ecm_rx_buffer;
+        }
+
+        usbh_bulk_urb_fill(&g_cdc_ecm_class.bulkin_urb, g_cdc_ecm_class.hport, g_cdc_ecm_class.bulkin, rx_buf, CONFIG_USBHOST_CDC_ECM_ETH_MAX_SIZE, USB_OSAL_WAITING_FOREVER, NULL, NULL);
         ret = usbh_submit_urb(&g_cdc_ecm_class.bulkin_urb);
         if (ret < 0) {
+            usbh_eth_rxbuf_free(rx_buf);
             goto find_class;
         }
 
@@ -281,12 +288,13 @@ find_class:
             (g_cdc_ecm_class.bulkin_urb.actual_length < CONFIG_USBHOST_CDC_ECM_ETH_MAX_SIZE)) {
             USB_LOG_DBG("rxlen:%d\r\n", g_cdc_ecm_rx_length);
 
-            usbh_cdc_ecm_eth_input(g_cdc_ecm_rx_buffer, g_cdc_ecm_rx_length);
+            usbh_cdc_ecm_eth_input(rx_buf, g_cdc_ecm_rx_length);
 
             g_cdc_ecm_rx_length = 0;
         } else {
             /* There's no way to run here. */
         }
+        usbh_eth_rxbuf_free(rx_buf);
     }
     // clang-format off
 delete:
@@ -22,9 +22,57 @@
 #define INTF_DESC_bAlternateSetting 3 /** Alternate setting offset */
 
 #define CONFIG_USBHOST_CDC_NCM_ETH_MAX_SEGSZE 1514U
+#define CDC_NCM_NTH16_LEN                     12U
+
+#ifndef CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM
+#define CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM 3
+#endif
+
+#ifndef CONFIG_USBHOST_CDC_NCM_RX_URB_NUM
+#define CONFIG_USBHOST_CDC_NCM_RX_URB_NUM 2
+#endif
+
+#if CONFIG_USBHOST_CDC_NCM_RX_URB_NUM >= CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM
+#error "CONFIG_USBHOST_CDC_NCM_RX_URB_NUM must be less than CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM"
+#endif
+
+#if CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE > 65535 || CONFIG_USBHOST_CDC_NCM_ETH_MAX_TX_SIZE > 65535
+#error "CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE and CONFIG_USBHOST_CDC_NCM_ETH_MAX_TX_SIZE must fit in NTB16 wBlockLength"
+#endif
+
+/* one datagram needs at least a 60 bytes frame and a 4 bytes ndp entry */
+#define CDC_NCM_TX_MAX_DATAGRAMS (CONFIG_USBHOST_CDC_NCM_ETH_MAX_TX_SIZE / 64U)
+
+/* one ntb is parsed while the others are on the bus */
+static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_cdc_ncm_rx_buffer[CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM][USB_ALIGN_UP(CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE, CONFIG_USB_ALIGN_SIZE)];
+static struct usbh_urb g_cdc_ncm_rx_urb[CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM];
+static uint8_t *g_cdc_ncm_rx_ntb[CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM]; /* buffer each urb receives into, NULL if idle */
+static usb_osal_sem_t g_cdc_ncm_rx_sem = NULL;
+static bool g_cdc_ncm_rx_toggle; /* toggle left by the last completed rx urb */
+static uint32_t g_cdc_ncm_rx_ntb_size = CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE;
+
+/* one ntb is on the bus while the other one collects datagrams */
+static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_cdc_ncm_tx_buffer[2][USB_ALIGN_UP(CONFIG_USBHOST_CDC_NCM_ETH_MAX_TX_SIZE, CONFIG_USB_ALIGN_SIZE)];
+static struct cdc_ncm_ndp16_datagram g_cdc_ncm_tx_datagram[CDC_NCM_TX_MAX_DATAGRAMS];
+static uint8_t g_cdc_ncm_tx_fill = 0;          /* ntb collecting datagrams */
+static uint16_t g_cdc_ncm_tx_datagram_num = 0; /* datagrams in the collecting ntb */
+static uint32_t g_cdc_ncm_tx_offset = CDC_NCM_NTH16_LEN;
+static volatile bool g_cdc_ncm_tx_busy = false; /* bulk out urb is on the bus */
+static bool g_cdc_ncm_tx_writing = false;       /* caller is copying a frame into the collecting ntb */
+static bool g_cdc_ncm_tx_flush_pending = false;
+static uint32_t g_cdc_ncm_tx_queued_len = 0;    /* closed ntb whose submit failed, resent by the next kick */
+static usb_osal_sem_t g_cdc_ncm_tx_sem = NULL;
+#ifdef CONFIG_USBHOST_CDC_NCM_TX_FLUSH_TIMEOUT
+static struct usb_osal_timer *g_cdc_ncm_tx_timer = NULL;
+#endif
+
+/* out ntb format negotiated with the device */
+static uint32_t g_cdc_ncm_tx_ntb_size = CONFIG_USBHOST_CDC_NCM_ETH_MAX_TX_SIZE;
+static uint16_t g_cdc_ncm_tx_divisor = 4;
+static uint16_t g_cdc_ncm_tx_remainder = 0;
+static uint16_t g_cdc_ncm_tx_ndp_alignment = 4;
+static uint16_t g_cdc_ncm_tx_max_datagrams = CDC_NCM_TX_MAX_DATAGRAMS;
 
-static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_cdc_ncm_rx_buffer[CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE];
-static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_cdc_ncm_tx_buffer[CONFIG_USBHOST_CDC_NCM_ETH_MAX_TX_SIZE];
 static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_cdc_ncm_inttx_buffer[USB_ALIGN_UP(16, CONFIG_USB_ALIGN_SIZE)];
 
 static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_cdc_ncm_buf[USB_ALIGN_UP(32, CONFIG_USB_ALIGN_SIZE)];
@@ -56,6 +104,67 @@ static int usbh_cdc_ncm_get_ntb_parameters(struct usbh_cdc_ncm *cdc_ncm_class, s
     return 0;
 }
 
+static int usbh_cdc_ncm_set_ntb_input_size(struct usbh_cdc_ncm *cdc_ncm_class, uint32_t ntb_size)
+{
+    struct usb_setup_packet *setup;
+
+    if (!cdc_ncm_class || !cdc_ncm_class->hport) {
+        return -USB_ERR_INVAL;
+    }
+    setup = cdc_ncm_class->hport->setup;
+
+    setup->bmRequestType = USB_REQUEST_DIR_OUT | USB_REQUEST_CLASS | USB_REQUEST_RECIPIENT_INTERFACE;
+    setup->bRequest = CDC_REQUEST_SET_NTB_INPUT_SIZE;
+    setup->wValue = 0;
+    setup->wIndex = cdc_ncm_class->ctrl_intf;
+    setup->wLength = 4;
+
+    memcpy(g_cdc_ncm_buf, &ntb_size, 4);
+    return usbh_control_transfer(cdc_ncm_class->hport, setup, g_cdc_ncm_buf);
+}
+
+/* size rx transfers and tx ntbs from the device ntb parameters */
+static void usbh_cdc_ncm_ntb_setup(struct usbh_cdc_ncm *cdc_ncm_class)
+{
+    struct cdc_ncm_ntb_parameters *param = &cdc_ncm_class->ntb_param;
+    uint32_t ntb_size;
+    int ret;
+
+    /* every rx transfer must end with the ntb, so ntbs can not be larger than one rx buffer */
+    ntb_size = CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE;
+    if (param->dwNtbInMaxSize && (param->dwNtbInMaxSize < ntb_size)) {
+        ntb_size = param->dwNtbInMaxSize;
+    } else if (param->dwNtbInMaxSize > ntb_size) {
+        ret = usbh_cdc_ncm_set_ntb_input_size(cdc_ncm_class, ntb_size);
+        if (ret < 0) {
+            USB_LOG_ERR("Failed to set ntb input size %u, rx ntb may be overflow\r\n", (unsigned int)ntb_size);
+        }
+    }
+    g_cdc_ncm_rx_ntb_size = ntb_size;
+
+    g_cdc_ncm_tx_ntb_size = CONFIG_USBHOST_CDC_NCM_ETH_MAX_TX_SIZE;
+    if (param->dwNtbOutMaxSize && (param->dwNtbOutMaxSize < g_cdc_ncm_tx_ntb_size)) {
+        g_cdc_ncm_tx_ntb_size = param->dwNtbOutMaxSize;
+    }
+    g_cdc_ncm_tx_divisor = param->wNdbOutDivisor ? param->wNdbOutDivisor : 4;
+    g_cdc_ncm_tx_remainder = param->wNdbOutPayloadRemainder % g_cdc_ncm_tx_divisor;
+    g_cdc_ncm_tx_ndp_alignment = (param->wNdbOutAlignment > 4) ? param->wNdbOutAlignment : 4;
+    g_cdc_ncm_tx_max_datagrams = CDC_NCM_TX_MAX_DATAGRAMS;
+    if (param->wNtbOutMaxDatagrams && (param->wNtbOutMaxDatagrams < g_cdc_ncm_tx_max_datagrams)) {
+        g_cdc_ncm_tx_max_datagrams = param->wNtbOutMaxDatagrams;
+    }
+
+    g_cdc_ncm_tx_fill = 0;
+    g_cdc_ncm_tx_datagram_num = 0;
+    g_cdc_ncm_tx_offset = CDC_NCM_NTH16_LEN;
+    g_cdc_ncm_tx_busy = false;
+    g_cdc_ncm_tx_writing = false;
+    g_cdc_ncm_tx_flush_pending = false;
+    g_cdc_ncm_tx_queued_len = 0;
+
+    USB_LOG_INFO("CDC NCM rx ntb size:%u, tx ntb size:%u\r\n", (unsigned int)g_cdc_ncm_rx_ntb_size, (unsigned int)g_cdc_ncm_tx_ntb_size);
+}
+
 static void print_ntb_parameters(struct cdc_ncm_ntb_parameters *param)
 {
     USB_LOG_RAW("CDC NCM ntb parameters:\r\n");
@@ -97,6 +206,14 @@ int usbh_cdc_ncm_get_connect_status(struct usbh_cdc_ncm *cdc_ncm_class)
     return 0;
 }
 
+#ifdef CONFIG_USBHOST_CDC_NCM_TX_FLUSH_TIMEOUT
+static void usbh_cdc_ncm_tx_timeout(void *argument)
+{
+    (void)argument;
+    usbh_cdc_ncm_eth_tx_flush();
+}
+#endif
+
 static int usbh_cdc_ncm_connect(struct usbh_hubport *hport, uint8_t intf)
 {
     struct usb_endpoint_descriptor *ep_desc;
@@ -185,6 +302,8 @@ get_mac:
 
     usbh_cdc_ncm_get_ntb_parameters(cdc_ncm_class, &cdc_ncm_class->ntb_param);
     print_ntb_parameters(&cdc_ncm_class->ntb_param);
+    /* ntb input size can only be changed while the data interface is in altsetting 0 */
+    usbh_cdc_ncm_ntb_setup(cdc_ncm_class);
 
     /* enable int ep */
     ep_desc = &hport->config.intf[intf].altsetting[0].ep[0].ep_desc;
@@ -217,6 +336,27 @@ get_mac:
         }
     }
 
+    /* the controller keeps the toggle between the queued rx urbs, and refuses a second urb it cannot queue */
+    usbh_pipe_open(hport, cdc_ncm_class->bulkin);
+    usbh_pipe_open(hport, cdc_ncm_class->bulkout);
+
+    /* kept across reconnects, urb callbacks may still reference them */
+    if (g_cdc_ncm_rx_sem == NULL) {
+        g_cdc_ncm_rx_sem = usb_osal_sem_create(0);
+    }
+    if (g_cdc_ncm_tx_sem == NULL) {
+        g_cdc_ncm_tx_sem = usb_osal_sem_create(0);
+    }
+#ifdef CONFIG_USBHOST_CDC_NCM_TX_FLUSH_TIMEOUT
+    if (g_cdc_ncm_tx_timer == NULL) {
+        g_cdc_ncm_tx_timer = usb_osal_timer_create("ncm_tx", CONFIG_USBHOST_CDC_NCM_TX_FLUSH_TIMEOUT, usbh_cdc_ncm_tx_timeout, NULL, false);
+    }
+#endif
+    if ((g_cdc_ncm_rx_sem == NULL) || (g_cdc_ncm_tx_sem == NULL)) {
+        USB_LOG_ERR("Failed to create cdc ncm sem\r\n");
+        return -USB_ERR_NOMEM;
+    }
+
     strncpy(hport->config.intf[intf].devname, DEV_FORMAT, CONFIG_USBHOST_DEV_NAMELEN);
 
     USB_LOG_INFO("Register CDC NCM Class:%s\r\n", hport->config.intf[intf].devname);
@@ -232,12 +372,24 @@ static int usbh_cdc_ncm_disconnect(struct usbh_hubport *hport, uint8_t intf)
     struct usbh_cdc_ncm *cdc_ncm_class = (struct usbh_cdc_ncm *)hport->config.intf[intf].priv;
 
     if (cdc_ncm_class) {
+        /* stop the tx completion from queueing the next ntb */
+        cdc_ncm_class->connect_status = false;
+#ifdef CONFIG_USBHOST_CDC_NCM_TX_FLUSH_TIMEOUT
+        if (g_cdc_ncm_tx_timer) {
+            usb_osal_timer_stop(g_cdc_ncm_tx_timer);
+        }
+#endif
+
         if (cdc_ncm_class->bulkin) {
-            usbh_kill_urb(&cdc_ncm_class->bulkin_urb);
+            for (uint8_t i = 0; i < CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM; i++) {
+                usbh_kill_urb(&g_cdc_ncm_rx_urb[i]);
+            }
+            usbh_pipe_close(hport, cdc_ncm_class->bulkin);
         }
 
         if (cdc_ncm_class->bulkout) {
             usbh_kill_urb(&cdc_ncm_class->bulkout_urb);
+            usbh_pipe_close(hport, cdc_ncm_class->bulkout);
         }
 
         if (cdc_ncm_class->intin) {
@@ -256,21 +408,132 @@ static int usbh_cdc_ncm_disconnect(struct usbh_hubport *hport, uint8_t intf)
     return ret;
 }
 
+static void usbh_cdc_ncm_rx_complete(void *arg, int nbytes)
+{
+    struct usbh_urb *urb = (struct usbh_urb *)arg;
+
+    if (nbytes != -USB_ERR_SHUTDOWN) {
+        g_cdc_ncm_rx_toggle = urb->data_toggle;
+    }
+    usb_osal_sem_give(g_cdc_ncm_rx_sem);
+}
+
+static int usbh_cdc_ncm_rx_submit(uint8_t index)
+{
+    size_t flags;
+
+    g_cdc_ncm_rx_ntb[index] = usbh_eth_rxbuf_alloc(g_cdc_ncm_rx_ntb_size);
+    if (g_cdc_ncm_rx_ntb[index] == NULL) {
+        g_cdc_ncm_rx_ntb[index] = g_cdc_ncm_rx_buffer[index];
+    }
+
+    usbh_bulk_urb_fill(&g_cdc_ncm_rx_urb[index], g_cdc_ncm_class.hport, g_cdc_ncm_class.bulkin, g_cdc_ncm_rx_ntb[index], g_cdc_ncm_rx_ntb_size, 0, usbh_cdc_ncm_rx_complete, &g_cdc_ncm_rx_urb[index]);
+
+    /*
+     * Only controllers without endpoint state use the toggle of the urb, the
+     * open pipe keeps it otherwise. The submit itself may allocate and run
+     * device callbacks, so it must not run with interrupts off.
+     */
+    flags = usb_osal_enter_critical_section();
+    g_cdc_ncm_rx_urb[index].data_toggle = g_cdc_ncm_rx_toggle;
+    usb_osal_leave_critical_section(flags);
+
+    return usbh_submit_urb(&g_cdc_ncm_rx_urb[index]);
+}
+
+static void usbh_cdc_ncm_rx_release(uint8_t index)
+{
+    if (g_cdc_ncm_rx_ntb[index]) {
+        usbh_eth_rxbuf_free(g_cdc_ncm_rx_ntb[index]);
+        g_cdc_ncm_rx_ntb[index] = NULL;
+    }
+}
+
+static void usbh_cdc_ncm_rx_parse(uint8_t *ntb, uint32_t len)
+{
+    struct cdc_ncm_nth16 *nth16 = (struct cdc_ncm_nth16 *)ntb;
+    struct cdc_ncm_ndp16 *ndp16;
+    struct cdc_ncm_ndp16_datagram *ndp16_datagram;
+    uint32_t block_len;
+    uint32_t ndp_index;
+    uint16_t datagram_num;
+    uint16_t ndp_count = 0;
+
+    USB_LOG_DBG("rxlen:%d\r\n", len);
+
+    if ((len < CDC_NCM_NTH16_LEN) ||
+        (nth16->dwSignature != CDC_NCM_NTH16_SIGNATURE) ||
+        (nth16->wHeaderLength != CDC_NCM_NTH16_LEN) ||
+        (nth16->wBlockLength > len)) {
+        USB_LOG_ERR("invalid rx nth16\r\n");
+        return;
+    }
+
+    /* wBlockLength of 0 means the ntb ends with the transfer */
+    block_len = nth16->wBlockLength ? nth16->wBlockLength : len;
+    ndp_index = nth16->wNdpIndex;
+
+    /* follow the ndp chain, each ndp takes at least 16 bytes so a loop can not go on forever */
+    while (ndp_index && (ndp_count++ < (block_len / 16))) {
+        if ((ndp_index < CDC_NCM_NTH16_LEN) || (ndp_index % 4) || ((ndp_index + 16) > block_len)) {
+            USB_LOG_ERR("invalid rx ndp16 index:%u\r\n", (unsigned int)ndp_index);
+            return;
+        }
+
+        ndp16 = (struct cdc_ncm_ndp16 *)&ntb[ndp_index];
+        if (((ndp16->dwSignature != CDC_NCM_NDP16_SIGNATURE_NCM0) && (ndp16->dwSignature != CDC_NCM_NDP16_SIGNATURE_NCM1)) ||
+            (ndp16->wLength < 16) || ((ndp_index + ndp16->wLength) > block_len)) {
+            USB_LOG_ERR("invalid rx ndp16\r\n");
+            return;
+        }
+
+        datagram_num = (ndp16->wLength - 8) / 4;
+
+        USB_LOG_DBG("datagram num:%02x\r\n", datagram_num);
+        for (uint16_t i = 0; i < datagram_num; i++) {
+            ndp16_datagram = (struct cdc_ncm_ndp16_datagram *)&ntb[ndp_index + 8 + 4 * i];
+            if ((ndp16_datagram->wDatagramIndex == 0) || (ndp16_datagram->wDatagramLength == 0)) {
+                break;
+            }
+            if (((uint32_t)ndp16_datagram->wDatagramIndex + ndp16_datagram->wDatagramLength) > block_len) {
+                USB_LOG_ERR("invalid rx datagram\r\n");
+                break;
+            }
+
+            USB_LOG_DBG("ndp16_datagram index:%02x, length:%02x\r\n", ndp16_datagram->wDatagramIndex, ndp16_datagram->wDatagramLength);
+            usbh_cdc_ncm_eth_input(&ntb[ndp16_datagram->wDatagramIndex], ndp16_datagram->wDatagramLength);
+        }
+
+        ndp_index = ndp16->wNextNdpIndex;
+    }
+}
+
+static void usbh_cdc_ncm_rx_kill(void)
+{
+    for (uint8_t i = 0; i < CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM; i++) {
+        if (g_cdc_ncm_rx_urb[i].errorcode == -USB_ERR_BUSY) {
+            usbh_kill_urb(&g_cdc_ncm_rx_urb[i]);
+        }
+        usbh_cdc_ncm_rx_release(i);
+    }
+}
+
 void usbh_cdc_ncm_rx_thread(CONFIG_USB_OSAL_THREAD_SET_ARGV)
 {
-    uint32_t g_cdc_ncm_rx_length;
+    uint8_t head;     /* oldest ntb on the bus */
+    uint8_t tail;     /* next ntb to put on the bus */
+    uint8_t inflight; /* ntbs on the bus */
+    uint8_t urb_num;  /* urbs the controller accepted on the endpoint */
+    uint8_t ready;    /* completed ntb to parse */
+    uint32_t ready_len;
     int ret;
-#if CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE <= (16 * 1024)
-    uint32_t transfer_size = CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE;
-#else
-    uint32_t transfer_size = (16 * 1024);
-#endif
 
     (void)CONFIG_USB_OSAL_THREAD_GET_ARGV;
     USB_LOG_INFO("Create cdc ncm rx thread\r\n");
     // clang-format off
 find_class:
     // clang-format on
+    usbh_cdc_ncm_rx_kill();
     g_cdc_ncm_class.connect_status = false;
     if (usbh_find_class_instance("/dev/cdc_ncm") == NULL) {
         goto delete;
@@ -284,65 +547,53 @@ find_class:
         }
     }
 
-    g_cdc_ncm_rx_length = 0;
+    head = 0;
+    tail = 0;
+    inflight = 0;
+    urb_num = CONFIG_USBHOST_CDC_NCM_RX_URB_NUM;
+    g_cdc_ncm_rx_toggle = false;
+    ready = CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM;
+    ready_len = 0;
     while (1) {
-        usbh_bulk_urb_fill(&g_cdc_ncm_class.bulkin_urb, g_cdc_ncm_class.hport, g_cdc_ncm_class.bulkin, &g_cdc_ncm_rx_buffer[g_cdc_ncm_rx_length], transfer_size, USB_OSAL_WAITING_FOREVER, NULL, NULL);
-        ret = usbh_submit_urb(&g_cdc_ncm_class.bulkin_urb);
-        if (ret < 0) {
-            goto find_class;
-        }
-
-        g_cdc_ncm_rx_length += g_cdc_ncm_class.bulkin_urb.actual_length;
-
-        /* A transfer is complete because last packet is a short packet.
-         * Short packet is not zero, match g_cdc_ncm_rx_length % USB_GET_MAXPACKETSIZE(g_cdc_ncm_class.bulkin->wMaxPacketSize).
-         * Short packet is zero, check if g_cdc_ncm_class.bulkin_urb.actual_length < transfer_size, for example transfer is complete with size is 1024 < 2048.
-        */
-        if ((g_cdc_ncm_rx_length % USB_GET_MAXPACKETSIZE(g_cdc_ncm_class.bulkin->wMaxPacketSize)) ||
-            (g_cdc_ncm_class.bulkin_urb.actual_length < transfer_size)) {
-            USB_LOG_DBG("rxlen:%d\r\n", g_cdc_ncm_rx_length);
-
-            struct cdc_ncm_nth16 *nth16 = (struct cdc_ncm_nth16 *)&g_cdc_ncm_rx_buffer[0];
-            if ((nth16->dwSignature != CDC_NCM_NTH16_SIGNATURE) ||
-                (nth16->wHeaderLength != 12) ||
-                (nth16->wBlockLength != g_cdc_ncm_rx_length)) {
-                USB_LOG_ERR("invalid rx nth16\r\n");
-                g_cdc_ncm_rx_length = 0;
-                continue;
+        /* refill the bus first, the device can send the next ntbs while this one is parsed */
+        while (inflight < urb_num) {
+            ret = usbh_cdc_ncm_rx_submit(tail);
+            if (ret < 0) {
+                usbh_cdc_ncm_rx_release(tail);
+                if (inflight == 0) {
+                    goto find_class;
+                }
+                /* the controller cannot queue another urb on this endpoint, stay with what it took */
+                urb_num = inflight;
+                break;
             }
+            tail = (tail + 1) % CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM;
+            inflight++;
+        }
 
-            struct cdc_ncm_ndp16 *ndp16 = (struct cdc_ncm_ndp16 *)&g_cdc_ncm_rx_buffer[nth16->wNdpIndex];
-            if ((ndp16->dwSignature != CDC_NCM_NDP16_SIGNATURE_NCM0) && (ndp16->dwSignature != CDC_NCM_NDP16_SIGNATURE_NCM1)) {
-                USB_LOG_ERR("invalid rx ndp16\r\n");
-                g_cdc_ncm_rx_length = 0;
-                continue;
+        if (ready < CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM) {
+            /* a zero length packet ends an ntb of exactly rx ntb size on some devices */
+            if (ready_len) {
+                usbh_cdc_ncm_rx_parse(g_cdc_ncm_rx_ntb[ready], ready_len);
             }
+            usbh_cdc_ncm_rx_release(ready);
+            ready = CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM;
+        }
 
-            uint16_t datagram_num = (ndp16->wLength - 8) / 4;
-
-            USB_LOG_DBG("datagram num:%02x\r\n", datagram_num);
-            for (uint16_t i = 0; i < datagram_num; i++) {
-                struct cdc_ncm_ndp16_datagram *ndp16_datagram = (struct cdc_ncm_ndp16_datagram *)&g_cdc_ncm_rx_buffer[nth16->wNdpIndex + 8 + 4 * i];
-                if (ndp16_datagram->wDatagramIndex && ndp16_datagram->wDatagramLength) {
-                    USB_LOG_DBG("ndp16_datagram index:%02x, length:%02x\r\n", ndp16_datagram->wDatagramIndex, ndp16_datagram->wDatagramLength);
-
-                    uint8_t *buf = (uint8_t *)&g_cdc_ncm_rx_buffer[ndp16_datagram->wDatagramIndex];
-                    usbh_cdc_ncm_eth_input(buf, ndp16_datagram->wDatagramLength);
-                }
-            }
+        /* urbs on one endpoint complete in order */
+        while (g_cdc_ncm_rx_urb[head].errorcode == -USB_ERR_BUSY) {
+            usb_osal_sem_take(g_cdc_ncm_rx_sem, USB_OSAL_WAITING_FOREVER);
+        }
 
-            g_cdc_ncm_rx_length = 0;
-        } else {
-#if CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE <= (16 * 1024)
-            if (g_cdc_ncm_rx_length == CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE) {
-#else
-            if ((g_cdc_ncm_rx_length + (16 * 1024)) > CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE) {
-#endif
-                USB_LOG_ERR("Rx packet is overflow, please reduce tcp window size or increase CONFIG_USBHOST_CDC_NCM_ETH_MAX_RX_SIZE\r\n");
-                while (1) {
-                }
-            }
+        ret = g_cdc_ncm_rx_urb[head].errorcode;
+        if (ret < 0) {
+            goto find_class;
         }
+
+        ready = head;
+        ready_len = g_cdc_ncm_rx_urb[head].actual_length;
+        head = (head + 1) % CONFIG_USBHOST_CDC_NCM_RX_NTB_NUM;
+        inflight--;
     }
     // clang-format off
 delete:
@@ -351,45 +602,236 @@ delete:
     // clang-format on
 }
 
-uint8_t *usbh_cdc_ncm_get_eth_txbuf(void)
+static uint32_t usbh_cdc_ncm_tx_datagram_offset(uint32_t offset)
 {
-    return &g_cdc_ncm_tx_buffer[16];
+    return offset + (g_cdc_ncm_tx_remainder + g_cdc_ncm_tx_divisor - (offset % g_cdc_ncm_tx_divisor)) % g_cdc_ncm_tx_divisor;
 }
 
-int usbh_cdc_ncm_eth_output(uint32_t buflen)
+/* room for one more datagram, its ndp entry and the terminating null entry */
+static bool usbh_cdc_ncm_tx_has_room(uint32_t len)
+{
+    uint32_t ndp_index;
+
+    if (g_cdc_ncm_tx_datagram_num >= g_cdc_ncm_tx_max_datagrams) {
+        return false;
+    }
+
+    ndp_index = USB_ALIGN_UP(usbh_cdc_ncm_tx_datagram_offset(g_cdc_ncm_tx_offset) + len, g_cdc_ncm_tx_ndp_alignment);
+    return (ndp_index + 8 + 4 * (g_cdc_ncm_tx_datagram_num + 2)) <= g_cdc_ncm_tx_ntb_size;
+}
+
+/*
+ * Close the collecting ntb, must be called with interrupts disabled.
+ * Returns the ntb length to send or 0.
+ */
+static uint32_t usbh_cdc_ncm_tx_close_ntb(uint8_t **buf)
 {
+    struct cdc_ncm_nth16 *nth16;
+    struct cdc_ncm_ndp16 *ndp16;
     struct cdc_ncm_ndp16_datagram *ndp16_datagram;
+    uint8_t *ntb;
+    uint32_t ndp_index;
+    uint32_t block_len;
 
-    if (g_cdc_ncm_class.connect_status == false) {
-        return -USB_ERR_NOTCONN;
+    if (g_cdc_ncm_tx_busy || g_cdc_ncm_tx_writing || (g_cdc_ncm_tx_datagram_num == 0)) {
+        return 0;
     }
 
-    struct cdc_ncm_nth16 *nth16 = (struct cdc_ncm_nth16 *)&g_cdc_ncm_tx_buffer[0];
+    ntb = g_cdc_ncm_tx_buffer[g_cdc_ncm_tx_fill];
+    ndp_index = USB_ALIGN_UP(g_cdc_ncm_tx_offset, g_cdc_ncm_tx_ndp_alignment);
+    block_len = ndp_index + 8 + 4 * (g_cdc_ncm_tx_datagram_num + 1);
 
+    /* host does not send zlp, pad a short ntb that ends on a packet boundary instead */
+    if (((block_len % USB_GET_MAXPACKETSIZE(g_cdc_ncm_class.bulkout->wMaxPacketSize)) == 0) && (block_len < g_cdc_ncm_tx_ntb_size)) {
+        ntb[block_len] = 0;
+        block_len++;
+    }
+
+    nth16 = (struct cdc_ncm_nth16 *)&ntb[0];
     nth16->dwSignature = CDC_NCM_NTH16_SIGNATURE;
-    nth16->wHeaderLength = 12;
+    nth16->wHeaderLength = CDC_NCM_NTH16_LEN;
     nth16->wSequence = g_cdc_ncm_class.bulkout_sequence++;
-    nth16->wBlockLength = 16 + 16 + USB_ALIGN_UP(buflen, 4);
-    nth16->wNdpIndex = 16 + USB_ALIGN_UP(buflen, 4);
-
-    struct cdc_ncm_ndp16 *ndp16 = (struct cdc_ncm_ndp16 *)&g_cdc_ncm_tx_buffer[nth16->wNdpIndex];
+    nth16->wBlockLength = block_len;
+    nth16->wNdpIndex = ndp_index;
 
+    ndp16 = (struct cdc_ncm_ndp16 *)&ntb[ndp_index];
     ndp16->dwSignature = CDC_NCM_NDP16_SIGNATURE_NCM0;
-    ndp16->wLength = 16;
+    ndp16->wLength = 8 + 4 * (g_cdc_ncm_tx_datagram_num + 1);
     ndp16->wNextNdpIndex = 0;
 
-    ndp16_datagram = (struct cdc_ncm_ndp16_datagram *)&g_cdc_ncm_tx_buffer[nth16->wNdpIndex + 8 + 4 * 0];
-    ndp16_datagram->wDatagramIndex = 16;
-    ndp16_datagram->wDatagramLength = buflen;
+    ndp16_datagram = (struct cdc_ncm_ndp16_datagram *)&ntb[ndp_index + 8];
+    for (uint16_t i = 0; i < g_cdc_ncm_tx_datagram_num; i++) {
+        ndp16_datagram[i].wDatagramIndex = g_cdc_ncm_tx_datagram[i].wDatagramIndex;
+        ndp16_datagram[i].wDatagramLength = g_cdc_ncm_tx_datagram[i].wDatagramLength;
+    }
+    ndp16_datagram[g_cdc_ncm_tx_datagram_num].wDatagramIndex = 0;
+    ndp16_datagram[g_cdc_ncm_tx_datagram_num].wDatagramLength = 0;
+
+    /* mark busy before submitting: the urb may complete before usbh_submit_urb() returns */
+    g_cdc_ncm_tx_busy = true;
+    g_cdc_ncm_tx_fill ^= 1;
+    g_cdc_ncm_tx_datagram_num = 0;
+    g_cdc_ncm_tx_offset = CDC_NCM_NTH16_LEN;
+    g_cdc_ncm_tx_flush_pending = false;
+
+    *buf = ntb;
+    return block_len;
+}
+
+static void usbh_cdc_ncm_tx_complete(void *arg, int nbytes);
+
+static int usbh_cdc_ncm_tx_kick(void)
+{
+    uint8_t *buf = NULL;
+    uint32_t len;
+    size_t flags;
+    int ret;
+
+    flags = usb_osal_enter_critical_section();
+    if (g_cdc_ncm_class.connect_status == false) {
+        /* drop what was collected, the device is gone */
+        g_cdc_ncm_tx_datagram_num = 0;
+        g_cdc_ncm_tx_offset = CDC_NCM_NTH16_LEN;
+        if (g_cdc_ncm_tx_queued_len) {
+            g_cdc_ncm_tx_queued_len = 0;
+            g_cdc_ncm_tx_busy = false;
+        }
+        usb_osal_leave_critical_section(flags);
+        return -USB_ERR_NOTCONN;
+    }
+    if (g_cdc_ncm_tx_queued_len) {
+        /* the closed ntb went to the other buffer, busy is still held for it */
+        buf = g_cdc_ncm_tx_buffer[g_cdc_ncm_tx_fill ^ 1];
+        len = g_cdc_ncm_tx_queued_len;
+        g_cdc_ncm_tx_queued_len = 0;
+    } else {
+        len = usbh_cdc_ncm_tx_close_ntb(&buf);
+    }
+    usb_osal_leave_critical_section(flags);
+
+    if (len == 0) {
+        return 0;
+    }
+
+    USB_LOG_DBG("txlen:%d\r\n", len);
+
+    usbh_bulk_urb_fill(&g_cdc_ncm_class.bulkout_urb, g_cdc_ncm_class.hport, g_cdc_ncm_class.bulkout, buf, len, 0, usbh_cdc_ncm_tx_complete, NULL);
+    ret = usbh_submit_urb(&g_cdc_ncm_class.bulkout_urb);
+    if (ret < 0) {
+        /* keep busy so no other ntb is closed over it, the next kick submits it again */
+        flags = usb_osal_enter_critical_section();
+        g_cdc_ncm_tx_queued_len = len;
+        usb_osal_leave_critical_section(flags);
+        USB_LOG_ERR("tx submit failed, ret:%d\r\n", ret);
+    }
+    return ret;
+}
+
+static void usbh_cdc_ncm_tx_complete(void *arg, int nbytes)
+{
+    (void)arg;
+    (void)nbytes;
+
+    g_cdc_ncm_tx_busy = false;
+    /* datagrams collected while this ntb was on the bus go out right away */
+    usbh_cdc_ncm_tx_kick();
+    usb_osal_sem_give(g_cdc_ncm_tx_sem);
+}
+
+uint8_t *usbh_cdc_ncm_get_eth_txbuf(void)
+{
+    uint8_t *buf;
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    /* keep the collecting ntb until the frame is queued by usbh_cdc_ncm_eth_output */
+    g_cdc_ncm_tx_writing = true;
+    buf = &g_cdc_ncm_tx_buffer[g_cdc_ncm_tx_fill][usbh_cdc_ncm_tx_datagram_offset(g_cdc_ncm_tx_offset)];
+    usb_osal_leave_critical_section(flags);
+
+    return buf;
+}
+
+/*
+ * Queue the frame copied into usbh_cdc_ncm_get_eth_txbuf(). Frames are packed into
+ * one ntb while the previous ntb is on the bus, blocks only when both ntbs are in use.
+ * A failed submit is returned, the ntb stays queued and goes out on the next call.
+ */
+int usbh_cdc_ncm_eth_output(uint32_t buflen)
+{
+    uint32_t offset;
+    bool send_now;
+    bool full;
+#ifdef CONFIG_USBHOST_CDC_NCM_TX_FLUSH_TIMEOUT
+    bool start_timer;
+#endif
+    size_t flags;
+    int ret = 0;
+
+    flags = usb_osal_enter_critical_section();
+    g_cdc_ncm_tx_writing = false;
+
+    if (g_cdc_ncm_class.connect_status == false) {
+        usb_osal_leave_critical_section(flags);
+        return -USB_ERR_NOTCONN;
+    }
+
+    if ((buflen > CONFIG_USBHOST_CDC_NCM_ETH_MAX_SEGSZE) || !usbh_cdc_ncm_tx_has_room(buflen)) {
+        usb_osal_leave_critical_section(flags);
+        USB_LOG_ERR("tx frame too large:%u\r\n", (unsigned int)buflen);
+        return -USB_ERR_INVAL;
+    }
+
+    offset = usbh_cdc_ncm_tx_datagram_offset(g_cdc_ncm_tx_offset);
+    g_cdc_ncm_tx_datagram[g_cdc_ncm_tx_datagram_num].wDatagramIndex = offset;
+    g_cdc_ncm_tx_datagram[g_cdc_ncm_tx_datagram_num].wDatagramLength = buflen;
+    g_cdc_ncm_tx_datagram_num++;
+    g_cdc_ncm_tx_offset = offset + buflen;
+
+    /* the next usbh_cdc_ncm_get_eth_txbuf must have room for a full frame */
+    full = !usbh_cdc_ncm_tx_has_room(CONFIG_USBHOST_CDC_NCM_ETH_MAX_SEGSZE);
+#ifdef CONFIG_USBHOST_CDC_NCM_TX_FLUSH_TIMEOUT
+    /* hold datagrams until the ntb is full, the flush timer expires or the bus frees up */
+    send_now = full || g_cdc_ncm_tx_flush_pending || g_cdc_ncm_tx_queued_len;
+    start_timer = !send_now && (g_cdc_ncm_tx_datagram_num == 1);
+#else
+    /* an idle bus takes the datagram at once, a busy one lets datagrams gather */
+    send_now = true;
+#endif
+    usb_osal_leave_critical_section(flags);
+
+#ifdef CONFIG_USBHOST_CDC_NCM_TX_FLUSH_TIMEOUT
+    if (start_timer && g_cdc_ncm_tx_timer) {
+        usb_osal_timer_start(g_cdc_ncm_tx_timer);
+    }
+#endif
+    if (send_now) {
+        ret = usbh_cdc_ncm_tx_kick();
+    }
+
+    /* wait for the ntb on the bus, its completion sends the full one */
+    while (full && (ret == 0)) {
+        usb_osal_sem_take(g_cdc_ncm_tx_sem, USB_OSAL_WAITING_FOREVER);
+        ret = usbh_cdc_ncm_tx_kick();
 
-    ndp16_datagram = (struct cdc_ncm_ndp16_datagram *)&g_cdc_ncm_tx_buffer[nth16->wNdpIndex + 8 + 4 * 1];
-    ndp16_datagram->wDatagramIndex = 0;
-    ndp16_datagram->wDatagramLength = 0;
+        flags = usb_osal_enter_critical_section();
+        full = !usbh_cdc_ncm_tx_has_room(CONFIG_USBHOST_CDC_NCM_ETH_MAX_SEGSZE);
+        usb_osal_leave_critical_section(flags);
+    }
+
+    return ret;
+}
+
+void usbh_cdc_ncm_eth_tx_flush(void)
+{
+    size_t flags;
 
-    USB_LOG_DBG("txlen:%d\r\n", nth16->wBlockLength);
+    flags = usb_osal_enter_critical_section();
+    /* the frame being copied is sent by usbh_cdc_ncm_eth_output itself */
+    g_cdc_ncm_tx_flush_pending = g_cdc_ncm_tx_writing;
+    usb_osal_leave_critical_section(flags);
 
-    usbh_bulk_urb_fill(&g_cdc_ncm_class.bulkout_urb, g_cdc_ncm_class.hport, g_cdc_ncm_class.bulkout, g_cdc_ncm_tx_buffer, nth16->wBlockLength, USB_OSAL_WAITING_FOREVER, NULL, NULL);
-    return usbh_submit_urb(&g_cdc_ncm_class.bulkout_urb);
+    usbh_cdc_ncm_tx_kick();
 }
 
 const struct usbh_class_driver cdc_ncm_class_driver = {
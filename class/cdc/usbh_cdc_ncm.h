@@ -14,7 +14,6 @@ struct usbh_cdc_ncm {
     struct usb_endpoint_descriptor *bulkout; /* Bulk OUT endpoint */
     struct usb_endpoint_descriptor *intin;   /* Interrupt IN endpoint */
     struct usbh_urb bulkout_urb;             /* Bulk out endpoint */
-    struct usbh_urb bulkin_urb;              /* Bulk IN endpoint */
     struct usbh_urb intin_urb;               /* Interrupt IN endpoint */
 
     uint8_t ctrl_intf; /* Control interface number */
@@ -44,6 +43,7 @@ void usbh_cdc_ncm_stop(struct usbh_cdc_ncm *cdc_ncm_class);
 
 uint8_t *usbh_cdc_ncm_get_eth_txbuf(void);
 int usbh_cdc_ncm_eth_output(uint32_t buflen);
+void usbh_cdc_ncm_eth_tx_flush(void);
 void usbh_cdc_ncm_eth_input(uint8_t *buf, uint32_t buflen);
 void usbh_cdc_ncm_rx_thread(CONFIG_USB_OSAL_THREAD_SET_ARGV);
 
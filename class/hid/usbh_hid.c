@@ -28,26 +28,33 @@ static uint32_t g_devinuse = 0;
 static struct usbh_hid *usbh_hid_class_alloc(void)
 {
     uint8_t devno;
+    size_t flags;
 
+    flags = usb_osal_enter_critical_section();
     for (devno = 0; devno < CONFIG_USBHOST_MAX_HID_CLASS; devno++) {
         if ((g_devinuse & (1U << devno)) == 0) {
             g_devinuse |= (1U << devno);
+            usb_osal_leave_critical_section(flags);
             memset(&g_hid_class[devno], 0, sizeof(struct usbh_hid));
             g_hid_class[devno].minor = devno;
             return &g_hid_class[devno];
         }
     }
+    usb_osal_leave_critical_section(flags);
     return NULL;
 }
 
 static void usbh_hid_class_free(struct usbh_hid *hid_class)
 {
     uint8_t devno = hid_class->minor;
+    size_t flags;
 
+    memset(hid_class, 0, sizeof(struct usbh_hid));
     if (devno < 32) {
+        flags = usb_osal_enter_critical_section();
         g_devinuse &= ~(1U << devno);
+        usb_osal_leave_critical_section(flags);
     }
-    memset(hid_class, 0, sizeof(struct usbh_hid));
 }
 
 int usbh_hid_get_report_descriptor(struct usbh_hid *hid_class, uint8_t *buffer, uint32_t buflen)
@@ -255,6 +262,7 @@ found:
         } else {
             USBH_EP_INIT(hid_class->intout, ep_desc);
         }
+        usbh_pipe_open(hport, ep_desc);
     }
 
     snprintf(hport->config.intf[intf].devname, CONFIG_USBHOST_DEV_NAMELEN, DEV_FORMAT, hid_class->minor);
@@ -274,10 +282,12 @@ int usbh_hid_disconnect(struct usbh_hubport *hport, uint8_t intf)
     if (hid_class) {
         if (hid_class->intin) {
             usbh_kill_urb(&hid_class->intin_urb);
+            usbh_pipe_close(hport, hid_class->intin);
         }
 
         if (hid_class->intout) {
             usbh_kill_urb(&hid_class->intout_urb);
+            usbh_pipe_close(hport, hid_class->intout);
         }
 
         if (hport->config.intf[intf].devname[0] != '\0') {
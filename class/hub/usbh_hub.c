@@ -19,14 +19,39 @@
 
 #define EXTHUB_FIRST_INDEX 2
 
-USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_hub_buf[CONFIG_USBHOST_MAX_BUS][USB_ALIGN_UP(32, CONFIG_USB_ALIGN_SIZE)];
+USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_hub_buf[CONFIG_USBHOST_MAX_BUS][CONFIG_USBHOST_MAX_EXTHUBS + 1][USB_ALIGN_UP(32, CONFIG_USB_ALIGN_SIZE)];
 USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_hub_intbuf[CONFIG_USBHOST_MAX_BUS][CONFIG_USBHOST_MAX_EXTHUBS + 1][USB_ALIGN_UP(1, CONFIG_USB_ALIGN_SIZE)];
 
 extern int usbh_enumerate(struct usbh_hubport *hport);
+extern int usbh_enumerate_address(struct usbh_hubport *hport);
+extern int usbh_enumerate_configure(struct usbh_hubport *hport);
 extern void usbh_hubport_release(struct usbh_hubport *hport);
 
 static const char *speed_table[] = { "error-speed", "low-speed", "full-speed", "high-speed", "wireless-speed", "super-speed", "superplus-speed" };
 
+#if CONFIG_USBHOST_ENUM_THREADS > 0
+struct usbh_enum_worker {
+    struct usbh_bus *bus;
+    uint8_t index;
+};
+
+static struct usbh_enum_worker g_enum_worker[CONFIG_USBHOST_MAX_BUS][CONFIG_USBHOST_ENUM_THREADS];
+#endif
+
+/* the enumeration thread owns the child until it gives enum_sem, a request it is stuck on is killed */
+static void usbh_hub_port_release(struct usbh_hubport *child)
+{
+    if (child->enum_sem) {
+        while (usb_osal_sem_take(child->enum_sem, CONFIG_USBHOST_CONTROL_TRANSFER_TIMEOUT) < 0) {
+            USB_LOG_WRN("Port %u is still enumerating, kill its request\r\n", child->port);
+            usbh_kill_urb(&child->ep0_urb);
+        }
+        usb_osal_sem_delete(child->enum_sem);
+        child->enum_sem = NULL;
+    }
+    usbh_hubport_release(child);
+}
+
 #if CONFIG_USBHOST_MAX_EXTHUBS > 0
 static struct usbh_hub g_hub_class[CONFIG_USBHOST_MAX_EXTHUBS];
 static uint32_t g_devinuse = 0;
@@ -34,26 +59,33 @@ static uint32_t g_devinuse = 0;
 static struct usbh_hub *usbh_hub_class_alloc(void)
 {
     uint8_t devno;
+    size_t flags;
 
+    flags = usb_osal_enter_critical_section();
     for (devno = 0; devno < CONFIG_USBHOST_MAX_EXTHUBS; devno++) {
         if ((g_devinuse & (1U << devno)) == 0) {
             g_devinuse |= (1U << devno);
+            usb_osal_leave_critical_section(flags);
             memset(&g_hub_class[devno], 0, sizeof(struct usbh_hub));
             g_hub_class[devno].index = EXTHUB_FIRST_INDEX + devno;
             return &g_hub_class[devno];
         }
     }
+    usb_osal_leave_critical_section(flags);
     return NULL;
 }
 
 static void usbh_hub_class_free(struct usbh_hub *hub_class)
 {
     uint8_t devno = hub_class->index - EXTHUB_FIRST_INDEX;
+    size_t flags;
 
+    memset(hub_class, 0, sizeof(struct usbh_hub));
     if (devno < 32) {
+        flags = usb_osal_enter_critical_section();
         g_devinuse &= ~(1U << devno);
+        usb_osal_leave_critical_section(flags);
     }
-    memset(hub_class, 0, sizeof(struct usbh_hub));
 }
 
 static int _usbh_hub_get_hub_descriptor(struct usbh_hub *hub, uint8_t *buffer)
@@ -70,11 +102,11 @@ static int _usbh_hub_get_hub_descriptor(struct usbh_hub *hub, uint8_t *buffer)
     setup->wIndex = 0;
     setup->wLength = USB_SIZEOF_HUB_DESC;
 
-    ret = usbh_control_transfer(hub->parent, setup, g_hub_buf[hub->bus->busid]);
+    ret = usbh_control_transfer(hub->parent, setup, g_hub_buf[hub->bus->busid][hub->index - 1]);
     if (ret < 0) {
         return ret;
     }
-    memcpy(buffer, g_hub_buf[hub->bus->busid], USB_SIZEOF_HUB_DESC);
+    memcpy(buffer, g_hub_buf[hub->bus->busid][hub->index - 1], USB_SIZEOF_HUB_DESC);
     return ret;
 }
 
@@ -92,11 +124,11 @@ static int _usbh_hub_get_hub_ss_descriptor(struct usbh_hub *hub, uint8_t *buffer
     setup->wIndex = 0;
     setup->wLength = USB_SIZEOF_HUB_SS_DESC;
 
-    ret = usbh_control_transfer(hub->parent, setup, g_hub_buf[hub->bus->busid]);
+    ret = usbh_control_transfer(hub->parent, setup, g_hub_buf[hub->bus->busid][hub->index - 1]);
     if (ret < 0) {
         return ret;
     }
-    memcpy(buffer, g_hub_buf[hub->bus->busid], USB_SIZEOF_HUB_SS_DESC);
+    memcpy(buffer, g_hub_buf[hub->bus->busid][hub->index - 1], USB_SIZEOF_HUB_SS_DESC);
     return ret;
 }
 #endif
@@ -114,11 +146,11 @@ static int _usbh_hub_get_portstatus(struct usbh_hub *hub, uint8_t port, struct h
     setup->wIndex = port;
     setup->wLength = 4;
 
-    ret = usbh_control_transfer(hub->parent, setup, g_hub_buf[hub->bus->busid]);
+    ret = usbh_control_transfer(hub->parent, setup, g_hub_buf[hub->bus->busid][hub->index - 1]);
     if (ret < 0) {
         return ret;
     }
-    memcpy(port_status, g_hub_buf[hub->bus->busid], 4);
+    memcpy(port_status, g_hub_buf[hub->bus->busid][hub->index - 1], 4);
     return ret;
 }
 
@@ -462,7 +494,7 @@ static int usbh_hub_disconnect(struct usbh_hubport *hport, uint8_t intf)
 
         for (uint8_t port = 0; port < hub->nports; port++) {
             child = &hub->child[port];
-            usbh_hubport_release(child);
+            usbh_hub_port_release(child);
             child->parent = NULL;
         }
 
@@ -476,6 +508,37 @@ static int usbh_hub_disconnect(struct usbh_hubport *hport, uint8_t intf)
 }
 #endif
 
+/*
+ * Reset and addressing are done here one port at a time, the rest of the enumeration
+ * is handed to an enumeration thread so that devices on several ports come up together.
+ */
+static void usbh_hub_enumerate(struct usbh_hubport *child)
+{
+    int ret;
+
+#if CONFIG_USBHOST_ENUM_THREADS > 0
+    ret = usbh_enumerate_address(child);
+    if (ret >= 0) {
+        child->enum_sem = usb_osal_sem_create(0);
+        if (child->enum_sem && usb_osal_mq_send(child->bus->enum_mq, (uintptr_t)child) == 0) {
+            return;
+        }
+        if (child->enum_sem) {
+            usb_osal_sem_delete(child->enum_sem);
+            child->enum_sem = NULL;
+        }
+        ret = usbh_enumerate_configure(child);
+    }
+#else
+    ret = usbh_enumerate(child);
+#endif
+    if (ret < 0) {
+        /** release child sources */
+        usbh_hubport_release(child);
+        USB_LOG_ERR("Port %u enumerate fail\r\n", child->port);
+    }
+}
+
 static void usbh_hub_events(struct usbh_hub *hub)
 {
     struct usbh_hubport *child;
@@ -632,7 +695,7 @@ static void usbh_hub_events(struct usbh_hub *hub)
 
                     child = &hub->child[port];
                     /** release child sources first */
-                    usbh_hubport_release(child);
+                    usbh_hub_port_release(child);
 
                     memset(child, 0, sizeof(struct usbh_hubport));
                     child->parent = hub;
@@ -646,15 +709,11 @@ static void usbh_hub_events(struct usbh_hub *hub)
 
                     USB_LOG_INFO("New %s device on Bus %u, Hub %u, Port %u connected\r\n", speed_table[speed], hub->bus->busid, hub->index, port + 1);
 
-                    if (usbh_enumerate(child) < 0) {
-                        /** release child sources */
-                        usbh_hubport_release(child);
-                        USB_LOG_ERR("Port %u enumerate fail\r\n", child->port);
-                    }
+                    usbh_hub_enumerate(child);
                 } else {
                     child = &hub->child[port];
                     /** release child sources */
-                    usbh_hubport_release(child);
+                    usbh_hub_port_release(child);
 
                     /** some USB 3.0 ip may failed to enable USB 2.0 port for USB 3.0 device */
                     USB_LOG_WRN("Failed to enable port %u\r\n", port + 1);
@@ -664,7 +723,7 @@ static void usbh_hub_events(struct usbh_hub *hub)
             } else {
                 child = &hub->child[port];
                 /** release child sources */
-                usbh_hubport_release(child);
+                usbh_hub_port_release(child);
             }
         }
     }
@@ -675,6 +734,84 @@ static void usbh_hub_events(struct usbh_hub *hub)
     }
 }
 
+#if CONFIG_USBHOST_ENUM_THREADS > 0
+static void usbh_enum_thread(CONFIG_USB_OSAL_THREAD_SET_ARGV)
+{
+    struct usbh_hubport *child;
+    int ret = 0;
+
+    struct usbh_enum_worker *worker = (struct usbh_enum_worker *)CONFIG_USB_OSAL_THREAD_GET_ARGV;
+
+    while (1) {
+        ret = usb_osal_mq_recv(worker->bus->enum_mq, (uintptr_t *)&child, USB_OSAL_WAITING_FOREVER);
+        if (ret < 0) {
+            continue;
+        }
+        if (child == NULL) {
+            break;
+        }
+
+        child->ep0_buf_index = worker->index + 1;
+        if (usbh_enumerate_configure(child) < 0) {
+            /** release child sources */
+            usbh_hubport_release(child);
+            USB_LOG_ERR("Port %u enumerate fail\r\n", child->port);
+        }
+        child->ep0_buf_index = 0;
+        usb_osal_sem_give(child->enum_sem);
+    }
+
+    usb_osal_sem_give(worker->bus->enum_sem);
+    usb_osal_thread_delete(NULL);
+}
+
+static void usbh_enum_threads_stop(struct usbh_bus *bus, uint8_t count)
+{
+    for (uint8_t i = 0; i < count; i++) {
+        usb_osal_mq_send(bus->enum_mq, (uintptr_t)NULL);
+    }
+    for (uint8_t i = 0; i < count; i++) {
+        usb_osal_sem_take(bus->enum_sem, USB_OSAL_WAITING_FOREVER);
+    }
+    usb_osal_mq_delete(bus->enum_mq);
+    usb_osal_sem_delete(bus->enum_sem);
+    bus->enum_mq = NULL;
+    bus->enum_sem = NULL;
+}
+
+static int usbh_enum_threads_start(struct usbh_bus *bus)
+{
+    char thread_name[32] = { 0 };
+    struct usbh_enum_worker *worker;
+
+    /* every child is queued at most once */
+    bus->enum_mq = usb_osal_mq_create(CONFIG_USBHOST_MAX_RHPORTS + CONFIG_USBHOST_MAX_EXTHUBS * CONFIG_USBHOST_MAX_EHPORTS);
+    if (bus->enum_mq == NULL) {
+        return -USB_ERR_NOMEM;
+    }
+
+    bus->enum_sem = usb_osal_sem_create_counting(CONFIG_USBHOST_ENUM_THREADS);
+    if (bus->enum_sem == NULL) {
+        usb_osal_mq_delete(bus->enum_mq);
+        bus->enum_mq = NULL;
+        return -USB_ERR_NOMEM;
+    }
+
+    for (uint8_t i = 0; i < CONFIG_USBHOST_ENUM_THREADS; i++) {
+        worker = &g_enum_worker[bus->busid][i];
+        worker->bus = bus;
+        worker->index = i;
+
+        snprintf(thread_name, 32, "usbh_enum%u_%u", bus->busid, i);
+        if (usb_osal_thread_create(thread_name, CONFIG_USBHOST_PSC_STACKSIZE, CONFIG_USBHOST_PSC_PRIO, usbh_enum_thread, worker) == NULL) {
+            usbh_enum_threads_stop(bus, i);
+            return -USB_ERR_NOMEM;
+        }
+    }
+    return 0;
+}
+#endif
+
 static void usbh_hub_thread(CONFIG_USB_OSAL_THREAD_SET_ARGV)
 {
     struct usbh_hub *hub;
@@ -701,10 +838,13 @@ static void usbh_hub_thread(CONFIG_USB_OSAL_THREAD_SET_ARGV)
     for (uint8_t port = 0; port < hub->nports; port++) {
         hport = &hub->child[port];
 
-        usbh_hubport_release(hport);
+        usbh_hub_port_release(hport);
     }
+#if CONFIG_USBHOST_ENUM_THREADS > 0
+    usbh_enum_threads_stop(bus, CONFIG_USBHOST_ENUM_THREADS);
+#endif
     usb_hc_deinit(bus);
-    usb_osal_mq_delete(bus->hub_mq);
+    /* hub_mq is deleted by usbh_hub_deinitialize once we signal hub_sem */
     usb_osal_sem_give(bus->hub_sem);
     usb_osal_thread_delete(NULL);
 }
@@ -740,9 +880,20 @@ int usbh_hub_initialize(struct usbh_bus *bus)
         return -USB_ERR_NOMEM;
     }
 
+#if CONFIG_USBHOST_ENUM_THREADS > 0
+    if (usbh_enum_threads_start(bus) < 0) {
+        usb_osal_mq_delete(bus->hub_mq);
+        usb_osal_sem_delete(bus->hub_sem);
+        return -USB_ERR_NOMEM;
+    }
+#endif
+
     snprintf(thread_name, 32, "usbh_hub%u", bus->busid);
     bus->hub_thread = usb_osal_thread_create(thread_name, CONFIG_USBHOST_PSC_STACKSIZE, CONFIG_USBHOST_PSC_PRIO, usbh_hub_thread, bus);
     if (bus->hub_thread == NULL) {
+#if CONFIG_USBHOST_ENUM_THREADS > 0
+        usbh_enum_threads_stop(bus, CONFIG_USBHOST_ENUM_THREADS);
+#endif
         usb_osal_mq_delete(bus->hub_mq);
         usb_osal_sem_delete(bus->hub_sem);
         return -USB_ERR_NOMEM;
@@ -18,6 +18,7 @@
 #define MSC_PROTOCOL_CBI_INT   0x00 /* CBI transport with command completion interrupt */
 #define MSC_PROTOCOL_CBI_NOINT 0x01 /* CBI transport without command completion interrupt */
 #define MSC_PROTOCOL_BULK_ONLY 0x50 /* Bulk only transport */
+#define MSC_PROTOCOL_UAS       0x62 /* USB attached scsi */
 
 /* MSC Request Codes */
 #define MSC_REQUEST_RESET       0xFF
@@ -58,6 +59,83 @@ struct CSW {
 
 #define USB_SIZEOF_MSC_CSW 13
 
+/* UAS pipe usage descriptor, follows each endpoint of the uas alternate setting */
+#define UAS_DESCRIPTOR_TYPE_PIPE_USAGE 0x24
+
+#define UAS_PIPE_ID_COMMAND  0x01
+#define UAS_PIPE_ID_STATUS   0x02
+#define UAS_PIPE_ID_DATA_IN  0x03
+#define UAS_PIPE_ID_DATA_OUT 0x04
+
+/* UAS information unit ids */
+#define UAS_IU_ID_COMMAND     0x01
+#define UAS_IU_ID_SENSE       0x03
+#define UAS_IU_ID_RESPONSE    0x04
+#define UAS_IU_ID_TASK_MGMT   0x05
+#define UAS_IU_ID_READ_READY  0x06
+#define UAS_IU_ID_WRITE_READY 0x07
+
+#define UAS_TASK_ATTR_SIMPLE 0x00
+
+#define UAS_TMF_ABORT_TASK         0x01
+#define UAS_TMF_LOGICAL_UNIT_RESET 0x08
+
+#define UAS_RC_TMF_COMPLETE  0x00
+#define UAS_RC_TMF_SUCCEEDED 0x08
+
+/** UAS command iu, 16 byte cdb without additional cdb bytes */
+struct uas_command_iu {
+    uint8_t bIUID;
+    uint8_t bReserved;
+    uint16_t wTag; /* Big endian */
+    uint8_t bPrioAttr;
+    uint8_t bReserved1;
+    uint8_t bAddCDBLen;
+    uint8_t bReserved2;
+    uint8_t bLUN[8];
+    uint8_t CDB[MSC_MAX_CDB_LEN];
+} __PACKED;
+
+#define UAS_COMMAND_IU_SIZEOF 32
+
+/** UAS task management iu */
+struct uas_task_mgmt_iu {
+    uint8_t bIUID;
+    uint8_t bReserved;
+    uint16_t wTag; /* Big endian */
+    uint8_t bFunction;
+    uint8_t bReserved1;
+    uint16_t wTaskTag; /* Big endian */
+    uint8_t bLUN[8];
+} __PACKED;
+
+#define UAS_TASK_MGMT_IU_SIZEOF 16
+
+/** UAS sense iu, carries the scsi status of a finished command */
+struct uas_sense_iu {
+    uint8_t bIUID;
+    uint8_t bReserved;
+    uint16_t wTag;        /* Big endian */
+    uint16_t wStatusQual; /* Big endian */
+    uint8_t bStatus;
+    uint8_t bReserved1[7];
+    uint16_t wSenseLength; /* Big endian */
+    uint8_t SenseData[96];
+} __PACKED;
+
+#define UAS_SENSE_IU_SIZEOF 112
+
+/** UAS response iu, answers a task management iu or rejects a command iu */
+struct uas_response_iu {
+    uint8_t bIUID;
+    uint8_t bReserved;
+    uint16_t wTag; /* Big endian */
+    uint8_t bAddResponseInfo[3];
+    uint8_t bResponseCode;
+} __PACKED;
+
+#define UAS_RESPONSE_IU_SIZEOF 8
+
 /*Length of template descriptor: 23 bytes*/
 #define MSC_DESCRIPTOR_LEN (9 + 7 + 7)
 // clang-format off
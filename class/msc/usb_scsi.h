@@ -431,6 +431,11 @@
 #define SCSIRESP_INQUIRYFLAGS6_QAS               0x02  /* Bit 1: QAS */
 #define SCSIRESP_INQUIRYFLAGS6_IUS               0x01  /* Bit 0: IUS */
 
+/* Vital product data pages */
+
+#define SCSIRESP_VPD_SUPPORTEDPAGES              0x00  /* Supported VPD pages */
+#define SCSIRESP_VPD_BLOCKLIMITS                 0xb0  /* Block limits */
+
 /* Sense data */
 
 /* Sense data response codes */
@@ -917,6 +922,18 @@ struct scsicmd_readcapacity16_s
   uint8_t control;       /* 15: Control */
 };
 #define SCSICMD_READCAPACITY16_SIZEOF 16
+#define SCSICMD_READCAPACITY16_ACTION 0x10 /* Service action: READ CAPACITY (16) */
+
+struct scsiresp_readcapacity16_s
+{
+  uint8_t lba[8];        /* 0-7: Returned logical block address (LBA) */
+  uint8_t blklen[4];     /* 8-11: Logical block length (in bytes) */
+  uint8_t flags;         /* 12: Bits 1-3: P_TYPE, Bit 0: PROT_EN */
+  uint8_t exponent;      /* 13: Bits 4-7: P_I_EXPONENT, Bits 0-3: logical blocks per physical block exponent */
+  uint8_t lowest[2];     /* 14-15: Lowest aligned logical block address */
+  uint8_t reserved[16];  /* 16-31: Reserved */
+};
+#define SCSIRESP_READCAPACITY16_SIZEOF 32
 
 struct scsicmd_read12_s
 {
@@ -951,6 +968,28 @@ struct scsicmd_verify12_s
 };
 #define SCSICMD_VERIFY12_SIZEOF 12
 
+struct scsicmd_read16_s
+{
+  uint8_t opcode;        /* 0: 0x88 */
+  uint8_t flags;         /* 1: Same bits as SCSICMD_READ12FLAGS_* */
+  uint8_t lba[8];        /* 2-9: Logical Block Address (LBA) */
+  uint8_t xfrlen[4];     /* 10-13: Transfer length (in contiguous logical blocks) */
+  uint8_t groupno;       /* 14: Bit 7: restricted; Bits 5-6: reserved; Bits 0-6: group number */
+  uint8_t control;       /* 15: Control */
+};
+#define SCSICMD_READ16_SIZEOF 16
+
+struct scsicmd_write16_s
+{
+  uint8_t opcode;        /* 0: 0x8a */
+  uint8_t flags;         /* 1: Same bits as SCSICMD_WRITE12FLAGS_* */
+  uint8_t lba[8];        /* 2-9: Logical Block Address (LBA) */
+  uint8_t xfrlen[4];     /* 10-13: Transfer length (in contiguous logical blocks) */
+  uint8_t groupno;       /* 14: Bit 7: restricted; Bits 5-6: reserved; Bits 0-6: group number */
+  uint8_t control;       /* 15: Control */
+};
+#define SCSICMD_WRITE16_SIZEOF 16
+
 /****************************************************************************
  * Public Functions Definitions
  ****************************************************************************/
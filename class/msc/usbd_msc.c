@@ -15,6 +15,10 @@
 #define MSD_OUT_EP_IDX 0
 #define MSD_IN_EP_IDX  1
 
+#ifndef CONFIG_USBDEV_MSC_BUFCOUNT
+#define CONFIG_USBDEV_MSC_BUFCOUNT 1
+#endif
+
 /* Describe EndPoints configuration */
 static struct usbd_endpoint mass_ep_data[CONFIG_USBDEV_MAX_BUS][2];
 
@@ -45,15 +49,26 @@ USB_NOCACHE_RAM_SECTION struct usbd_msc_priv {
     uint32_t scsi_blk_size[CONFIG_USBDEV_MSC_MAX_LUN];
     uint32_t scsi_blk_nbr[CONFIG_USBDEV_MSC_MAX_LUN];
 
-    USB_MEM_ALIGNX uint8_t block_buffer[CONFIG_USBDEV_MSC_MAX_BUFSIZE];
+    /*
+     * Data stage buffers, used as a ring: storage fills/drains one buffer while
+     * another one is on the bus. With one buffer, storage and usb take turns.
+     */
+    USB_MEM_ALIGNX uint8_t block_buffer[CONFIG_USBDEV_MSC_BUFCOUNT][CONFIG_USBDEV_MSC_MAX_BUFSIZE];
+    uint32_t block_len[CONFIG_USBDEV_MSC_BUFCOUNT];
+    uint8_t block_head;  /* next buffer to fill, by storage for read, by usb for write */
+    uint8_t block_tail;  /* next buffer to drain, by usb for read, by storage for write */
+    uint8_t block_count; /* filled buffers */
+    bool block_busy;     /* a bulk transfer is in flight on the ring */
+    bool block_err;      /* storage failed while a bulk transfer was in flight */
+    bool block_pending;  /* a storage read/write is in progress */
+    uint32_t bus_len;    /* data stage bytes not yet handed to the bus */
 
 #if defined(CONFIG_USBDEV_MSC_THREAD)
     usb_osal_mq_t usbd_msc_mq;
     usb_osal_thread_t usbd_msc_thread;
-    uint32_t nbytes;
+    uint32_t event;
 #elif defined(CONFIG_USBDEV_MSC_POLLING)
     uint32_t event;
-    uint32_t nbytes;
 #endif
 } g_usbd_msc[CONFIG_USBDEV_MAX_BUS];
 
@@ -66,9 +81,21 @@ static void usdb_msc_set_max_lun(uint8_t busid)
     g_usbd_msc[busid].max_lun = CONFIG_USBDEV_MSC_MAX_LUN - 1u;
 }
 
+static void usbd_msc_block_reset(uint8_t busid, uint32_t bus_len)
+{
+    g_usbd_msc[busid].block_head = 0;
+    g_usbd_msc[busid].block_tail = 0;
+    g_usbd_msc[busid].block_count = 0;
+    g_usbd_msc[busid].block_busy = false;
+    g_usbd_msc[busid].block_err = false;
+    g_usbd_msc[busid].block_pending = false;
+    g_usbd_msc[busid].bus_len = bus_len;
+}
+
 static void usbd_msc_reset(uint8_t busid)
 {
     g_usbd_msc[busid].stage = MSC_READ_CBW;
+    usbd_msc_block_reset(busid, 0);
 }
 
 static int msc_storage_class_interface_request_handler(uint8_t busid, struct usb_setup_packet *setup, uint8_t **data, uint32_t *len)
@@ -175,8 +202,10 @@ static void usbd_msc_send_info(uint8_t busid, uint8_t *buffer, uint8_t size)
     g_usbd_msc[busid].csw.bStatus = CSW_STATUS_CMD_PASSED;
 }
 
-static bool SCSI_processWrite(uint8_t busid, uint32_t nbytes);
+static bool SCSI_processWrite(uint8_t busid);
 static bool SCSI_processRead(uint8_t busid);
+static void usbd_msc_start_out(uint8_t busid);
+static void usbd_msc_notify(uint8_t busid, uint32_t event);
 
 /**
 * @brief  SCSI_SetSenseData
@@ -527,11 +556,9 @@ static bool SCSI_read10(uint8_t busid, uint8_t **data, uint32_t *len)
         return false;
     }
     g_usbd_msc[busid].stage = MSC_DATA_IN;
-#if defined(CONFIG_USBDEV_MSC_THREAD)
-    usb_osal_mq_send(g_usbd_msc[busid].usbd_msc_mq, MSC_DATA_IN);
-    return true;
-#elif defined(CONFIG_USBDEV_MSC_POLLING)
-    g_usbd_msc[busid].event = MSC_DATA_IN;
+    usbd_msc_block_reset(busid, g_usbd_msc[busid].cbw.dDataLength);
+#if defined(CONFIG_USBDEV_MSC_THREAD) || defined(CONFIG_USBDEV_MSC_POLLING)
+    usbd_msc_notify(busid, MSC_DATA_IN);
     return true;
 #else
     return SCSI_processRead(busid);
@@ -560,11 +587,9 @@ static bool SCSI_read12(uint8_t busid, uint8_t **data, uint32_t *len)
         return false;
     }
     g_usbd_msc[busid].stage = MSC_DATA_IN;
-#if defined(CONFIG_USBDEV_MSC_THREAD)
-    usb_osal_mq_send(g_usbd_msc[busid].usbd_msc_mq, MSC_DATA_IN);
-    return true;
-#elif defined(CONFIG_USBDEV_MSC_POLLING)
-    g_usbd_msc[busid].event = MSC_DATA_IN;
+    usbd_msc_block_reset(busid, g_usbd_msc[busid].cbw.dDataLength);
+#if defined(CONFIG_USBDEV_MSC_THREAD) || defined(CONFIG_USBDEV_MSC_POLLING)
+    usbd_msc_notify(busid, MSC_DATA_IN);
     return true;
 #else
     return SCSI_processRead(busid);
@@ -595,8 +620,8 @@ static bool SCSI_write10(uint8_t busid, uint8_t **data, uint32_t *len)
         return false;
     }
     g_usbd_msc[busid].stage = MSC_DATA_OUT;
-    data_len = MIN(data_len, CONFIG_USBDEV_MSC_MAX_BUFSIZE);
-    usbd_ep_start_read(busid, mass_ep_data[busid][MSD_OUT_EP_IDX].ep_addr, g_usbd_msc[busid].block_buffer, data_len);
+    usbd_msc_block_reset(busid, data_len);
+    usbd_msc_start_out(busid);
     return true;
 }
 
@@ -624,57 +649,205 @@ static bool SCSI_write12(uint8_t busid, uint8_t **data, uint32_t *len)
         return false;
     }
     g_usbd_msc[busid].stage = MSC_DATA_OUT;
-    data_len = MIN(data_len, CONFIG_USBDEV_MSC_MAX_BUFSIZE);
-    usbd_ep_start_read(busid, mass_ep_data[busid][MSD_OUT_EP_IDX].ep_addr, g_usbd_msc[busid].block_buffer, data_len);
+    usbd_msc_block_reset(busid, data_len);
+    usbd_msc_start_out(busid);
     return true;
 }
 
-static bool SCSI_processRead(uint8_t busid)
+/* hand the oldest filled buffer to bulk in, if the bus is idle */
+static void usbd_msc_start_in(uint8_t busid)
 {
-    uint32_t transfer_len;
+    uint8_t *buf;
+    uint32_t len;
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    if (g_usbd_msc[busid].block_busy || g_usbd_msc[busid].block_err || (g_usbd_msc[busid].block_count == 0)) {
+        usb_osal_leave_critical_section(flags);
+        return;
+    }
+    g_usbd_msc[busid].block_busy = true;
+    buf = g_usbd_msc[busid].block_buffer[g_usbd_msc[busid].block_tail];
+    len = g_usbd_msc[busid].block_len[g_usbd_msc[busid].block_tail];
+    g_usbd_msc[busid].bus_len -= len;
+    g_usbd_msc[busid].csw.dDataResidue -= len;
+    if (g_usbd_msc[busid].bus_len == 0) {
+        g_usbd_msc[busid].stage = MSC_SEND_CSW;
+    }
+    usb_osal_leave_critical_section(flags);
 
-    USB_LOG_DBG("read lba:%d\r\n", g_usbd_msc[busid].start_sector);
+    usbd_ep_start_write(busid, mass_ep_data[busid][MSD_IN_EP_IDX].ep_addr, buf, len);
+}
 
-    transfer_len = MIN(g_usbd_msc[busid].nsectors * g_usbd_msc[busid].scsi_blk_size[g_usbd_msc[busid].cbw.bLUN], CONFIG_USBDEV_MSC_MAX_BUFSIZE);
+/* arm bulk out on the next free buffer, if the bus is idle */
+static void usbd_msc_start_out(uint8_t busid)
+{
+    uint8_t *buf;
+    uint32_t len;
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    if (g_usbd_msc[busid].block_busy || g_usbd_msc[busid].block_err || (g_usbd_msc[busid].bus_len == 0) ||
+        (g_usbd_msc[busid].block_count == CONFIG_USBDEV_MSC_BUFCOUNT)) {
+        usb_osal_leave_critical_section(flags);
+        return;
+    }
+    g_usbd_msc[busid].block_busy = true;
+    buf = g_usbd_msc[busid].block_buffer[g_usbd_msc[busid].block_head];
+    len = MIN(g_usbd_msc[busid].bus_len, CONFIG_USBDEV_MSC_MAX_BUFSIZE);
+    g_usbd_msc[busid].bus_len -= len;
+    usb_osal_leave_critical_section(flags);
+
+    usbd_ep_start_read(busid, mass_ep_data[busid][MSD_OUT_EP_IDX].ep_addr, buf, len);
+}
+
+/*
+ * Stop the data stage after a storage error. Returns false if no bulk transfer is in flight and
+ * the caller has to send the csw, otherwise the csw is sent when the transfer in flight completes.
+ */
+static bool usbd_msc_block_fail(uint8_t busid)
+{
+    size_t flags;
+    bool busy;
+
+    flags = usb_osal_enter_critical_section();
+    busy = g_usbd_msc[busid].block_busy;
+    g_usbd_msc[busid].block_err = true;
+    g_usbd_msc[busid].block_pending = false;
+    usb_osal_leave_critical_section(flags);
+
+    return busy;
+}
+
+/* storage read into the head buffer has finished */
+static bool SCSI_readDone(uint8_t busid, int status)
+{
+    uint32_t transfer_len;
+    size_t flags;
 
-    if (usbd_msc_sector_read(busid, g_usbd_msc[busid].cbw.bLUN, g_usbd_msc[busid].start_sector, g_usbd_msc[busid].block_buffer, transfer_len) != 0) {
+    if (status != 0) {
         SCSI_SetSenseData(busid, SCSI_KCQHE_UREINRESERVEDAREA);
-        return false;
+        return usbd_msc_block_fail(busid);
     }
 
+    transfer_len = g_usbd_msc[busid].block_len[g_usbd_msc[busid].block_head];
     g_usbd_msc[busid].start_sector += (transfer_len / g_usbd_msc[busid].scsi_blk_size[g_usbd_msc[busid].cbw.bLUN]);
     g_usbd_msc[busid].nsectors -= (transfer_len / g_usbd_msc[busid].scsi_blk_size[g_usbd_msc[busid].cbw.bLUN]);
-    g_usbd_msc[busid].csw.dDataResidue -= transfer_len;
-
-    if (g_usbd_msc[busid].nsectors == 0) {
-        g_usbd_msc[busid].stage = MSC_SEND_CSW;
-    }
 
-    usbd_ep_start_write(busid, mass_ep_data[busid][MSD_IN_EP_IDX].ep_addr, g_usbd_msc[busid].block_buffer, transfer_len);
+    flags = usb_osal_enter_critical_section();
+    g_usbd_msc[busid].block_head = (g_usbd_msc[busid].block_head + 1) % CONFIG_USBDEV_MSC_BUFCOUNT;
+    g_usbd_msc[busid].block_count++;
+    g_usbd_msc[busid].block_pending = false;
+    usb_osal_leave_critical_section(flags);
 
+    usbd_msc_start_in(busid);
     return true;
 }
 
-static bool SCSI_processWrite(uint8_t busid, uint32_t nbytes)
+static bool SCSI_processRead(uint8_t busid)
 {
-    uint32_t data_len = 0;
+    uint32_t transfer_len;
+    uint8_t idx;
+    size_t flags;
+    int ret;
 
-    USB_LOG_DBG("write lba:%d\r\n", g_usbd_msc[busid].start_sector);
+    /* fill every free buffer, the bus drains them from the bulk in callback */
+    while ((g_usbd_msc[busid].stage == MSC_DATA_IN) && (g_usbd_msc[busid].nsectors > 0)) {
+        flags = usb_osal_enter_critical_section();
+        if (g_usbd_msc[busid].block_pending || g_usbd_msc[busid].block_err || (g_usbd_msc[busid].block_count == CONFIG_USBDEV_MSC_BUFCOUNT)) {
+            usb_osal_leave_critical_section(flags);
+            break;
+        }
+        g_usbd_msc[busid].block_pending = true;
+        idx = g_usbd_msc[busid].block_head;
+        usb_osal_leave_critical_section(flags);
+
+        USB_LOG_DBG("read lba:%d\r\n", g_usbd_msc[busid].start_sector);
+
+        transfer_len = MIN(g_usbd_msc[busid].nsectors * g_usbd_msc[busid].scsi_blk_size[g_usbd_msc[busid].cbw.bLUN], CONFIG_USBDEV_MSC_MAX_BUFSIZE);
+        g_usbd_msc[busid].block_len[idx] = transfer_len;
 
-    if (usbd_msc_sector_write(busid, g_usbd_msc[busid].cbw.bLUN, g_usbd_msc[busid].start_sector, g_usbd_msc[busid].block_buffer, nbytes) != 0) {
+        ret = usbd_msc_sector_read(busid, g_usbd_msc[busid].cbw.bLUN, g_usbd_msc[busid].start_sector, g_usbd_msc[busid].block_buffer[idx], transfer_len);
+#ifdef CONFIG_USBDEV_MSC_ASYNC
+        if (ret != 0) {
+            return SCSI_readDone(busid, ret);
+        }
+        /* continued from usbd_msc_sector_read_done */
+        break;
+#else
+        if (SCSI_readDone(busid, ret) == false) {
+            return false;
+        }
+#endif
+    }
+
+    return true;
+}
+
+/* storage write from the tail buffer has finished */
+static bool SCSI_writeDone(uint8_t busid, int status)
+{
+    uint32_t nbytes;
+    size_t flags;
+
+    if (status != 0) {
         SCSI_SetSenseData(busid, SCSI_KCQHE_WRITEFAULT);
-        return false;
+        return usbd_msc_block_fail(busid);
     }
 
+    nbytes = g_usbd_msc[busid].block_len[g_usbd_msc[busid].block_tail];
     g_usbd_msc[busid].start_sector += (nbytes / g_usbd_msc[busid].scsi_blk_size[g_usbd_msc[busid].cbw.bLUN]);
     g_usbd_msc[busid].nsectors -= (nbytes / g_usbd_msc[busid].scsi_blk_size[g_usbd_msc[busid].cbw.bLUN]);
     g_usbd_msc[busid].csw.dDataResidue -= nbytes;
 
+    flags = usb_osal_enter_critical_section();
+    g_usbd_msc[busid].block_tail = (g_usbd_msc[busid].block_tail + 1) % CONFIG_USBDEV_MSC_BUFCOUNT;
+    g_usbd_msc[busid].block_count--;
+    g_usbd_msc[busid].block_pending = false;
+    usb_osal_leave_critical_section(flags);
+
     if (g_usbd_msc[busid].nsectors == 0) {
         usbd_msc_send_csw(busid, CSW_STATUS_CMD_PASSED);
     } else {
-        data_len = MIN(g_usbd_msc[busid].nsectors * g_usbd_msc[busid].scsi_blk_size[g_usbd_msc[busid].cbw.bLUN], CONFIG_USBDEV_MSC_MAX_BUFSIZE);
-        usbd_ep_start_read(busid, mass_ep_data[busid][MSD_OUT_EP_IDX].ep_addr, g_usbd_msc[busid].block_buffer, data_len);
+        /* a buffer is free again, re-arm bulk out if it was waiting for one */
+        usbd_msc_start_out(busid);
+    }
+    return true;
+}
+
+static bool SCSI_processWrite(uint8_t busid)
+{
+    uint32_t nbytes;
+    uint8_t idx;
+    size_t flags;
+    int ret;
+
+    /* drain every filled buffer, the bus fills the free ones from the bulk out callback */
+    while ((g_usbd_msc[busid].stage == MSC_DATA_OUT) && (g_usbd_msc[busid].nsectors > 0)) {
+        flags = usb_osal_enter_critical_section();
+        if (g_usbd_msc[busid].block_pending || g_usbd_msc[busid].block_err || (g_usbd_msc[busid].block_count == 0)) {
+            usb_osal_leave_critical_section(flags);
+            break;
+        }
+        g_usbd_msc[busid].block_pending = true;
+        idx = g_usbd_msc[busid].block_tail;
+        nbytes = g_usbd_msc[busid].block_len[idx];
+        usb_osal_leave_critical_section(flags);
+
+        USB_LOG_DBG("write lba:%d\r\n", g_usbd_msc[busid].start_sector);
+
+        ret = usbd_msc_sector_write(busid, g_usbd_msc[busid].cbw.bLUN, g_usbd_msc[busid].start_sector, g_usbd_msc[busid].block_buffer[idx], nbytes);
+#ifdef CONFIG_USBDEV_MSC_ASYNC
+        if (ret != 0) {
+            return SCSI_writeDone(busid, ret);
+        }
+        /* continued from usbd_msc_sector_write_done */
+        break;
+#else
+        if (SCSI_writeDone(busid, ret) == false) {
+            return false;
+        }
+#endif
     }
 
     return true;
@@ -682,7 +855,7 @@ static bool SCSI_processWrite(uint8_t busid, uint32_t nbytes)
 
 static bool SCSI_CBWDecode(uint8_t busid, uint32_t nbytes)
 {
-    uint8_t *buf2send = g_usbd_msc[busid].block_buffer;
+    uint8_t *buf2send = g_usbd_msc[busid].block_buffer[0];
     uint32_t len2send = 0;
     bool ret = false;
 
@@ -767,6 +940,9 @@ static bool SCSI_CBWDecode(uint8_t busid, uint32_t nbytes)
 
 void mass_storage_bulk_out(uint8_t busid, uint8_t ep, uint32_t nbytes)
 {
+    size_t flags;
+    bool err;
+
     (void)ep;
 
     switch (g_usbd_msc[busid].stage) {
@@ -781,17 +957,21 @@ void mass_storage_bulk_out(uint8_t busid, uint8_t ep, uint32_t nbytes)
             switch (g_usbd_msc[busid].cbw.CB[0]) {
                 case SCSI_CMD_WRITE10:
                 case SCSI_CMD_WRITE12:
-#if defined(CONFIG_USBDEV_MSC_THREAD)
-                    g_usbd_msc[busid].nbytes = nbytes;
-                    usb_osal_mq_send(g_usbd_msc[busid].usbd_msc_mq, MSC_DATA_OUT);
-#elif defined(CONFIG_USBDEV_MSC_POLLING)
-                    g_usbd_msc[busid].nbytes = nbytes;
-                    g_usbd_msc[busid].event = MSC_DATA_OUT;
-#else
-                    if (SCSI_processWrite(busid, nbytes) == false) {
+                    flags = usb_osal_enter_critical_section();
+                    g_usbd_msc[busid].block_len[g_usbd_msc[busid].block_head] = nbytes;
+                    g_usbd_msc[busid].block_head = (g_usbd_msc[busid].block_head + 1) % CONFIG_USBDEV_MSC_BUFCOUNT;
+                    g_usbd_msc[busid].block_count++;
+                    g_usbd_msc[busid].block_busy = false;
+                    err = g_usbd_msc[busid].block_err;
+                    usb_osal_leave_critical_section(flags);
+
+                    if (err) {
                         usbd_msc_send_csw(busid, CSW_STATUS_CMD_FAILED); /* send fail status to host,and the host will retry*/
+                        return;
                     }
-#endif
+                    /* keep the bus busy while storage drains the filled buffers */
+                    usbd_msc_start_out(busid);
+                    usbd_msc_notify(busid, MSC_DATA_OUT);
                     break;
                 default:
                     break;
@@ -804,6 +984,9 @@ void mass_storage_bulk_out(uint8_t busid, uint8_t ep, uint32_t nbytes)
 
 void mass_storage_bulk_in(uint8_t busid, uint8_t ep, uint32_t nbytes)
 {
+    size_t flags;
+    bool err;
+
     (void)ep;
     (void)nbytes;
 
@@ -812,16 +995,22 @@ void mass_storage_bulk_in(uint8_t busid, uint8_t ep, uint32_t nbytes)
             switch (g_usbd_msc[busid].cbw.CB[0]) {
                 case SCSI_CMD_READ10:
                 case SCSI_CMD_READ12:
-#if defined(CONFIG_USBDEV_MSC_THREAD)
-                    usb_osal_mq_send(g_usbd_msc[busid].usbd_msc_mq, MSC_DATA_IN);
-#elif defined(CONFIG_USBDEV_MSC_POLLING)
-                    g_usbd_msc[busid].event = MSC_DATA_IN;
-#else
-                    if (SCSI_processRead(busid) == false) {
+                    flags = usb_osal_enter_critical_section();
+                    g_usbd_msc[busid].block_tail = (g_usbd_msc[busid].block_tail + 1) % CONFIG_USBDEV_MSC_BUFCOUNT;
+                    g_usbd_msc[busid].block_count--;
+                    g_usbd_msc[busid].block_busy = false;
+                    err = g_usbd_msc[busid].block_err;
+                    usb_osal_leave_critical_section(flags);
+
+                    if (err) {
                         usbd_msc_send_csw(busid, CSW_STATUS_CMD_FAILED); /* send fail status to host,and the host will retry*/
                         return;
                     }
-#endif
+                    /* the next buffer is usually ready, storage refills the one just sent */
+                    usbd_msc_start_in(busid);
+                    if (g_usbd_msc[busid].nsectors > 0) {
+                        usbd_msc_notify(busid, MSC_DATA_IN);
+                    }
                     break;
                 default:
                     break;
@@ -844,11 +1033,51 @@ void mass_storage_bulk_in(uint8_t busid, uint8_t ep, uint32_t nbytes)
     }
 }
 
+/* events are coalesced, so do whatever the current data stage needs */
+static void usbd_msc_process(uint8_t busid)
+{
+    if (g_usbd_msc[busid].stage == MSC_DATA_OUT) {
+        if (SCSI_processWrite(busid) == false) {
+            usbd_msc_send_csw(busid, CSW_STATUS_CMD_FAILED); /* send fail status to host,and the host will retry*/
+        }
+    } else if (g_usbd_msc[busid].stage == MSC_DATA_IN) {
+        if (SCSI_processRead(busid) == false) {
+            usbd_msc_send_csw(busid, CSW_STATUS_CMD_FAILED); /* send fail status to host,and the host will retry*/
+        }
+    } else {
+    }
+}
+
+/* hand storage work to the thread or polling loop, or do it right here */
+static void usbd_msc_notify(uint8_t busid, uint32_t event)
+{
+#if defined(CONFIG_USBDEV_MSC_THREAD)
+    size_t flags;
+
+    /* one pending message is enough, the thread handles every ready buffer when it runs */
+    flags = usb_osal_enter_critical_section();
+    if (g_usbd_msc[busid].event != 0) {
+        usb_osal_leave_critical_section(flags);
+        return;
+    }
+    g_usbd_msc[busid].event = event;
+    usb_osal_leave_critical_section(flags);
+
+    usb_osal_mq_send(g_usbd_msc[busid].usbd_msc_mq, event);
+#elif defined(CONFIG_USBDEV_MSC_POLLING)
+    g_usbd_msc[busid].event = event;
+#else
+    (void)event;
+    usbd_msc_process(busid);
+#endif
+}
+
 #if defined(CONFIG_USBDEV_MSC_THREAD)
 static void usbdev_msc_thread(CONFIG_USB_OSAL_THREAD_SET_ARGV)
 {
     uintptr_t event;
     int ret;
+    size_t flags;
     uint8_t busid = (uint8_t)CONFIG_USB_OSAL_THREAD_GET_ARGV;
 
     while (1) {
@@ -856,16 +1085,11 @@ static void usbdev_msc_thread(CONFIG_USB_OSAL_THREAD_SET_ARGV)
         if (ret < 0) {
             continue;
         }
-        if (event == MSC_DATA_OUT) {
-            if (SCSI_processWrite(busid, g_usbd_msc[busid].nbytes) == false) {
-                usbd_msc_send_csw(busid, CSW_STATUS_CMD_FAILED); /* send fail status to host,and the host will retry*/
-            }
-        } else if (event == MSC_DATA_IN) {
-            if (SCSI_processRead(busid) == false) {
-                usbd_msc_send_csw(busid, CSW_STATUS_CMD_FAILED); /* send fail status to host,and the host will retry*/
-            }
-        } else {
-        }
+        flags = usb_osal_enter_critical_section();
+        g_usbd_msc[busid].event = 0;
+        usb_osal_leave_critical_section(flags);
+
+        usbd_msc_process(busid);
     }
 }
 #elif defined(CONFIG_USBDEV_MSC_POLLING)
@@ -877,17 +1101,40 @@ void usbd_msc_polling(uint8_t busid)
 
     if (event != 0) {
         g_usbd_msc[busid].event = 0;
-        if (event == MSC_DATA_OUT) {
-            if (SCSI_processWrite(busid, g_usbd_msc[busid].nbytes) == false) {
-                usbd_msc_send_csw(busid, CSW_STATUS_CMD_FAILED); /* send fail status to host,and the host will retry*/
-            }
-        } else if (event == MSC_DATA_IN) {
-            if (SCSI_processRead(busid) == false) {
-                usbd_msc_send_csw(busid, CSW_STATUS_CMD_FAILED); /* send fail status to host,and the host will retry*/
-            }
-        } else {
-        }
+        usbd_msc_process(busid);
+    }
+}
+#endif
+
+#ifdef CONFIG_USBDEV_MSC_ASYNC
+void usbd_msc_sector_read_done(uint8_t busid, uint8_t lun, int status)
+{
+    (void)lun;
+
+    if (!g_usbd_msc[busid].block_pending || (g_usbd_msc[busid].stage != MSC_DATA_IN)) {
+        return;
+    }
+
+    if (SCSI_readDone(busid, status) == false) {
+        usbd_msc_send_csw(busid, CSW_STATUS_CMD_FAILED); /* send fail status to host,and the host will retry*/
+        return;
+    }
+    usbd_msc_notify(busid, MSC_DATA_IN);
+}
+
+void usbd_msc_sector_write_done(uint8_t busid, uint8_t lun, int status)
+{
+    (void)lun;
+
+    if (!g_usbd_msc[busid].block_pending || (g_usbd_msc[busid].stage != MSC_DATA_OUT)) {
+        return;
+    }
+
+    if (SCSI_writeDone(busid, status) == false) {
+        usbd_msc_send_csw(busid, CSW_STATUS_CMD_FAILED); /* send fail status to host,and the host will retry*/
+        return;
     }
+    usbd_msc_notify(busid, MSC_DATA_OUT);
 }
 #endif
 
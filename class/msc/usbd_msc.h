@@ -22,6 +22,10 @@ void usbd_msc_get_cap(uint8_t busid, uint8_t lun, uint32_t *block_num, uint32_t
 int usbd_msc_sector_read(uint8_t busid, uint8_t lun, uint32_t sector, uint8_t *buffer, uint32_t length);
 int usbd_msc_sector_write(uint8_t busid, uint8_t lun, uint32_t sector, uint8_t *buffer, uint32_t length);
 
+/* with CONFIG_USBDEV_MSC_ASYNC, sector read/write only start the access and call these when it finishes */
+void usbd_msc_sector_read_done(uint8_t busid, uint8_t lun, int status);
+void usbd_msc_sector_write_done(uint8_t busid, uint8_t lun, int status);
+
 void usbd_msc_set_readonly(uint8_t busid, bool readonly);
 bool usbd_msc_get_popup(uint8_t busid);
 
@@ -5,6 +5,8 @@
  */
 #include "usbh_core.h"
 #include "usbh_msc.h"
+#include "usbh_uas.h"
+#include "usbh_msc_cache.h"
 #include "usb_scsi.h"
 
 #undef USB_DBG_TAG
@@ -19,6 +21,17 @@
 
 USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_msc_cbw_csw[CONFIG_USBHOST_MAX_MSC_CLASS][USB_ALIGN_UP(64, CONFIG_USB_ALIGN_SIZE)];
 USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_msc_buf[CONFIG_USBHOST_MAX_MSC_CLASS][USB_ALIGN_UP(64, CONFIG_USB_ALIGN_SIZE)];
+USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_msc_bounce_buf[CONFIG_USBHOST_MAX_MSC_CLASS][USB_ALIGN_UP(CONFIG_USBHOST_MSC_BOUNCE_SIZE, CONFIG_USB_ALIGN_SIZE)];
+#if CONFIG_USBHOST_MSC_READAHEAD_SIZE > 0
+USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_msc_readahead_buf[CONFIG_USBHOST_MAX_MSC_CLASS][USB_ALIGN_UP(CONFIG_USBHOST_MSC_READAHEAD_SIZE, CONFIG_USB_ALIGN_SIZE)];
+#endif
+
+#define USBH_MSC_STAGE_CBW  0
+#define USBH_MSC_STAGE_DATA 1
+#define USBH_MSC_STAGE_CSW  2
+
+/* kill attempts after a timeout, 100 ms apart, before the urbs are given up on */
+#define USBH_MSC_KILL_RETRY 10
 
 static struct usbh_msc g_msc_class[CONFIG_USBHOST_MAX_MSC_CLASS];
 static uint32_t g_devinuse = 0;
@@ -27,26 +40,33 @@ static struct usbh_msc_modeswitch_config *g_msc_modeswitch_config = NULL;
 static struct usbh_msc *usbh_msc_class_alloc(void)
 {
     uint8_t devno;
+    size_t flags;
 
+    flags = usb_osal_enter_critical_section();
     for (devno = 0; devno < CONFIG_USBHOST_MAX_MSC_CLASS; devno++) {
         if ((g_devinuse & (1U << devno)) == 0) {
             g_devinuse |= (1U << devno);
+            usb_osal_leave_critical_section(flags);
             memset(&g_msc_class[devno], 0, sizeof(struct usbh_msc));
             g_msc_class[devno].sdchar = 'a' + devno;
             return &g_msc_class[devno];
         }
     }
+    usb_osal_leave_critical_section(flags);
     return NULL;
 }
 
 static void usbh_msc_class_free(struct usbh_msc *msc_class)
 {
     uint8_t devno = msc_class->sdchar - 'a';
+    size_t flags;
 
+    memset(msc_class, 0, sizeof(struct usbh_msc));
     if (devno < 32) {
+        flags = usb_osal_enter_critical_section();
         g_devinuse &= ~(1U << devno);
+        usb_osal_leave_critical_section(flags);
     }
-    memset(msc_class, 0, sizeof(struct usbh_msc));
 }
 
 static int usbh_msc_get_maxlun(struct usbh_msc *msc_class, uint8_t *buffer)
@@ -102,7 +122,7 @@ static void usbh_msc_csw_dump(struct CSW *csw)
 static inline int usbh_msc_bulk_in_transfer(struct usbh_msc *msc_class, uint8_t *buffer, uint32_t buflen, uint32_t timeout)
 {
     int ret;
-    struct usbh_urb *urb = &msc_class->bulkin_urb;
+    struct usbh_urb *urb = &msc_class->dev->bulkin_urb;
 
     usbh_bulk_urb_fill(urb, msc_class->hport, msc_class->bulkin, buffer, buflen, timeout, NULL, NULL);
     ret = usbh_submit_urb(urb);
@@ -115,7 +135,7 @@ static inline int usbh_msc_bulk_in_transfer(struct usbh_msc *msc_class, uint8_t
 static inline int usbh_msc_bulk_out_transfer(struct usbh_msc *msc_class, uint8_t *buffer, uint32_t buflen, uint32_t timeout)
 {
     int ret;
-    struct usbh_urb *urb = &msc_class->bulkout_urb;
+    struct usbh_urb *urb = &msc_class->dev->bulkout_urb;
 
     usbh_bulk_urb_fill(urb, msc_class->hport, msc_class->bulkout, buffer, buflen, timeout, NULL, NULL);
     ret = usbh_submit_urb(urb);
@@ -125,10 +145,156 @@ static inline int usbh_msc_bulk_out_transfer(struct usbh_msc *msc_class, uint8_t
     return ret;
 }
 
+static int usbh_msc_clear_halt(struct usbh_msc *msc_class, bool in)
+{
+    struct usb_setup_packet *setup = msc_class->hport->setup;
+    struct usbh_urb *urb = in ? &msc_class->dev->bulkin_urb : &msc_class->dev->bulkout_urb;
+
+    setup->bmRequestType = USB_REQUEST_DIR_OUT | USB_REQUEST_STANDARD | USB_REQUEST_RECIPIENT_ENDPOINT;
+    setup->bRequest = USB_REQUEST_CLEAR_FEATURE;
+    setup->wValue = USB_FEATURE_ENDPOINT_HALT;
+    setup->wIndex = in ? msc_class->bulkin->bEndpointAddress : msc_class->bulkout->bEndpointAddress;
+    setup->wLength = 0;
+
+    /* the device restarts the endpoint with DATA0 */
+    urb->data_toggle = 0;
+    return usbh_control_transfer(msc_class->hport, setup, NULL);
+}
+
+/* bulk-only reset recovery, the device drops the command and both pipes restart with DATA0 */
+static int usbh_msc_reset_recovery(struct usbh_msc *msc_class)
+{
+    struct usb_setup_packet *setup = msc_class->hport->setup;
+    int ret;
+
+    setup->bmRequestType = USB_REQUEST_DIR_OUT | USB_REQUEST_CLASS | USB_REQUEST_RECIPIENT_INTERFACE;
+    setup->bRequest = MSC_REQUEST_RESET;
+    setup->wValue = 0;
+    setup->wIndex = msc_class->intf;
+    setup->wLength = 0;
+
+    ret = usbh_control_transfer(msc_class->hport, setup, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+    usbh_msc_clear_halt(msc_class, true);
+    return usbh_msc_clear_halt(msc_class, false);
+}
+
+/* -USB_ERR_IO for a csw that is not valid or reports a phase error, both need reset recovery */
+static int usbh_msc_check_csw(struct usbh_msc *msc_class, struct CSW *csw, int nbytes)
+{
+    if ((nbytes != USB_SIZEOF_MSC_CSW) || (csw->dSignature != MSC_CSW_Signature) || (csw->dTag != msc_class->dev->tag)) {
+        return -USB_ERR_IO;
+    }
+
+    msc_class->residue = csw->dDataResidue;
+    if (csw->bStatus == CSW_STATUS_PHASE_ERROR) {
+        return -USB_ERR_IO;
+    }
+    if (csw->bStatus != CSW_STATUS_CMD_PASSED) {
+        return -USB_ERR_INVAL;
+    }
+    return 0;
+}
+
+static int usbh_msc_receive_csw(struct usbh_msc *msc_class, struct CSW *csw, uint32_t timeout)
+{
+    int ret;
+    int nbytes;
+
+    for (uint8_t i = 0; i < 2; i++) {
+        memset(csw, 0, USB_SIZEOF_MSC_CSW);
+        nbytes = usbh_msc_bulk_in_transfer(msc_class, (uint8_t *)csw, USB_SIZEOF_MSC_CSW, timeout);
+        if (nbytes != -USB_ERR_STALL) {
+            break;
+        }
+        /* a stalled csw may be retried once after clearing the halt */
+        usbh_msc_clear_halt(msc_class, true);
+    }
+    if (nbytes < 0) {
+        USB_LOG_ERR("csw transfer error: %d\r\n", nbytes);
+        return nbytes;
+    }
+
+    usbh_msc_csw_dump(csw);
+
+    ret = usbh_msc_check_csw(msc_class, csw, nbytes);
+    if (ret == -USB_ERR_IO) {
+        USB_LOG_ERR("csw len %d tag 0x%08x status %d, reset recovery\r\n", nbytes, (unsigned int)csw->dTag, csw->bStatus);
+        usbh_msc_reset_recovery(msc_class);
+    } else if (ret < 0) {
+        USB_LOG_ERR("csw bStatus %d\r\n", csw->bStatus);
+    } else if (msc_class->residue) {
+        USB_LOG_DBG("csw residue %u\r\n", (unsigned int)msc_class->residue);
+    }
+    return ret;
+}
+
+#if CONFIG_USBHOST_MSC_READAHEAD_SIZE > 0
+static void usbh_msc_readahead_sync(struct usbh_msc *msc_class);
+#endif
+
+/* luns of one device share the pipes, commands to different devices run in parallel */
+static int usbh_msc_lock(struct usbh_msc *msc_class)
+{
+    struct usbh_msc *dev;
+    size_t flags;
+    int ret;
+
+    flags = usb_osal_enter_critical_section();
+    dev = msc_class->dev;
+    if (!dev || !dev->mutex || dev->removed) {
+        usb_osal_leave_critical_section(flags);
+        return -USB_ERR_NODEV;
+    }
+    dev->lock_waiters++;
+    usb_osal_leave_critical_section(flags);
+
+    ret = usb_osal_mutex_take(dev->mutex);
+
+    flags = usb_osal_enter_critical_section();
+    dev->lock_waiters--;
+    usb_osal_leave_critical_section(flags);
+
+    if (ret < 0) {
+        return ret;
+    }
+    if (dev->removed) {
+        /* disconnect released the lock to let us out, the device is gone */
+        usb_osal_mutex_give(dev->mutex);
+        return -USB_ERR_NODEV;
+    }
+#if CONFIG_USBHOST_MSC_READAHEAD_SIZE > 0
+    /* a background refill of another lun may still own the urbs */
+    for (uint8_t devno = 0; devno < CONFIG_USBHOST_MAX_MSC_CLASS; devno++) {
+        if ((g_devinuse & (1U << devno)) && (g_msc_class[devno].dev == dev) && (&g_msc_class[devno] != msc_class)) {
+            usbh_msc_readahead_sync(&g_msc_class[devno]);
+        }
+    }
+#endif
+    return 0;
+}
+
+static void usbh_msc_unlock(struct usbh_msc *msc_class)
+{
+    usb_osal_mutex_give(msc_class->dev->mutex);
+}
+
 static int usbh_bulk_cbw_csw_xfer(struct usbh_msc *msc_class, struct CBW *cbw, struct CSW *csw, uint8_t *buffer, uint32_t timeout)
 {
     int nbytes;
+    int ret;
 
+#if CONFIG_USBHOST_MSC_READAHEAD_SIZE > 0
+    usbh_msc_readahead_sync(msc_class);
+#endif
+#ifdef CONFIG_USBHOST_MSC_UAS
+    if (msc_class->uas) {
+        return usbh_uas_command(msc_class, cbw->CB, cbw->bCBLength, buffer, cbw->dDataLength, cbw->bmFlags & 0x80, timeout);
+    }
+#endif
+    cbw->dTag = ++msc_class->dev->tag;
     usbh_msc_cbw_dump(cbw);
 
     /* Send the CBW */
@@ -141,47 +307,328 @@ static int usbh_bulk_cbw_csw_xfer(struct usbh_msc *msc_class, struct CBW *cbw, s
     if (cbw->dDataLength != 0) {
         if (cbw->CB[0] == SCSI_CMD_WRITE10) {
             nbytes = usbh_msc_bulk_out_transfer(msc_class, buffer, cbw->dDataLength, timeout);
-        } else if (cbw->CB[0] == SCSI_CMD_READCAPACITY10) {
-            nbytes = usbh_msc_bulk_in_transfer(msc_class, buffer, cbw->dDataLength, timeout);
-            if (nbytes >= 0) {
-                /* Save the capacity information */
-                msc_class->blocknum = GET_BE32(&buffer[0]) + 1;
-                msc_class->blocksize = GET_BE32(&buffer[4]);
-            }
         } else {
             nbytes = usbh_msc_bulk_in_transfer(msc_class, buffer, cbw->dDataLength, timeout);
         }
 
-        if (nbytes < 0) {
+        if (nbytes == -USB_ERR_STALL) {
+            /* the device ended the data stage early, the csw still follows */
+            usbh_msc_clear_halt(msc_class, cbw->bmFlags & 0x80);
+        } else if (nbytes < 0) {
             USB_LOG_ERR("msc data transfer error: %d\r\n", nbytes);
             goto __err_exit;
         }
     }
 
     /* Receive the CSW */
-    memset(csw, 0, USB_SIZEOF_MSC_CSW);
-    nbytes = usbh_msc_bulk_in_transfer(msc_class, (uint8_t *)csw, USB_SIZEOF_MSC_CSW, timeout);
+    ret = usbh_msc_receive_csw(msc_class, csw, timeout);
+    if (ret < 0) {
+        return ret;
+    }
+__err_exit:
+    return nbytes < 0 ? (int)nbytes : 0;
+}
+
+static void usbh_msc_xfer_end(struct usbh_msc *msc_class, int ret)
+{
+    msc_class->xfer.ret = ret;
+    usb_osal_sem_give(msc_class->xfer_sem);
+}
+
+static void usbh_msc_xfer_complete(void *arg, int nbytes);
+
+uint8_t usbh_msc_rw_cdb(struct usbh_msc *msc_class, bool write, uint64_t sector, uint32_t *nsectors, uint8_t *cb)
+{
+    uint32_t max_blocks;
+
+    max_blocks = msc_class->cdb16 ? (0xffffffff / msc_class->blocksize) : 0xffff;
+    if (msc_class->max_transfer_blocks && (msc_class->max_transfer_blocks < max_blocks)) {
+        max_blocks = msc_class->max_transfer_blocks;
+    }
+    *nsectors = MIN(*nsectors, max_blocks);
+
+    if (msc_class->cdb16) {
+        cb[0] = write ? SCSI_CMD_WRITE16 : SCSI_CMD_READ16;
+
+        SET_BE32(&cb[2], (uint32_t)(sector >> 32));
+        SET_BE32(&cb[6], (uint32_t)sector);
+        SET_BE32(&cb[10], *nsectors);
+        return SCSICMD_READ16_SIZEOF;
+    } else {
+        cb[0] = write ? SCSI_CMD_WRITE10 : SCSI_CMD_READ10;
+
+        SET_BE32(&cb[2], (uint32_t)sector);
+        SET_BE16(&cb[7], *nsectors);
+        return SCSICMD_READ10_SIZEOF;
+    }
+}
+
+static int usbh_msc_xfer_submit_cbw(struct usbh_msc *msc_class)
+{
+    struct usbh_msc_xfer *xfer = &msc_class->xfer;
+    struct CBW *cbw;
+
+    /* Construct the CBW */
+    cbw = (struct CBW *)g_msc_cbw_csw[msc_class->sdchar - 'a'];
+    memset(cbw, 0, USB_SIZEOF_MSC_CBW);
+    cbw->dSignature = MSC_CBW_Signature;
+    cbw->dTag = ++msc_class->dev->tag;
+    cbw->bLUN = msc_class->lun;
+
+    xfer->chunk = xfer->nsectors;
+    cbw->bCBLength = usbh_msc_rw_cdb(msc_class, xfer->write, xfer->sector, &xfer->chunk, cbw->CB);
+    cbw->dDataLength = msc_class->blocksize * xfer->chunk;
+    cbw->bmFlags = xfer->write ? 0x00 : 0x80;
+
+    xfer->stage = USBH_MSC_STAGE_CBW;
+    usbh_bulk_urb_fill(&msc_class->dev->bulkout_urb, msc_class->hport, msc_class->bulkout, (uint8_t *)cbw, USB_SIZEOF_MSC_CBW, 0, usbh_msc_xfer_complete, msc_class);
+    return usbh_submit_urb(&msc_class->dev->bulkout_urb);
+}
+
+/* runs in urb completion context, every stage submits the next one without waking the caller */
+static void usbh_msc_xfer_complete(void *arg, int nbytes)
+{
+    struct usbh_msc *msc_class = (struct usbh_msc *)arg;
+    struct usbh_msc_xfer *xfer = &msc_class->xfer;
+    struct CSW *csw = (struct CSW *)g_msc_cbw_csw[msc_class->sdchar - 'a'];
+    uint32_t len = msc_class->blocksize * xfer->chunk;
+    int ret;
+
+    xfer->progress++;
     if (nbytes < 0) {
-        USB_LOG_ERR("csw transfer error: %d\r\n", nbytes);
-        goto __err_exit;
+        usbh_msc_xfer_end(msc_class, nbytes);
+        return;
+    }
+    if (xfer->abort) {
+        usbh_msc_xfer_end(msc_class, -USB_ERR_SHUTDOWN);
+        return;
     }
 
-    usbh_msc_csw_dump(csw);
+    switch (xfer->stage) {
+        case USBH_MSC_STAGE_CBW:
+            xfer->stage = USBH_MSC_STAGE_DATA;
+            if (xfer->write) {
+                usbh_bulk_urb_fill(&msc_class->dev->bulkout_urb, msc_class->hport, msc_class->bulkout, xfer->buffer, len, 0, usbh_msc_xfer_complete, msc_class);
+                ret = usbh_submit_urb(&msc_class->dev->bulkout_urb);
+            } else {
+                usbh_bulk_urb_fill(&msc_class->dev->bulkin_urb, msc_class->hport, msc_class->bulkin, xfer->buffer, len, 0, usbh_msc_xfer_complete, msc_class);
+                ret = usbh_submit_urb(&msc_class->dev->bulkin_urb);
+            }
+            break;
+        case USBH_MSC_STAGE_DATA:
+            xfer->stage = USBH_MSC_STAGE_CSW;
+            memset(csw, 0, USB_SIZEOF_MSC_CSW);
+            usbh_bulk_urb_fill(&msc_class->dev->bulkin_urb, msc_class->hport, msc_class->bulkin, (uint8_t *)csw, USB_SIZEOF_MSC_CSW, 0, usbh_msc_xfer_complete, msc_class);
+            ret = usbh_submit_urb(&msc_class->dev->bulkin_urb);
+            break;
+        default:
+            ret = usbh_msc_check_csw(msc_class, csw, nbytes);
+            if ((ret == 0) && msc_class->residue) {
+                /* the device moved fewer blocks than asked for */
+                ret = -USB_ERR_INVAL;
+            }
+            if (ret < 0) {
+                usbh_msc_xfer_end(msc_class, ret);
+                return;
+            }
 
-    /* check csw status */
-    if (csw->dSignature != MSC_CSW_Signature) {
-        USB_LOG_ERR("csw signature error\r\n");
-        return -USB_ERR_INVAL;
+            xfer->buffer += len;
+            xfer->sector += xfer->chunk;
+            xfer->nsectors -= xfer->chunk;
+            if (xfer->nsectors == 0) {
+                usbh_msc_xfer_end(msc_class, 0);
+                return;
+            }
+            ret = usbh_msc_xfer_submit_cbw(msc_class);
+            break;
     }
 
-    if (csw->bStatus != 0) {
-        USB_LOG_ERR("csw bStatus %d\r\n", csw->bStatus);
-        return -USB_ERR_INVAL;
+    if (ret < 0) {
+        usbh_msc_xfer_end(msc_class, ret);
     }
-__err_exit:
-    return nbytes < 0 ? (int)nbytes : 0;
 }
 
+static int usbh_msc_xfer_start(struct usbh_msc *msc_class, bool write, uint64_t sector, uint8_t *buffer, uint32_t nsectors)
+{
+    struct usbh_msc_xfer *xfer = &msc_class->xfer;
+
+    xfer->buffer = buffer;
+    xfer->sector = sector;
+    xfer->nsectors = nsectors;
+    xfer->write = write;
+    xfer->abort = false;
+    xfer->ret = 0;
+
+    return usbh_msc_xfer_submit_cbw(msc_class);
+}
+
+static int usbh_msc_xfer_wait(struct usbh_msc *msc_class)
+{
+    struct usbh_msc_xfer *xfer = &msc_class->xfer;
+    struct CSW *csw = (struct CSW *)g_msc_cbw_csw[msc_class->sdchar - 'a'];
+    uint32_t progress;
+    uint8_t retry;
+    int ret;
+
+    /* the timeout applies to each stage, not to the whole request */
+    do {
+        progress = xfer->progress;
+        ret = usb_osal_sem_take(msc_class->xfer_sem, CONFIG_USBHOST_MSC_TIMEOUT);
+    } while ((ret < 0) && (progress != xfer->progress));
+
+    if (ret < 0) {
+        xfer->abort = true;
+        for (retry = 0; retry < USBH_MSC_KILL_RETRY; retry++) {
+            usbh_kill_urb(&msc_class->dev->bulkout_urb);
+            usbh_kill_urb(&msc_class->dev->bulkin_urb);
+            if (usb_osal_sem_take(msc_class->xfer_sem, 100) == 0) {
+                break;
+            }
+        }
+        if (retry == USBH_MSC_KILL_RETRY) {
+            /* the hcd cannot cancel the urbs, detach them so a late completion is dropped */
+            msc_class->dev->bulkout_urb.complete = NULL;
+            msc_class->dev->bulkin_urb.complete = NULL;
+            usb_osal_sem_reset(msc_class->xfer_sem);
+        }
+        usbh_msc_reset_recovery(msc_class);
+        USB_LOG_ERR("msc transfer timeout\r\n");
+        return -USB_ERR_TIMEOUT;
+    }
+
+    ret = xfer->ret;
+    if ((ret == -USB_ERR_IO) && (xfer->stage == USBH_MSC_STAGE_CSW)) {
+        USB_LOG_ERR("csw not valid or phase error, reset recovery\r\n");
+        usbh_msc_reset_recovery(msc_class);
+    } else if (ret == -USB_ERR_STALL) {
+        if (xfer->stage == USBH_MSC_STAGE_CBW) {
+            usbh_msc_clear_halt(msc_class, false);
+        } else {
+            usbh_msc_clear_halt(msc_class, (xfer->stage == USBH_MSC_STAGE_CSW) || !xfer->write);
+            usbh_msc_receive_csw(msc_class, csw, CONFIG_USBHOST_MSC_TIMEOUT);
+        }
+    }
+
+    if (ret < 0) {
+        USB_LOG_ERR("msc transfer error: %d, stage %u\r\n", ret, xfer->stage);
+    }
+    return ret;
+}
+
+static int usbh_msc_xfer_dma(struct usbh_msc *msc_class, bool write, uint64_t sector, uint8_t *buffer, uint32_t nsectors)
+{
+    int ret;
+
+#ifdef CONFIG_USBHOST_MSC_UAS
+    if (msc_class->uas) {
+        return usbh_uas_xfer(msc_class, write, sector, buffer, nsectors);
+    }
+#endif
+    ret = usbh_msc_xfer_start(msc_class, write, sector, buffer, nsectors);
+    if (ret < 0) {
+        return ret;
+    }
+    return usbh_msc_xfer_wait(msc_class);
+}
+
+/* stage a buffer the hcd cannot take through the per device bounce buffer */
+static int usbh_msc_xfer_bounce(struct usbh_msc *msc_class, bool write, uint64_t sector, uint8_t *buffer, uint32_t nsectors)
+{
+    uint8_t *bounce_buf = g_msc_bounce_buf[msc_class->sdchar - 'a'];
+    uint32_t max_sectors = CONFIG_USBHOST_MSC_BOUNCE_SIZE / msc_class->blocksize;
+    uint32_t count;
+    int ret;
+
+    if (max_sectors == 0) {
+        USB_LOG_ERR("Bounce buffer is smaller than block size %u\r\n", msc_class->blocksize);
+        return -USB_ERR_NOMEM;
+    }
+
+    while (nsectors) {
+        count = MIN(nsectors, max_sectors);
+        if (write) {
+            memcpy(bounce_buf, buffer, count * msc_class->blocksize);
+        }
+        ret = usbh_msc_xfer_dma(msc_class, write, sector, bounce_buf, count);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!write) {
+            memcpy(buffer, bounce_buf, count * msc_class->blocksize);
+        }
+        buffer += count * msc_class->blocksize;
+        sector += count;
+        nsectors -= count;
+    }
+    return 0;
+}
+
+static int usbh_msc_xfer(struct usbh_msc *msc_class, bool write, uint64_t sector, uint8_t *buffer, uint32_t nsectors)
+{
+    int ret;
+
+    if (nsectors == 0) {
+        return 0;
+    }
+    if ((sector >= msc_class->blocknum) || (nsectors > (msc_class->blocknum - sector))) {
+        return -USB_ERR_RANGE;
+    }
+
+    /* the hcd cleans and invalidates whole cache lines of the urb buffer,
+     * a buffer sharing a line with other data must not be handed to it
+     */
+    if (((uintptr_t)buffer | (nsectors * msc_class->blocksize)) & (CONFIG_USB_ALIGN_SIZE - 1)) {
+        return usbh_msc_xfer_bounce(msc_class, write, sector, buffer, nsectors);
+    }
+    ret = usbh_msc_xfer_dma(msc_class, write, sector, buffer, nsectors);
+    if ((ret >= 0) && !write) {
+        /* drop lines the cpu may have fetched speculatively while the data was in flight */
+        usb_dcache_invalidate((uintptr_t)buffer, nsectors * msc_class->blocksize);
+    }
+    return ret;
+}
+
+#if CONFIG_USBHOST_MSC_READAHEAD_SIZE > 0
+static uint32_t usbh_msc_readahead_sectors(struct usbh_msc *msc_class, uint64_t sector)
+{
+    if (sector >= msc_class->blocknum) {
+        return 0;
+    }
+    return (uint32_t)MIN(CONFIG_USBHOST_MSC_READAHEAD_SIZE / msc_class->blocksize, msc_class->blocknum - sector);
+}
+
+/* refill the window in the background, the next request on this device picks it up */
+static void usbh_msc_readahead_start(struct usbh_msc *msc_class, uint64_t sector)
+{
+    uint32_t count = usbh_msc_readahead_sectors(msc_class, sector);
+
+    msc_class->ra_count = 0;
+    msc_class->ra_sector = sector;
+    if (count == 0) {
+        return;
+    }
+#ifdef CONFIG_USBHOST_MSC_UAS
+    /* no background refill over uas, the next sequential read reloads the window */
+    if (msc_class->uas) {
+        return;
+    }
+#endif
+    if (usbh_msc_xfer_start(msc_class, false, sector, g_msc_readahead_buf[msc_class->sdchar - 'a'], count) == 0) {
+        msc_class->ra_pending = true;
+    }
+}
+
+static void usbh_msc_readahead_sync(struct usbh_msc *msc_class)
+{
+    if (msc_class->ra_pending) {
+        msc_class->ra_pending = false;
+        if (usbh_msc_xfer_wait(msc_class) == 0) {
+            msc_class->ra_count = usbh_msc_readahead_sectors(msc_class, msc_class->ra_sector);
+        }
+    }
+}
+#endif
+
 static inline int usbh_msc_scsi_testunitready(struct usbh_msc *msc_class)
 {
     struct CBW *cbw;
@@ -190,6 +637,7 @@ static inline int usbh_msc_scsi_testunitready(struct usbh_msc *msc_class)
     cbw = (struct CBW *)g_msc_cbw_csw[msc_class->sdchar - 'a'];
     memset(cbw, 0, USB_SIZEOF_MSC_CBW);
     cbw->dSignature = MSC_CBW_Signature;
+    cbw->bLUN = msc_class->lun;
 
     cbw->bCBLength = SCSICMD_TESTUNITREADY_SIZEOF;
     cbw->CB[0] = SCSI_CMD_TESTUNITREADY;
@@ -205,6 +653,7 @@ static inline int usbh_msc_scsi_requestsense(struct usbh_msc *msc_class)
     cbw = (struct CBW *)g_msc_cbw_csw[msc_class->sdchar - 'a'];
     memset(cbw, 0, USB_SIZEOF_MSC_CBW);
     cbw->dSignature = MSC_CBW_Signature;
+    cbw->bLUN = msc_class->lun;
 
     cbw->bmFlags = 0x80;
     cbw->dDataLength = SCSIRESP_FIXEDSENSEDATA_SIZEOF;
@@ -223,6 +672,7 @@ static inline int usbh_msc_scsi_inquiry(struct usbh_msc *msc_class)
     cbw = (struct CBW *)g_msc_cbw_csw[msc_class->sdchar - 'a'];
     memset(cbw, 0, USB_SIZEOF_MSC_CBW);
     cbw->dSignature = MSC_CBW_Signature;
+    cbw->bLUN = msc_class->lun;
 
     cbw->dDataLength = SCSIRESP_INQUIRY_SIZEOF;
     cbw->bmFlags = 0x80;
@@ -233,21 +683,116 @@ static inline int usbh_msc_scsi_inquiry(struct usbh_msc *msc_class)
     return usbh_bulk_cbw_csw_xfer(msc_class, cbw, (struct CSW *)g_msc_cbw_csw[msc_class->sdchar - 'a'], g_msc_buf[msc_class->sdchar - 'a'], CONFIG_USBHOST_MSC_TIMEOUT);
 }
 
+static inline int usbh_msc_scsi_inquiry_vpd(struct usbh_msc *msc_class, uint8_t page)
+{
+    struct CBW *cbw;
+
+    /* Construct the CBW */
+    cbw = (struct CBW *)g_msc_cbw_csw[msc_class->sdchar - 'a'];
+    memset(cbw, 0, USB_SIZEOF_MSC_CBW);
+    cbw->dSignature = MSC_CBW_Signature;
+    cbw->bLUN = msc_class->lun;
+
+    cbw->dDataLength = 64;
+    cbw->bmFlags = 0x80;
+    cbw->bCBLength = SCSICMD_INQUIRY_SIZEOF;
+    cbw->CB[0] = SCSI_CMD_INQUIRY;
+    cbw->CB[1] = SCSICMD_INQUIRYFLAGS_EVPD;
+    cbw->CB[2] = page;
+    cbw->CB[4] = 64;
+
+    return usbh_bulk_cbw_csw_xfer(msc_class, cbw, (struct CSW *)g_msc_cbw_csw[msc_class->sdchar - 'a'], g_msc_buf[msc_class->sdchar - 'a'], CONFIG_USBHOST_MSC_TIMEOUT);
+}
+
+static void usbh_msc_scsi_get_block_limits(struct usbh_msc *msc_class)
+{
+    uint8_t *buf = g_msc_buf[msc_class->sdchar - 'a'];
+    uint8_t num;
+    uint8_t i;
+
+    /* plenty of bridges fail on vpd pages, only ask devices claiming SPC-3 or later, buf still holds the inquiry data */
+    if (buf[2] < 0x05) {
+        return;
+    }
+
+    if (usbh_msc_scsi_inquiry_vpd(msc_class, SCSIRESP_VPD_SUPPORTEDPAGES) < 0) {
+        usbh_msc_scsi_requestsense(msc_class);
+        return;
+    }
+
+    num = MIN(buf[3], 64 - 4);
+    for (i = 0; i < num; i++) {
+        if (buf[4 + i] == SCSIRESP_VPD_BLOCKLIMITS) {
+            break;
+        }
+    }
+    if (i == num) {
+        return;
+    }
+
+    if (usbh_msc_scsi_inquiry_vpd(msc_class, SCSIRESP_VPD_BLOCKLIMITS) < 0) {
+        usbh_msc_scsi_requestsense(msc_class);
+        return;
+    }
+
+    msc_class->max_transfer_blocks = GET_BE32(&buf[8]);
+}
+
 static inline int usbh_msc_scsi_readcapacity10(struct usbh_msc *msc_class)
 {
     struct CBW *cbw;
+    uint8_t *buf = g_msc_buf[msc_class->sdchar - 'a'];
+    int ret;
 
     /* Construct the CBW */
     cbw = (struct CBW *)g_msc_cbw_csw[msc_class->sdchar - 'a'];
     memset(cbw, 0, USB_SIZEOF_MSC_CBW);
     cbw->dSignature = MSC_CBW_Signature;
+    cbw->bLUN = msc_class->lun;
 
     cbw->dDataLength = SCSIRESP_READCAPACITY10_SIZEOF;
     cbw->bmFlags = 0x80;
     cbw->bCBLength = SCSICMD_READCAPACITY10_SIZEOF;
     cbw->CB[0] = SCSI_CMD_READCAPACITY10;
 
-    return usbh_bulk_cbw_csw_xfer(msc_class, cbw, (struct CSW *)g_msc_cbw_csw[msc_class->sdchar - 'a'], g_msc_buf[msc_class->sdchar - 'a'], CONFIG_USBHOST_MSC_TIMEOUT);
+    ret = usbh_bulk_cbw_csw_xfer(msc_class, cbw, (struct CSW *)g_msc_cbw_csw[msc_class->sdchar - 'a'], buf, CONFIG_USBHOST_MSC_TIMEOUT);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Save the capacity information, the last lba is 0xffffffff if it needs READ CAPACITY(16) */
+    msc_class->blocknum = (uint64_t)GET_BE32(&buf[0]) + 1;
+    msc_class->blocksize = GET_BE32(&buf[4]);
+    return 0;
+}
+
+static inline int usbh_msc_scsi_readcapacity16(struct usbh_msc *msc_class)
+{
+    struct CBW *cbw;
+    uint8_t *buf = g_msc_buf[msc_class->sdchar - 'a'];
+    int ret;
+
+    /* Construct the CBW */
+    cbw = (struct CBW *)g_msc_cbw_csw[msc_class->sdchar - 'a'];
+    memset(cbw, 0, USB_SIZEOF_MSC_CBW);
+    cbw->dSignature = MSC_CBW_Signature;
+    cbw->bLUN = msc_class->lun;
+
+    cbw->dDataLength = SCSIRESP_READCAPACITY16_SIZEOF;
+    cbw->bmFlags = 0x80;
+    cbw->bCBLength = SCSICMD_READCAPACITY16_SIZEOF;
+    cbw->CB[0] = SCSI_CMD_READCAPACITY16;
+    cbw->CB[1] = SCSICMD_READCAPACITY16_ACTION;
+    SET_BE32(&cbw->CB[10], SCSIRESP_READCAPACITY16_SIZEOF);
+
+    ret = usbh_bulk_cbw_csw_xfer(msc_class, cbw, (struct CSW *)g_msc_cbw_csw[msc_class->sdchar - 'a'], buf, CONFIG_USBHOST_MSC_TIMEOUT);
+    if (ret < 0) {
+        return ret;
+    }
+
+    msc_class->blocknum = (((uint64_t)GET_BE32(&buf[0]) << 32) | GET_BE32(&buf[4])) + 1;
+    msc_class->blocksize = GET_BE32(&buf[8]);
+    return 0;
 }
 
 static inline void usbh_msc_modeswitch(struct usbh_msc *msc_class, const uint8_t *message)
@@ -262,11 +807,51 @@ static inline void usbh_msc_modeswitch(struct usbh_msc *msc_class, const uint8_t
     usbh_bulk_cbw_csw_xfer(msc_class, cbw, (struct CSW *)g_msc_cbw_csw[msc_class->sdchar - 'a'], NULL, CONFIG_USBHOST_MSC_TIMEOUT);
 }
 
+/* further luns of a multi-lun device such as a card reader, each one is its own /dev/sdX */
+static int usbh_msc_lun_register(struct usbh_msc *dev, uint8_t lun)
+{
+    struct usbh_msc *msc_class = usbh_msc_class_alloc();
+    if (msc_class == NULL) {
+        USB_LOG_WRN("No free msc_class for LUN %u\r\n", lun);
+        return -USB_ERR_NOMEM;
+    }
+
+    msc_class->hport = dev->hport;
+    msc_class->intf = dev->intf;
+    msc_class->bulkin = dev->bulkin;
+    msc_class->bulkout = dev->bulkout;
+    msc_class->lun = lun;
+    msc_class->dev = dev;
+
+    msc_class->xfer_sem = usb_osal_sem_create(0);
+    if (msc_class->xfer_sem == NULL) {
+        usbh_msc_class_free(msc_class);
+        return -USB_ERR_NOMEM;
+    }
+
+    USB_LOG_INFO("Register MSC Class:" DEV_FORMAT " (LUN %u)\r\n", msc_class->sdchar, lun);
+
+    usbh_msc_run(msc_class);
+    return 0;
+}
+
+static void usbh_msc_lun_release(struct usbh_msc *msc_class)
+{
+#if CONFIG_USBHOST_MSC_CACHE_SIZE > 0
+    usbh_msc_cache_release(msc_class);
+#endif
+    if (msc_class->xfer_sem) {
+        usb_osal_sem_delete(msc_class->xfer_sem);
+    }
+    usbh_msc_class_free(msc_class);
+}
+
 static int usbh_msc_connect(struct usbh_hubport *hport, uint8_t intf)
 {
     struct usb_endpoint_descriptor *ep_desc;
     struct usbh_msc_modeswitch_config *config;
-    int ret;
+    uint8_t nluns = 1;
+    int ret = 0;
 
     struct usbh_msc *msc_class = usbh_msc_class_alloc();
     if (msc_class == NULL) {
@@ -276,9 +861,35 @@ static int usbh_msc_connect(struct usbh_hubport *hport, uint8_t intf)
 
     msc_class->hport = hport;
     msc_class->intf = intf;
+    msc_class->dev = msc_class;
+
+    msc_class->xfer_sem = usb_osal_sem_create(0);
+    if (msc_class->xfer_sem == NULL) {
+        usbh_msc_class_free(msc_class);
+        return -USB_ERR_NOMEM;
+    }
+
+    msc_class->mutex = usb_osal_mutex_create();
+    if (msc_class->mutex == NULL) {
+        usb_osal_sem_delete(msc_class->xfer_sem);
+        usbh_msc_class_free(msc_class);
+        return -USB_ERR_NOMEM;
+    }
 
     hport->config.intf[intf].priv = msc_class;
 
+#ifdef CONFIG_USBHOST_MSC_UAS
+    ret = usbh_uas_probe(msc_class);
+    if (ret == 0) {
+        USB_LOG_INFO("Use usb attached scsi, %u tags\r\n", CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH);
+        goto register_dev;
+    }
+    /* a uas only interface has no bulk-only transport to fall back to */
+    if (hport->config.intf[intf].altsetting[0].intf_desc.bInterfaceProtocol == MSC_PROTOCOL_UAS) {
+        return ret;
+    }
+#endif
+
     ret = usbh_msc_get_maxlun(msc_class, g_msc_buf[msc_class->sdchar - 'a']);
     if (ret < 0) {
         if (ret == -USB_ERR_STALL) {
@@ -290,7 +901,9 @@ static int usbh_msc_connect(struct usbh_hubport *hport, uint8_t intf)
         }
     }
 
-    USB_LOG_INFO("Get max LUN:%u\r\n", g_msc_buf[msc_class->sdchar - 'a'][0] + 1);
+    /* bulk-only allows up to 16 luns */
+    nluns = MIN(g_msc_buf[msc_class->sdchar - 'a'][0], 15) + 1;
+    USB_LOG_INFO("Get max LUN:%u\r\n", nluns);
 
     for (uint8_t i = 0; i < hport->config.intf[intf].altsetting[0].intf_desc.bNumEndpoints; i++) {
         ep_desc = &hport->config.intf[intf].altsetting[0].ep[i].ep_desc;
@@ -319,21 +932,83 @@ static int usbh_msc_connect(struct usbh_hubport *hport, uint8_t intf)
         }
     }
 
+#ifdef CONFIG_USBHOST_MSC_UAS
+register_dev:
+#endif
     snprintf(hport->config.intf[intf].devname, CONFIG_USBHOST_DEV_NAMELEN, DEV_FORMAT, msc_class->sdchar);
 
     USB_LOG_INFO("Register MSC Class:%s\r\n", hport->config.intf[intf].devname);
 
     usbh_msc_run(msc_class);
+
+    for (uint8_t lun = 1; lun < nluns; lun++) {
+        if (usbh_msc_lun_register(msc_class, lun) < 0) {
+            break;
+        }
+    }
     return ret;
 }
 
+#if CONFIG_USBHOST_MSC_CACHE_SIZE > 0
+/* the core still has the device addressed here, a device that is only torn down gets its dirty sectors */
+static int usbh_msc_prepare_disconnect(struct usbh_hubport *hport, uint8_t intf)
+{
+    size_t flags;
+    int ret;
+
+    struct usbh_msc *msc_class = (struct usbh_msc *)hport->config.intf[intf].priv;
+
+    if (!msc_class) {
+        return 0;
+    }
+
+    ret = usbh_msc_lock(msc_class);
+    if (ret < 0) {
+        return ret;
+    }
+    for (uint8_t devno = 0; devno < CONFIG_USBHOST_MAX_MSC_CLASS; devno++) {
+        if ((g_devinuse & (1U << devno)) && (g_msc_class[devno].dev == msc_class)) {
+            usbh_msc_cache_flush(&g_msc_class[devno]);
+        }
+    }
+    /* nothing may reach the cache after the flush, every lun fails until disconnect releases it */
+    flags = usb_osal_enter_critical_section();
+    msc_class->removed = true;
+    usb_osal_leave_critical_section(flags);
+    usbh_msc_unlock(msc_class);
+
+    return 0;
+}
+#endif
+
 static int usbh_msc_disconnect(struct usbh_hubport *hport, uint8_t intf)
 {
+    size_t flags;
+    bool locked;
     int ret = 0;
 
     struct usbh_msc *msc_class = (struct usbh_msc *)hport->config.intf[intf].priv;
 
     if (msc_class) {
+        if (hport->config.intf[intf].devname[0] != '\0') {
+            usb_osal_thread_schedule_other();
+            USB_LOG_INFO("Unregister MSC Class:%s\r\n", hport->config.intf[intf].devname);
+            usbh_msc_stop(msc_class);
+        }
+        for (uint8_t devno = 0; devno < CONFIG_USBHOST_MAX_MSC_CLASS; devno++) {
+            if ((g_devinuse & (1U << devno)) && (g_msc_class[devno].dev == msc_class) && (&g_msc_class[devno] != msc_class)) {
+                USB_LOG_INFO("Unregister MSC Class:" DEV_FORMAT "\r\n", g_msc_class[devno].sdchar);
+                usbh_msc_stop(&g_msc_class[devno]);
+            }
+        }
+
+        /* wait for a command still running on another thread, fails if prepare_disconnect already closed the device */
+        locked = (usbh_msc_lock(msc_class) == 0);
+#ifdef CONFIG_USBHOST_MSC_UAS
+        if (msc_class->uas) {
+            usbh_uas_release(msc_class);
+        }
+#endif
         if (msc_class->bulkin) {
             usbh_kill_urb(&msc_class->bulkin_urb);
         }
@@ -342,19 +1017,32 @@ static int usbh_msc_disconnect(struct usbh_hubport *hport, uint8_t intf)
             usbh_kill_urb(&msc_class->bulkout_urb);
         }
 
-        if (hport->config.intf[intf].devname[0] != '\0') {
-            usb_osal_thread_schedule_other();
-            USB_LOG_INFO("Unregister MSC Class:%s\r\n", hport->config.intf[intf].devname);
-            usbh_msc_stop(msc_class);
+        /* fail the threads blocked on the lock before the mutex goes away */
+        flags = usb_osal_enter_critical_section();
+        msc_class->removed = true;
+        usb_osal_leave_critical_section(flags);
+        if (locked) {
+            usbh_msc_unlock(msc_class);
+        }
+        while (msc_class->lock_waiters) {
+            usb_osal_msleep(1);
         }
 
-        usbh_msc_class_free(msc_class);
+        for (uint8_t devno = 0; devno < CONFIG_USBHOST_MAX_MSC_CLASS; devno++) {
+            if ((g_devinuse & (1U << devno)) && (g_msc_class[devno].dev == msc_class) && (&g_msc_class[devno] != msc_class)) {
+                usbh_msc_lun_release(&g_msc_class[devno]);
+            }
+        }
+        if (msc_class->mutex) {
+            usb_osal_mutex_delete(msc_class->mutex);
+        }
+        usbh_msc_lun_release(msc_class);
     }
 
     return ret;
 }
 
-int usbh_msc_scsi_init(struct usbh_msc *msc_class)
+static int usbh_msc_lun_init(struct usbh_msc *msc_class)
 {
     int ret;
     uint16_t cnt;
@@ -377,60 +1065,188 @@ int usbh_msc_scsi_init(struct usbh_msc *msc_class)
         return ret;
     }
 
+    usbh_msc_scsi_get_block_limits(msc_class);
+
     ret = usbh_msc_scsi_readcapacity10(msc_class);
     if (ret < 0) {
         USB_LOG_ERR("Fail to scsi_readcapacity10\r\n");
         return ret;
     }
 
+    if (msc_class->blocknum > 0xffffffff) {
+        ret = usbh_msc_scsi_readcapacity16(msc_class);
+        if (ret < 0) {
+            USB_LOG_ERR("Fail to scsi_readcapacity16\r\n");
+            return ret;
+        }
+    }
+
+    /* 16 byte commands only when needed, older devices may not know them */
+    msc_class->cdb16 = (msc_class->blocknum > 0x100000000ULL) || (msc_class->max_transfer_blocks > 0xffff);
+
     if (msc_class->blocksize > 0) {
         USB_LOG_INFO("Capacity info:\r\n");
-        USB_LOG_INFO("Block num:%d,block size:%d\r\n", (unsigned int)msc_class->blocknum, (unsigned int)msc_class->blocksize);
+        if (msc_class->blocknum > 0xffffffff) {
+            USB_LOG_INFO("Block num:0x%x%08x,block size:%d\r\n", (unsigned int)(msc_class->blocknum >> 32), (unsigned int)msc_class->blocknum, (unsigned int)msc_class->blocksize);
+        } else {
+            USB_LOG_INFO("Block num:%d,block size:%d\r\n", (unsigned int)msc_class->blocknum, (unsigned int)msc_class->blocksize);
+        }
+        if (msc_class->max_transfer_blocks) {
+            USB_LOG_INFO("Max transfer length:%u blocks\r\n", (unsigned int)msc_class->max_transfer_blocks);
+        }
     } else {
         USB_LOG_ERR("Invalid block size\r\n");
         return -USB_ERR_RANGE;
     }
 
+#if CONFIG_USBHOST_MSC_CACHE_SIZE > 0
+    usbh_msc_cache_init(msc_class);
+#endif
     return 0;
 }
 
-int usbh_msc_scsi_write10(struct usbh_msc *msc_class, uint32_t start_sector, const uint8_t *buffer, uint32_t nsectors)
+int usbh_msc_scsi_init(struct usbh_msc *msc_class)
 {
-    struct CBW *cbw;
+    int ret;
 
-    /* Construct the CBW */
-    cbw = (struct CBW *)g_msc_cbw_csw[msc_class->sdchar - 'a'];
-    memset(cbw, 0, USB_SIZEOF_MSC_CBW);
-    cbw->dSignature = MSC_CBW_Signature;
+    ret = usbh_msc_lock(msc_class);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = usbh_msc_lun_init(msc_class);
+    usbh_msc_unlock(msc_class);
+    return ret;
+}
 
-    cbw->dDataLength = (msc_class->blocksize * (nsectors & 0xffff));
-    cbw->bCBLength = SCSICMD_WRITE10_SIZEOF;
-    cbw->CB[0] = SCSI_CMD_WRITE10;
+int usbh_msc_write_uncached(struct usbh_msc *msc_class, uint64_t start_sector, const uint8_t *buffer, uint32_t nsectors)
+{
+#if CONFIG_USBHOST_MSC_READAHEAD_SIZE > 0
+    usbh_msc_readahead_sync(msc_class);
+    if ((start_sector < (msc_class->ra_sector + msc_class->ra_count)) && ((start_sector + nsectors) > msc_class->ra_sector)) {
+        msc_class->ra_count = 0;
+    }
+#endif
+    return usbh_msc_xfer(msc_class, true, start_sector, (uint8_t *)buffer, nsectors);
+}
 
-    SET_BE32(&cbw->CB[2], start_sector);
-    SET_BE16(&cbw->CB[7], nsectors & 0xffff);
+int usbh_msc_read_uncached(struct usbh_msc *msc_class, uint64_t start_sector, uint8_t *buffer, uint32_t nsectors)
+{
+#if CONFIG_USBHOST_MSC_READAHEAD_SIZE > 0
+    uint8_t *ra_buf = g_msc_readahead_buf[msc_class->sdchar - 'a'];
+    uint32_t count;
+    int ret;
 
-    return usbh_bulk_cbw_csw_xfer(msc_class, cbw, (struct CSW *)g_msc_cbw_csw[msc_class->sdchar - 'a'], (uint8_t *)buffer, CONFIG_USBHOST_MSC_TIMEOUT);
+    usbh_msc_readahead_sync(msc_class);
+
+    if ((start_sector >= msc_class->ra_sector) && ((start_sector + nsectors) <= (msc_class->ra_sector + msc_class->ra_count))) {
+        memcpy(buffer, &ra_buf[(uint32_t)(start_sector - msc_class->ra_sector) * msc_class->blocksize], nsectors * msc_class->blocksize);
+        msc_class->ra_next = start_sector + nsectors;
+        if (msc_class->ra_next == (msc_class->ra_sector + msc_class->ra_count)) {
+            usbh_msc_readahead_start(msc_class, msc_class->ra_next);
+        }
+        return 0;
+    }
+
+    /* small sequential reads are served from one large read */
+    count = usbh_msc_readahead_sectors(msc_class, start_sector);
+    if ((start_sector == msc_class->ra_next) && (nsectors < count)) {
+        msc_class->ra_count = 0;
+        ret = usbh_msc_xfer(msc_class, false, start_sector, ra_buf, count);
+        if (ret < 0) {
+            return ret;
+        }
+        msc_class->ra_sector = start_sector;
+        msc_class->ra_count = count;
+        memcpy(buffer, ra_buf, nsectors * msc_class->blocksize);
+        msc_class->ra_next = start_sector + nsectors;
+        return 0;
+    }
+    msc_class->ra_next = start_sector + nsectors;
+#endif
+    return usbh_msc_xfer(msc_class, false, start_sector, buffer, nsectors);
 }
 
-int usbh_msc_scsi_read10(struct usbh_msc *msc_class, uint32_t start_sector, const uint8_t *buffer, uint32_t nsectors)
+int usbh_msc_scsi_write(struct usbh_msc *msc_class, uint64_t start_sector, const uint8_t *buffer, uint32_t nsectors)
 {
-    struct CBW *cbw;
+    int ret;
 
-    /* Construct the CBW */
-    cbw = (struct CBW *)g_msc_cbw_csw[msc_class->sdchar - 'a'];
-    memset(cbw, 0, USB_SIZEOF_MSC_CBW);
-    cbw->dSignature = MSC_CBW_Signature;
+    ret = usbh_msc_lock(msc_class);
+    if (ret < 0) {
+        return ret;
+    }
+#if CONFIG_USBHOST_MSC_CACHE_SIZE > 0
+    ret = usbh_msc_cache_write(msc_class, start_sector, buffer, nsectors);
+#else
+    ret = usbh_msc_write_uncached(msc_class, start_sector, buffer, nsectors);
+#endif
+    usbh_msc_unlock(msc_class);
+    return ret;
+}
 
-    cbw->dDataLength = (msc_class->blocksize * (nsectors & 0xffff));
-    cbw->bmFlags = 0x80;
-    cbw->bCBLength = SCSICMD_READ10_SIZEOF;
-    cbw->CB[0] = SCSI_CMD_READ10;
+int usbh_msc_scsi_read(struct usbh_msc *msc_class, uint64_t start_sector, uint8_t *buffer, uint32_t nsectors)
+{
+    int ret;
 
-    SET_BE32(&cbw->CB[2], start_sector);
-    SET_BE16(&cbw->CB[7], nsectors & 0xffff);
+    ret = usbh_msc_lock(msc_class);
+    if (ret < 0) {
+        return ret;
+    }
+#if CONFIG_USBHOST_MSC_CACHE_SIZE > 0
+    ret = usbh_msc_cache_read(msc_class, start_sector, buffer, nsectors);
+#else
+    ret = usbh_msc_read_uncached(msc_class, start_sector, buffer, nsectors);
+#endif
+    usbh_msc_unlock(msc_class);
+    return ret;
+}
 
-    return usbh_bulk_cbw_csw_xfer(msc_class, cbw, (struct CSW *)g_msc_cbw_csw[msc_class->sdchar - 'a'], (uint8_t *)buffer, CONFIG_USBHOST_MSC_TIMEOUT);
+int usbh_msc_scsi_sync(struct usbh_msc *msc_class)
+{
+#if CONFIG_USBHOST_MSC_CACHE_SIZE > 0
+    int ret;
+
+    ret = usbh_msc_lock(msc_class);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = usbh_msc_cache_flush(msc_class);
+    usbh_msc_unlock(msc_class);
+    return ret;
+#else
+    (void)msc_class;
+    return 0;
+#endif
+}
+
+int usbh_msc_scsi_write10(struct usbh_msc *msc_class, uint32_t start_sector, const uint8_t *buffer, uint32_t nsectors)
+{
+    return usbh_msc_scsi_write(msc_class, start_sector, buffer, nsectors);
+}
+
+int usbh_msc_scsi_read10(struct usbh_msc *msc_class, uint32_t start_sector, uint8_t *buffer, uint32_t nsectors)
+{
+    return usbh_msc_scsi_read(msc_class, start_sector, buffer, nsectors);
+}
+
+struct usbh_msc *usbh_msc_find(const char *devname)
+{
+    char name[CONFIG_USBHOST_DEV_NAMELEN];
+    struct usbh_msc *msc_class;
+
+    /* lun 0 is the interface instance */
+    msc_class = (struct usbh_msc *)usbh_find_class_instance(devname);
+    if (msc_class) {
+        return msc_class;
+    }
+    for (uint8_t devno = 0; devno < CONFIG_USBHOST_MAX_MSC_CLASS; devno++) {
+        if ((g_devinuse & (1U << devno)) && (g_msc_class[devno].lun != 0) && g_msc_class[devno].xfer_sem) {
+            snprintf(name, sizeof(name), DEV_FORMAT, g_msc_class[devno].sdchar);
+            if (strncmp(name, devname, CONFIG_USBHOST_DEV_NAMELEN) == 0) {
+                return &g_msc_class[devno];
+            }
+        }
+    }
+    return NULL;
 }
 
 void usbh_msc_modeswitch_enable(struct usbh_msc_modeswitch_config *config)
@@ -455,7 +1271,10 @@ __WEAK void usbh_msc_stop(struct usbh_msc *msc_class)
 const struct usbh_class_driver msc_class_driver = {
     .driver_name = "msc",
     .connect = usbh_msc_connect,
-    .disconnect = usbh_msc_disconnect
+    .disconnect = usbh_msc_disconnect,
+#if CONFIG_USBHOST_MSC_CACHE_SIZE > 0
+    .prepare_disconnect = usbh_msc_prepare_disconnect
+#endif
 };
 
 CLASS_INFO_DEFINE const struct usbh_class_info msc_class_info = {
@@ -466,3 +1285,14 @@ CLASS_INFO_DEFINE const struct usbh_class_info msc_class_info = {
     .id_table = NULL,
     .class_driver = &msc_class_driver
 };
+
+#ifdef CONFIG_USBHOST_MSC_UAS
+CLASS_INFO_DEFINE const struct usbh_class_info uas_class_info = {
+    .match_flags = USB_CLASS_MATCH_INTF_CLASS | USB_CLASS_MATCH_INTF_SUBCLASS | USB_CLASS_MATCH_INTF_PROTOCOL,
+    .bInterfaceClass = USB_DEVICE_CLASS_MASS_STORAGE,
+    .bInterfaceSubClass = MSC_SUBCLASS_SCSI,
+    .bInterfaceProtocol = MSC_PROTOCOL_UAS,
+    .id_table = NULL,
+    .class_driver = &msc_class_driver
+};
+#endif
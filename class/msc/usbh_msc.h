@@ -9,6 +9,36 @@
 #include "usb_msc.h"
 #include "usb_scsi.h"
 
+/* bytes per msc device kept for sequential read-ahead, 0 is disable */
+#ifndef CONFIG_USBHOST_MSC_READAHEAD_SIZE
+#define CONFIG_USBHOST_MSC_READAHEAD_SIZE 0
+#endif
+
+/* bytes per msc device for staging reads and writes on buffers that are not aligned to CONFIG_USB_ALIGN_SIZE */
+#ifndef CONFIG_USBHOST_MSC_BOUNCE_SIZE
+#define CONFIG_USBHOST_MSC_BOUNCE_SIZE 4096
+#endif
+
+/* bytes per msc device for caching single sectors such as fat and directory sectors, written back on sync, 0 is disable */
+#ifndef CONFIG_USBHOST_MSC_CACHE_SIZE
+#define CONFIG_USBHOST_MSC_CACHE_SIZE 0
+#endif
+
+/* a read or write split into commands that are chained from urb completion */
+struct usbh_msc_xfer {
+    uint8_t *buffer;
+    uint64_t sector;   /* First sector of the next command */
+    uint32_t nsectors; /* Sectors not transferred yet */
+    uint32_t chunk;    /* Sectors of the command in flight */
+    bool write;
+    uint8_t stage;
+    volatile bool abort;
+    volatile uint32_t progress;
+    int ret;
+};
+
+struct usbh_uas;
+
 struct usbh_msc {
     struct usbh_hubport *hport;
     struct usb_endpoint_descriptor *bulkin;  /* Bulk IN endpoint */
@@ -18,8 +48,34 @@ struct usbh_msc {
 
     uint8_t intf; /* Data interface number */
     uint8_t sdchar;
-    uint32_t blocknum;  /* Number of blocks on the USB mass storage device */
+    uint8_t lun;
+    struct usbh_msc *dev;   /* Lun 0 of the device, owns the urbs and the lock, itself for lun 0 */
+    usb_osal_mutex_t mutex; /* Serializes commands to the device, lun 0 only */
+    volatile bool removed;         /* Device is being disconnected, lock waiters fail, lun 0 only */
+    volatile uint8_t lock_waiters; /* Threads inside usbh_msc_lock, lun 0 only */
+    uint32_t tag;                  /* dTag of the last cbw, lun 0 only */
+    uint32_t residue;              /* dDataResidue of the last csw, data the device did not transfer */
+    uint64_t blocknum;  /* Number of blocks on the USB mass storage device */
     uint16_t blocksize; /* Block size of USB mass storage device */
+    uint32_t max_transfer_blocks; /* From the block limits vpd page, 0 if the device does not report it */
+    bool cdb16;                   /* Use READ(16)/WRITE(16), the lba or transfer length does not fit 10 byte commands */
+
+    usb_osal_sem_t xfer_sem;
+    struct usbh_msc_xfer xfer;
+#if CONFIG_USBHOST_MSC_READAHEAD_SIZE > 0
+    uint64_t ra_sector; /* First sector held in the read-ahead buffer */
+    uint32_t ra_count;  /* Valid sectors in the read-ahead buffer */
+    uint64_t ra_next;   /* Sector following the last read, a read starting here is sequential */
+    bool ra_pending;    /* The read-ahead buffer is being refilled */
+#endif
+#if CONFIG_USBHOST_MSC_CACHE_SIZE > 0
+    uint32_t cache_hits;       /* Sectors read from the cache */
+    uint32_t cache_misses;     /* Sectors read from the device */
+    uint32_t cache_writebacks; /* Write commands issued for dirty sectors */
+#endif
+#ifdef CONFIG_USBHOST_MSC_UAS
+    struct usbh_uas *uas; /* Set when the device runs usb attached scsi instead of bulk-only */
+#endif
 
     void *user_data;
 };
@@ -33,8 +89,12 @@ struct usbh_msc_modeswitch_config {
 
 void usbh_msc_modeswitch_enable(struct usbh_msc_modeswitch_config *config);
 int usbh_msc_scsi_init(struct usbh_msc *msc_class);
+int usbh_msc_scsi_write(struct usbh_msc *msc_class, uint64_t start_sector, const uint8_t *buffer, uint32_t nsectors);
+int usbh_msc_scsi_read(struct usbh_msc *msc_class, uint64_t start_sector, uint8_t *buffer, uint32_t nsectors);
 int usbh_msc_scsi_write10(struct usbh_msc *msc_class, uint32_t start_sector, const uint8_t *buffer, uint32_t nsectors);
-int usbh_msc_scsi_read10(struct usbh_msc *msc_class, uint32_t start_sector, const uint8_t *buffer, uint32_t nsectors);
+int usbh_msc_scsi_read10(struct usbh_msc *msc_class, uint32_t start_sector, uint8_t *buffer, uint32_t nsectors);
+int usbh_msc_scsi_sync(struct usbh_msc *msc_class);
+struct usbh_msc *usbh_msc_find(const char *devname);
 
 void usbh_msc_run(struct usbh_msc *msc_class);
 void usbh_msc_stop(struct usbh_msc *msc_class);
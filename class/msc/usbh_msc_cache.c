@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2024, sakumisu
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include "usbh_core.h"
+#include "usbh_msc.h"
+#include "usbh_msc_cache.h"
+
+#undef USB_DBG_TAG
+#define USB_DBG_TAG "usbh_msc"
+#include "usb_log.h"
+
+#if CONFIG_USBHOST_MSC_CACHE_SIZE > 0
+
+#define USBH_MSC_CACHE_MAX_ENTRIES (CONFIG_USBHOST_MSC_CACHE_SIZE / 512)
+
+/* longer requests bypass the cache so file data does not push out fat and directory sectors */
+#define USBH_MSC_CACHE_MAX_REQ(cache) ((cache)->entries > 4 ? (cache)->entries / 4 : 1)
+
+struct usbh_msc_cache_entry {
+    uint64_t sector;
+    uint32_t stamp; /* Last use, 0 is a free slot */
+    bool dirty;
+};
+
+struct usbh_msc_cache {
+    struct usbh_msc_cache_entry entry[USBH_MSC_CACHE_MAX_ENTRIES];
+    uint32_t entries; /* Slots of one block, 0 bypasses the cache */
+    uint32_t clock;
+    uint32_t ndirty;
+};
+
+USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_msc_cache_buf[CONFIG_USBHOST_MAX_MSC_CLASS][USB_ALIGN_UP(CONFIG_USBHOST_MSC_CACHE_SIZE, CONFIG_USB_ALIGN_SIZE)];
+
+static struct usbh_msc_cache g_msc_cache[CONFIG_USBHOST_MAX_MSC_CLASS];
+
+static inline uint8_t *usbh_msc_cache_data(struct usbh_msc *msc_class, uint32_t slot)
+{
+    return &g_msc_cache_buf[msc_class->sdchar - 'a'][slot * msc_class->blocksize];
+}
+
+static int usbh_msc_cache_lookup(struct usbh_msc_cache *cache, uint64_t sector)
+{
+    for (uint32_t i = 0; i < cache->entries; i++) {
+        if (cache->entry[i].stamp && (cache->entry[i].sector == sector)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void usbh_msc_cache_touch(struct usbh_msc_cache *cache, uint32_t slot)
+{
+    if (++cache->clock == 0) {
+        /* wrapped, forget the order rather than mistaking slots for free ones */
+        for (uint32_t i = 0; i < cache->entries; i++) {
+            if (cache->entry[i].stamp) {
+                cache->entry[i].stamp = 1;
+            }
+        }
+        cache->clock = 2;
+    }
+    cache->entry[slot].stamp = cache->clock;
+}
+
+static void usbh_msc_cache_swap(struct usbh_msc *msc_class, struct usbh_msc_cache *cache, uint32_t a, uint32_t b)
+{
+    struct usbh_msc_cache_entry entry;
+    uint32_t *pa = (uint32_t *)usbh_msc_cache_data(msc_class, a);
+    uint32_t *pb = (uint32_t *)usbh_msc_cache_data(msc_class, b);
+    uint32_t tmp;
+
+    for (uint32_t i = 0; i < msc_class->blocksize / 4; i++) {
+        tmp = pa[i];
+        pa[i] = pb[i];
+        pb[i] = tmp;
+    }
+    entry = cache->entry[a];
+    cache->entry[a] = cache->entry[b];
+    cache->entry[b] = entry;
+}
+
+int usbh_msc_cache_flush(struct usbh_msc *msc_class)
+{
+    struct usbh_msc_cache *cache = &g_msc_cache[msc_class->sdchar - 'a'];
+    uint64_t start;
+    uint32_t count;
+    int first;
+    int slot;
+    int ret;
+
+    while (cache->ndirty) {
+        first = -1;
+        for (uint32_t i = 0; i < cache->entries; i++) {
+            if (cache->entry[i].dirty && ((first < 0) || (cache->entry[i].sector < cache->entry[first].sector))) {
+                first = i;
+            }
+        }
+        start = cache->entry[first].sector;
+
+        /* move the dirty run to the first slots in sector order, then one command writes all of it */
+        count = 0;
+        while (count < cache->entries) {
+            slot = usbh_msc_cache_lookup(cache, start + count);
+            if ((slot < 0) || !cache->entry[slot].dirty) {
+                break;
+            }
+            if ((uint32_t)slot != count) {
+                usbh_msc_cache_swap(msc_class, cache, slot, count);
+            }
+            count++;
+        }
+
+        ret = usbh_msc_write_uncached(msc_class, start, usbh_msc_cache_data(msc_class, 0), count);
+        if (ret < 0) {
+            return ret;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            cache->entry[i].dirty = false;
+        }
+        cache->ndirty -= count;
+        msc_class->cache_writebacks++;
+    }
+    return 0;
+}
+
+/* a free slot or the least recently used one, dirty data is written back first */
+static int usbh_msc_cache_victim(struct usbh_msc *msc_class, struct usbh_msc_cache *cache)
+{
+    uint32_t victim = 0;
+    int ret;
+
+    for (uint32_t i = 0; i < cache->entries; i++) {
+        if (cache->entry[i].stamp == 0) {
+            return i;
+        }
+        if (cache->entry[i].stamp < cache->entry[victim].stamp) {
+            victim = i;
+        }
+    }
+
+    if (cache->entry[victim].dirty) {
+        ret = usbh_msc_cache_flush(msc_class);
+        if (ret < 0) {
+            return ret;
+        }
+        /* the flush moved slots around, everything is clean now */
+        victim = 0;
+        for (uint32_t i = 1; i < cache->entries; i++) {
+            if (cache->entry[i].stamp < cache->entry[victim].stamp) {
+                victim = i;
+            }
+        }
+    }
+    return victim;
+}
+
+int usbh_msc_cache_read(struct usbh_msc *msc_class, uint64_t sector, uint8_t *buffer, uint32_t nsectors)
+{
+    struct usbh_msc_cache *cache = &g_msc_cache[msc_class->sdchar - 'a'];
+    uint32_t count;
+    int slot;
+    int ret;
+
+    if ((cache->entries == 0) || (nsectors > USBH_MSC_CACHE_MAX_REQ(cache))) {
+        ret = usbh_msc_read_uncached(msc_class, sector, buffer, nsectors);
+        if (ret < 0) {
+            return ret;
+        }
+        /* the device does not have these yet */
+        for (uint32_t i = 0; (i < cache->entries) && cache->ndirty; i++) {
+            if (cache->entry[i].dirty && (cache->entry[i].sector >= sector) && (cache->entry[i].sector < (sector + nsectors))) {
+                memcpy(&buffer[(uint32_t)(cache->entry[i].sector - sector) * msc_class->blocksize], usbh_msc_cache_data(msc_class, i), msc_class->blocksize);
+            }
+        }
+        return ret;
+    }
+
+    if ((sector >= msc_class->blocknum) || (nsectors > (msc_class->blocknum - sector))) {
+        return -USB_ERR_RANGE;
+    }
+
+    for (uint32_t i = 0; i < nsectors;) {
+        slot = usbh_msc_cache_lookup(cache, sector + i);
+        if (slot >= 0) {
+            memcpy(&buffer[i * msc_class->blocksize], usbh_msc_cache_data(msc_class, slot), msc_class->blocksize);
+            usbh_msc_cache_touch(cache, slot);
+            msc_class->cache_hits++;
+            i++;
+            continue;
+        }
+
+        /* missing sectors in a row are read with one command straight into the caller's buffer */
+        count = 1;
+        while (((i + count) < nsectors) && (usbh_msc_cache_lookup(cache, sector + i + count) < 0)) {
+            count++;
+        }
+        ret = usbh_msc_read_uncached(msc_class, sector + i, &buffer[i * msc_class->blocksize], count);
+        if (ret < 0) {
+            return ret;
+        }
+        msc_class->cache_misses += count;
+
+        for (uint32_t j = 0; j < count; j++) {
+            slot = usbh_msc_cache_victim(msc_class, cache);
+            if (slot < 0) {
+                return slot;
+            }
+            memcpy(usbh_msc_cache_data(msc_class, slot), &buffer[(i + j) * msc_class->blocksize], msc_class->blocksize);
+            cache->entry[slot].sector = sector + i + j;
+            cache->entry[slot].dirty = false;
+            usbh_msc_cache_touch(cache, slot);
+        }
+        i += count;
+    }
+    return 0;
+}
+
+int usbh_msc_cache_write(struct usbh_msc *msc_class, uint64_t sector, const uint8_t *buffer, uint32_t nsectors)
+{
+    struct usbh_msc_cache *cache = &g_msc_cache[msc_class->sdchar - 'a'];
+    int slot;
+    int ret;
+
+    if ((cache->entries == 0) || (nsectors > USBH_MSC_CACHE_MAX_REQ(cache))) {
+        ret = usbh_msc_write_uncached(msc_class, sector, buffer, nsectors);
+        if (ret < 0) {
+            return ret;
+        }
+        /* cached copies in the range are superseded by what went to the device */
+        for (uint32_t i = 0; i < cache->entries; i++) {
+            if (cache->entry[i].stamp && (cache->entry[i].sector >= sector) && (cache->entry[i].sector < (sector + nsectors))) {
+                memcpy(usbh_msc_cache_data(msc_class, i), &buffer[(uint32_t)(cache->entry[i].sector - sector) * msc_class->blocksize], msc_class->blocksize);
+                if (cache->entry[i].dirty) {
+                    cache->entry[i].dirty = false;
+                    cache->ndirty--;
+                }
+            }
+        }
+        return ret;
+    }
+
+    if ((sector >= msc_class->blocknum) || (nsectors > (msc_class->blocknum - sector))) {
+        return -USB_ERR_RANGE;
+    }
+
+    for (uint32_t i = 0; i < nsectors; i++) {
+        slot = usbh_msc_cache_lookup(cache, sector + i);
+        if (slot < 0) {
+            slot = usbh_msc_cache_victim(msc_class, cache);
+            if (slot < 0) {
+                return slot;
+            }
+            cache->entry[slot].sector = sector + i;
+            cache->entry[slot].dirty = false;
+        }
+        memcpy(usbh_msc_cache_data(msc_class, slot), &buffer[i * msc_class->blocksize], msc_class->blocksize);
+        if (!cache->entry[slot].dirty) {
+            cache->entry[slot].dirty = true;
+            cache->ndirty++;
+        }
+        usbh_msc_cache_touch(cache, slot);
+    }
+    return 0;
+}
+
+void usbh_msc_cache_init(struct usbh_msc *msc_class)
+{
+    struct usbh_msc_cache *cache = &g_msc_cache[msc_class->sdchar - 'a'];
+
+    if (cache->ndirty) {
+        usbh_msc_cache_flush(msc_class);
+    }
+    memset(cache, 0, sizeof(struct usbh_msc_cache));
+    cache->entries = MIN(CONFIG_USBHOST_MSC_CACHE_SIZE / msc_class->blocksize, USBH_MSC_CACHE_MAX_ENTRIES);
+    if (cache->entries == 0) {
+        USB_LOG_WRN("Cache is smaller than block size %u, disabled\r\n", msc_class->blocksize);
+    }
+}
+
+void usbh_msc_cache_release(struct usbh_msc *msc_class)
+{
+    struct usbh_msc_cache *cache = &g_msc_cache[msc_class->sdchar - 'a'];
+
+    /* what the flush before disconnect could not write back */
+    if (cache->ndirty) {
+        USB_LOG_ERR("Drop %u cached sectors not written back\r\n", (unsigned int)cache->ndirty);
+    }
+    memset(cache, 0, sizeof(struct usbh_msc_cache));
+}
+
+#endif
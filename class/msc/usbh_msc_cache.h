@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2024, sakumisu
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef USBH_MSC_CACHE_H
+#define USBH_MSC_CACHE_H
+
+struct usbh_msc;
+
+int usbh_msc_cache_read(struct usbh_msc *msc_class, uint64_t sector, uint8_t *buffer, uint32_t nsectors);
+int usbh_msc_cache_write(struct usbh_msc *msc_class, uint64_t sector, const uint8_t *buffer, uint32_t nsectors);
+int usbh_msc_cache_flush(struct usbh_msc *msc_class);
+void usbh_msc_cache_init(struct usbh_msc *msc_class);
+void usbh_msc_cache_release(struct usbh_msc *msc_class);
+
+/* provided by usbh_msc.c, go to the device */
+int usbh_msc_read_uncached(struct usbh_msc *msc_class, uint64_t sector, uint8_t *buffer, uint32_t nsectors);
+int usbh_msc_write_uncached(struct usbh_msc *msc_class, uint64_t sector, const uint8_t *buffer, uint32_t nsectors);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USBH_MSC_CACHE_H */
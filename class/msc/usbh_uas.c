@@ -0,0 +1,544 @@
+/*
+ * Copyright (c) 2024, sakumisu
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include "usbh_core.h"
+#include "usbh_msc.h"
+#include "usbh_uas.h"
+
+#undef USB_DBG_TAG
+#define USB_DBG_TAG "usbh_uas"
+#include "usb_log.h"
+
+#ifdef CONFIG_USBHOST_MSC_UAS
+
+#define USBH_UAS_CMD_FREE   0
+#define USBH_UAS_CMD_QUEUED 1 /* Command iu not sent yet */
+#define USBH_UAS_CMD_ACTIVE 2
+
+/* task management uses the tag after the command tags */
+#define USBH_UAS_TMF_TAG (CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH + 1)
+
+/* smallest piece a request is split into for queueing */
+#define USBH_UAS_MIN_SPLIT_SIZE (64 * 1024)
+
+USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_uas_cmd_iu[CONFIG_USBHOST_MAX_MSC_CLASS][CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH][USB_ALIGN_UP(UAS_COMMAND_IU_SIZEOF, CONFIG_USB_ALIGN_SIZE)];
+USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_uas_status_iu[CONFIG_USBHOST_MAX_MSC_CLASS][USB_ALIGN_UP(UAS_SENSE_IU_SIZEOF, CONFIG_USB_ALIGN_SIZE)];
+
+static struct usbh_uas g_uas[CONFIG_USBHOST_MAX_MSC_CLASS];
+
+static void usbh_uas_cmd_complete(void *arg, int nbytes);
+static void usbh_uas_status_complete(void *arg, int nbytes);
+static void usbh_uas_datain_complete(void *arg, int nbytes);
+static void usbh_uas_dataout_complete(void *arg, int nbytes);
+
+static uint8_t usbh_uas_pipe_id(struct usbh_hubport *hport, uint8_t intf, uint8_t alt, uint8_t ep_addr)
+{
+    uint8_t *p = hport->raw_config_desc;
+    uint8_t *end = p + hport->config.config_desc.wTotalLength;
+    bool in_alt = false;
+    bool in_ep = false;
+
+    while (((p + 2) <= end) && (p[0] >= 2)) {
+        switch (p[1]) {
+            case USB_DESCRIPTOR_TYPE_INTERFACE:
+                in_alt = (p[2] == intf) && (p[3] == alt);
+                in_ep = false;
+                break;
+            case USB_DESCRIPTOR_TYPE_ENDPOINT:
+                in_ep = in_alt && (p[2] == ep_addr);
+                break;
+            case UAS_DESCRIPTOR_TYPE_PIPE_USAGE:
+                if (in_ep && (p[0] >= 4)) {
+                    return p[2];
+                }
+                break;
+            default:
+                break;
+        }
+        p += p[0];
+    }
+    return 0;
+}
+
+static int usbh_uas_clear_halt(struct usbh_uas *uas, struct usb_endpoint_descriptor *ep, struct usbh_urb *urb)
+{
+    struct usb_setup_packet *setup = uas->msc_class->hport->setup;
+
+    setup->bmRequestType = USB_REQUEST_DIR_OUT | USB_REQUEST_STANDARD | USB_REQUEST_RECIPIENT_ENDPOINT;
+    setup->bRequest = USB_REQUEST_CLEAR_FEATURE;
+    setup->wValue = USB_FEATURE_ENDPOINT_HALT;
+    setup->wIndex = ep->bEndpointAddress;
+    setup->wLength = 0;
+
+    urb->data_toggle = 0;
+    return usbh_control_transfer(uas->msc_class->hport, setup, NULL);
+}
+
+static void usbh_uas_end(struct usbh_uas *uas, int ret)
+{
+    if (uas->done) {
+        return;
+    }
+    if (uas->ret == 0) {
+        uas->ret = ret;
+    }
+    uas->done = true;
+    usb_osal_sem_give(uas->msc_class->xfer_sem);
+}
+
+static void usbh_uas_queue(struct usbh_uas *uas, uint8_t slot, const uint8_t *cdb, uint8_t cdb_len, uint8_t *buffer, uint32_t len, bool in)
+{
+    struct uas_command_iu *iu = (struct uas_command_iu *)g_uas_cmd_iu[uas->msc_class->sdchar - 'a'][slot];
+    struct usbh_uas_cmd *cmd = &uas->cmds[slot];
+
+    memset(iu, 0, UAS_COMMAND_IU_SIZEOF);
+    iu->bIUID = UAS_IU_ID_COMMAND;
+    SET_BE16((uint8_t *)&iu->wTag, slot + 1);
+    iu->bPrioAttr = UAS_TASK_ATTR_SIMPLE;
+    memcpy(iu->CDB, cdb, cdb_len);
+
+    cmd->buffer = buffer;
+    cmd->len = len;
+    cmd->in = in;
+    cmd->data_pending = false;
+    cmd->status_done = false;
+    cmd->state = USBH_UAS_CMD_QUEUED;
+    uas->active++;
+}
+
+static void usbh_uas_queue_rw(struct usbh_uas *uas, uint8_t slot)
+{
+    uint8_t cdb[MSC_MAX_CDB_LEN];
+    uint32_t chunk = MIN(uas->nsectors, uas->split);
+    uint32_t len;
+    uint8_t cdb_len;
+
+    cdb_len = usbh_msc_rw_cdb(uas->msc_class, uas->write, uas->sector, &chunk, cdb);
+    len = chunk * uas->msc_class->blocksize;
+    usbh_uas_queue(uas, slot, cdb, cdb_len, uas->buffer, len, !uas->write);
+
+    uas->buffer += len;
+    uas->sector += chunk;
+    uas->nsectors -= chunk;
+}
+
+static void usbh_uas_send_next(struct usbh_uas *uas)
+{
+    int ret;
+
+    for (uint8_t i = 0; i < CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH; i++) {
+        if (uas->cmds[i].state == USBH_UAS_CMD_QUEUED) {
+            /* active before the iu goes out, its status may be handled ahead of the command completion */
+            uas->cmds[i].state = USBH_UAS_CMD_ACTIVE;
+            uas->cmd_busy = true;
+            usbh_bulk_urb_fill(&uas->cmd_urb, uas->msc_class->hport, uas->cmd, g_uas_cmd_iu[uas->msc_class->sdchar - 'a'][i],
+                               UAS_COMMAND_IU_SIZEOF, 0, usbh_uas_cmd_complete, uas);
+            ret = usbh_submit_urb(&uas->cmd_urb);
+            if (ret < 0) {
+                uas->cmd_busy = false;
+                usbh_uas_end(uas, ret);
+            }
+            return;
+        }
+    }
+}
+
+static void usbh_uas_post_status(struct usbh_uas *uas)
+{
+    int ret;
+
+    uas->status_busy = true;
+    usbh_bulk_urb_fill(&uas->status_urb, uas->msc_class->hport, uas->status, g_uas_status_iu[uas->msc_class->sdchar - 'a'],
+                       UAS_SENSE_IU_SIZEOF, 0, usbh_uas_status_complete, uas);
+    ret = usbh_submit_urb(&uas->status_urb);
+    if (ret < 0) {
+        uas->status_busy = false;
+        usbh_uas_end(uas, ret);
+    }
+}
+
+static bool usbh_uas_status_expected(struct usbh_uas *uas)
+{
+    for (uint8_t i = 0; i < CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH; i++) {
+        if ((uas->cmds[i].state != USBH_UAS_CMD_FREE) && !uas->cmds[i].status_done) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* the command has its status and data, hand the tag to the rest of the request */
+static void usbh_uas_cmd_finish(struct usbh_uas *uas, uint8_t slot)
+{
+    uas->cmds[slot].state = USBH_UAS_CMD_FREE;
+    uas->active--;
+
+    if (uas->nsectors && (uas->ret == 0)) {
+        usbh_uas_queue_rw(uas, slot);
+        if (!uas->status_busy) {
+            usbh_uas_post_status(uas);
+        }
+        if (!uas->cmd_busy && !uas->done) {
+            usbh_uas_send_next(uas);
+        }
+    } else if (uas->active == 0) {
+        usbh_uas_end(uas, 0);
+    }
+}
+
+static int usbh_uas_submit_data(struct usbh_uas *uas, uint8_t tag, bool in)
+{
+    struct usbh_uas_cmd *cmd = &uas->cmds[tag - 1];
+
+    if ((cmd->in != in) || (cmd->len == 0) || cmd->data_pending) {
+        USB_LOG_ERR("uas unexpected %s ready for tag %u\r\n", in ? "read" : "write", tag);
+        return -USB_ERR_IO;
+    }
+
+    /* the previous data stage is done on the bus but its completion has not run yet */
+    if (in && uas->datain_tag) {
+        uas->datain_deferred = tag;
+        return 0;
+    }
+    if (!in && uas->dataout_tag) {
+        uas->dataout_deferred = tag;
+        return 0;
+    }
+
+    cmd->data_pending = true;
+    if (in) {
+        uas->datain_tag = tag;
+        usbh_bulk_urb_fill(&uas->datain_urb, uas->msc_class->hport, uas->datain, cmd->buffer, cmd->len, 0, usbh_uas_datain_complete, uas);
+        return usbh_submit_urb(&uas->datain_urb);
+    } else {
+        uas->dataout_tag = tag;
+        usbh_bulk_urb_fill(&uas->dataout_urb, uas->msc_class->hport, uas->dataout, cmd->buffer, cmd->len, 0, usbh_uas_dataout_complete, uas);
+        return usbh_submit_urb(&uas->dataout_urb);
+    }
+}
+
+static void usbh_uas_cmd_complete(void *arg, int nbytes)
+{
+    struct usbh_uas *uas = (struct usbh_uas *)arg;
+
+    uas->progress++;
+    uas->cmd_busy = false;
+    if (uas->done) {
+        return;
+    }
+    if (nbytes < 0) {
+        usbh_uas_end(uas, nbytes);
+        return;
+    }
+    usbh_uas_send_next(uas);
+}
+
+static void usbh_uas_status_complete(void *arg, int nbytes)
+{
+    struct usbh_uas *uas = (struct usbh_uas *)arg;
+    uint8_t *iu = g_uas_status_iu[uas->msc_class->sdchar - 'a'];
+    struct uas_sense_iu *sense = (struct uas_sense_iu *)iu;
+    struct usbh_uas_cmd *cmd;
+    uint16_t tag;
+    int ret = 0;
+
+    uas->progress++;
+    uas->status_busy = false;
+    if (uas->done) {
+        return;
+    }
+    if (nbytes < 4) {
+        usbh_uas_end(uas, nbytes < 0 ? nbytes : -USB_ERR_IO);
+        return;
+    }
+
+    tag = GET_BE16(&iu[2]);
+    if ((tag == 0) || (tag > CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH) || (uas->cmds[tag - 1].state != USBH_UAS_CMD_ACTIVE)) {
+        USB_LOG_ERR("uas iu 0x%02x for unknown tag %u\r\n", iu[0], tag);
+        usbh_uas_end(uas, -USB_ERR_IO);
+        return;
+    }
+    cmd = &uas->cmds[tag - 1];
+
+    switch (iu[0]) {
+        case UAS_IU_ID_READ_READY:
+        case UAS_IU_ID_WRITE_READY:
+            ret = usbh_uas_submit_data(uas, tag, iu[0] == UAS_IU_ID_READ_READY);
+            break;
+        case UAS_IU_ID_SENSE:
+            if (sense->bStatus != SCSI_STATUS_OK) {
+                USB_LOG_ERR("uas tag %u status 0x%02x, sense key 0x%02x\r\n", tag, sense->bStatus, sense->SenseData[2] & 0x0f);
+                if (uas->ret == 0) {
+                    uas->ret = -USB_ERR_INVAL;
+                }
+            }
+            cmd->status_done = true;
+            if (!cmd->data_pending) {
+                usbh_uas_cmd_finish(uas, tag - 1);
+            }
+            break;
+        case UAS_IU_ID_RESPONSE:
+            USB_LOG_ERR("uas tag %u rejected, response code 0x%02x\r\n", tag, ((struct uas_response_iu *)iu)->bResponseCode);
+            ret = -USB_ERR_IO;
+            break;
+        default:
+            USB_LOG_ERR("uas unknown iu 0x%02x\r\n", iu[0]);
+            ret = -USB_ERR_IO;
+            break;
+    }
+
+    if (ret < 0) {
+        usbh_uas_end(uas, ret);
+        return;
+    }
+    if (!uas->done && !uas->status_busy && usbh_uas_status_expected(uas)) {
+        usbh_uas_post_status(uas);
+    }
+}
+
+static void usbh_uas_data_complete(struct usbh_uas *uas, bool in, int nbytes)
+{
+    uint8_t *owner = in ? &uas->datain_tag : &uas->dataout_tag;
+    uint8_t *deferred = in ? &uas->datain_deferred : &uas->dataout_deferred;
+    uint8_t tag = *owner;
+    int ret;
+
+    uas->progress++;
+    *owner = 0;
+    if (uas->done) {
+        return;
+    }
+    if (nbytes < 0) {
+        usbh_uas_end(uas, nbytes);
+        return;
+    }
+
+    uas->cmds[tag - 1].data_pending = false;
+    if (uas->cmds[tag - 1].status_done) {
+        usbh_uas_cmd_finish(uas, tag - 1);
+    }
+
+    if (*deferred && !uas->done) {
+        tag = *deferred;
+        *deferred = 0;
+        ret = usbh_uas_submit_data(uas, tag, in);
+        if (ret < 0) {
+            usbh_uas_end(uas, ret);
+        }
+    }
+}
+
+static void usbh_uas_datain_complete(void *arg, int nbytes)
+{
+    usbh_uas_data_complete((struct usbh_uas *)arg, true, nbytes);
+}
+
+static void usbh_uas_dataout_complete(void *arg, int nbytes)
+{
+    usbh_uas_data_complete((struct usbh_uas *)arg, false, nbytes);
+}
+
+static int usbh_uas_reset_lun(struct usbh_uas *uas)
+{
+    struct uas_task_mgmt_iu *tmf = (struct uas_task_mgmt_iu *)g_uas_cmd_iu[uas->msc_class->sdchar - 'a'][0];
+    uint8_t *iu = g_uas_status_iu[uas->msc_class->sdchar - 'a'];
+    int ret;
+
+    memset(tmf, 0, UAS_TASK_MGMT_IU_SIZEOF);
+    tmf->bIUID = UAS_IU_ID_TASK_MGMT;
+    SET_BE16((uint8_t *)&tmf->wTag, USBH_UAS_TMF_TAG);
+    tmf->bFunction = UAS_TMF_LOGICAL_UNIT_RESET;
+
+    usbh_bulk_urb_fill(&uas->cmd_urb, uas->msc_class->hport, uas->cmd, (uint8_t *)tmf, UAS_TASK_MGMT_IU_SIZEOF, CONFIG_USBHOST_MSC_TIMEOUT, NULL, NULL);
+    ret = usbh_submit_urb(&uas->cmd_urb);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* iu of the aborted commands may still be queued ahead of the response */
+    for (uint8_t i = 0; i < (CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH + 1); i++) {
+        usbh_bulk_urb_fill(&uas->status_urb, uas->msc_class->hport, uas->status, iu, UAS_SENSE_IU_SIZEOF, CONFIG_USBHOST_MSC_TIMEOUT, NULL, NULL);
+        ret = usbh_submit_urb(&uas->status_urb);
+        if (ret < 0) {
+            return ret;
+        }
+        if ((iu[0] == UAS_IU_ID_RESPONSE) && (GET_BE16(&iu[2]) == USBH_UAS_TMF_TAG)) {
+            ret = ((struct uas_response_iu *)iu)->bResponseCode;
+            return ((ret == UAS_RC_TMF_COMPLETE) || (ret == UAS_RC_TMF_SUCCEEDED)) ? 0 : -USB_ERR_IO;
+        }
+    }
+    return -USB_ERR_IO;
+}
+
+/* the device still owns some tags, stop the pipes and abort everything on the logical unit */
+static void usbh_uas_recover(struct usbh_uas *uas)
+{
+    usbh_kill_urb(&uas->cmd_urb);
+    usbh_kill_urb(&uas->status_urb);
+    usbh_kill_urb(&uas->datain_urb);
+    usbh_kill_urb(&uas->dataout_urb);
+
+    if (uas->ret == -USB_ERR_STALL) {
+        usbh_uas_clear_halt(uas, uas->cmd, &uas->cmd_urb);
+        usbh_uas_clear_halt(uas, uas->status, &uas->status_urb);
+        usbh_uas_clear_halt(uas, uas->datain, &uas->datain_urb);
+        usbh_uas_clear_halt(uas, uas->dataout, &uas->dataout_urb);
+    }
+
+    if (usbh_uas_reset_lun(uas) < 0) {
+        USB_LOG_ERR("uas logical unit reset failed\r\n");
+    }
+
+    memset(uas->cmds, 0, sizeof(uas->cmds));
+    uas->active = 0;
+    uas->cmd_busy = false;
+    uas->status_busy = false;
+    uas->datain_tag = 0;
+    uas->dataout_tag = 0;
+    uas->datain_deferred = 0;
+    uas->dataout_deferred = 0;
+}
+
+static int usbh_uas_run(struct usbh_uas *uas, uint32_t timeout)
+{
+    uint32_t progress;
+    size_t flags;
+    bool done;
+    int ret;
+
+    usbh_uas_post_status(uas);
+    if (!uas->done) {
+        usbh_uas_send_next(uas);
+    }
+
+    /* the timeout applies to each iu, not to the whole request */
+    do {
+        progress = uas->progress;
+        ret = usb_osal_sem_take(uas->msc_class->xfer_sem, timeout);
+    } while ((ret < 0) && (progress != uas->progress));
+
+    if (ret < 0) {
+        flags = usb_osal_enter_critical_section();
+        done = uas->done;
+        uas->done = true;
+        usb_osal_leave_critical_section(flags);
+
+        if (done) {
+            usb_osal_sem_take(uas->msc_class->xfer_sem, USB_OSAL_WAITING_FOREVER);
+        } else {
+            uas->ret = -USB_ERR_TIMEOUT;
+        }
+    }
+
+    if (uas->active) {
+        USB_LOG_ERR("uas transfer error: %d\r\n", uas->ret);
+        usbh_uas_recover(uas);
+    }
+    return uas->ret;
+}
+
+int usbh_uas_command(struct usbh_msc *msc_class, const uint8_t *cdb, uint8_t cdb_len, uint8_t *buffer, uint32_t len, bool in, uint32_t timeout)
+{
+    struct usbh_uas *uas = msc_class->uas;
+
+    uas->nsectors = 0;
+    uas->ret = 0;
+    uas->done = false;
+    usbh_uas_queue(uas, 0, cdb, cdb_len, buffer, len, in);
+
+    return usbh_uas_run(uas, timeout);
+}
+
+int usbh_uas_xfer(struct usbh_msc *msc_class, bool write, uint64_t sector, uint8_t *buffer, uint32_t nsectors)
+{
+    struct usbh_uas *uas = msc_class->uas;
+
+    uas->buffer = buffer;
+    uas->sector = sector;
+    uas->nsectors = nsectors;
+    uas->write = write;
+    uas->split = MAX((nsectors + CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH - 1) / CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH,
+                     USBH_UAS_MIN_SPLIT_SIZE / msc_class->blocksize);
+    uas->ret = 0;
+    uas->done = false;
+
+    for (uint8_t i = 0; (i < CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH) && uas->nsectors; i++) {
+        usbh_uas_queue_rw(uas, i);
+    }
+
+    return usbh_uas_run(uas, CONFIG_USBHOST_MSC_TIMEOUT);
+}
+
+int usbh_uas_probe(struct usbh_msc *msc_class)
+{
+    struct usbh_hubport *hport = msc_class->hport;
+    struct usbh_interface *intf = &hport->config.intf[msc_class->intf];
+    struct usbh_uas *uas = &g_uas[msc_class->sdchar - 'a'];
+    struct usb_endpoint_descriptor *ep_desc;
+    uint8_t alt;
+    int ret;
+
+    for (alt = 0; alt < intf->altsetting_num; alt++) {
+        if (intf->altsetting[alt].intf_desc.bInterfaceProtocol == MSC_PROTOCOL_UAS) {
+            break;
+        }
+    }
+    if (alt == intf->altsetting_num) {
+        return -USB_ERR_NOTSUPP;
+    }
+
+    /* super speed uas moves each tag on its own bulk stream, which none of the host controllers provide */
+    if (hport->speed >= USB_SPEED_SUPER) {
+        USB_LOG_INFO("No bulk streams for uas, use bulk-only transport\r\n");
+        return -USB_ERR_NOTSUPP;
+    }
+
+    memset(uas, 0, sizeof(struct usbh_uas));
+    for (uint8_t i = 0; i < intf->altsetting[alt].intf_desc.bNumEndpoints; i++) {
+        ep_desc = &intf->altsetting[alt].ep[i].ep_desc;
+        switch (usbh_uas_pipe_id(hport, msc_class->intf, alt, ep_desc->bEndpointAddress)) {
+            case UAS_PIPE_ID_COMMAND:
+                USBH_EP_INIT(uas->cmd, ep_desc);
+                break;
+            case UAS_PIPE_ID_STATUS:
+                USBH_EP_INIT(uas->status, ep_desc);
+                break;
+            case UAS_PIPE_ID_DATA_IN:
+                USBH_EP_INIT(uas->datain, ep_desc);
+                break;
+            case UAS_PIPE_ID_DATA_OUT:
+                USBH_EP_INIT(uas->dataout, ep_desc);
+                break;
+            default:
+                break;
+        }
+    }
+    if (!uas->cmd || !uas->status || !uas->datain || !uas->dataout) {
+        USB_LOG_ERR("Missing uas pipe usage descriptors\r\n");
+        return -USB_ERR_INVAL;
+    }
+
+    ret = usbh_set_interface(hport, msc_class->intf, intf->altsetting[alt].intf_desc.bAlternateSetting);
+    if (ret < 0) {
+        return ret;
+    }
+
+    uas->msc_class = msc_class;
+    msc_class->uas = uas;
+    return 0;
+}
+
+void usbh_uas_release(struct usbh_msc *msc_class)
+{
+    struct usbh_uas *uas = msc_class->uas;
+
+    usbh_kill_urb(&uas->cmd_urb);
+    usbh_kill_urb(&uas->status_urb);
+    usbh_kill_urb(&uas->datain_urb);
+    usbh_kill_urb(&uas->dataout_urb);
+    msc_class->uas = NULL;
+}
+
+#endif /* CONFIG_USBHOST_MSC_UAS */
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2024, sakumisu
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef USBH_UAS_H
+#define USBH_UAS_H
+
+#include "usb_msc.h"
+
+/* commands kept in flight on a uas device, each one owns a tag */
+#ifndef CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH
+#define CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH 4
+#endif
+
+struct usbh_msc;
+
+struct usbh_uas_cmd {
+    uint8_t *buffer;
+    uint32_t len;
+    bool in;
+    uint8_t state;
+    bool data_pending; /* Data stage submitted and not completed */
+    bool status_done;  /* Sense iu received */
+};
+
+struct usbh_uas {
+    struct usbh_msc *msc_class;
+    struct usb_endpoint_descriptor *cmd;     /* Command pipe, bulk OUT */
+    struct usb_endpoint_descriptor *status;  /* Status pipe, bulk IN */
+    struct usb_endpoint_descriptor *datain;  /* Data-in pipe, bulk IN */
+    struct usb_endpoint_descriptor *dataout; /* Data-out pipe, bulk OUT */
+    struct usbh_urb cmd_urb;
+    struct usbh_urb status_urb;
+    struct usbh_urb datain_urb;
+    struct usbh_urb dataout_urb;
+
+    struct usbh_uas_cmd cmds[CONFIG_USBHOST_MSC_UAS_QUEUE_DEPTH]; /* Tag is index + 1 */
+    uint8_t active;          /* Commands queued or running on the device */
+    bool cmd_busy;
+    bool status_busy;
+    uint8_t datain_tag;      /* Tag owning the data-in pipe, 0 if idle */
+    uint8_t dataout_tag;     /* Tag owning the data-out pipe, 0 if idle */
+    uint8_t datain_deferred; /* READ READY seen while the data-in pipe was still busy */
+    uint8_t dataout_deferred;
+
+    /* remainder of a read or write, refills the tags as they complete */
+    uint8_t *buffer;
+    uint64_t sector;
+    uint32_t nsectors;
+    uint32_t split; /* Sectors per command, spreads a large request over the tags */
+    bool write;
+
+    volatile bool done;
+    volatile uint32_t progress;
+    int ret;
+};
+
+int usbh_uas_probe(struct usbh_msc *msc_class);
+void usbh_uas_release(struct usbh_msc *msc_class);
+int usbh_uas_command(struct usbh_msc *msc_class, const uint8_t *cdb, uint8_t cdb_len, uint8_t *buffer, uint32_t len, bool in, uint32_t timeout);
+int usbh_uas_xfer(struct usbh_msc *msc_class, bool write, uint64_t sector, uint8_t *buffer, uint32_t nsectors);
+
+/* provided by usbh_msc.c, clamps nsectors to one command and returns the cdb length */
+uint8_t usbh_msc_rw_cdb(struct usbh_msc *msc_class, bool write, uint64_t sector, uint32_t *nsectors, uint8_t *cb);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USBH_UAS_H */
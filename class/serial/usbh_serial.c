@@ -19,51 +19,71 @@ static struct usbh_serial g_serial_class[CONFIG_USBHOST_MAX_SERIAL_CLASS];
 static uint32_t g_devinuse = 0;
 static uint32_t g_cdcacm_devinuse = 0;
 
-USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_serial_iobuffer[CONFIG_USBHOST_MAX_SERIAL_CLASS][USB_ALIGN_UP((USBH_SERIAL_RX2_NOCACHE_OFFSET + CONFIG_USBHOST_SERIAL_BULKIN_SIZE), CONFIG_USB_ALIGN_SIZE)];
+USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_serial_iobuffer[CONFIG_USBHOST_MAX_SERIAL_CLASS][USBH_SERIAL_TX_NOCACHE_OFFSET + CONFIG_USBHOST_SERIAL_TX_URB_NUM * USBH_SERIAL_TX_NOCACHE_SIZE];
 
 static void usbh_serial_callback(void *arg, int nbytes);
+static void usbh_serial_tx_callback(void *arg, int nbytes);
+
+static void usbh_serial_free(struct usbh_serial *serial);
 
 static struct usbh_serial *usbh_serial_alloc(bool is_cdcacm)
 {
     uint8_t devno;
-    uint8_t devno2;
+    uint8_t devno2 = 0;
+    size_t flags;
 
+    flags = usb_osal_enter_critical_section();
     for (devno = 0; devno < CONFIG_USBHOST_MAX_SERIAL_CLASS; devno++) {
         if ((g_devinuse & (1U << devno)) == 0) {
-            g_devinuse |= (1U << devno);
-            memset(&g_serial_class[devno], 0, sizeof(struct usbh_serial));
-            g_serial_class[devno].minor = devno;
-            g_serial_class[devno].cdc_minor = -1;
-            g_serial_class[devno].iobuffer = g_serial_iobuffer[devno];
-            g_serial_class[devno].rx_complete_sem = usb_osal_sem_create(0);
-
-            if (g_serial_class[devno].rx_complete_sem == NULL) {
-                g_devinuse &= ~(1U << devno);
-                return NULL;
+            break;
+        }
+    }
+    if (is_cdcacm) {
+        for (devno2 = 0; devno2 < CONFIG_USBHOST_MAX_SERIAL_CLASS; devno2++) {
+            if ((g_cdcacm_devinuse & (1U << devno2)) == 0) {
+                break;
             }
+        }
+    }
+    if ((devno == CONFIG_USBHOST_MAX_SERIAL_CLASS) || (devno2 == CONFIG_USBHOST_MAX_SERIAL_CLASS)) {
+        usb_osal_leave_critical_section(flags);
+        return NULL;
+    }
+    g_devinuse |= (1U << devno);
+    if (is_cdcacm) {
+        g_cdcacm_devinuse |= (1U << devno2);
+    }
+    usb_osal_leave_critical_section(flags);
 
-            if (is_cdcacm) {
-                for (devno2 = 0; devno2 < CONFIG_USBHOST_MAX_SERIAL_CLASS; devno2++) {
-                    if ((g_cdcacm_devinuse & (1U << devno2)) == 0) {
-                        g_cdcacm_devinuse |= (1U << devno2);
-                        g_serial_class[devno].cdc_minor = devno2;
-                        return &g_serial_class[devno];
-                    }
-                }
+    memset(&g_serial_class[devno], 0, sizeof(struct usbh_serial));
+    g_serial_class[devno].minor = devno;
+    g_serial_class[devno].cdc_minor = is_cdcacm ? devno2 : -1;
+    g_serial_class[devno].iobuffer = g_serial_iobuffer[devno];
+    g_serial_class[devno].rx_complete_sem = usb_osal_sem_create(0);
+    g_serial_class[devno].tx_complete_sem = usb_osal_sem_create(0);
 
-                g_devinuse &= ~(1U << devno);
-                return NULL;
-            } else {
-                return &g_serial_class[devno];
-            }
-        }
+    if ((g_serial_class[devno].rx_complete_sem == NULL) || (g_serial_class[devno].tx_complete_sem == NULL)) {
+        usbh_serial_free(&g_serial_class[devno]);
+        return NULL;
     }
-    return NULL;
+    return &g_serial_class[devno];
 }
 
 static void usbh_serial_free(struct usbh_serial *serial)
 {
     uint8_t devno = serial->minor;
+    size_t flags;
+
+    if (g_serial_class[devno].rx_complete_sem) {
+        usb_osal_sem_delete(g_serial_class[devno].rx_complete_sem);
+        g_serial_class[devno].rx_complete_sem = NULL;
+    }
+    if (g_serial_class[devno].tx_complete_sem) {
+        usb_osal_sem_delete(g_serial_class[devno].tx_complete_sem);
+        g_serial_class[devno].tx_complete_sem = NULL;
+    }
+
+    flags = usb_osal_enter_critical_section();
     if (devno < 32) {
         g_devinuse &= ~(1U << devno);
     }
@@ -71,11 +91,7 @@ static void usbh_serial_free(struct usbh_serial *serial)
     if (serial->cdc_minor >= 0) {
         g_cdcacm_devinuse &= ~(1U << serial->cdc_minor);
     }
-
-    if (g_serial_class[devno].rx_complete_sem) {
-        usb_osal_sem_delete(g_serial_class[devno].rx_complete_sem);
-        g_serial_class[devno].rx_complete_sem = NULL;
-    }
+    usb_osal_leave_critical_section(flags);
 }
 
 static int usbh_serial_rx_restart(struct usbh_serial *serial)
@@ -141,6 +157,212 @@ static void usbh_serial_callback(void *arg, int nbytes)
     }
 }
 
+/*
+ * A controller that keeps the toggle in the urb instead of the open pipe starts every urb with
+ * the toggle the previous one leaves behind, each packet flips it.
+ */
+static void usbh_serial_tx_toggle(struct usbh_serial *serial, struct usbh_urb *urb)
+{
+    uint16_t mps = USB_GET_MAXPACKETSIZE(serial->bulkout->wMaxPacketSize);
+    uint32_t packets;
+
+    packets = urb->transfer_buffer_length ? ((urb->transfer_buffer_length + mps - 1) / mps) : 1;
+    urb->data_toggle = serial->tx_toggle;
+    serial->tx_toggle ^= (packets & 1);
+}
+
+/* books the filled urb at tx_head as in flight, with interrupts off */
+static void usbh_serial_tx_queue(struct usbh_serial *serial, uint32_t len)
+{
+    usbh_serial_tx_toggle(serial, &serial->bulkout_urb[serial->tx_head]);
+    serial->tx_len[serial->tx_head] = len;
+    serial->tx_queued += len;
+    serial->tx_head = (serial->tx_head + 1) % CONFIG_USBHOST_SERIAL_TX_URB_NUM;
+    serial->tx_inflight++;
+}
+
+/* takes back the urb booked last, its submit failed */
+static void usbh_serial_tx_unqueue(struct usbh_serial *serial)
+{
+    serial->tx_head = (serial->tx_head + CONFIG_USBHOST_SERIAL_TX_URB_NUM - 1) % CONFIG_USBHOST_SERIAL_TX_URB_NUM;
+    serial->tx_queued -= serial->tx_len[serial->tx_head];
+    serial->tx_toggle = serial->bulkout_urb[serial->tx_head].data_toggle;
+    serial->tx_inflight--;
+}
+
+/*
+ * Fills a free urb with the ring data no urb carries yet, with interrupts off. The data is sent
+ * from the ring itself and only dropped once the urb completes, controllers without sg support
+ * copy it into the nocache tx buffer of the urb.
+ */
+static struct usbh_urb *usbh_serial_tx_claim(struct usbh_serial *serial)
+{
+    struct usbh_urb *urb = &serial->bulkout_urb[serial->tx_head];
+    struct usbh_sg *sg = serial->tx_sg[serial->tx_head];
+    uint32_t num_sgs = 0;
+    uint32_t start;
+    uint32_t offset;
+    uint32_t used;
+
+    if (serial->tx_failed || (serial->tx_inflight >= serial->tx_urb_num)) {
+        return NULL;
+    }
+
+    start = serial->tx_rb.out + serial->tx_queued;
+    used = MIN(serial->tx_rb.in - start, CONFIG_USBHOST_SERIAL_BULKOUT_SIZE);
+    if (used) {
+        offset = start & serial->tx_rb.mask;
+        sg[0].buffer = (uint8_t *)serial->tx_rb.pool + offset;
+        sg[0].length = MIN(used, serial->tx_rb.mask + 1 - offset);
+        num_sgs = 1;
+        if (used > sg[0].length) {
+            /* the rest wrapped to the start of the pool */
+            sg[1].buffer = serial->tx_rb.pool;
+            sg[1].length = used - sg[0].length;
+            num_sgs = 2;
+        }
+    } else if (!serial->tx_zlp || serial->tx_inflight) {
+        return NULL;
+    }
+    /* more data ends the transfer as well as a zlp */
+    serial->tx_zlp = false;
+
+    usbh_bulk_urb_fill_sg(urb, serial->hport, serial->bulkout, sg, num_sgs,
+                          &serial->iobuffer[USBH_SERIAL_TX_NOCACHE_OFFSET + serial->tx_head * USBH_SERIAL_TX_NOCACHE_SIZE],
+                          0, usbh_serial_tx_callback, serial);
+    usbh_serial_tx_queue(serial, used);
+    return urb;
+}
+
+/*
+ * Keeps up to tx_urb_num urbs in flight with everything written so far. One caller submits at a
+ * time so urbs reach the endpoint in ring order, others only ask it for another pass. The submit
+ * itself runs with interrupts on.
+ */
+static int usbh_serial_tx_pump(struct usbh_serial *serial)
+{
+    struct usbh_urb *urb;
+    size_t flags;
+    int ret = 0;
+
+    flags = usb_osal_enter_critical_section();
+    if (serial->tx_pumping) {
+        serial->tx_repump = true;
+        usb_osal_leave_critical_section(flags);
+        return 0;
+    }
+    serial->tx_pumping = true;
+    do {
+        serial->tx_repump = false;
+        while ((urb = usbh_serial_tx_claim(serial)) != NULL) {
+            usb_osal_leave_critical_section(flags);
+            ret = usbh_submit_urb(urb);
+            flags = usb_osal_enter_critical_section();
+            if (ret < 0) {
+                usbh_serial_tx_unqueue(serial);
+                if (serial->tx_inflight) {
+                    /* the controller cannot queue another urb on this endpoint, stay with what it took */
+                    serial->tx_urb_num = serial->tx_inflight;
+                    ret = 0;
+                } else {
+                    /* nothing in flight, queued data is dropped */
+                    usb_ringbuffer_reset_read(&serial->tx_rb);
+                    serial->tx_queued = 0;
+                    serial->tx_zlp = false;
+                }
+                break;
+            }
+        }
+    } while (serial->tx_repump && (ret == 0));
+    serial->tx_pumping = false;
+    usb_osal_leave_critical_section(flags);
+    return ret;
+}
+
+static void usbh_serial_tx_callback(void *arg, int nbytes)
+{
+    struct usbh_serial *serial = (struct usbh_serial *)arg;
+    uint8_t index;
+    size_t flags;
+    int ret;
+
+    if (!serial)
+        return;
+
+    flags = usb_osal_enter_critical_section();
+    /* urbs of one endpoint complete in submit order */
+    index = serial->tx_tail;
+    serial->tx_tail = (index + 1) % CONFIG_USBHOST_SERIAL_TX_URB_NUM;
+    serial->tx_inflight--;
+    serial->tx_direct = false;
+    usb_ringbuffer_drop(&serial->tx_rb, serial->tx_len[index]);
+    serial->tx_queued -= serial->tx_len[index];
+    if (nbytes >= 0) {
+        /* a transfer of whole packets is only terminated by a short one */
+        serial->tx_zlp = (nbytes > 0) && ((nbytes % USB_GET_MAXPACKETSIZE(serial->bulkout->wMaxPacketSize)) == 0) && (serial->tx_inflight == 0);
+    } else {
+        serial->tx_failed = true;
+        serial->tx_errorcode = nbytes;
+    }
+    if (serial->tx_failed && (serial->tx_inflight == 0)) {
+        /* queued data is dropped, the next write or drain reports the error */
+        usb_ringbuffer_reset_read(&serial->tx_rb);
+        serial->tx_queued = 0;
+        serial->tx_zlp = false;
+        serial->tx_failed = false;
+    }
+    usb_osal_leave_critical_section(flags);
+
+    if (nbytes >= 0) {
+        ret = usbh_serial_tx_pump(serial);
+        if (ret < 0) {
+            serial->tx_errorcode = ret;
+            nbytes = ret;
+        }
+    }
+
+    if ((nbytes < 0) && (nbytes != -USB_ERR_SHUTDOWN)) {
+        USB_LOG_ERR("serial tx error: %d\n", nbytes);
+    }
+    usb_osal_sem_give(serial->tx_complete_sem);
+}
+
+/* nothing queued, in flight or owed */
+static bool usbh_serial_tx_idle(struct usbh_serial *serial)
+{
+    return !serial->tx_inflight && !serial->tx_pumping && !serial->tx_zlp && usb_ringbuffer_check_empty(&serial->tx_rb);
+}
+
+static void usbh_serial_tx_reset(struct usbh_serial *serial)
+{
+    if (serial->bulkout) {
+        for (uint8_t i = 0; i < CONFIG_USBHOST_SERIAL_TX_URB_NUM; i++) {
+            usbh_kill_urb(&serial->bulkout_urb[i]);
+        }
+    }
+    usb_ringbuffer_reset(&serial->tx_rb);
+    usb_osal_sem_reset(serial->tx_complete_sem);
+    serial->tx_errorcode = 0;
+    serial->tx_queued = 0;
+    serial->tx_head = 0;
+    serial->tx_tail = 0;
+    serial->tx_urb_num = CONFIG_USBHOST_SERIAL_TX_URB_NUM;
+    serial->tx_inflight = 0;
+    serial->tx_zlp = false;
+    serial->tx_direct = false;
+    serial->tx_failed = false;
+    serial->tx_pumping = false;
+    serial->tx_repump = false;
+}
+
+static int usbh_serial_tx_error(struct usbh_serial *serial)
+{
+    int ret = serial->tx_errorcode;
+
+    serial->tx_errorcode = 0;
+    return ret;
+}
+
 struct usbh_serial *usbh_serial_probe(struct usbh_hubport *hport, uint8_t intf,
                                       const struct usbh_serial_driver *driver)
 {
@@ -204,6 +426,9 @@ struct usbh_serial *usbh_serial_probe(struct usbh_hubport *hport, uint8_t intf,
         snprintf(hport->config.intf[intf].devname, CONFIG_USBHOST_DEV_NAMELEN, DEV_FORMAT_VENDOR, serial->minor);
     }
 
+    usbh_pipe_open(hport, serial->bulkin);
+    usbh_pipe_open(hport, serial->bulkout);
+
     hport->config.intf[intf].priv = serial;
     USB_LOG_INFO("Register Serial Class: %s (%s)\r\n", hport->config.intf[intf].devname, driver->driver_name);
 
@@ -219,6 +444,9 @@ void usbh_serial_remove(struct usbh_serial *serial)
 
     usbh_serial_close(serial);
 
+    usbh_pipe_close(serial->hport, serial->bulkin);
+    usbh_pipe_close(serial->hport, serial->bulkout);
+
     if (serial->driver && serial->driver->detach) {
         serial->driver->detach(serial);
     }
@@ -255,6 +483,8 @@ struct usbh_serial *usbh_serial_open(const char *devname, uint32_t open_flags)
     }
 
     usb_ringbuffer_init(&serial->rx_rb, serial->rx_rb_pool, CONFIG_USBHOST_SERIAL_RX_SIZE);
+    usb_ringbuffer_init(&serial->tx_rb, serial->tx_rb_pool, CONFIG_USBHOST_SERIAL_TX_SIZE);
+    usbh_serial_tx_reset(serial);
 
     serial->ref_count++;
     serial->open_flags = open_flags;
@@ -275,9 +505,7 @@ int usbh_serial_close(struct usbh_serial *serial)
     if (serial->bulkin) {
         usbh_kill_urb(&serial->bulkin_urb);
     }
-    if (serial->bulkout) {
-        usbh_kill_urb(&serial->bulkout_urb);
-    }
+    usbh_serial_tx_reset(serial);
 
     if (serial && serial->driver && serial->driver->set_flow_control && serial->rtscts) {
         serial->driver->set_flow_control(serial, false);
@@ -364,9 +592,7 @@ int usbh_serial_control(struct usbh_serial *serial, int cmd, void *arg)
             if (serial->bulkin) {
                 usbh_kill_urb(&serial->bulkin_urb);
             }
-            if (serial->bulkout) {
-                usbh_kill_urb(&serial->bulkout_urb);
-            }
+            usbh_serial_tx_reset(serial);
 
             if (serial->driver && serial->driver->set_line_coding) {
                 ret = serial->driver->set_line_coding(serial, &line_coding);
@@ -463,8 +689,12 @@ int usbh_serial_control(struct usbh_serial *serial, int cmd, void *arg)
 
 int usbh_serial_write(struct usbh_serial *serial, const void *buffer, uint32_t buflen)
 {
+    const uint8_t *data = (const uint8_t *)buffer;
+    struct usbh_urb *urb = NULL;
+    uint32_t offset = 0;
+    uint32_t len;
+    size_t flags;
     int ret;
-    struct usbh_urb *urb;
 
     if (!serial || !serial->hport || !serial->hport->connected || !serial->bulkout) {
         return -USB_ERR_INVAL;
@@ -474,14 +704,62 @@ int usbh_serial_write(struct usbh_serial *serial, const void *buffer, uint32_t b
         return -USB_ERR_NODEV;
     }
 
-    urb = &serial->bulkout_urb;
+    if (serial->tx_errorcode < 0) {
+        return usbh_serial_tx_error(serial);
+    }
 
-    usbh_bulk_urb_fill(urb, serial->hport, serial->bulkout, (uint8_t *)buffer, buflen, 0xffffffff, NULL, NULL);
-    ret = usbh_submit_urb(urb);
-    if (ret == 0) {
-        ret = urb->actual_length;
+    /* large blocking writes with nothing queued are sent from the caller's buffer */
+    if (!(serial->open_flags & USBH_SERIAL_O_NONBLOCK) && (buflen >= CONFIG_USBHOST_SERIAL_BULKOUT_SIZE) &&
+        (((uintptr_t)buffer & (CONFIG_USB_ALIGN_SIZE - 1)) == 0)) {
+        flags = usb_osal_enter_critical_section();
+        if (usbh_serial_tx_idle(serial)) {
+            urb = &serial->bulkout_urb[serial->tx_head];
+            usbh_bulk_urb_fill(urb, serial->hport, serial->bulkout, (uint8_t *)buffer, buflen,
+                               0, usbh_serial_tx_callback, serial);
+            usbh_serial_tx_queue(serial, 0);
+            serial->tx_direct = true;
+        }
+        usb_osal_leave_critical_section(flags);
     }
-    return ret;
+
+    if (urb) {
+        ret = usbh_submit_urb(urb);
+        if (ret < 0) {
+            flags = usb_osal_enter_critical_section();
+            usbh_serial_tx_unqueue(serial);
+            serial->tx_direct = false;
+            usb_osal_leave_critical_section(flags);
+            return ret;
+        }
+        while (serial->tx_direct) {
+            usb_osal_sem_take(serial->tx_complete_sem, USB_OSAL_WAITING_FOREVER);
+        }
+        if (serial->tx_errorcode < 0) {
+            return usbh_serial_tx_error(serial);
+        }
+        return buflen;
+    }
+
+    while (1) {
+        len = usb_ringbuffer_write(&serial->tx_rb, (void *)&data[offset], buflen - offset);
+        offset += len;
+        if (len) {
+            ret = usbh_serial_tx_pump(serial);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        if ((offset == buflen) || (serial->open_flags & USBH_SERIAL_O_NONBLOCK)) {
+            break;
+        }
+
+        /* ring is full, every completed urb makes room */
+        usb_osal_sem_take(serial->tx_complete_sem, USB_OSAL_WAITING_FOREVER);
+        if (serial->tx_errorcode < 0) {
+            return usbh_serial_tx_error(serial);
+        }
+    }
+    return offset;
 }
 
 int usbh_serial_read(struct usbh_serial *serial, void *buffer, uint32_t buflen)
@@ -520,9 +798,45 @@ int usbh_serial_read(struct usbh_serial *serial, void *buffer, uint32_t buflen)
     }
 }
 
+int usbh_serial_drain(struct usbh_serial *serial, uint32_t timeout)
+{
+    int ret;
+
+    if (!serial || !serial->hport || !serial->bulkout) {
+        return -USB_ERR_INVAL;
+    }
+
+    if (serial->ref_count == 0) {
+        return -USB_ERR_NODEV;
+    }
+
+    while (!usbh_serial_tx_idle(serial)) {
+        ret = usb_osal_sem_take(serial->tx_complete_sem, timeout == 0 ? USB_OSAL_WAITING_FOREVER : timeout);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return usbh_serial_tx_error(serial);
+}
+
+int usbh_serial_flush(struct usbh_serial *serial)
+{
+    if (!serial || !serial->hport) {
+        return -USB_ERR_INVAL;
+    }
+
+    if (serial->ref_count == 0) {
+        return -USB_ERR_NODEV;
+    }
+
+    usbh_serial_tx_reset(serial);
+    return 0;
+}
+
 int usbh_serial_cdc_write_async(struct usbh_serial *serial, uint8_t *buffer, uint32_t buflen, usbh_complete_callback_t complete, void *arg)
 {
     struct usbh_urb *urb;
+    int ret;
 
     if (!serial || !serial->hport || !serial->hport->connected || !serial->bulkout || !complete || serial->line_coding.dwDTERate) {
         return -USB_ERR_INVAL;
@@ -532,11 +846,20 @@ int usbh_serial_cdc_write_async(struct usbh_serial *serial, uint8_t *buffer, uin
         return -USB_ERR_NODEV;
     }
 
-    urb = &serial->bulkout_urb;
+    if (!usbh_serial_tx_idle(serial)) {
+        return -USB_ERR_BUSY;
+    }
+
+    urb = &serial->bulkout_urb[serial->tx_head];
 
     usbh_bulk_urb_fill(urb, serial->hport, serial->bulkout, buffer, buflen,
                        0, complete, serial);
-    return usbh_submit_urb(urb);
+    usbh_serial_tx_toggle(serial, urb);
+    ret = usbh_submit_urb(urb);
+    if (ret < 0) {
+        serial->tx_toggle = urb->data_toggle;
+    }
+    return ret;
 }
 
 int usbh_serial_cdc_read_async(struct usbh_serial *serial, uint8_t *buffer, uint32_t buflen, usbh_complete_callback_t complete, void *arg)
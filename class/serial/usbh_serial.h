@@ -13,17 +13,41 @@
 #define CONFIG_USBHOST_SERIAL_BULKIN_SIZE 512
 #endif
 
+/* largest batch of tx ring data sent with one bulk out urb */
+#ifndef CONFIG_USBHOST_SERIAL_BULKOUT_SIZE
+#define CONFIG_USBHOST_SERIAL_BULKOUT_SIZE 512
+#endif
+
+#ifndef CONFIG_USBHOST_SERIAL_TX_SIZE
+#define CONFIG_USBHOST_SERIAL_TX_SIZE 2048
+#endif
+
+/* bulk out urbs queued from the tx ring at once */
+#ifndef CONFIG_USBHOST_SERIAL_TX_URB_NUM
+#define CONFIG_USBHOST_SERIAL_TX_URB_NUM 2
+#endif
+
 #define USBH_SERIAL_CTRL_NOCACHE_OFFSET 0
 #define USBH_SERIAL_CTRL_NOCACHE_SIZE   32
 #define USBH_SERIAL_INT_NOCACHE_OFFSET  USB_ALIGN_UP(USBH_SERIAL_CTRL_NOCACHE_SIZE, CONFIG_USB_ALIGN_SIZE)
 #define USBH_SERIAL_INT_NOCACHE_SIZE    32
 #define USBH_SERIAL_RX_NOCACHE_OFFSET   USB_ALIGN_UP((USBH_SERIAL_INT_NOCACHE_OFFSET + USBH_SERIAL_INT_NOCACHE_SIZE), CONFIG_USB_ALIGN_SIZE)
 #define USBH_SERIAL_RX2_NOCACHE_OFFSET  USB_ALIGN_UP((USBH_SERIAL_RX_NOCACHE_OFFSET + CONFIG_USBHOST_SERIAL_BULKIN_SIZE), CONFIG_USB_ALIGN_SIZE)
+#define USBH_SERIAL_TX_NOCACHE_OFFSET   USB_ALIGN_UP((USBH_SERIAL_RX2_NOCACHE_OFFSET + CONFIG_USBHOST_SERIAL_BULKIN_SIZE), CONFIG_USB_ALIGN_SIZE)
+#define USBH_SERIAL_TX_NOCACHE_SIZE     USB_ALIGN_UP(CONFIG_USBHOST_SERIAL_BULKOUT_SIZE, CONFIG_USB_ALIGN_SIZE)
 
 #if CONFIG_USBHOST_SERIAL_RX_SIZE < CONFIG_USBHOST_SERIAL_BULKIN_SIZE
 #error "CONFIG_USBHOST_SERIAL_RX_SIZE must be greater than or equal to CONFIG_USBHOST_SERIAL_BULKIN_SIZE"
 #endif
 
+#if (CONFIG_USBHOST_SERIAL_TX_SIZE < 2) || (CONFIG_USBHOST_SERIAL_TX_SIZE & (CONFIG_USBHOST_SERIAL_TX_SIZE - 1))
+#error "CONFIG_USBHOST_SERIAL_TX_SIZE must be a power of 2"
+#endif
+
+#if (CONFIG_USBHOST_SERIAL_TX_URB_NUM < 1) || (CONFIG_USBHOST_SERIAL_TX_URB_NUM > 255)
+#error "CONFIG_USBHOST_SERIAL_TX_URB_NUM must be between 1 and 255"
+#endif
+
 #define USBH_SERIAL_DATABITS_5 5
 #define USBH_SERIAL_DATABITS_6 6
 #define USBH_SERIAL_DATABITS_7 7
@@ -137,7 +161,7 @@ struct usbh_serial {
 
     struct usb_endpoint_descriptor *bulkin;  /* Bulk IN endpoint */
     struct usb_endpoint_descriptor *bulkout; /* Bulk OUT endpoint */
-    struct usbh_urb bulkout_urb;
+    struct usbh_urb bulkout_urb[CONFIG_USBHOST_SERIAL_TX_URB_NUM];
     struct usbh_urb bulkin_urb;
 
     const struct usbh_serial_driver *driver;
@@ -150,6 +174,24 @@ struct usbh_serial {
     usbh_serial_rx_complete_callback_t rx_complete_callback;
     bool rx_pending;
 
+    usb_ringbuffer_t tx_rb;
+    uint8_t tx_rb_pool[CONFIG_USBHOST_SERIAL_TX_SIZE];
+    struct usbh_sg tx_sg[CONFIG_USBHOST_SERIAL_TX_URB_NUM][2]; /* Ring regions of each urb, the second one after a wrap */
+    uint32_t tx_len[CONFIG_USBHOST_SERIAL_TX_URB_NUM];        /* Ring bytes each urb carries */
+    uint32_t tx_queued;        /* Ring bytes owned by urbs in flight, they are dropped in order on completion */
+    usb_osal_sem_t tx_complete_sem;
+    int tx_errorcode;
+    uint8_t tx_head;           /* Next bulk out urb to submit */
+    uint8_t tx_tail;           /* Oldest bulk out urb in flight */
+    uint8_t tx_urb_num;        /* Urbs the controller takes on the endpoint, lowered if it refuses more */
+    uint8_t tx_toggle;         /* Toggle the next urb starts with, for controllers that keep it in the urb */
+    volatile uint8_t tx_inflight; /* Bulk out urbs in flight */
+    volatile bool tx_zlp;      /* The last transfer ended on a packet boundary, a zlp is owed */
+    volatile bool tx_direct;   /* It sends the caller's buffer, not the ring */
+    bool tx_failed;            /* An urb failed, the rest of the ring is dropped once the others are back */
+    bool tx_pumping;           /* Someone is submitting urbs from the ring */
+    bool tx_repump;            /* More data or a free urb showed up while submitting */
+
     void *priv;      /* Private Data */
     void *user_data; /* User Data */
 };
@@ -164,6 +206,8 @@ int usbh_serial_close(struct usbh_serial *serial);
 int usbh_serial_control(struct usbh_serial *serial, int cmd, void *arg);
 int usbh_serial_write(struct usbh_serial *serial, const void *buffer, uint32_t buflen);
 int usbh_serial_read(struct usbh_serial *serial, void *buffer, uint32_t buflen);
+int usbh_serial_drain(struct usbh_serial *serial, uint32_t timeout);
+int usbh_serial_flush(struct usbh_serial *serial);
 
 /* cdc only api */
 int usbh_serial_cdc_write_async(struct usbh_serial *serial, uint8_t *buffer, uint32_t buflen, usbh_complete_callback_t complete, void *arg);
@@ -10,26 +10,33 @@ static uint32_t g_devinuse = 0;
 static struct usbh_xxx *usbh_xxx_class_alloc(void)
 {
     uint8_t devno;
+    size_t flags;
 
+    flags = usb_osal_enter_critical_section();
     for (devno = 0; devno < CONFIG_USBHOST_MAX_CUSTOM_CLASS; devno++) {
         if ((g_devinuse & (1U << devno)) == 0) {
             g_devinuse |= (1U << devno);
+            usb_osal_leave_critical_section(flags);
             memset(&g_xxx_class[devno], 0, sizeof(struct usbh_xxx));
             g_xxx_class[devno].minor = devno;
             return &g_xxx_class[devno];
         }
     }
+    usb_osal_leave_critical_section(flags);
     return NULL;
 }
 
 static void usbh_xxx_class_free(struct usbh_xxx *xxx_class)
 {
     uint8_t devno = xxx_class->minor;
+    size_t flags;
 
+    memset(xxx_class, 0, sizeof(struct usbh_xxx));
     if (devno < 32) {
+        flags = usb_osal_enter_critical_section();
         g_devinuse &= ~(1U << devno);
+        usb_osal_leave_critical_section(flags);
     }
-    memset(xxx_class, 0, sizeof(struct usbh_xxx));
 }
 
 static int usbh_xxx_connect(struct usbh_hubport *hport, uint8_t intf)
@@ -35,26 +35,33 @@ static uint32_t g_devinuse = 0;
 static struct usbh_video *usbh_video_class_alloc(void)
 {
     uint8_t devno;
+    size_t flags;
 
+    flags = usb_osal_enter_critical_section();
     for (devno = 0; devno < CONFIG_USBHOST_MAX_VIDEO_CLASS; devno++) {
         if ((g_devinuse & (1U << devno)) == 0) {
             g_devinuse |= (1U << devno);
+            usb_osal_leave_critical_section(flags);
             memset(&g_video_class[devno], 0, sizeof(struct usbh_video));
             g_video_class[devno].minor = devno;
             return &g_video_class[devno];
         }
     }
+    usb_osal_leave_critical_section(flags);
     return NULL;
 }
 
 static void usbh_video_class_free(struct usbh_video *video_class)
 {
     uint8_t devno = video_class->minor;
+    size_t flags;
 
+    memset(video_class, 0, sizeof(struct usbh_video));
     if (devno < 32) {
+        flags = usb_osal_enter_critical_section();
         g_devinuse &= ~(1U << devno);
+        usb_osal_leave_critical_section(flags);
     }
-    memset(video_class, 0, sizeof(struct usbh_video));
 }
 
 int usbh_video_get(struct usbh_video *video_class, uint8_t request, uint8_t intf, uint8_t entity_id, uint8_t cs, uint8_t *buf, uint16_t len)
@@ -277,6 +284,9 @@ dev_found:
     USB_LOG_INFO("Open video and select formatidx:%u, frameidx:%u, altsetting:%u\r\n", formatidx, frameidx, altsetting);
     video_class->is_opened = true;
     video_class->current_format = format_type;
+    video_class->stream.frame_format = format_type;
+    video_class->stream.width = wWidth;
+    video_class->stream.height = wHeight;
     return ret;
 
 errout:
@@ -296,6 +306,7 @@ int usbh_video_close(struct usbh_video *video_class)
 
     USB_LOG_INFO("Close video device\r\n");
 
+    usbh_video_stream_stop(video_class);
     video_class->is_opened = false;
 
     if (video_class->is_bulk) {
@@ -320,6 +331,136 @@ int usbh_video_close(struct usbh_video *video_class)
     return ret;
 }
 
+static void usbh_video_frame_done(struct usbh_video *video_class)
+{
+    struct usbh_videostreaming *stream = &video_class->stream;
+
+    if (!stream->frame_error && stream->bufoffset) {
+        stream->frame->frame_format = stream->frame_format;
+        stream->frame->frame_size = stream->bufoffset;
+        video_class->frame_callback(video_class, stream->frame);
+    }
+    stream->bufoffset = 0;
+    stream->frame_error = false;
+}
+
+/* the packet is re-armed once this returns, its payload is copied into the frame here */
+static void usbh_video_isoin_complete(void *arg, struct usbh_iso_frame_packet *iso_packet, uint32_t index)
+{
+    struct usbh_video *video_class = (struct usbh_video *)arg;
+    struct usbh_videostreaming *stream = &video_class->stream;
+    struct video_payload_header *header = (struct video_payload_header *)iso_packet->transfer_buffer;
+    uint32_t len = iso_packet->actual_length;
+    uint8_t fid;
+
+    (void)index;
+
+    if (iso_packet->errorcode < 0) {
+        stream->frame_error = true;
+        return;
+    }
+
+    /* packets without payload keep the stream going */
+    if (len == 0) {
+        return;
+    }
+
+    if ((len < 2) || (header->bHeaderLength < 2) || (header->bHeaderLength > len)) {
+        stream->frame_error = true;
+        return;
+    }
+
+    fid = header->headerInfoUnion.headerInfoBitmap.FID;
+    if (fid != stream->last_fid) {
+        if (stream->last_fid == 0xff) {
+            /* joined in the middle of a frame, wait for the next one */
+            stream->frame_error = true;
+        } else if (stream->bufoffset) {
+            /* fid toggled without eof */
+            usbh_video_frame_done(video_class);
+        }
+        stream->last_fid = fid;
+    }
+
+    if (header->headerInfoUnion.headerInfoBitmap.ERR) {
+        stream->frame_error = true;
+    }
+
+    len -= header->bHeaderLength;
+    if ((stream->bufoffset + len) > stream->frame->frame_bufsize) {
+        stream->frame_error = true;
+    } else if (!stream->frame_error) {
+        memcpy(&stream->frame->frame_buf[stream->bufoffset], &iso_packet->transfer_buffer[header->bHeaderLength], len);
+        stream->bufoffset += len;
+    }
+
+    if (header->headerInfoUnion.headerInfoBitmap.EOI) {
+        usbh_video_frame_done(video_class);
+    }
+}
+
+int usbh_video_stream_start(struct usbh_video *video_class,
+                            struct usbh_urb *urb,
+                            uint8_t *iso_buf,
+                            uint32_t num_of_iso_packets,
+                            struct usbh_videoframe *frame,
+                            usbh_video_frame_callback_t frame_callback)
+{
+    uint32_t stride;
+    int ret;
+
+    if (!video_class || !video_class->hport || !urb || !iso_buf || !num_of_iso_packets || !frame || !frame_callback) {
+        return -USB_ERR_INVAL;
+    }
+
+    if (!video_class->is_opened || video_class->is_bulk || !video_class->isoin) {
+        return -USB_ERR_INVAL;
+    }
+
+    if (video_class->isoin_urb) {
+        return -USB_ERR_BUSY;
+    }
+
+    video_class->stream.frame = frame;
+    video_class->stream.bufoffset = 0;
+    video_class->stream.last_fid = 0xff;
+    video_class->stream.frame_error = false;
+    video_class->frame_callback = frame_callback;
+
+    stride = USB_ALIGN_UP(video_class->isoin_mps, CONFIG_USB_ALIGN_SIZE);
+    for (uint32_t i = 0; i < num_of_iso_packets; i++) {
+        urb->iso_packet[i].transfer_buffer = &iso_buf[i * stride];
+        urb->iso_packet[i].transfer_buffer_length = video_class->isoin_mps;
+    }
+
+    /* the packets are re-armed by the hcd until usbh_video_stream_stop */
+    usbh_iso_urb_fill(urb, video_class->hport, video_class->isoin, num_of_iso_packets, usbh_video_isoin_complete, NULL, video_class);
+    video_class->isoin_urb = urb;
+
+    ret = usbh_submit_urb(urb);
+    if (ret < 0) {
+        video_class->isoin_urb = NULL;
+    }
+    return ret;
+}
+
+int usbh_video_stream_stop(struct usbh_video *video_class)
+{
+    struct usbh_urb *urb;
+
+    if (!video_class) {
+        return -USB_ERR_INVAL;
+    }
+
+    urb = video_class->isoin_urb;
+    if (urb == NULL) {
+        return 0;
+    }
+
+    video_class->isoin_urb = NULL;
+    return usbh_kill_urb(urb);
+}
+
 void usbh_video_list_info(struct usbh_video *video_class)
 {
     struct usb_endpoint_descriptor *ep_desc;
@@ -518,6 +659,7 @@ static int usbh_video_ctrl_disconnect(struct usbh_hubport *hport, uint8_t intf)
         if (hport->config.intf[intf].devname[0] != '\0') {
             usb_osal_thread_schedule_other();
             USB_LOG_INFO("Unregister Video Class:%s\r\n", hport->config.intf[intf].devname);
+            usbh_video_stream_stop(video_class);
             usbh_video_stop(video_class);
         }
 
@@ -44,8 +44,19 @@ struct usbh_videostreaming {
     uint32_t bufoffset;
     uint16_t width;
     uint16_t height;
+    uint8_t last_fid;  /* frame identifier of the frame being received, 0xff until the first one starts */
+    bool frame_error;  /* frame is dropped at its end */
 };
 
+struct usbh_video;
+
+/* called from the iso completion for every complete frame, frame_buf may be swapped for the next one */
+typedef void (*usbh_video_frame_callback_t)(struct usbh_video *video_class, struct usbh_videoframe *frame);
+
+/* iso_buf size for usbh_video_stream_start, every packet starts on CONFIG_USB_ALIGN_SIZE */
+#define USBH_VIDEO_ISO_BUFSIZE(video_class, num_of_iso_packets) \
+    ((num_of_iso_packets) * USB_ALIGN_UP((video_class)->isoin_mps, CONFIG_USB_ALIGN_SIZE))
+
 struct usbh_video {
     struct usbh_hubport *hport;
     struct usb_endpoint_descriptor *isoin;  /* ISO IN endpoint */
@@ -65,6 +76,10 @@ struct usbh_video {
     uint8_t num_of_formats;
     struct usbh_video_format format[CONFIG_USBHOST_VIDEO_MAX_FORMATS];
 
+    struct usbh_urb *isoin_urb; /* USBH_URB_ISO_RING urb while streaming */
+    struct usbh_videostreaming stream;
+    usbh_video_frame_callback_t frame_callback;
+
     void *user_data;
 };
 
@@ -82,6 +97,14 @@ int usbh_video_open(struct usbh_video *video_class,
                     uint8_t altsetting);
 int usbh_video_close(struct usbh_video *video_class);
 
+int usbh_video_stream_start(struct usbh_video *video_class,
+                            struct usbh_urb *urb,
+                            uint8_t *iso_buf,
+                            uint32_t num_of_iso_packets,
+                            struct usbh_videoframe *frame,
+                            usbh_video_frame_callback_t frame_callback);
+int usbh_video_stream_stop(struct usbh_video *video_class);
+
 void usbh_video_list_info(struct usbh_video *video_class);
 
 void usbh_video_run(struct usbh_video *video_class);
@@ -38,9 +38,28 @@ struct usbd_rndis_priv {
 #define CONFIG_USBDEV_RNDIS_ETH_MAX_FRAME_SIZE 1580
 #endif
 
+#ifndef CONFIG_USBDEV_RNDIS_MAX_TRANSFER_SIZE
+#define CONFIG_USBDEV_RNDIS_MAX_TRANSFER_SIZE CONFIG_USBDEV_RNDIS_ETH_MAX_FRAME_SIZE
+#endif
+
+#if CONFIG_USBDEV_RNDIS_MAX_TRANSFER_SIZE < CONFIG_USBDEV_RNDIS_ETH_MAX_FRAME_SIZE
+#undef CONFIG_USBDEV_RNDIS_MAX_TRANSFER_SIZE
+#define CONFIG_USBDEV_RNDIS_MAX_TRANSFER_SIZE CONFIG_USBDEV_RNDIS_ETH_MAX_FRAME_SIZE
+#endif
+
 #ifdef CONFIG_USBDEV_RNDIS_USING_LWIP
-static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_rndis_rx_buffer[USB_ALIGN_UP(CONFIG_USBDEV_RNDIS_ETH_MAX_FRAME_SIZE, CONFIG_USB_ALIGN_SIZE)];
-static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_rndis_tx_buffer[USB_ALIGN_UP(CONFIG_USBDEV_RNDIS_ETH_MAX_FRAME_SIZE, CONFIG_USB_ALIGN_SIZE)];
+/* packet messages are padded to 4 bytes, the smallest one carries a 60 bytes frame */
+#define RNDIS_PACKET_ALIGN                4
+#define RNDIS_MAX_PACKETS_PER_TRANSFER    (CONFIG_USBDEV_RNDIS_MAX_TRANSFER_SIZE / (sizeof(rndis_data_packet_t) + 60))
+
+static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_rndis_rx_buffer[USB_ALIGN_UP(CONFIG_USBDEV_RNDIS_MAX_TRANSFER_SIZE, CONFIG_USB_ALIGN_SIZE)];
+/* one transfer is on the bus while the other one collects packet messages */
+static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_rndis_tx_buffer[2][USB_ALIGN_UP(CONFIG_USBDEV_RNDIS_MAX_TRANSFER_SIZE, CONFIG_USB_ALIGN_SIZE)];
+static uint8_t g_rndis_tx_fill = 0;       /* buffer collecting packet messages */
+static uint32_t g_rndis_tx_offset = 0;    /* bytes in the collecting buffer */
+static bool g_rndis_tx_copying = false;   /* usbd_rndis_eth_tx is copying into the collecting buffer */
+static uint32_t g_rndis_tx_max_transfer = CONFIG_USBDEV_RNDIS_ETH_MAX_FRAME_SIZE; /* host limit from REMOTE_NDIS_INITIALIZE_MSG */
+static uint32_t g_rndis_rx_offset = 0;    /* next packet message in g_rndis_rx_buffer */
 #endif
 
 static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t rndis_encapsulated_resp_buffer[USB_ALIGN_UP(CONFIG_USBDEV_RNDIS_RESP_BUFFER_SIZE, CONFIG_USB_ALIGN_SIZE)];
@@ -173,9 +192,24 @@ static int rndis_init_cmd_handler(uint8_t *data, uint32_t len)
     resp->Status = RNDIS_STATUS_SUCCESS;
     resp->DeviceFlags = RNDIS_DF_CONNECTIONLESS;
     resp->Medium = RNDIS_MEDIUM_802_3;
+#ifdef CONFIG_USBDEV_RNDIS_USING_LWIP
+    resp->MaxPacketsPerTransfer = RNDIS_MAX_PACKETS_PER_TRANSFER;
+    resp->MaxTransferSize = CONFIG_USBDEV_RNDIS_MAX_TRANSFER_SIZE;
+    resp->PacketAlignmentFactor = 2; /* 1 << 2 bytes */
+
+    /* host rx size bounds our in transfers, one byte is kept for the short packet */
+    if (cmd->MaxTransferSize >= CONFIG_USBDEV_RNDIS_ETH_MAX_FRAME_SIZE && cmd->MaxTransferSize <= CONFIG_USBDEV_RNDIS_MAX_TRANSFER_SIZE) {
+        g_rndis_tx_max_transfer = cmd->MaxTransferSize;
+    } else if (cmd->MaxTransferSize > CONFIG_USBDEV_RNDIS_MAX_TRANSFER_SIZE) {
+        g_rndis_tx_max_transfer = CONFIG_USBDEV_RNDIS_MAX_TRANSFER_SIZE;
+    } else {
+        g_rndis_tx_max_transfer = CONFIG_USBDEV_RNDIS_ETH_MAX_FRAME_SIZE;
+    }
+#else
     resp->MaxPacketsPerTransfer = CONFIG_USBDEV_RNDIS_ETH_MAX_FRAME_SIZE / 1580;
     resp->MaxTransferSize = CONFIG_USBDEV_RNDIS_ETH_MAX_FRAME_SIZE;
     resp->PacketAlignmentFactor = 0;
+#endif
     resp->AfListOffset = 0;
     resp->AfListSize = 0;
 
@@ -452,6 +486,10 @@ static void rndis_notify_handler(uint8_t busid, uint8_t event, void *arg)
             g_usbd_rndis.link_status = NDIS_MEDIA_STATE_DISCONNECTED;
             g_rndis_rx_data_length = 0;
             g_rndis_tx_data_length = 0;
+#ifdef CONFIG_USBDEV_RNDIS_USING_LWIP
+            g_rndis_tx_offset = 0;
+            g_rndis_rx_offset = 0;
+#endif
             break;
         case USBD_EVENT_CONFIGURED:
 #ifdef CONFIG_USBDEV_RNDIS_USING_LWIP
@@ -467,6 +505,19 @@ static void rndis_notify_handler(uint8_t busid, uint8_t event, void *arg)
 
 void rndis_bulk_out(uint8_t busid, uint8_t ep, uint32_t nbytes)
 {
+#ifdef CONFIG_USBDEV_RNDIS_USING_LWIP
+    (void)busid;
+    (void)ep;
+
+    /* the transfer may carry several packet messages, usbd_rndis_eth_rx walks them */
+    g_rndis_rx_offset = 0;
+    g_rndis_rx_data_length = nbytes;
+    if (nbytes == 0) {
+        usbd_rndis_start_read(g_rndis_rx_buffer, sizeof(g_rndis_rx_buffer));
+        return;
+    }
+    usbd_rndis_data_recv_done(nbytes);
+#else
     rndis_data_packet_t *hdr;
 
     (void)busid;
@@ -483,14 +534,28 @@ void rndis_bulk_out(uint8_t busid, uint8_t ep, uint32_t nbytes)
     g_rndis_rx_data_length = hdr->DataLength;
 
     usbd_rndis_data_recv_done(g_rndis_rx_data_length);
+#endif
 }
 
+#ifdef CONFIG_USBDEV_RNDIS_USING_LWIP
+static int rndis_tx_kick(void);
+#endif
+
 void rndis_bulk_in(uint8_t busid, uint8_t ep, uint32_t nbytes)
 {
+    uint32_t tx_length;
+
     (void)busid;
+    (void)ep;
+    (void)nbytes;
 
-    usbd_rndis_data_send_done(g_rndis_tx_data_length);
+    tx_length = g_rndis_tx_data_length;
     g_rndis_tx_data_length = 0;
+#ifdef CONFIG_USBDEV_RNDIS_USING_LWIP
+    /* packets collected while this transfer was on the bus go out right away */
+    rndis_tx_kick();
+#endif
+    usbd_rndis_data_send_done(tx_length);
 }
 
 void rndis_int_in(uint8_t busid, uint8_t ep, uint32_t nbytes)
@@ -538,59 +603,184 @@ int usbd_rndis_start_read(uint8_t *buf, uint32_t len)
 #ifdef CONFIG_USBDEV_RNDIS_USING_LWIP
 #include <lwip/pbuf.h>
 
+/*
+ * Return the next frame of the received transfer, NULL once all packet messages
+ * are consumed. The next transfer is armed after the last one is taken.
+ */
 struct pbuf *usbd_rndis_eth_rx(void)
 {
+    rndis_data_packet_t hdr;
     struct pbuf *p;
+    uint32_t remain;
+
+    while (g_rndis_rx_data_length > g_rndis_rx_offset) {
+        remain = g_rndis_rx_data_length - g_rndis_rx_offset;
+        if (remain < sizeof(rndis_data_packet_t)) {
+            /* padding or the short packet byte after the last message */
+            break;
+        }
+
+        /* messages are 4 bytes aligned if the host follows PacketAlignmentFactor, do not rely on it */
+        usb_memcpy(&hdr, &g_rndis_rx_buffer[g_rndis_rx_offset], sizeof(rndis_data_packet_t));
+        if ((hdr.MessageType != REMOTE_NDIS_PACKET_MSG) || (hdr.MessageLength < sizeof(rndis_data_packet_t)) ||
+            (hdr.MessageLength > remain) || (hdr.DataLength == 0) ||
+            ((uint64_t)hdr.DataOffset + sizeof(rndis_generic_msg_t) + hdr.DataLength > hdr.MessageLength)) {
+            USB_LOG_WRN("invalid rndis packet message\r\n");
+            g_usbd_rndis.eth_state.rxbad++;
+            break;
+        }
+
+        p = pbuf_alloc(PBUF_RAW, hdr.DataLength, PBUF_POOL);
+        if (p == NULL) {
+            /* drop the rest of this transfer */
+            break;
+        }
+        pbuf_take(p, &g_rndis_rx_buffer[g_rndis_rx_offset + sizeof(rndis_generic_msg_t) + hdr.DataOffset], hdr.DataLength);
 
-    if (g_rndis_rx_data_length == 0) {
-        return NULL;
+        g_rndis_rx_offset += hdr.MessageLength;
+        g_usbd_rndis.eth_state.rxok++;
+        USB_LOG_DBG("rxlen:%d\r\n", hdr.DataLength);
+
+        if ((g_rndis_rx_data_length - g_rndis_rx_offset) < sizeof(rndis_data_packet_t)) {
+            g_rndis_rx_data_length = 0;
+            usbd_rndis_start_read(g_rndis_rx_buffer, sizeof(g_rndis_rx_buffer));
+        }
+        return p;
     }
-    p = pbuf_alloc(PBUF_RAW, g_rndis_rx_data_length, PBUF_POOL);
-    if (p == NULL) {
+
+    if (g_rndis_rx_data_length) {
+        g_rndis_rx_data_length = 0;
         usbd_rndis_start_read(g_rndis_rx_buffer, sizeof(g_rndis_rx_buffer));
-        return NULL;
     }
-    usb_memcpy(p->payload, (uint8_t *)g_rndis_rx_data_buffer, g_rndis_rx_data_length);
-    p->len = g_rndis_rx_data_length;
+    return NULL;
+}
+
+/*
+ * Hand the collecting buffer to the bus if it is idle, must be called with
+ * interrupts disabled. Returns the transfer length or 0.
+ */
+static uint32_t rndis_tx_close(uint8_t **buf)
+{
+    uint8_t *data;
+    uint32_t len;
 
-    USB_LOG_DBG("rxlen:%d\r\n", g_rndis_rx_data_length);
-    usbd_rndis_start_read(g_rndis_rx_buffer, sizeof(g_rndis_rx_buffer));
-    return p;
+    if ((g_rndis_tx_data_length > 0) || g_rndis_tx_copying || (g_rndis_tx_offset == 0)) {
+        return 0;
+    }
+
+    data = g_rndis_tx_buffer[g_rndis_tx_fill];
+    len = g_rndis_tx_offset;
+    if ((len % usbd_get_ep_mps(0, rndis_ep_data[RNDIS_IN_EP_IDX].ep_addr)) == 0) {
+        /* If the data length is a multiple of the endpoint max packet size, add one byte to indicate the end of the transfer. */
+        data[len++] = 0;
+    }
+
+    /* mark busy before submitting: the transfer may complete in interrupt
+       context before usbd_ep_start_write() returns */
+    g_rndis_tx_data_length = len;
+    g_rndis_tx_fill ^= 1;
+    g_rndis_tx_offset = 0;
+
+    *buf = data;
+    return len;
 }
 
+static int rndis_tx_kick(void)
+{
+    uint8_t *buf = NULL;
+    uint32_t len;
+    size_t flags;
+    int ret;
+
+    flags = usb_osal_enter_critical_section();
+    len = rndis_tx_close(&buf);
+    usb_osal_leave_critical_section(flags);
+
+    if (len == 0) {
+        return 0;
+    }
+
+    USB_LOG_DBG("txlen:%d\r\n", len);
+    ret = usbd_ep_start_write(0, rndis_ep_data[RNDIS_IN_EP_IDX].ep_addr, buf, len);
+    if (ret != 0) {
+        g_rndis_tx_data_length = 0;
+    }
+    return ret;
+}
+
+/*
+ * Queue one frame as a packet message. Frames queued while a transfer is on the bus
+ * go out together in the next one. Returns -USB_ERR_BUSY if both buffers are in use,
+ * retry after usbd_rndis_data_send_done.
+ */
 int usbd_rndis_eth_tx(struct pbuf *p)
 {
     struct pbuf *q;
     uint8_t *buffer;
     rndis_data_packet_t *hdr;
+    uint32_t offset;
+    uint32_t msg_len;
+    uint16_t payload_len;
+    size_t flags;
 
     if (!usb_device_is_configured(0)) {
         return -USB_ERR_NOTCONN;
     }
 
-    if (g_rndis_tx_data_length > 0) {
-        return -USB_ERR_BUSY;
+    payload_len = p->tot_len;
+    msg_len = USB_ALIGN_UP(sizeof(rndis_data_packet_t) + payload_len, RNDIS_PACKET_ALIGN);
+    if (msg_len + 1 > g_rndis_tx_max_transfer) {
+        USB_LOG_WRN("rndis tx frame too large:%u\r\n", payload_len);
+        g_usbd_rndis.eth_state.txbad++;
+        return -USB_ERR_INVAL;
     }
 
-    if (p->tot_len > sizeof(g_rndis_tx_buffer)) {
-        p->tot_len = sizeof(g_rndis_tx_buffer);
+    flags = usb_osal_enter_critical_section();
+    if (g_rndis_tx_copying) {
+        usb_osal_leave_critical_section(flags);
+        return -USB_ERR_BUSY;
     }
 
-    buffer = (uint8_t *)(g_rndis_tx_buffer + sizeof(rndis_data_packet_t));
-    for (q = p; q != NULL; q = q->next) {
-        usb_memcpy(buffer, q->payload, q->len);
-        buffer += q->len;
+    /* keep one byte for the short packet */
+    offset = g_rndis_tx_offset;
+    if (offset + msg_len + 1 > g_rndis_tx_max_transfer) {
+        if (g_rndis_tx_data_length > 0) {
+            usb_osal_leave_critical_section(flags);
+            return -USB_ERR_BUSY;
+        }
+        /* collecting buffer is full and the bus is idle, send it and start over in the other one */
+        usb_osal_leave_critical_section(flags);
+        rndis_tx_kick();
+        return usbd_rndis_eth_tx(p);
     }
+    g_rndis_tx_copying = true;
+    usb_osal_leave_critical_section(flags);
 
-    hdr = (rndis_data_packet_t *)g_rndis_tx_buffer;
-
+    hdr = (rndis_data_packet_t *)&g_rndis_tx_buffer[g_rndis_tx_fill][offset];
     memset(hdr, 0, sizeof(rndis_data_packet_t));
     hdr->MessageType = REMOTE_NDIS_PACKET_MSG;
-    hdr->MessageLength = sizeof(rndis_data_packet_t) + p->tot_len;
+    hdr->MessageLength = msg_len;
     hdr->DataOffset = sizeof(rndis_data_packet_t) - sizeof(rndis_generic_msg_t);
-    hdr->DataLength = p->tot_len;
+    hdr->DataLength = payload_len;
+
+    buffer = (uint8_t *)hdr + sizeof(rndis_data_packet_t);
+    for (q = p; q != NULL && payload_len > 0; q = q->next) {
+        uint16_t copy_len = MIN(q->len, payload_len);
+        usb_memcpy(buffer, q->payload, copy_len);
+        buffer += copy_len;
+        payload_len -= copy_len;
+    }
+    memset(buffer, 0, msg_len - sizeof(rndis_data_packet_t) - p->tot_len);
 
-    return usbd_rndis_start_write(g_rndis_tx_buffer, sizeof(rndis_data_packet_t) + p->tot_len);
+    flags = usb_osal_enter_critical_section();
+    g_rndis_tx_offset = offset + msg_len;
+    g_rndis_tx_copying = false;
+    g_usbd_rndis.eth_state.txok++;
+    usb_osal_leave_critical_section(flags);
+
+    /* an idle bus takes the packet at once, a busy one lets packets gather */
+    rndis_tx_kick();
+    return 0;
 }
 #endif
 struct usbd_interface *usbd_rndis_init_intf(struct usbd_interface *intf,
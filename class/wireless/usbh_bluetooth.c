@@ -69,6 +69,7 @@ static int usbh_bluetooth_connect(struct usbh_hubport *hport, uint8_t intf)
 #ifndef CONFIG_USBHOST_BLUETOOTH_HCI_H4
         }
 #endif
+        usbh_pipe_open(hport, ep_desc);
     }
 #ifndef CONFIG_USBHOST_BLUETOOTH_HCI_H4
     USB_LOG_INFO("Num of altsettings:%u\r\n", bluetooth_class->num_of_intf_altsettings);
@@ -115,14 +116,17 @@ static int usbh_bluetooth_disconnect(struct usbh_hubport *hport, uint8_t intf)
     if (bluetooth_class) {
         if (bluetooth_class->bulkin) {
             usbh_kill_urb(&bluetooth_class->bulkin_urb);
+            usbh_pipe_close(hport, bluetooth_class->bulkin);
         }
 
         if (bluetooth_class->bulkout) {
             usbh_kill_urb(&bluetooth_class->bulkout_urb);
+            usbh_pipe_close(hport, bluetooth_class->bulkout);
         }
 #ifndef CONFIG_USBHOST_BLUETOOTH_HCI_H4
         if (bluetooth_class->intin) {
             usbh_kill_urb(&bluetooth_class->intin_urb);
+            usbh_pipe_close(hport, bluetooth_class->intin);
         }
 
         // if (bluetooth_class->isoin) {
@@ -447,6 +447,7 @@ static int usbh_rndis_disconnect(struct usbh_hubport *hport, uint8_t intf)
 void usbh_rndis_rx_thread(CONFIG_USB_OSAL_THREAD_SET_ARGV)
 {
     uint32_t g_rndis_rx_length;
+    uint8_t *rx_buf = NULL;
     int ret;
     uint32_t pmg_offset;
     rndis_data_packet_t *pmsg;
@@ -479,9 +480,18 @@ find_class:
 
     g_rndis_rx_length = 0;
     while (1) {
-        usbh_bulk_urb_fill(&g_rndis_class.bulkin_urb, g_rndis_class.hport, g_rndis_class.bulkin, &g_rndis_rx_buffer[g_rndis_rx_length], transfer_size, USB_OSAL_WAITING_FOREVER, NULL, NULL);
+        /* one buffer holds a whole transfer, it may take several urbs */
+        if (rx_buf == NULL) {
+            rx_buf = usbh_eth_rxbuf_alloc(CONFIG_USBHOST_RNDIS_ETH_MAX_RX_SIZE);
+            if (rx_buf == NULL) {
+                rx_buf = g_rndis_rx_buffer;
+            }
+        }
+
+        usbh_bulk_urb_fill(&g_rndis_class.bulkin_urb, g_rndis_class.hport, g_rndis_class.bulkin, &rx_buf[g_rndis_rx_length], transfer_size, USB_OSAL_WAITING_FOREVER, NULL, NULL);
         ret = usbh_submit_urb(&g_rndis_class.bulkin_urb);
         if (ret < 0) {
+            usbh_eth_rxbuf_free(rx_buf);
             break;
         }
 
@@ -499,7 +509,7 @@ find_class:
             while (g_rndis_rx_length > 0) {
                 USB_LOG_DBG("rxlen:%u\r\n", (unsigned int)g_rndis_rx_length);
 
-                pmsg = (rndis_data_packet_t *)(g_rndis_rx_buffer + pmg_offset);
+                pmsg = (rndis_data_packet_t *)(rx_buf + pmg_offset);
 
                 /* Not word-aligned case */
                 if (pmg_offset & 0x3) {
@@ -508,7 +518,7 @@ find_class:
                 }
 
                 if (pmsg->MessageType == REMOTE_NDIS_PACKET_MSG) {
-                    uint8_t *buf = (uint8_t *)(g_rndis_rx_buffer + pmg_offset + sizeof(rndis_generic_msg_t) + pmsg->DataOffset);
+                    uint8_t *buf = (uint8_t *)(rx_buf + pmg_offset + sizeof(rndis_generic_msg_t) + pmsg->DataOffset);
 
                     usbh_rndis_eth_input(buf, pmsg->DataLength);
                     pmg_offset += pmsg->MessageLength;
@@ -524,6 +534,9 @@ find_class:
                     USB_LOG_ERR("Error rndis packet message\r\n");
                 }
             }
+
+            usbh_eth_rxbuf_free(rx_buf);
+            rx_buf = NULL;
         } else {
 #if CONFIG_USBHOST_RNDIS_ETH_MAX_RX_SIZE <= (16 * 1024)
             if (g_rndis_rx_length == CONFIG_USBHOST_RNDIS_ETH_MAX_RX_SIZE) {
@@ -136,6 +136,36 @@ int usbd_ep_start_write(uint8_t busid, const uint8_t ep, const uint8_t *data, ui
  */
 int usbd_ep_start_read(uint8_t busid, const uint8_t ep, uint8_t *data, uint32_t data_len);
 
+/**
+ * @brief Optional, append a transfer behind the ones already started on the endpoint, used by usbd_ep_submit.
+ *        Each transfer reports its own usbd_event_ep_in_complete_handler in order, so controller
+ *        can move to the next one without waiting for software.
+ *
+ * @param [in]  busid      busid
+ * @param [in]  ep         Endpoint address corresponding to the one
+ *                         listed in the device configuration table
+ * @param [in]  data       Pointer to data to write
+ * @param [in]  data_len   Length of the data requested to write. This may
+ *                         be zero for a zero length status packet.
+ * @return 0 on success, negative errno code if transfer can not be chained, core will then
+ *         start it with usbd_ep_start_write once the endpoint is idle.
+ */
+int usbd_ep_queue_write(uint8_t busid, const uint8_t ep, const uint8_t *data, uint32_t data_len);
+
+/**
+ * @brief Optional, append a transfer behind the ones already started on the endpoint, used by usbd_ep_submit.
+ *        Each transfer ends on short packet or when full and reports its own usbd_event_ep_out_complete_handler in order.
+ *
+ * @param [in]  busid      busid
+ * @param [in]  ep         Endpoint address corresponding to the one
+ *                         listed in the device configuration table
+ * @param [in]  data       Pointer to data to read
+ * @param [in]  data_len   Max length of data to read
+ * @return 0 on success, negative errno code if transfer can not be chained, core will then
+ *         start it with usbd_ep_start_read once the endpoint is idle.
+ */
+int usbd_ep_queue_read(uint8_t busid, const uint8_t ep, uint8_t *data, uint32_t data_len);
+
 /* usb dcd irq callback, called by user */
 
 /**
@@ -28,6 +28,26 @@ struct usbh_iso_frame_packet {
     int errorcode;
 };
 
+typedef void (*usbh_iso_complete_callback_t)(void *arg, struct usbh_iso_frame_packet *iso_packet, uint32_t index);
+
+/**
+ * @brief USB Scatter-Gather Segment.
+ *
+ * One buffer of a scatter-gather urb.
+ */
+struct usbh_sg {
+    uint8_t *buffer;
+    uint32_t length;
+};
+
+/* transfer_flags, set by hcd when the sg list is copied through transfer_buffer */
+#define USBH_URB_SG_BOUNCE (1 << 0)
+/* transfer_flags, iso packets are re-armed after iso_complete until the urb is killed */
+#define USBH_URB_ISO_RING (1 << 1)
+
+/* bumped whenever struct usbh_urb changes, 2 added sg, num_sgs and iso_complete before iso_packet */
+#define USBH_URB_LAYOUT_VERSION 2
+
 /**
  * @brief USB Urb Configuration.
  *
@@ -51,6 +71,9 @@ struct usbh_urb {
     uint32_t start_frame;
     usbh_complete_callback_t complete;
     void *arg;
+    struct usbh_sg *sg; /* if num_sgs is not zero, data is in sg and transfer_buffer is only a bounce buffer */
+    uint32_t num_sgs;
+    usbh_iso_complete_callback_t iso_complete; /* called for every iso packet of a USBH_URB_ISO_RING urb */
 #if defined(__ICCARM__) || defined(__ICCRISCV__) || defined(__ICCRX__)
     struct usbh_iso_frame_packet *iso_packet;
 #else
@@ -108,6 +131,30 @@ int usbh_submit_urb(struct usbh_urb *urb);
  */
 int usbh_kill_urb(struct usbh_urb *urb);
 
+/**
+ * @brief Keep the host controller state of a bulk or interrupt endpoint resident.
+ *
+ * Urbs of an open pipe skip the per transfer qh or channel setup and the data toggle
+ * is kept by the controller. Controllers without such state do nothing, and urbs can
+ * be submitted whether the open succeeded or not.
+ *
+ * @param hport Hub port of the device.
+ * @param ep Endpoint descriptor, the same pointer the urbs use.
+ * @return  On success will return 0, and others indicate fail.
+ */
+int usbh_pipe_open(struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep);
+
+/**
+ * @brief Release the state taken by usbh_pipe_open.
+ *
+ * Urbs still queued on the endpoint are given back with -USB_ERR_SHUTDOWN.
+ *
+ * @param hport Hub port of the device.
+ * @param ep Endpoint descriptor.
+ * @return  On success will return 0, and others indicate fail.
+ */
+int usbh_pipe_close(struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep);
+
 /* called by user */
 void USBH_IRQHandler(uint8_t busid);
 
@@ -74,4 +74,7 @@ void usb_osal_msleep(uint32_t delay);
 void *usb_osal_malloc(size_t size);
 void usb_osal_free(void *ptr);
 
+/* monotonic timestamp, tick resolution on most rtos */
+uint64_t usb_osal_get_timestamp_ns(void);
+
 #endif /* USB_OSAL_H */
@@ -35,8 +35,14 @@ struct usbd_tx_rx_msg {
     uint16_t ep_mps;
     uint32_t nbytes;
     usbd_endpoint_callback cb;
+    usb_dlist_t req_list;
 };
 
+#define USBD_REQ_STATE_PENDING 0 /* waiting in software queue */
+#define USBD_REQ_STATE_ACTIVE  1 /* started with usbd_ep_start_write/usbd_ep_start_read */
+#define USBD_REQ_STATE_QUEUED  2 /* chained by usbd_ep_queue_write/usbd_ep_queue_read */
+#define USBD_REQ_STATE_ZLP     3 /* data done, zlp in flight */
+
 USB_NOCACHE_RAM_SECTION struct usbd_core_priv {
     /** Setup packet */
     USB_MEM_ALIGNX struct usb_setup_packet setup;
@@ -84,6 +90,7 @@ USB_NOCACHE_RAM_SECTION struct usbd_core_priv {
 struct usbd_bus g_usbdev_bus[CONFIG_USBDEV_MAX_BUS];
 
 static void usbd_class_event_notify_handler(uint8_t busid, uint8_t event, void *arg);
+static void usbd_ep_flush_requests(uint8_t busid, uint8_t ep);
 
 static void usbd_print_setup(struct usb_setup_packet *setup)
 {
@@ -152,11 +159,15 @@ static bool usbd_set_endpoint(uint8_t busid, const struct usb_endpoint_descripto
  */
 static bool usbd_reset_endpoint(uint8_t busid, const struct usb_endpoint_descriptor *ep)
 {
+    bool ret;
+
     USB_LOG_DBG("Close ep:0x%02x type:%u\r\n",
                 ep->bEndpointAddress,
                 USB_GET_ENDPOINT_TYPE(ep->bmAttributes));
 
-    return usbd_ep_close(busid, ep->bEndpointAddress) == 0 ? true : false;
+    ret = usbd_ep_close(busid, ep->bEndpointAddress) == 0 ? true : false;
+    usbd_ep_flush_requests(busid, ep->bEndpointAddress);
+    return ret;
 }
 
 /**
@@ -966,6 +977,10 @@ void usbd_event_connect_handler(uint8_t busid)
 void usbd_event_disconnect_handler(uint8_t busid)
 {
     g_usbd_core[busid].configuration = 0;
+    for (uint8_t i = 1; i < 16; i++) {
+        usbd_ep_flush_requests(busid, i | 0x80);
+        usbd_ep_flush_requests(busid, i);
+    }
     g_usbd_core[busid].event_handler(busid, USBD_EVENT_DISCONNECTED);
 }
 
@@ -993,6 +1008,11 @@ void usbd_event_reset_handler(uint8_t busid)
     g_usbd_core[busid].ep0_next_state = USBD_EP0_STATE_SETUP;
     g_usbd_core[busid].speed = USB_SPEED_UNKNOWN;
 
+    for (uint8_t i = 1; i < 16; i++) {
+        usbd_ep_flush_requests(busid, i | 0x80);
+        usbd_ep_flush_requests(busid, i);
+    }
+
     USB_ASSERT_MSG(g_usbd_core[busid].descriptors->device_descriptor_callback != NULL,
                    "device_descriptor_callback is NULL\r\n");
 
@@ -1199,8 +1219,256 @@ static void usbd_event_ep0_out_complete_handler(uint8_t busid, uint8_t ep, uint3
     }
 }
 
+static inline struct usbd_tx_rx_msg *usbd_get_ep_msg(uint8_t busid, uint8_t ep)
+{
+    if (ep & 0x80) {
+        return &g_usbd_core[busid].tx_msg[ep & 0x7f];
+    } else {
+        return &g_usbd_core[busid].rx_msg[ep & 0x7f];
+    }
+}
+
+/* hand pending requests to the controller, must be called with critical section held */
+static void usbd_ep_kick_requests(uint8_t busid, uint8_t ep)
+{
+    struct usbd_tx_rx_msg *msg = usbd_get_ep_msg(busid, ep);
+    struct usbd_request *req;
+    usb_dlist_t *node;
+    bool chained = false;
+    uint16_t mps;
+    int ret;
+
+    usb_dlist_for_each(node, &msg->req_list)
+    {
+        req = usb_dlist_entry(node, struct usbd_request, list);
+
+        if (req->state == USBD_REQ_STATE_QUEUED) {
+            chained = true;
+            continue;
+        } else if (req->state != USBD_REQ_STATE_PENDING) {
+            /* single transfer in progress */
+            return;
+        }
+
+        /* zlp can not be expressed with one chained transfer */
+        mps = msg->ep_mps;
+        if (!req->zero || !req->length || !mps || (req->length % mps)) {
+            if (ep & 0x80) {
+                ret = usbd_ep_queue_write(busid, ep, req->buf, req->length);
+            } else {
+                ret = usbd_ep_queue_read(busid, ep, req->buf, req->length);
+            }
+            if (ret == 0) {
+                req->state = USBD_REQ_STATE_QUEUED;
+                chained = true;
+                continue;
+            }
+        }
+
+        if (chained) {
+            /* wait for the chained ones to drain */
+            return;
+        }
+
+        req->state = USBD_REQ_STATE_ACTIVE;
+        if (ep & 0x80) {
+            usbd_ep_start_write(busid, ep, req->buf, req->length);
+        } else {
+            usbd_ep_start_read(busid, ep, req->buf, req->length);
+        }
+        return;
+    }
+}
+
+/* return true if head request is done */
+static bool usbd_ep_request_update(uint8_t busid, uint8_t ep, struct usbd_request *req, uint32_t nbytes)
+{
+    uint16_t mps = usbd_get_ep_mps(busid, ep);
+
+    if (req->state == USBD_REQ_STATE_QUEUED) {
+        req->actual = nbytes;
+        return true;
+    } else if (req->state == USBD_REQ_STATE_ZLP) {
+        return true;
+    }
+
+    req->actual += nbytes;
+
+    /* out ends on short packet, same as usbd_ep_start_read */
+    if (ep & 0x80) {
+        /* controller may split big transfer, continue with the rest */
+        if (req->actual < req->length && nbytes) {
+            usbd_ep_start_write(busid, ep, req->buf + req->actual, req->length - req->actual);
+            return false;
+        }
+        if (req->zero && req->length && mps && !(req->length % mps)) {
+            req->state = USBD_REQ_STATE_ZLP;
+            usbd_ep_start_write(busid, ep, NULL, 0);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool usbd_ep_request_complete(uint8_t busid, uint8_t ep, uint32_t nbytes)
+{
+    struct usbd_tx_rx_msg *msg = usbd_get_ep_msg(busid, ep);
+    struct usbd_request *req;
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    if (usb_dlist_isempty(&msg->req_list)) {
+        usb_osal_leave_critical_section(flags);
+        return false;
+    }
+
+    req = usb_dlist_first_entry(&msg->req_list, struct usbd_request, list);
+    if (!usbd_ep_request_update(busid, ep, req, nbytes)) {
+        usb_osal_leave_critical_section(flags);
+        return true;
+    }
+
+    usb_dlist_remove(&req->list);
+    /* keep the endpoint busy before giving the buffer back */
+    usbd_ep_kick_requests(busid, ep);
+    usb_osal_leave_critical_section(flags);
+
+    req->status = 0;
+    if (req->complete) {
+        req->complete(busid, ep, req);
+    }
+    return true;
+}
+
+static void usbd_ep_flush_requests(uint8_t busid, uint8_t ep)
+{
+    struct usbd_tx_rx_msg *msg = usbd_get_ep_msg(busid, ep);
+    struct usbd_request *req;
+    size_t flags;
+
+    while (1) {
+        flags = usb_osal_enter_critical_section();
+        if (usb_dlist_isempty(&msg->req_list)) {
+            usb_osal_leave_critical_section(flags);
+            break;
+        }
+        req = usb_dlist_first_entry(&msg->req_list, struct usbd_request, list);
+        usb_dlist_remove(&req->list);
+        usb_osal_leave_critical_section(flags);
+
+        req->status = -USB_ERR_SHUTDOWN;
+        if (req->complete) {
+            req->complete(busid, ep, req);
+        }
+    }
+}
+
+/**
+ * @brief Queue a transfer request on a non-control endpoint
+ *
+ * Requests are started in order, the next one is handed to the controller before the
+ * previous one is completed, so the endpoint does not go idle while software refills it.
+ * Controllers implementing usbd_ep_queue_write/usbd_ep_queue_read chain them in hardware.
+ * Do not mix with usbd_ep_start_write/usbd_ep_start_read on the same endpoint.
+ *
+ * @param [in]  busid busid
+ * @param [in]  ep    Endpoint address
+ * @param [in]  req   Request with buf, length, zero and complete filled
+ *
+ * @return 0 on success, negative errno code on fail
+ */
+int usbd_ep_submit(uint8_t busid, uint8_t ep, struct usbd_request *req)
+{
+    struct usbd_tx_rx_msg *msg;
+    size_t flags;
+
+    if ((ep & 0x7f) == 0 || (ep & 0x7f) >= 16 || !req || (!req->buf && req->length)) {
+        return -USB_ERR_INVAL;
+    }
+
+    if (!is_device_configured(busid)) {
+        return -USB_ERR_NOTCONN;
+    }
+
+    msg = usbd_get_ep_msg(busid, ep);
+
+    req->actual = 0;
+    req->status = -USB_ERR_BUSY;
+    req->state = USBD_REQ_STATE_PENDING;
+
+    flags = usb_osal_enter_critical_section();
+    usb_dlist_insert_before(&msg->req_list, &req->list);
+    usbd_ep_kick_requests(busid, ep);
+    usb_osal_leave_critical_section(flags);
+
+    return 0;
+}
+
+/**
+ * @brief Cancel a request that has not been handed to the controller yet
+ *
+ * @param [in]  busid busid
+ * @param [in]  ep    Endpoint address
+ * @param [in]  req   Request passed to usbd_ep_submit
+ *
+ * @return 0 if canceled and completed with -USB_ERR_SHUTDOWN, -USB_ERR_BUSY if transfer is
+ *         already in progress, -USB_ERR_INVAL if it is not queued
+ */
+int usbd_ep_cancel(uint8_t busid, uint8_t ep, struct usbd_request *req)
+{
+    struct usbd_tx_rx_msg *msg = usbd_get_ep_msg(busid, ep);
+    usb_dlist_t *node;
+    size_t flags;
+    int ret = -USB_ERR_INVAL;
+
+    flags = usb_osal_enter_critical_section();
+    usb_dlist_for_each(node, &msg->req_list)
+    {
+        if (node == &req->list) {
+            if (req->state == USBD_REQ_STATE_PENDING) {
+                usb_dlist_remove(&req->list);
+                ret = 0;
+            } else {
+                ret = -USB_ERR_BUSY;
+            }
+            break;
+        }
+    }
+    usb_osal_leave_critical_section(flags);
+
+    if (ret == 0) {
+        req->status = -USB_ERR_SHUTDOWN;
+        if (req->complete) {
+            req->complete(busid, ep, req);
+        }
+    }
+    return ret;
+}
+
+__WEAK int usbd_ep_queue_write(uint8_t busid, const uint8_t ep, const uint8_t *data, uint32_t data_len)
+{
+    (void)busid;
+    (void)ep;
+    (void)data;
+    (void)data_len;
+    return -USB_ERR_NOTSUPP;
+}
+
+__WEAK int usbd_ep_queue_read(uint8_t busid, const uint8_t ep, uint8_t *data, uint32_t data_len)
+{
+    (void)busid;
+    (void)ep;
+    (void)data;
+    (void)data_len;
+    return -USB_ERR_NOTSUPP;
+}
+
 void usbd_event_ep_in_complete_handler(uint8_t busid, uint8_t ep, uint32_t nbytes)
 {
+    if ((ep & 0x7f) && usbd_ep_request_complete(busid, ep, nbytes)) {
+        return;
+    }
+
     if (g_usbd_core[busid].tx_msg[ep & 0x7f].cb) {
         g_usbd_core[busid].tx_msg[ep & 0x7f].cb(busid, ep, nbytes);
     }
@@ -1208,6 +1476,10 @@ void usbd_event_ep_in_complete_handler(uint8_t busid, uint8_t ep, uint32_t nbyte
 
 void usbd_event_ep_out_complete_handler(uint8_t busid, uint8_t ep, uint32_t nbytes)
 {
+    if ((ep & 0x7f) && usbd_ep_request_complete(busid, ep, nbytes)) {
+        return;
+    }
+
     if (g_usbd_core[busid].rx_msg[ep & 0x7f].cb) {
         g_usbd_core[busid].rx_msg[ep & 0x7f].cb(busid, ep, nbytes);
     }
@@ -1220,6 +1492,11 @@ void usbd_desc_register(uint8_t busid, const struct usb_descriptor *desc)
     g_usbd_core[busid].descriptors = desc;
     g_usbd_core[busid].intf_offset = 0;
 
+    for (uint8_t i = 0; i < 16; i++) {
+        usb_dlist_init(&g_usbd_core[busid].tx_msg[i].req_list);
+        usb_dlist_init(&g_usbd_core[busid].rx_msg[i].req_list);
+    }
+
     g_usbd_core[busid].tx_msg[0].ep = 0x80;
     g_usbd_core[busid].tx_msg[0].cb = usbd_event_ep0_in_complete_handler;
     g_usbd_core[busid].rx_msg[0].ep = 0x00;
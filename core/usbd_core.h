@@ -65,6 +65,26 @@ struct usbd_endpoint {
     usbd_endpoint_callback ep_cb;
 };
 
+struct usbd_request;
+typedef void (*usbd_request_complete_t)(uint8_t busid, uint8_t ep, struct usbd_request *req);
+
+/*
+ * Transfer request for usbd_ep_submit, several requests can be queued on one endpoint and are
+ * completed in order. The request is owned by the core until complete is called, complete is
+ * called in irq context.
+ */
+struct usbd_request {
+    usb_dlist_t list;
+    uint8_t *buf;
+    uint32_t length;
+    uint32_t actual;
+    int status;    /* 0 on success, -USB_ERR_SHUTDOWN if canceled or flushed by reset/close */
+    bool zero;     /* in only, end with zlp if length is a multiple of mps */
+    uint8_t state; /* internal use */
+    usbd_request_complete_t complete;
+    void *arg;
+};
+
 struct usbd_interface {
     usbd_request_handler class_interface_handler;
     usbd_request_handler class_endpoint_handler;
@@ -103,6 +123,9 @@ void usbd_desc_register(uint8_t busid, const struct usb_descriptor *desc);
 void usbd_add_interface(uint8_t busid, struct usbd_interface *intf);
 void usbd_add_endpoint(uint8_t busid, struct usbd_endpoint *ep);
 
+int usbd_ep_submit(uint8_t busid, uint8_t ep, struct usbd_request *req);
+int usbd_ep_cancel(uint8_t busid, uint8_t ep, struct usbd_request *req);
+
 uint16_t usbd_get_ep_mps(uint8_t busid, uint8_t ep);
 uint8_t usbd_get_ep_mult(uint8_t busid, uint8_t ep);
 bool usb_device_is_configured(uint8_t busid);
@@ -18,7 +18,7 @@ struct setup_align_buffer {
     uint8_t buffer[USB_ALIGN_UP(8, CONFIG_USB_ALIGN_SIZE)];
 };
 
-USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t ep0_request_buffer[CONFIG_USBHOST_MAX_BUS][USB_ALIGN_UP(CONFIG_USBHOST_REQUEST_BUFFER_LEN, CONFIG_USB_ALIGN_SIZE)];
+USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t ep0_request_buffer[CONFIG_USBHOST_MAX_BUS][CONFIG_USBHOST_ENUM_THREADS + 1][USB_ALIGN_UP(CONFIG_USBHOST_REQUEST_BUFFER_LEN, CONFIG_USB_ALIGN_SIZE)];
 USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX struct setup_align_buffer g_setup_buffer[CONFIG_USBHOST_MAX_BUS][CONFIG_USBHOST_MAX_EXTHUBS + 1][CONFIG_USBHOST_MAX_EHPORTS];
 
 struct usbh_bus g_usbhost_bus[CONFIG_USBHOST_MAX_BUS];
@@ -88,8 +88,12 @@ static int __usbh_free_devaddr(struct usbh_devaddr_map *devgen, uint8_t devaddr)
 
 static int usbh_free_devaddr(struct usbh_hubport *hport)
 {
+    size_t flags;
+
     if (hport->dev_addr > 0) {
+        flags = usb_osal_enter_critical_section();
         __usbh_free_devaddr(&hport->bus->devgen, hport->dev_addr);
+        usb_osal_leave_critical_section(flags);
     }
     return 0;
 }
@@ -331,18 +335,164 @@ static int usbh_get_default_mps(int speed)
     }
 }
 
-int usbh_enumerate(struct usbh_hubport *hport)
+#if CONFIG_USBHOST_DESC_CACHE > 0
+/* parsed tables of a recently configured device, class driver fields are still empty */
+struct usbh_desc_cache {
+    struct usbh_configuration config;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t config_index;
+    uint32_t serial_hash;
+    uint32_t last_used;
+    uint8_t raw_config_desc[];
+};
+
+static struct usbh_desc_cache *g_desc_cache[CONFIG_USBHOST_DESC_CACHE];
+static uint32_t g_desc_cache_tick;
+/* entries are copied in and out whole, a mutex keeps that off the irq-disabled path */
+static usb_osal_mutex_t g_desc_cache_mutex;
+
+#ifdef CONFIG_USBHOST_GET_STRING_DESC
+static uint32_t usbh_desc_cache_hash(const uint8_t *str)
+{
+    uint32_t hash = 2166136261UL;
+
+    while (*str) {
+        hash ^= *str++;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+#endif
+
+static bool usbh_desc_cache_match(struct usbh_desc_cache *entry, struct usbh_hubport *hport, uint8_t config_index, uint32_t serial_hash)
+{
+    return (entry->idVendor == hport->device_desc.idVendor) &&
+           (entry->idProduct == hport->device_desc.idProduct) &&
+           (entry->bcdDevice == hport->device_desc.bcdDevice) &&
+           (entry->config_index == config_index) &&
+           (entry->serial_hash == serial_hash);
+}
+
+/* the freshly read config header doubles as the validation read, any field that differs is a miss */
+static bool usbh_desc_cache_load(struct usbh_hubport *hport, uint8_t config_index, uint32_t serial_hash,
+                                 struct usb_configuration_descriptor *config_header)
+{
+    struct usbh_desc_cache *entry;
+    bool found = false;
+
+    usb_osal_mutex_take(g_desc_cache_mutex);
+    for (uint8_t i = 0; i < CONFIG_USBHOST_DESC_CACHE; i++) {
+        entry = g_desc_cache[i];
+        if (entry && usbh_desc_cache_match(entry, hport, config_index, serial_hash) &&
+            (memcmp(&entry->config.config_desc, config_header, USB_SIZEOF_CONFIG_DESC) == 0)) {
+            memcpy(&hport->config, &entry->config, sizeof(struct usbh_configuration));
+            memcpy(hport->raw_config_desc, entry->raw_config_desc, config_header->wTotalLength);
+            entry->last_used = ++g_desc_cache_tick;
+            found = true;
+            break;
+        }
+    }
+    usb_osal_mutex_give(g_desc_cache_mutex);
+
+    return found;
+}
+
+static void usbh_desc_cache_store(struct usbh_hubport *hport, uint8_t config_index, uint32_t serial_hash)
+{
+    struct usbh_desc_cache *entry;
+    struct usbh_desc_cache *old;
+    uint16_t wTotalLength = hport->config.config_desc.wTotalLength;
+    uint8_t slot = 0;
+
+    entry = usb_osal_malloc(sizeof(struct usbh_desc_cache) + wTotalLength);
+    if (entry == NULL) {
+        return;
+    }
+
+    memcpy(&entry->config, &hport->config, sizeof(struct usbh_configuration));
+    memcpy(entry->raw_config_desc, hport->raw_config_desc, wTotalLength);
+    entry->idVendor = hport->device_desc.idVendor;
+    entry->idProduct = hport->device_desc.idProduct;
+    entry->bcdDevice = hport->device_desc.bcdDevice;
+    entry->config_index = config_index;
+    entry->serial_hash = serial_hash;
+
+    /* replace the same device, else take a free slot, else evict the least recently used one */
+    usb_osal_mutex_take(g_desc_cache_mutex);
+    for (uint8_t i = 0; i < CONFIG_USBHOST_DESC_CACHE; i++) {
+        if (g_desc_cache[i] == NULL) {
+            slot = i;
+            continue;
+        }
+        if (usbh_desc_cache_match(g_desc_cache[i], hport, config_index, serial_hash)) {
+            slot = i;
+            break;
+        }
+        if (g_desc_cache[slot] && (g_desc_cache[i]->last_used < g_desc_cache[slot]->last_used)) {
+            slot = i;
+        }
+    }
+    old = g_desc_cache[slot];
+    entry->last_used = ++g_desc_cache_tick;
+    g_desc_cache[slot] = entry;
+    usb_osal_mutex_give(g_desc_cache_mutex);
+
+    if (old) {
+        usb_osal_free(old);
+    }
+}
+
+static void usbh_desc_cache_drop(struct usbh_hubport *hport, uint8_t config_index, uint32_t serial_hash)
+{
+    struct usbh_desc_cache *old = NULL;
+
+    usb_osal_mutex_take(g_desc_cache_mutex);
+    for (uint8_t i = 0; i < CONFIG_USBHOST_DESC_CACHE; i++) {
+        if (g_desc_cache[i] && usbh_desc_cache_match(g_desc_cache[i], hport, config_index, serial_hash)) {
+            old = g_desc_cache[i];
+            g_desc_cache[i] = NULL;
+            break;
+        }
+    }
+    usb_osal_mutex_give(g_desc_cache_mutex);
+
+    if (old) {
+        usb_osal_free(old);
+    }
+}
+
+void usbh_desc_cache_flush(void)
+{
+    /* nothing can be cached before the first usbh_initialize */
+    if (g_desc_cache_mutex == NULL) {
+        return;
+    }
+
+    usb_osal_mutex_take(g_desc_cache_mutex);
+    for (uint8_t i = 0; i < CONFIG_USBHOST_DESC_CACHE; i++) {
+        if (g_desc_cache[i]) {
+            usb_osal_free(g_desc_cache[i]);
+            g_desc_cache[i] = NULL;
+        }
+    }
+    usb_osal_mutex_give(g_desc_cache_mutex);
+}
+#endif
+
+/* everything that still talks to address 0, only one device per bus may be in here at a time */
+int usbh_enumerate_address(struct usbh_hubport *hport)
 {
-    struct usb_interface_descriptor *intf_desc;
     struct usb_setup_packet *setup;
     struct usb_device_descriptor *dev_desc;
     struct usb_endpoint_descriptor *ep;
     int dev_addr;
     uint16_t ep_mps;
-    uint8_t config_value;
-    uint8_t config_index;
+    size_t flags;
     int ret;
 
+    hport->enum_time_ms = (uint32_t)(usb_osal_get_timestamp_ns() / 1000000);
     hport->setup = (struct usb_setup_packet *)&g_setup_buffer[hport->bus->busid][hport->parent->index - 1][hport->port - 1];
     setup = hport->setup;
     ep = &hport->ep0;
@@ -365,20 +515,20 @@ int usbh_enumerate(struct usbh_hubport *hport)
     setup->wIndex = 0;
     setup->wLength = 8;
 
-    ret = usbh_control_transfer(hport, setup, ep0_request_buffer[hport->bus->busid]);
+    ret = usbh_control_transfer(hport, setup, ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index]);
     if (ret < 0) {
         USB_LOG_ERR("Failed to get device descriptor,errorcode:%d\r\n", ret);
-        goto errout;
+        return ret;
     }
 
-    ret = parse_device_descriptor(hport, (struct usb_device_descriptor *)ep0_request_buffer[hport->bus->busid], 8);
+    ret = parse_device_descriptor(hport, (struct usb_device_descriptor *)ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index], 8);
     if (ret < 0) {
         USB_LOG_ERR("Parse device descriptor fail\r\n");
-        goto errout;
+        return ret;
     }
 
     /* Extract the correct max packetsize from the device descriptor */
-    dev_desc = (struct usb_device_descriptor *)ep0_request_buffer[hport->bus->busid];
+    dev_desc = (struct usb_device_descriptor *)ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index];
     if (dev_desc->bcdUSB >= USB_3_0) {
         ep_mps = 1 << dev_desc->bMaxPacketSize0;
     } else {
@@ -393,10 +543,12 @@ int usbh_enumerate(struct usbh_hubport *hport)
     ep->wMaxPacketSize = ep_mps;
 
     /* Assign a function address to the device connected to this port */
+    flags = usb_osal_enter_critical_section();
     dev_addr = usbh_allocate_devaddr(&hport->bus->devgen);
+    usb_osal_leave_critical_section(flags);
     if (dev_addr < 0) {
-        USB_LOG_ERR("Failed to allocate devaddr,errorcode:%d\r\n", ret);
-        goto errout;
+        USB_LOG_ERR("Failed to allocate devaddr,errorcode:%d\r\n", dev_addr);
+        return dev_addr;
     }
 
     /* Set the USB device address */
@@ -409,15 +561,34 @@ int usbh_enumerate(struct usbh_hubport *hport)
     ret = usbh_control_transfer(hport, setup, NULL);
     if (ret < 0) {
         USB_LOG_ERR("Failed to set devaddr,errorcode:%d\r\n", ret);
-        goto errout;
+        flags = usb_osal_enter_critical_section();
+        __usbh_free_devaddr(&hport->bus->devgen, dev_addr);
+        usb_osal_leave_critical_section(flags);
+        return ret;
     }
 
-    /* Wait device set address completely */
-    usb_osal_msleep(10);
-
     /*Reconfigure EP0 with the correct address */
     hport->dev_addr = dev_addr;
 
+    return 0;
+}
+
+/* descriptors, configuration and class drivers, devices on other ports may be enumerated meanwhile */
+int usbh_enumerate_configure(struct usbh_hubport *hport)
+{
+    struct usb_interface_descriptor *intf_desc;
+    struct usb_setup_packet *setup = hport->setup;
+    uint8_t config_value;
+    uint8_t config_index;
+#if CONFIG_USBHOST_DESC_CACHE > 0
+    struct usb_configuration_descriptor config_header;
+    uint32_t serial_hash = 0;
+#endif
+    int ret;
+
+    /* Wait device set address completely */
+    usb_osal_msleep(10);
+
     /* Read the full device descriptor */
     setup->bmRequestType = USB_REQUEST_DIR_IN | USB_REQUEST_STANDARD | USB_REQUEST_RECIPIENT_DEVICE;
     setup->bRequest = USB_REQUEST_GET_DESCRIPTOR;
@@ -425,19 +596,19 @@ int usbh_enumerate(struct usbh_hubport *hport)
     setup->wIndex = 0;
     setup->wLength = USB_SIZEOF_DEVICE_DESC;
 
-    ret = usbh_control_transfer(hport, setup, ep0_request_buffer[hport->bus->busid]);
+    ret = usbh_control_transfer(hport, setup, ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index]);
     if (ret < 0) {
         USB_LOG_ERR("Failed to get full device descriptor,errorcode:%d\r\n", ret);
         goto errout;
     }
 
-    parse_device_descriptor(hport, (struct usb_device_descriptor *)ep0_request_buffer[hport->bus->busid], USB_SIZEOF_DEVICE_DESC);
+    parse_device_descriptor(hport, (struct usb_device_descriptor *)ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index], USB_SIZEOF_DEVICE_DESC);
     USB_LOG_INFO("New device found,idVendor:%04x,idProduct:%04x,bcdDevice:%04x\r\n",
-                 ((struct usb_device_descriptor *)ep0_request_buffer[hport->bus->busid])->idVendor,
-                 ((struct usb_device_descriptor *)ep0_request_buffer[hport->bus->busid])->idProduct,
-                 ((struct usb_device_descriptor *)ep0_request_buffer[hport->bus->busid])->bcdDevice);
+                 ((struct usb_device_descriptor *)ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index])->idVendor,
+                 ((struct usb_device_descriptor *)ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index])->idProduct,
+                 ((struct usb_device_descriptor *)ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index])->bcdDevice);
 
-    USB_LOG_INFO("The device has %d bNumConfigurations\r\n", ((struct usb_device_descriptor *)ep0_request_buffer[hport->bus->busid])->bNumConfigurations);
+    USB_LOG_INFO("The device has %d bNumConfigurations\r\n", ((struct usb_device_descriptor *)ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index])->bNumConfigurations);
 
     config_index = usbh_get_hport_active_config_index(hport);
     USB_LOG_DBG("The device selects config %d\r\n", config_index);
@@ -449,20 +620,20 @@ int usbh_enumerate(struct usbh_hubport *hport)
     setup->wIndex = 0;
     setup->wLength = USB_SIZEOF_CONFIG_DESC;
 
-    ret = usbh_control_transfer(hport, setup, ep0_request_buffer[hport->bus->busid]);
+    ret = usbh_control_transfer(hport, setup, ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index]);
     if (ret < 0) {
         USB_LOG_ERR("Failed to get config descriptor,errorcode:%d\r\n", ret);
         goto errout;
     }
 
-    ret = parse_config_descriptor(hport, (struct usb_configuration_descriptor *)ep0_request_buffer[hport->bus->busid], USB_SIZEOF_CONFIG_DESC);
+    ret = parse_config_descriptor(hport, (struct usb_configuration_descriptor *)ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index], USB_SIZEOF_CONFIG_DESC);
     if (ret < 0) {
         USB_LOG_ERR("Parse config descriptor fail\r\n");
         goto errout;
     }
 
     /* Read the full size of the configuration data */
-    uint16_t wTotalLength = ((struct usb_configuration_descriptor *)ep0_request_buffer[hport->bus->busid])->wTotalLength;
+    uint16_t wTotalLength = ((struct usb_configuration_descriptor *)ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index])->wTotalLength;
 
     if (wTotalLength >= CONFIG_USBHOST_REQUEST_BUFFER_LEN) {
         ret = -USB_ERR_NOMEM;
@@ -470,40 +641,73 @@ int usbh_enumerate(struct usbh_hubport *hport)
         goto errout;
     }
 
+    config_value = ((struct usb_configuration_descriptor *)ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index])->bConfigurationValue;
+#if CONFIG_USBHOST_DESC_CACHE > 0
+    memcpy(&config_header, ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index], USB_SIZEOF_CONFIG_DESC);
+#endif
+
+    hport->raw_config_desc = usb_osal_malloc(wTotalLength + 1);
+    if (hport->raw_config_desc == NULL) {
+        ret = -USB_ERR_NOMEM;
+        USB_LOG_ERR("No memory to alloc for raw_config_desc\r\n");
+        goto errout;
+    }
+
+#ifdef CONFIG_USBHOST_GET_STRING_DESC
+    uint8_t string_buffer[128];
+
+    if (hport->device_desc.iSerialNumber > 0) {
+        /* Get SerialNumber string */
+        memset(string_buffer, 0, 128);
+        ret = usbh_get_string_desc(hport, USB_STRING_SERIAL_INDEX, string_buffer, 128);
+        if (ret < 0) {
+            USB_LOG_ERR("Failed to get SerialNumber string,errorcode:%d\r\n", ret);
+            goto errout;
+        }
+
+        USB_LOG_INFO("SerialNumber: %s\r\n", string_buffer);
+#if CONFIG_USBHOST_DESC_CACHE > 0
+        serial_hash = usbh_desc_cache_hash(string_buffer);
+#endif
+    } else {
+        USB_LOG_WRN("Do not support SerialNumber string\r\n");
+    }
+#endif
+
+#if CONFIG_USBHOST_DESC_CACHE > 0
+    if (usbh_desc_cache_load(hport, config_index, serial_hash, &config_header)) {
+        USB_LOG_INFO("Using cached descriptors, the device has %d interfaces\r\n", hport->config.config_desc.bNumInterfaces);
+        goto set_config;
+    }
+#endif
+
     setup->bmRequestType = USB_REQUEST_DIR_IN | USB_REQUEST_STANDARD | USB_REQUEST_RECIPIENT_DEVICE;
     setup->bRequest = USB_REQUEST_GET_DESCRIPTOR;
     setup->wValue = (uint16_t)((USB_DESCRIPTOR_TYPE_CONFIGURATION << 8) | config_index);
     setup->wIndex = 0;
     setup->wLength = wTotalLength;
 
-    ret = usbh_control_transfer(hport, setup, ep0_request_buffer[hport->bus->busid]);
+    ret = usbh_control_transfer(hport, setup, ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index]);
     if (ret < 0) {
         USB_LOG_ERR("Failed to get full config descriptor,errorcode:%d\r\n", ret);
         goto errout;
     }
 
-    ep0_request_buffer[hport->bus->busid][wTotalLength] = '\0';
-    ret = parse_config_descriptor(hport, (struct usb_configuration_descriptor *)ep0_request_buffer[hport->bus->busid], wTotalLength);
+    ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index][wTotalLength] = '\0';
+    ret = parse_config_descriptor(hport, (struct usb_configuration_descriptor *)ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index], wTotalLength);
     if (ret < 0) {
         USB_LOG_ERR("Parse config descriptor fail\r\n");
         goto errout;
     }
 
-    USB_LOG_INFO("The device has %d interfaces\r\n", ((struct usb_configuration_descriptor *)ep0_request_buffer[hport->bus->busid])->bNumInterfaces);
-    hport->raw_config_desc = usb_osal_malloc(wTotalLength + 1);
-    if (hport->raw_config_desc == NULL) {
-        ret = -USB_ERR_NOMEM;
-        USB_LOG_ERR("No memory to alloc for raw_config_desc\r\n");
-        goto errout;
-    }
+    USB_LOG_INFO("The device has %d interfaces\r\n", ((struct usb_configuration_descriptor *)ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index])->bNumInterfaces);
+    memcpy(hport->raw_config_desc, ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index], wTotalLength);
 
-    config_value = ((struct usb_configuration_descriptor *)ep0_request_buffer[hport->bus->busid])->bConfigurationValue;
-    memcpy(hport->raw_config_desc, ep0_request_buffer[hport->bus->busid], wTotalLength);
-    hport->raw_config_desc[wTotalLength] = '\0';
+#if CONFIG_USBHOST_DESC_CACHE > 0
+    usbh_desc_cache_store(hport, config_index, serial_hash);
+#endif
 
 #ifdef CONFIG_USBHOST_GET_STRING_DESC
-    uint8_t string_buffer[128];
-
     if (hport->device_desc.iManufacturer > 0) {
         /* Get Manufacturer string */
         memset(string_buffer, 0, 128);
@@ -531,21 +735,13 @@ int usbh_enumerate(struct usbh_hubport *hport)
     } else {
         USB_LOG_WRN("Do not support Product string\r\n");
     }
+#endif
 
-    if (hport->device_desc.iSerialNumber > 0) {
-        /* Get SerialNumber string */
-        memset(string_buffer, 0, 128);
-        ret = usbh_get_string_desc(hport, USB_STRING_SERIAL_INDEX, string_buffer, 128);
-        if (ret < 0) {
-            USB_LOG_ERR("Failed to get SerialNumber string,errorcode:%d\r\n", ret);
-            goto errout;
-        }
-
-        USB_LOG_INFO("SerialNumber: %s\r\n", string_buffer);
-    } else {
-        USB_LOG_WRN("Do not support SerialNumber string\r\n");
-    }
+#if CONFIG_USBHOST_DESC_CACHE > 0
+set_config:
 #endif
+    hport->raw_config_desc[wTotalLength] = '\0';
+
     /* Select device configuration 1 */
     setup->bmRequestType = USB_REQUEST_DIR_OUT | USB_REQUEST_STANDARD | USB_REQUEST_RECIPIENT_DEVICE;
     setup->bRequest = USB_REQUEST_SET_CONFIGURATION;
@@ -556,6 +752,10 @@ int usbh_enumerate(struct usbh_hubport *hport)
     ret = usbh_control_transfer(hport, setup, NULL);
     if (ret < 0) {
         USB_LOG_ERR("Failed to set configuration,errorcode:%d\r\n", ret);
+#if CONFIG_USBHOST_DESC_CACHE > 0
+        /* do not hand the same tables to the next connect */
+        usbh_desc_cache_drop(hport, config_index, serial_hash);
+#endif
         goto errout;
     }
 
@@ -566,7 +766,7 @@ int usbh_enumerate(struct usbh_hubport *hport)
     setup->wIndex = 0x0004;
     setup->wLength = 16;
 
-    ret = usbh_control_transfer(hport, setup, ep0_request_buffer[hport->bus->busid]);
+    ret = usbh_control_transfer(hport, setup, ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index]);
     if (ret < 0 && (ret != -USB_ERR_STALL)) {
         USB_LOG_ERR("Failed to get msosv1 compat id,errorcode:%d\r\n", ret);
         goto errout;
@@ -604,6 +804,9 @@ int usbh_enumerate(struct usbh_hubport *hport)
         }
     }
 
+    hport->enum_time_ms = (uint32_t)(usb_osal_get_timestamp_ns() / 1000000) - hport->enum_time_ms;
+    USB_LOG_INFO("Device %u enumerated in %u ms\r\n", hport->dev_addr, (unsigned int)hport->enum_time_ms);
+
 errout:
     if (hport->raw_config_desc) {
         usb_osal_free(hport->raw_config_desc);
@@ -612,9 +815,26 @@ errout:
     return ret;
 }
 
+int usbh_enumerate(struct usbh_hubport *hport)
+{
+    int ret;
+
+    ret = usbh_enumerate_address(hport);
+    if (ret < 0) {
+        return ret;
+    }
+    return usbh_enumerate_configure(hport);
+}
+
 void usbh_hubport_release(struct usbh_hubport *hport)
 {
     if (hport->connected) {
+        /* let classes write back what they hold, a device that is only torn down still answers */
+        for (uint8_t i = 0; i < hport->config.config_desc.bNumInterfaces; i++) {
+            if (hport->config.intf[i].class_driver && hport->config.intf[i].class_driver->prepare_disconnect) {
+                hport->config.intf[i].class_driver->prepare_disconnect(hport, i);
+            }
+        }
         hport->connected = false;
         usbh_kill_urb(&hport->ep0_urb);
         usbh_free_devaddr(hport);
@@ -624,6 +844,14 @@ void usbh_hubport_release(struct usbh_hubport *hport)
             }
             hport->bus->event_handler(hport->bus->busid, hport->parent->index, hport->port, i, USBH_EVENT_INTERFACE_STOP);
         }
+        /* drop pipes a class driver left open */
+        for (uint8_t i = 0; i < hport->config.config_desc.bNumInterfaces; i++) {
+            for (uint8_t j = 0; j < hport->config.intf[i].altsetting_num; j++) {
+                for (uint8_t k = 0; k < hport->config.intf[i].altsetting[j].intf_desc.bNumEndpoints; k++) {
+                    usbh_pipe_close(hport, &hport->config.intf[i].altsetting[j].ep[k].ep_desc);
+                }
+            }
+        }
         hport->config.config_desc.bNumInterfaces = 0;
         usb_osal_mutex_take(hport->mutex);
         usb_osal_mutex_delete(hport->mutex);
@@ -661,6 +889,14 @@ int usbh_initialize(uint8_t busid, uintptr_t reg_base, usbh_event_handler_t even
         bus->event_handler = dummy_event_handler;
     }
 
+#if CONFIG_USBHOST_DESC_CACHE > 0
+    /* shared by all buses and kept across deinit, like the cached entries */
+    if (g_desc_cache_mutex == NULL) {
+        g_desc_cache_mutex = usb_osal_mutex_create();
+        USB_ASSERT(g_desc_cache_mutex != NULL);
+    }
+#endif
+
 #ifdef __ARMCC_VERSION /* ARM C Compiler */
     extern const int usbh_class_info$$Base;
     extern const int usbh_class_info$$Limit;
@@ -733,6 +969,73 @@ resubmit:
     return ret;
 }
 
+int usbh_sg_urb_prepare(struct usbh_urb *urb, uint32_t align)
+{
+    uint32_t mps = USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize);
+    uint8_t *buffer;
+    bool native = (align != 0);
+
+    urb->transfer_flags &= ~USBH_URB_SG_BOUNCE;
+
+    if (urb->num_sgs == 0) {
+        return 0;
+    }
+
+    if ((USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) != USB_ENDPOINT_TYPE_BULK) &&
+        (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) != USB_ENDPOINT_TYPE_INTERRUPT)) {
+        return -USB_ERR_NOTSUPP;
+    }
+
+    for (uint32_t i = 0; native && (i < urb->num_sgs); i++) {
+        if ((uintptr_t)urb->sg[i].buffer % align) {
+            native = false;
+        }
+        /* a short packet in the middle would end the transfer */
+        if ((i < (urb->num_sgs - 1)) && (urb->sg[i].length % mps)) {
+            native = false;
+        }
+    }
+
+    if (native) {
+        return 0;
+    }
+
+    if (urb->transfer_buffer == NULL) {
+        return -USB_ERR_NOTSUPP;
+    }
+
+    urb->transfer_flags |= USBH_URB_SG_BOUNCE;
+
+    if (!(urb->ep->bEndpointAddress & 0x80)) {
+        buffer = urb->transfer_buffer;
+        for (uint32_t i = 0; i < urb->num_sgs; i++) {
+            usb_memcpy(buffer, urb->sg[i].buffer, urb->sg[i].length);
+            buffer += urb->sg[i].length;
+        }
+    }
+    return 0;
+}
+
+void usbh_sg_urb_done(struct usbh_urb *urb)
+{
+    uint8_t *buffer;
+    uint32_t remain;
+    uint32_t len;
+
+    if (!(urb->transfer_flags & USBH_URB_SG_BOUNCE) || !(urb->ep->bEndpointAddress & 0x80)) {
+        return;
+    }
+
+    buffer = urb->transfer_buffer;
+    remain = urb->actual_length;
+    for (uint32_t i = 0; (i < urb->num_sgs) && remain; i++) {
+        len = MIN(remain, urb->sg[i].length);
+        usb_memcpy(urb->sg[i].buffer, buffer, len);
+        buffer += len;
+        remain -= len;
+    }
+}
+
 int usbh_get_string_desc(struct usbh_hubport *hport, uint8_t index, uint8_t *output, uint16_t output_len)
 {
     struct usb_setup_packet *setup = hport->setup;
@@ -750,12 +1053,12 @@ int usbh_get_string_desc(struct usbh_hubport *hport, uint8_t index, uint8_t *out
     setup->wIndex = 0x0409;
     setup->wLength = 255;
 
-    ret = usbh_control_transfer(hport, setup, ep0_request_buffer[hport->bus->busid]);
+    ret = usbh_control_transfer(hport, setup, ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index]);
     if (ret < 0) {
         return ret;
     }
 
-    src = ep0_request_buffer[hport->bus->busid];
+    src = ep0_request_buffer[hport->bus->busid][hport->ep0_buf_index];
     dst = output;
     len = src[0];
 
@@ -1242,3 +1545,32 @@ __WEAK uint8_t usbh_get_hport_active_config_index(struct usbh_hubport *hport)
 
     return 0; // Default to configuration index 0
 }
+
+/* host controllers that set up every urb from scratch have nothing to keep */
+__WEAK int usbh_pipe_open(struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep)
+{
+    ARG_UNUSED(hport);
+    ARG_UNUSED(ep);
+
+    return 0;
+}
+
+__WEAK int usbh_pipe_close(struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep)
+{
+    ARG_UNUSED(hport);
+    ARG_UNUSED(ep);
+
+    return 0;
+}
+
+__WEAK uint8_t *usbh_eth_rxbuf_alloc(uint32_t size)
+{
+    ARG_UNUSED(size);
+
+    return NULL;
+}
+
+__WEAK void usbh_eth_rxbuf_free(uint8_t *buf)
+{
+    ARG_UNUSED(buf);
+}
@@ -30,6 +30,14 @@
 extern "C" {
 #endif
 
+#ifndef CONFIG_USBHOST_ENUM_THREADS
+#define CONFIG_USBHOST_ENUM_THREADS 0
+#endif
+
+#ifndef CONFIG_USBHOST_DESC_CACHE
+#define CONFIG_USBHOST_DESC_CACHE 0
+#endif
+
 enum usbh_event_type {
     /* USB HCD IRQ */
     USBH_EVENT_ERROR,
@@ -109,6 +117,8 @@ struct usbh_class_driver {
     const char *driver_name;
     int (*connect)(struct usbh_hubport *hport, uint8_t intf);
     int (*disconnect)(struct usbh_hubport *hport, uint8_t intf);
+    /* optional, runs on every interface before any is disconnected while the device is still addressed */
+    int (*prepare_disconnect)(struct usbh_hubport *hport, uint8_t intf);
 };
 
 struct usbh_endpoint {
@@ -154,6 +164,9 @@ struct usbh_hubport {
     struct usb_endpoint_descriptor ep0;
     struct usbh_urb ep0_urb;
     usb_osal_mutex_t mutex;
+    usb_osal_sem_t enum_sem;   /* given by the enumeration thread once it is done with the port */
+    uint8_t ep0_buf_index;     /* ep0 request buffer of the bus, one per enumeration thread */
+    uint32_t enum_time_ms;     /* time from the first request to the class drivers being loaded */
 };
 
 struct usbh_hub {
@@ -204,6 +217,10 @@ struct usbh_bus {
     usb_osal_thread_t hub_thread;
     usb_osal_mq_t hub_mq;
     usb_osal_sem_t hub_sem;
+#if CONFIG_USBHOST_ENUM_THREADS > 0
+    usb_osal_mq_t enum_mq;
+    usb_osal_sem_t enum_sem;
+#endif
     usbh_event_handler_t event_handler;
 };
 
@@ -221,6 +238,8 @@ static inline void usbh_control_urb_fill(struct usbh_urb *urb,
     urb->setup = setup;
     urb->transfer_buffer = transfer_buffer;
     urb->transfer_buffer_length = transfer_buffer_length;
+    urb->sg = NULL;
+    urb->num_sgs = 0;
     urb->timeout = timeout;
     urb->complete = complete;
     urb->arg = arg;
@@ -240,11 +259,73 @@ static inline void usbh_bulk_urb_fill(struct usbh_urb *urb,
     urb->setup = NULL;
     urb->transfer_buffer = transfer_buffer;
     urb->transfer_buffer_length = transfer_buffer_length;
+    urb->sg = NULL;
+    urb->num_sgs = 0;
     urb->timeout = timeout;
     urb->complete = complete;
     urb->arg = arg;
 }
 
+/*
+ * Bulk urb over a list of buffers. Every buffer but the last should be a multiple of ep mps,
+ * then controllers with sg support transfer the list directly. Other controllers, or lists that
+ * break this rule, go through bounce_buffer of the total length, NULL means no bounce buffer and
+ * such urbs fail with -USB_ERR_NOTSUPP.
+ */
+static inline void usbh_bulk_urb_fill_sg(struct usbh_urb *urb,
+                                         struct usbh_hubport *hport,
+                                         struct usb_endpoint_descriptor *ep,
+                                         struct usbh_sg *sg,
+                                         uint32_t num_sgs,
+                                         uint8_t *bounce_buffer,
+                                         uint32_t timeout,
+                                         usbh_complete_callback_t complete,
+                                         void *arg)
+{
+    urb->hport = hport;
+    urb->ep = ep;
+    urb->setup = NULL;
+    urb->transfer_buffer = bounce_buffer;
+    urb->transfer_buffer_length = 0;
+    for (uint32_t i = 0; i < num_sgs; i++) {
+        urb->transfer_buffer_length += sg[i].length;
+    }
+    urb->sg = sg;
+    urb->num_sgs = num_sgs;
+    urb->timeout = timeout;
+    urb->complete = complete;
+    urb->arg = arg;
+}
+
+/* iso_packet[] is filled by the caller, a non-NULL iso_complete makes it a ring (USBH_URB_ISO_RING) */
+static inline void usbh_iso_urb_fill(struct usbh_urb *urb,
+                                     struct usbh_hubport *hport,
+                                     struct usb_endpoint_descriptor *ep,
+                                     uint32_t num_of_iso_packets,
+                                     usbh_iso_complete_callback_t iso_complete,
+                                     usbh_complete_callback_t complete,
+                                     void *arg)
+{
+    urb->hport = hport;
+    urb->ep = ep;
+    urb->setup = NULL;
+    urb->transfer_buffer = NULL;
+    urb->transfer_buffer_length = 0;
+    urb->sg = NULL;
+    urb->num_sgs = 0;
+    urb->timeout = 0;
+    urb->num_of_iso_packets = num_of_iso_packets;
+    urb->iso_complete = iso_complete;
+    if (iso_complete) {
+        urb->transfer_flags |= USBH_URB_ISO_RING;
+    } else {
+        urb->transfer_flags &= ~USBH_URB_ISO_RING;
+    }
+    urb->complete = complete;
+    urb->arg = arg;
+    urb->interval = USBH_GET_URB_INTERVAL(ep->bInterval, hport->speed);
+}
+
 static inline void usbh_int_urb_fill(struct usbh_urb *urb,
                                      struct usbh_hubport *hport,
                                      struct usb_endpoint_descriptor *ep,
@@ -259,6 +340,8 @@ static inline void usbh_int_urb_fill(struct usbh_urb *urb,
     urb->setup = NULL;
     urb->transfer_buffer = transfer_buffer;
     urb->transfer_buffer_length = transfer_buffer_length;
+    urb->sg = NULL;
+    urb->num_sgs = 0;
     urb->timeout = timeout;
     urb->complete = complete;
     urb->arg = arg;
@@ -311,6 +394,57 @@ int usbh_get_string_desc(struct usbh_hubport *hport, uint8_t index, uint8_t *out
  */
 int usbh_set_interface(struct usbh_hubport *hport, uint8_t intf, uint8_t altsetting);
 
+#if CONFIG_USBHOST_DESC_CACHE > 0
+/**
+ * @brief Forgets all config descriptors kept by CONFIG_USBHOST_DESC_CACHE.
+ *
+ * Call it after a firmware update of an attached device changed its descriptors without
+ * changing bcdDevice, or to give the memory back.
+ */
+void usbh_desc_cache_flush(void);
+#endif
+
+/**
+ * @brief Used by hcd on submit of a sg urb.
+ *
+ * If every segment is aligned to align and all but the last one are a multiple of ep mps, the
+ * hcd transfers the list itself. Otherwise, or if align is 0, the list is copied through
+ * urb->transfer_buffer and USBH_URB_SG_BOUNCE is set.
+ *
+ * @param urb Usb request block.
+ * @param align Segment alignment the hcd needs, 0 if it has no sg support.
+ * @return On success will return 0, and others indicate fail.
+ */
+int usbh_sg_urb_prepare(struct usbh_urb *urb, uint32_t align);
+
+/**
+ * @brief Used by hcd when a sg urb completes, before the urb is given back.
+ *
+ * Copies received data from the bounce buffer into the sg list.
+ *
+ * @param urb Usb request block.
+ */
+void usbh_sg_urb_done(struct usbh_urb *urb);
+
+/**
+ * @brief Used by net class drivers to get a buffer for one bulk in transfer.
+ *
+ * The default returns NULL and the driver receives into its own buffer. A network stack that
+ * can pass frames up in place (e.g. platform/lwip with CONFIG_USBHOST_LWIP_RX_ZERO_COPY)
+ * overrides this pair for all net classes.
+ *
+ * @param size Size of the transfer.
+ * @return Buffer or NULL.
+ */
+uint8_t *usbh_eth_rxbuf_alloc(uint32_t size);
+
+/**
+ * @brief Used by net class drivers when they are done with a buffer from usbh_eth_rxbuf_alloc.
+ *
+ * @param buf Buffer from usbh_eth_rxbuf_alloc.
+ */
+void usbh_eth_rxbuf_free(uint8_t *buf);
+
 int usbh_initialize(uint8_t busid, uintptr_t reg_base, usbh_event_handler_t event_handler);
 int usbh_deinitialize(uint8_t busid);
 void *usbh_find_class_instance(const char *devname);
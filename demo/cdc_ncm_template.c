@@ -154,11 +154,14 @@ rt_err_t rt_usbd_cdc_ncm_eth_tx(rt_device_t dev, struct pbuf *p)
 {
     int ret;
 
-    ret = usbd_cdc_ncm_eth_tx(p);
-    if (ret == 0) {
+    /* frames are aggregated into ntbs, only wait when both ntbs are in use */
+    while ((ret = usbd_cdc_ncm_eth_tx(p)) == -USB_ERR_BUSY) {
         if (rt_sem_take(&cdc_ncm_tx_sem, rt_tick_from_millisecond(CDC_NCM_TX_TIMEOUT_MS)) != RT_EOK) {
             return -RT_ETIMEOUT;
         }
+    }
+
+    if (ret == 0) {
         return RT_EOK;
     } else
         return -RT_ERROR;
@@ -263,14 +266,18 @@ err_t linkoutput_fn(struct netif *netif, struct pbuf *p)
     int ret;
     uint32_t timeout = CDC_NCM_TX_TIMEOUT_LOOPS;
 
+    /* frames are aggregated into ntbs, only wait when both ntbs are in use */
     cdc_ncm_tx_done = false;
-    ret = usbd_cdc_ncm_eth_tx(p);
-    if (ret == 0) {
+    while ((ret = usbd_cdc_ncm_eth_tx(p)) == -USB_ERR_BUSY) {
         while (!cdc_ncm_tx_done) {
             if (--timeout == 0) {
                 return ERR_TIMEOUT;
             }
         }
+        cdc_ncm_tx_done = false;
+    }
+
+    if (ret == 0) {
         return ERR_OK;
     } else
         return ERR_BUF;
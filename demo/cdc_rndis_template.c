@@ -148,11 +148,15 @@ rt_err_t rt_usbd_rndis_eth_tx(rt_device_t dev, struct pbuf *p)
 {
     int ret;
 
+    /* frames are batched into one transfer, only wait when both buffers are in use */
     rndis_tx_done = false;
-    ret = usbd_rndis_eth_tx(p);
-    if (ret == 0) {
+    while ((ret = usbd_rndis_eth_tx(p)) == -USB_ERR_BUSY) {
         while (!rndis_tx_done) {
         }
+        rndis_tx_done = false;
+    }
+
+    if (ret == 0) {
         return RT_EOK;
     } else
         return -RT_ERROR;
@@ -250,11 +254,15 @@ err_t linkoutput_fn(struct netif *netif, struct pbuf *p)
 {
     int ret;
 
+    /* frames are batched into one transfer, only wait when both buffers are in use */
     rndis_tx_done = false;
-    ret = usbd_rndis_eth_tx(p);
-    if (ret == 0) {
+    while ((ret = usbd_rndis_eth_tx(p)) == -USB_ERR_BUSY) {
         while (!rndis_tx_done) {
         }
+        rndis_tx_done = false;
+    }
+
+    if (ret == 0) {
         return ERR_OK;
     } else
         return ERR_BUF;
@@ -70,14 +70,16 @@ static void usbh_serial_thread(CONFIG_USB_OSAL_THREAD_SET_ARGV)
     for (uint8_t j = 0; j < 6; j++) {
         uint32_t start_time = (uint32_t)xTaskGetTickCount();
         for (uint32_t i = 0; i < TEST_COUNT; i++) {
-            usbh_serial_write(serial, serial_speed_buffer, test_len[j]);
-            if (ret < 0) {
-                USB_LOG_RAW("bulk out error,ret:%d\r\n", ret);
-                while (1) {
+            for (uint32_t len = 0; len < test_len[j]; len += ret) {
+                ret = usbh_serial_write(serial, &serial_speed_buffer[len], test_len[j] - len);
+                if (ret < 0) {
+                    USB_LOG_RAW("bulk out error,ret:%d\r\n", ret);
+                    while (1) {
+                    }
                 }
-            } else {
             }
         }
+        usbh_serial_drain(serial, 0);
         uint32_t time_ms = xTaskGetTickCount() - start_time;
         USB_LOG_RAW("per packet len:%d, out speed:%f MB/S\r\n", (unsigned int)test_len[j], (test_len[j] * TEST_COUNT / 1024 / 1024) * 1000 / ((float)time_ms));
     }
@@ -89,7 +91,7 @@ static void usbh_serial_thread(CONFIG_USB_OSAL_THREAD_SET_ARGV)
 
     serial_tx_bytes = 0;
     while (1) {
-        ret = usbh_serial_write(serial, serial_tx_buffer, sizeof(serial_tx_buffer));
+        ret = usbh_serial_write(serial, &serial_tx_buffer[serial_tx_bytes], SERIAL_TEST_LEN - serial_tx_bytes);
         if (ret < 0) {
             USB_LOG_RAW("serial write error, ret:%d\r\n", ret);
             goto delete_with_close;
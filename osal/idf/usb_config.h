@@ -197,6 +197,14 @@
 #define CONFIG_USBHOST_SERIAL_RX_SIZE 2048
 #endif
 
+#ifndef CONFIG_USBHOST_SERIAL_TX_SIZE
+#define CONFIG_USBHOST_SERIAL_TX_SIZE 2048
+#endif
+
+#ifndef CONFIG_USBHOST_SERIAL_TX_URB_NUM
+#define CONFIG_USBHOST_SERIAL_TX_URB_NUM 2
+#endif
+
 /* This parameter affects usb performance, and depends on (TCP_WND)tcp eceive windows size,
  * you can change to 2K ~ 16K and must be larger than TCP RX windows size in order to avoid being overflow.
  */
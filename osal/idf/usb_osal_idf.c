@@ -229,6 +229,11 @@ void usb_osal_msleep(uint32_t delay)
     vTaskDelay(pdMS_TO_TICKS(delay));
 }
 
+uint64_t usb_osal_get_timestamp_ns(void)
+{
+    return (uint64_t)esp_timer_get_time() * 1000ULL;
+}
+
 void *usb_osal_malloc(size_t size)
 {
     return malloc(size);
@@ -237,6 +237,11 @@ void usb_osal_msleep(uint32_t delay)
     vTaskDelay(pdMS_TO_TICKS(delay));
 }
 
+uint64_t usb_osal_get_timestamp_ns(void)
+{
+    return (uint64_t)xTaskGetTickCount() * 1000000000ULL / configTICK_RATE_HZ;
+}
+
 void *usb_osal_malloc(size_t size)
 {
     return pvPortMalloc(size);
@@ -14,6 +14,7 @@
 #include "los_mux.h"
 #include "los_memory.h"
 #include "los_swtmr.h"
+#include "los_tick.h"
 
 usb_osal_thread_t usb_osal_thread_create(const char *name, uint32_t stack_size, uint32_t prio, usb_thread_entry_t entry, void *args)
 {
@@ -271,6 +272,11 @@ void usb_osal_msleep(uint32_t delay)
     LOS_Msleep(delay);
 }
 
+uint64_t usb_osal_get_timestamp_ns(void)
+{
+    return (uint64_t)LOS_TickCountGet() * 1000000000ULL / LOSCFG_BASE_CORE_TICK_PER_SECOND;
+}
+
 void *usb_osal_malloc(size_t size)
 {
     return LOS_MemAlloc((VOID *)OS_SYS_MEM_ADDR, size);
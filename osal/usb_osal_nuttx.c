@@ -17,6 +17,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -391,6 +392,14 @@ void usb_osal_msleep(uint32_t delay)
     nxsig_usleep(usec);
 }
 
+uint64_t usb_osal_get_timestamp_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
 void *usb_osal_malloc(size_t size)
 {
     return kmm_malloc(size);
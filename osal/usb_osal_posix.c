@@ -0,0 +1,730 @@
+/*
+ * Copyright (c) 2025, sakumisu
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "usb_osal.h"
+#include "usb_errno.h"
+#include "usb_config.h"
+#include "usb_log.h"
+#include "usb_util.h"
+#include "usb_list.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+/*
+ * Linux userspace backend, stacks run as normal pthreads so they can be debugged,
+ * profiled with perf and stress tested on a workstation.
+ *
+ * - thread: deleting another thread asks it to exit, it leaves at its next (or current)
+ *   sem, mq or sleep wait, never while holding a lock of this file.
+ * - sem: futex based counting semaphore, give is lock free and never blocks.
+ * - mq: fixed size ring protected by a mutex and two condition variables.
+ * - timer: one timerfd per timer, all handlers are dispatched from a single thread,
+ *   without any lock held.
+ * - critical section: one process wide recursive mutex, there is no real irq context.
+ */
+
+#ifndef CONFIG_USB_OSAL_POSIX_MIN_STACKSIZE
+#define CONFIG_USB_OSAL_POSIX_MIN_STACKSIZE (64 * 1024)
+#endif
+
+struct usb_osal_posix_thread {
+    char name[16]; /* limited to 15 chars on linux */
+    usb_thread_entry_t entry;
+    void *args;
+    atomic_uint exit_req;          /* set by usb_osal_thread_delete, also the futex word of msleep */
+    _Atomic(void *) blocked_sem;   /* sem the thread waits on */
+    _Atomic(void *) blocked_mq;    /* mq the thread waits on */
+    bool exited;                   /* the thread is gone, under g_usb_osal_thread_lock */
+    bool deleted;                  /* the handle is gone, under g_usb_osal_thread_lock */
+};
+
+struct usb_osal_posix_sem {
+    atomic_uint count;
+    atomic_uint seq; /* futex word, bumped by every give and by a thread delete */
+    uint32_t max_count;
+};
+
+struct usb_osal_posix_mq {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    uint32_t max_msgs;
+    uint32_t head;
+    uint32_t count;
+    uintptr_t msgs[];
+};
+
+struct usb_osal_posix_timer {
+    usb_dlist_t list;
+    int fd;
+    struct usb_osal_timer *timer;
+};
+
+static pthread_mutex_t g_usb_osal_critical_lock;
+static pthread_mutex_t g_usb_osal_timer_lock;
+static pthread_mutex_t g_usb_osal_thread_lock = PTHREAD_MUTEX_INITIALIZER; /* keeps a thread struct until both the thread and its handle are gone */
+static pthread_cond_t g_usb_osal_timer_cond; /* signaled when a handler returns */
+static struct usb_osal_posix_timer *g_usb_osal_timer_running;
+static pthread_t g_usb_osal_timer_tid;
+static pthread_once_t g_usb_osal_once = PTHREAD_ONCE_INIT;
+static int g_usb_osal_epfd = -1;
+static usb_dlist_t g_usb_osal_timer_list = USB_DLIST_OBJECT_INIT(g_usb_osal_timer_list);
+static __thread struct usb_osal_posix_thread *g_usb_osal_current_thread;
+
+static void usb_osal_get_deadline(struct timespec *ts, uint32_t timeout)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += timeout / 1000;
+    ts->tv_nsec += (long)(timeout % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/* return false if the deadline has passed, else fill the remaining time */
+static bool usb_osal_get_remaining(const struct timespec *deadline, struct timespec *remain)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remain->tv_sec = deadline->tv_sec - now.tv_sec;
+    remain->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (remain->tv_nsec < 0) {
+        remain->tv_sec--;
+        remain->tv_nsec += 1000000000L;
+    }
+    return (remain->tv_sec >= 0);
+}
+
+static bool usb_osal_timer_is_valid(struct usb_osal_posix_timer *posix_timer)
+{
+    usb_dlist_t *node;
+
+    usb_dlist_for_each(node, &g_usb_osal_timer_list)
+    {
+        if (node == &posix_timer->list) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *usb_osal_timer_thread(void *argument)
+{
+    struct epoll_event events[8];
+    struct usb_osal_posix_timer *posix_timer;
+    uint64_t expirations;
+    int nfds;
+
+    (void)argument;
+
+    while (1) {
+        nfds = epoll_wait(g_usb_osal_epfd, events, 8, -1);
+        if (nfds < 0) {
+            continue;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            posix_timer = (struct usb_osal_posix_timer *)events[i].data.ptr;
+
+            pthread_mutex_lock(&g_usb_osal_timer_lock);
+            /* timer may be deleted, stopped or rearmed since epoll_wait returned, recheck */
+            if (!usb_osal_timer_is_valid(posix_timer) ||
+                (read(posix_timer->fd, &expirations, sizeof(expirations)) != sizeof(expirations))) {
+                pthread_mutex_unlock(&g_usb_osal_timer_lock);
+                continue;
+            }
+            g_usb_osal_timer_running = posix_timer;
+            pthread_mutex_unlock(&g_usb_osal_timer_lock);
+
+            /* the handler may take any lock, usb_osal_timer_delete waits for it to return */
+            posix_timer->timer->handler(posix_timer->timer->argument);
+
+            pthread_mutex_lock(&g_usb_osal_timer_lock);
+            g_usb_osal_timer_running = NULL;
+            pthread_cond_broadcast(&g_usb_osal_timer_cond);
+            pthread_mutex_unlock(&g_usb_osal_timer_lock);
+        }
+    }
+
+    return NULL;
+}
+
+static void usb_osal_posix_init(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_t tid;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&g_usb_osal_critical_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&g_usb_osal_timer_lock, NULL);
+    pthread_cond_init(&g_usb_osal_timer_cond, NULL);
+
+    g_usb_osal_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_usb_osal_epfd < 0) {
+        USB_LOG_ERR("Create timer epoll failed\r\n");
+        return;
+    }
+
+    if (pthread_create(&tid, NULL, usb_osal_timer_thread, NULL) != 0) {
+        USB_LOG_ERR("Create timer thread failed\r\n");
+        return;
+    }
+    g_usb_osal_timer_tid = tid;
+    pthread_setname_np(tid, "usb_timer");
+    pthread_detach(tid);
+}
+
+static long usb_osal_futex(atomic_uint *uaddr, int op, uint32_t val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, uaddr, op | FUTEX_PRIVATE_FLAG, val, timeout, NULL, 0);
+}
+
+/* the struct is freed by whichever of the thread and usb_osal_thread_delete comes last */
+static void usb_osal_thread_finish(struct usb_osal_posix_thread *thread, bool deleted)
+{
+    if (thread == NULL) {
+        return;
+    }
+    /* usb_osal_thread_delete may still be waking us */
+    pthread_mutex_lock(&g_usb_osal_thread_lock);
+    thread->exited = true;
+    thread->deleted |= deleted;
+    if (thread->deleted) {
+        free(thread);
+    }
+    pthread_mutex_unlock(&g_usb_osal_thread_lock);
+    g_usb_osal_current_thread = NULL;
+}
+
+static void usb_osal_thread_exit(void)
+{
+    usb_osal_thread_finish(g_usb_osal_current_thread, false);
+    pthread_exit(NULL);
+}
+
+/* true if usb_osal_thread_delete asked the calling thread to exit */
+static inline bool usb_osal_thread_exit_requested(void)
+{
+    struct usb_osal_posix_thread *thread = g_usb_osal_current_thread;
+
+    return thread && atomic_load(&thread->exit_req);
+}
+
+static void *usb_osal_thread_entry(void *argument)
+{
+    struct usb_osal_posix_thread *thread = (struct usb_osal_posix_thread *)argument;
+
+    g_usb_osal_current_thread = thread;
+    /* named here, a thread deleting itself may be gone before pthread_create returns */
+    pthread_setname_np(pthread_self(), thread->name);
+    thread->entry(thread->args);
+    usb_osal_thread_finish(thread, false);
+    return NULL;
+}
+
+usb_osal_thread_t usb_osal_thread_create(const char *name, uint32_t stack_size, uint32_t prio, usb_thread_entry_t entry, void *args)
+{
+    struct usb_osal_posix_thread *thread;
+    pthread_attr_t attr;
+    pthread_t tid;
+    int ret;
+
+    (void)prio;
+
+    pthread_once(&g_usb_osal_once, usb_osal_posix_init);
+
+    thread = malloc(sizeof(struct usb_osal_posix_thread));
+    if (thread == NULL) {
+        return NULL;
+    }
+    strncpy(thread->name, name, sizeof(thread->name) - 1);
+    thread->name[sizeof(thread->name) - 1] = '\0';
+    thread->entry = entry;
+    thread->args = args;
+    atomic_init(&thread->exit_req, 0);
+    atomic_init(&thread->blocked_sem, NULL);
+    atomic_init(&thread->blocked_mq, NULL);
+    thread->exited = false;
+    thread->deleted = false;
+
+    /* stack sizes are tuned for mcu, libc needs much more */
+    if (stack_size < CONFIG_USB_OSAL_POSIX_MIN_STACKSIZE) {
+        stack_size = CONFIG_USB_OSAL_POSIX_MIN_STACKSIZE;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&tid, &attr, usb_osal_thread_entry, thread);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        USB_LOG_ERR("Create thread %s failed\r\n", name);
+        free(thread);
+        return NULL;
+    }
+
+    return (usb_osal_thread_t)thread;
+}
+
+void usb_osal_thread_delete(usb_osal_thread_t thread)
+{
+    struct usb_osal_posix_thread *posix_thread = (struct usb_osal_posix_thread *)thread;
+    struct usb_osal_posix_sem *sem;
+    struct usb_osal_posix_mq *mq;
+
+    if (thread == NULL || posix_thread == g_usb_osal_current_thread) {
+        usb_osal_thread_finish(g_usb_osal_current_thread, true);
+        pthread_exit(NULL);
+    }
+
+    /*
+     * pthread_cancel is not used: the futex wait is no cancellation point and a cancel in
+     * the mq wait leaves its mutex locked. The thread checks the flag in every wait after
+     * publishing what it waits on, so either it sees the flag or we see the object to wake.
+     * It frees itself on the way out, unless it has already returned from its entry.
+     */
+    pthread_mutex_lock(&g_usb_osal_thread_lock);
+    if (posix_thread->exited) {
+        free(posix_thread);
+        pthread_mutex_unlock(&g_usb_osal_thread_lock);
+        return;
+    }
+    posix_thread->deleted = true;
+    atomic_store(&posix_thread->exit_req, 1);
+    usb_osal_futex(&posix_thread->exit_req, FUTEX_WAKE, 1, NULL);
+
+    sem = atomic_load(&posix_thread->blocked_sem);
+    if (sem) {
+        atomic_fetch_add(&sem->seq, 1);
+        usb_osal_futex(&sem->seq, FUTEX_WAKE, INT_MAX, NULL);
+    }
+
+    mq = atomic_load(&posix_thread->blocked_mq);
+    if (mq) {
+        pthread_mutex_lock(&mq->lock);
+        pthread_cond_broadcast(&mq->not_empty);
+        pthread_cond_broadcast(&mq->not_full);
+        pthread_mutex_unlock(&mq->lock);
+    }
+    pthread_mutex_unlock(&g_usb_osal_thread_lock);
+}
+
+void usb_osal_thread_schedule_other(void)
+{
+    sched_yield();
+}
+
+usb_osal_sem_t usb_osal_sem_create(uint32_t initial_count)
+{
+    struct usb_osal_posix_sem *sem;
+
+    sem = malloc(sizeof(struct usb_osal_posix_sem));
+    if (sem == NULL) {
+        return NULL;
+    }
+
+    atomic_init(&sem->count, initial_count ? 1 : 0);
+    atomic_init(&sem->seq, 0);
+    sem->max_count = 1;
+    return (usb_osal_sem_t)sem;
+}
+
+usb_osal_sem_t usb_osal_sem_create_counting(uint32_t max_count)
+{
+    struct usb_osal_posix_sem *sem;
+
+    sem = malloc(sizeof(struct usb_osal_posix_sem));
+    if (sem == NULL) {
+        return NULL;
+    }
+
+    atomic_init(&sem->count, 0);
+    atomic_init(&sem->seq, 0);
+    sem->max_count = max_count;
+    return (usb_osal_sem_t)sem;
+}
+
+void usb_osal_sem_delete(usb_osal_sem_t sem)
+{
+    free(sem);
+}
+
+int usb_osal_sem_take(usb_osal_sem_t sem, uint32_t timeout)
+{
+    struct usb_osal_posix_sem *posix_sem = (struct usb_osal_posix_sem *)sem;
+    struct usb_osal_posix_thread *thread = g_usb_osal_current_thread;
+    struct timespec deadline;
+    struct timespec remain;
+    unsigned int count;
+    unsigned int seq;
+    int ret = 0;
+
+    if (timeout != USB_OSAL_WAITING_FOREVER) {
+        usb_osal_get_deadline(&deadline, timeout);
+    }
+
+    while (1) {
+        /* read before the count, a give in between changes it and the wait returns at once */
+        seq = atomic_load(&posix_sem->seq);
+
+        count = atomic_load_explicit(&posix_sem->count, memory_order_relaxed);
+        while (count > 0) {
+            if (atomic_compare_exchange_weak_explicit(&posix_sem->count, &count, count - 1,
+                                                      memory_order_acquire, memory_order_relaxed)) {
+                goto out;
+            }
+        }
+
+        if (thread) {
+            atomic_store(&thread->blocked_sem, posix_sem);
+            if (atomic_load(&thread->exit_req)) {
+                atomic_store(&thread->blocked_sem, NULL);
+                /* pass on a give that may have woken us instead of another waiter */
+                usb_osal_futex(&posix_sem->seq, FUTEX_WAKE, 1, NULL);
+                usb_osal_thread_exit();
+            }
+        }
+
+        if (timeout == USB_OSAL_WAITING_FOREVER) {
+            usb_osal_futex(&posix_sem->seq, FUTEX_WAIT, seq, NULL);
+        } else {
+            if (!usb_osal_get_remaining(&deadline, &remain)) {
+                ret = -USB_ERR_TIMEOUT;
+                goto out;
+            }
+            usb_osal_futex(&posix_sem->seq, FUTEX_WAIT, seq, &remain);
+        }
+    }
+
+out:
+    if (thread) {
+        atomic_store(&thread->blocked_sem, NULL);
+    }
+    return ret;
+}
+
+int usb_osal_sem_give(usb_osal_sem_t sem)
+{
+    struct usb_osal_posix_sem *posix_sem = (struct usb_osal_posix_sem *)sem;
+    unsigned int count;
+
+    count = atomic_load_explicit(&posix_sem->count, memory_order_relaxed);
+    do {
+        if (count >= posix_sem->max_count) {
+            return -USB_ERR_TIMEOUT;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&posix_sem->count, &count, count + 1,
+                                                    memory_order_release, memory_order_relaxed));
+
+    atomic_fetch_add(&posix_sem->seq, 1);
+    usb_osal_futex(&posix_sem->seq, FUTEX_WAKE, 1, NULL);
+    return 0;
+}
+
+void usb_osal_sem_reset(usb_osal_sem_t sem)
+{
+    struct usb_osal_posix_sem *posix_sem = (struct usb_osal_posix_sem *)sem;
+
+    atomic_store_explicit(&posix_sem->count, 0, memory_order_relaxed);
+}
+
+usb_osal_mutex_t usb_osal_mutex_create(void)
+{
+    pthread_mutex_t *mutex;
+
+    mutex = malloc(sizeof(pthread_mutex_t));
+    if (mutex == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(mutex, NULL);
+    return (usb_osal_mutex_t)mutex;
+}
+
+void usb_osal_mutex_delete(usb_osal_mutex_t mutex)
+{
+    pthread_mutex_destroy((pthread_mutex_t *)mutex);
+    free(mutex);
+}
+
+int usb_osal_mutex_take(usb_osal_mutex_t mutex)
+{
+    return (pthread_mutex_lock((pthread_mutex_t *)mutex) == 0) ? 0 : -USB_ERR_TIMEOUT;
+}
+
+int usb_osal_mutex_give(usb_osal_mutex_t mutex)
+{
+    return (pthread_mutex_unlock((pthread_mutex_t *)mutex) == 0) ? 0 : -USB_ERR_TIMEOUT;
+}
+
+usb_osal_mq_t usb_osal_mq_create(uint32_t max_msgs)
+{
+    struct usb_osal_posix_mq *mq;
+    pthread_condattr_t attr;
+
+    mq = malloc(sizeof(struct usb_osal_posix_mq) + max_msgs * sizeof(uintptr_t));
+    if (mq == NULL) {
+        return NULL;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&mq->lock, NULL);
+    pthread_cond_init(&mq->not_empty, &attr);
+    pthread_cond_init(&mq->not_full, &attr);
+    pthread_condattr_destroy(&attr);
+
+    mq->max_msgs = max_msgs;
+    mq->head = 0;
+    mq->count = 0;
+    return (usb_osal_mq_t)mq;
+}
+
+void usb_osal_mq_delete(usb_osal_mq_t mq)
+{
+    struct usb_osal_posix_mq *posix_mq = (struct usb_osal_posix_mq *)mq;
+
+    pthread_cond_destroy(&posix_mq->not_empty);
+    pthread_cond_destroy(&posix_mq->not_full);
+    pthread_mutex_destroy(&posix_mq->lock);
+    free(posix_mq);
+}
+
+/* called with the mq lock held before every wait, leaves the thread if it is being deleted */
+static void usb_osal_mq_check_exit(struct usb_osal_posix_mq *posix_mq)
+{
+    struct usb_osal_posix_thread *thread = g_usb_osal_current_thread;
+
+    if (thread) {
+        atomic_store(&thread->blocked_mq, posix_mq);
+        if (atomic_load(&thread->exit_req)) {
+            atomic_store(&thread->blocked_mq, NULL);
+            pthread_mutex_unlock(&posix_mq->lock);
+            usb_osal_thread_exit();
+        }
+    }
+}
+
+static void usb_osal_mq_wait_done(void)
+{
+    if (g_usb_osal_current_thread) {
+        atomic_store(&g_usb_osal_current_thread->blocked_mq, NULL);
+    }
+}
+
+int usb_osal_mq_send(usb_osal_mq_t mq, uintptr_t addr)
+{
+    struct usb_osal_posix_mq *posix_mq = (struct usb_osal_posix_mq *)mq;
+
+    pthread_mutex_lock(&posix_mq->lock);
+    while (posix_mq->count == posix_mq->max_msgs) {
+        usb_osal_mq_check_exit(posix_mq);
+        pthread_cond_wait(&posix_mq->not_full, &posix_mq->lock);
+    }
+    usb_osal_mq_wait_done();
+    posix_mq->msgs[(posix_mq->head + posix_mq->count) % posix_mq->max_msgs] = addr;
+    posix_mq->count++;
+    pthread_cond_signal(&posix_mq->not_empty);
+    pthread_mutex_unlock(&posix_mq->lock);
+
+    return 0;
+}
+
+int usb_osal_mq_recv(usb_osal_mq_t mq, uintptr_t *addr, uint32_t timeout)
+{
+    struct usb_osal_posix_mq *posix_mq = (struct usb_osal_posix_mq *)mq;
+    struct timespec deadline;
+    int ret = 0;
+
+    if (timeout != USB_OSAL_WAITING_FOREVER) {
+        usb_osal_get_deadline(&deadline, timeout);
+    }
+
+    pthread_mutex_lock(&posix_mq->lock);
+    while (posix_mq->count == 0) {
+        usb_osal_mq_check_exit(posix_mq);
+        if (timeout == USB_OSAL_WAITING_FOREVER) {
+            pthread_cond_wait(&posix_mq->not_empty, &posix_mq->lock);
+        } else if (pthread_cond_timedwait(&posix_mq->not_empty, &posix_mq->lock, &deadline) == ETIMEDOUT) {
+            if (posix_mq->count == 0) {
+                ret = -USB_ERR_TIMEOUT;
+                break;
+            }
+        }
+    }
+    usb_osal_mq_wait_done();
+
+    if (ret == 0) {
+        *addr = posix_mq->msgs[posix_mq->head];
+        posix_mq->head = (posix_mq->head + 1) % posix_mq->max_msgs;
+        posix_mq->count--;
+        pthread_cond_signal(&posix_mq->not_full);
+    }
+    pthread_mutex_unlock(&posix_mq->lock);
+
+    return ret;
+}
+
+struct usb_osal_timer *usb_osal_timer_create(const char *name, uint32_t timeout_ms, usb_timer_handler_t handler, void *argument, bool is_period)
+{
+    struct usb_osal_timer *timer;
+    struct usb_osal_posix_timer *posix_timer;
+    struct epoll_event event;
+
+    (void)name;
+
+    pthread_once(&g_usb_osal_once, usb_osal_posix_init);
+
+    timer = malloc(sizeof(struct usb_osal_timer) + sizeof(struct usb_osal_posix_timer));
+    if (timer == NULL) {
+        return NULL;
+    }
+    memset(timer, 0, sizeof(struct usb_osal_timer) + sizeof(struct usb_osal_posix_timer));
+
+    posix_timer = (struct usb_osal_posix_timer *)(timer + 1);
+    posix_timer->timer = timer;
+    posix_timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (posix_timer->fd < 0) {
+        free(timer);
+        return NULL;
+    }
+
+    timer->handler = handler;
+    timer->argument = argument;
+    timer->is_period = is_period;
+    timer->timeout_ms = timeout_ms;
+    timer->timer = posix_timer;
+
+    pthread_mutex_lock(&g_usb_osal_timer_lock);
+    usb_dlist_insert_after(&g_usb_osal_timer_list, &posix_timer->list);
+    pthread_mutex_unlock(&g_usb_osal_timer_lock);
+
+    event.events = EPOLLIN;
+    event.data.ptr = posix_timer;
+    if (epoll_ctl(g_usb_osal_epfd, EPOLL_CTL_ADD, posix_timer->fd, &event) < 0) {
+        usb_osal_timer_delete(timer);
+        return NULL;
+    }
+
+    return timer;
+}
+
+void usb_osal_timer_delete(struct usb_osal_timer *timer)
+{
+    struct usb_osal_posix_timer *posix_timer = (struct usb_osal_posix_timer *)timer->timer;
+
+    /* never dispatched again once off the list, then wait for a handler still running */
+    pthread_mutex_lock(&g_usb_osal_timer_lock);
+    usb_dlist_remove(&posix_timer->list);
+    epoll_ctl(g_usb_osal_epfd, EPOLL_CTL_DEL, posix_timer->fd, NULL);
+    close(posix_timer->fd);
+    /* a handler deleting its own timer must not wait for itself */
+    while ((g_usb_osal_timer_running == posix_timer) && !pthread_equal(pthread_self(), g_usb_osal_timer_tid)) {
+        pthread_cond_wait(&g_usb_osal_timer_cond, &g_usb_osal_timer_lock);
+    }
+    pthread_mutex_unlock(&g_usb_osal_timer_lock);
+
+    free(timer);
+}
+
+void usb_osal_timer_start(struct usb_osal_timer *timer)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(struct itimerspec));
+    its.it_value.tv_sec = timer->timeout_ms / 1000;
+    its.it_value.tv_nsec = (long)(timer->timeout_ms % 1000) * 1000000L;
+    if (timer->timeout_ms == 0) {
+        /* zero disarms a timerfd */
+        its.it_value.tv_nsec = 1;
+    }
+    if (timer->is_period) {
+        its.it_interval = its.it_value;
+    }
+
+    timerfd_settime(((struct usb_osal_posix_timer *)timer->timer)->fd, 0, &its, NULL);
+}
+
+void usb_osal_timer_stop(struct usb_osal_timer *timer)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(struct itimerspec));
+    timerfd_settime(((struct usb_osal_posix_timer *)timer->timer)->fd, 0, &its, NULL);
+}
+
+size_t usb_osal_enter_critical_section(void)
+{
+    pthread_once(&g_usb_osal_once, usb_osal_posix_init);
+    pthread_mutex_lock(&g_usb_osal_critical_lock);
+    return 1;
+}
+
+void usb_osal_leave_critical_section(size_t flag)
+{
+    (void)flag;
+    pthread_mutex_unlock(&g_usb_osal_critical_lock);
+}
+
+void usb_osal_msleep(uint32_t delay)
+{
+    struct usb_osal_posix_thread *thread = g_usb_osal_current_thread;
+    struct timespec deadline;
+    struct timespec remain;
+
+    if (thread == NULL) {
+        remain.tv_sec = delay / 1000;
+        remain.tv_nsec = (long)(delay % 1000) * 1000000L;
+        while (clock_nanosleep(CLOCK_MONOTONIC, 0, &remain, &remain) == EINTR) {
+        }
+        return;
+    }
+
+    /* sleep on the exit flag, usb_osal_thread_delete wakes it */
+    usb_osal_get_deadline(&deadline, delay);
+    while (usb_osal_get_remaining(&deadline, &remain)) {
+        if (atomic_load(&thread->exit_req)) {
+            usb_osal_thread_exit();
+        }
+        usb_osal_futex(&thread->exit_req, FUTEX_WAIT, 0, &remain);
+    }
+}
+
+void *usb_osal_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+void usb_osal_free(void *ptr)
+{
+    free(ptr);
+}
+
+/* Override with a cycle counter (rdtsc, cntvct_el0 ...) for finer and cheaper timestamps */
+__WEAK uint64_t usb_osal_get_timestamp_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
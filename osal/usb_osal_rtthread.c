@@ -201,6 +201,11 @@ void usb_osal_msleep(uint32_t delay)
     rt_thread_mdelay(delay);
 }
 
+uint64_t usb_osal_get_timestamp_ns(void)
+{
+    return (uint64_t)rt_tick_get() * 1000000000ULL / RT_TICK_PER_SECOND;
+}
+
 void *usb_osal_malloc(size_t size)
 {
     return rt_malloc(size);
@@ -273,6 +273,11 @@ void usb_osal_msleep(uint32_t delay)
     tx_thread_sleep(delay);
 }
 
+uint64_t usb_osal_get_timestamp_ns(void)
+{
+    return (uint64_t)tx_time_get() * 1000000000ULL / TX_TIMER_TICKS_PER_SECOND;
+}
+
 void *usb_osal_malloc(size_t size)
 {
     CHAR *pointer = TX_NULL;
@@ -309,6 +309,11 @@ void usb_osal_msleep(uint32_t delay)
     k_sleep(K_MSEC(delay));
 }
 
+uint64_t usb_osal_get_timestamp_ns(void)
+{
+    return (uint64_t)k_uptime_get() * 1000000ULL;
+}
+
 void *usb_osal_malloc(size_t size)
 {
     return k_malloc(size);
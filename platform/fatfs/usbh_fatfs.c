@@ -20,6 +20,15 @@ int USB_disk_initialize(void)
     if (usbh_msc_scsi_init(active_msc_class) < 0) {
         return RES_NOTRDY;
     }
+    if ((active_msc_class->blocksize < FF_MIN_SS) || (active_msc_class->blocksize > FF_MAX_SS)) {
+        printf("sector size %u is not supported, check FF_MIN_SS and FF_MAX_SS\r\n", active_msc_class->blocksize);
+        return RES_NOTRDY;
+    }
+#if !FF_LBA64
+    if (active_msc_class->blocknum > 0xffffffff) {
+        printf("only the first 2^32 sectors are usable, enable FF_LBA64\r\n");
+    }
+#endif
     return RES_OK;
 }
 
@@ -30,62 +39,19 @@ int USB_disk_status(void)
 
 int USB_disk_read(BYTE *buff, LBA_t sector, UINT count)
 {
-    int ret;
-    uint8_t *align_buf;
-
-    align_buf = (uint8_t *)buff;
-
-    if ((uint32_t)buff & (CONFIG_USB_ALIGN_SIZE - 1)) {
-        align_buf = (uint8_t *)aligned_alloc(CONFIG_USB_ALIGN_SIZE, count * active_msc_class->blocksize);
-        if (!align_buf) {
-            printf("msc get align buf failed\r\n");
-            return -USB_ERR_NOMEM;
-        }
+    /* unaligned buffers are staged through the msc bounce buffer */
+    if (usbh_msc_scsi_read(active_msc_class, sector, buff, count) < 0) {
+        return RES_ERROR;
     }
-
-    ret = usbh_msc_scsi_read10(active_msc_class, sector, align_buf, count);
-    if (ret < 0) {
-        ret = RES_ERROR;
-    } else {
-        ret = RES_OK;
-    }
-
-    if ((uint32_t)buff & (CONFIG_USB_ALIGN_SIZE - 1)) {
-        usb_memcpy(buff, align_buf, count * active_msc_class->blocksize);
-        free(align_buf);
-    }
-
-    return ret;
+    return RES_OK;
 }
 
 int USB_disk_write(const BYTE *buff, LBA_t sector, UINT count)
 {
-    int ret;
-    uint8_t *align_buf;
-
-    align_buf = (uint8_t *)buff;
-
-    if ((uint32_t)buff & (CONFIG_USB_ALIGN_SIZE - 1)) {
-        align_buf = (uint8_t *)aligned_alloc(CONFIG_USB_ALIGN_SIZE, count * active_msc_class->blocksize);
-        if (!align_buf) {
-            printf("msc get align buf failed\r\n");
-            return -USB_ERR_NOMEM;
-        }
-        usb_memcpy(align_buf, buff, count * active_msc_class->blocksize);
-    }
-
-    ret = usbh_msc_scsi_write10(active_msc_class, sector, align_buf, count);
-    if (ret < 0) {
-        ret = RES_ERROR;
-    } else {
-        ret = RES_OK;
+    if (usbh_msc_scsi_write(active_msc_class, sector, buff, count) < 0) {
+        return RES_ERROR;
     }
-
-    if ((uint32_t)buff & (CONFIG_USB_ALIGN_SIZE - 1)) {
-        free(align_buf);
-    }
-
-    return ret;
+    return RES_OK;
 }
 
 int USB_disk_ioctl(BYTE cmd, void *buff)
@@ -94,7 +60,7 @@ int USB_disk_ioctl(BYTE cmd, void *buff)
 
     switch (cmd) {
         case CTRL_SYNC:
-            result = RES_OK;
+            result = (usbh_msc_scsi_sync(active_msc_class) < 0) ? RES_ERROR : RES_OK;
             break;
 
         case GET_SECTOR_SIZE:
@@ -108,7 +74,7 @@ int USB_disk_ioctl(BYTE cmd, void *buff)
             break;
 
         case GET_SECTOR_COUNT:
-            *(DWORD *)buff = active_msc_class->blocknum;
+            *(LBA_t *)buff = (LBA_t)MIN(active_msc_class->blocknum, (LBA_t)-1);
             result = RES_OK;
             break;
 
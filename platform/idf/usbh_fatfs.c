@@ -54,25 +54,10 @@ static DRESULT usb_disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
         return RES_PARERR;
     }
 
-    uint8_t *dma_buff = buff;
-    size_t len = msc_class->blocksize * count;
-
-    if (((uint32_t)dma_buff & (CONFIG_USB_ALIGN_SIZE - 1)) || (len & (CONFIG_USB_ALIGN_SIZE - 1))) {
-        dma_buff = heap_caps_aligned_alloc(CONFIG_USB_ALIGN_SIZE, len, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
-        if (dma_buff == NULL) {
-            return RES_ERROR;
-        }
-    }
-
-    int ret = usbh_msc_scsi_read10(msc_class, sector, dma_buff, count);
-    if (dma_buff != buff) {
-        if (ret == 0) {
-            memcpy(buff, dma_buff, len);
-        }
-        heap_caps_free(dma_buff);
-    }
+    /* buffers that are not dma aligned are staged through the msc bounce buffer */
+    int ret = usbh_msc_scsi_read(msc_class, sector, buff, count);
     if (ret != 0) {
-        ESP_LOGE(TAG, "usbh_msc_scsi_read10 failed (%d)", ret);
+        ESP_LOGE(TAG, "usbh_msc_scsi_read failed (%d)", ret);
         return RES_ERROR;
     }
 
@@ -91,23 +76,9 @@ static DRESULT usb_disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT co
         return RES_PARERR;
     }
 
-    const uint8_t *dma_buff = buff;
-    size_t len = msc_class->blocksize * count;
-
-    if (((uint32_t)dma_buff & (CONFIG_USB_ALIGN_SIZE - 1)) || (len & (CONFIG_USB_ALIGN_SIZE - 1))) {
-        dma_buff = heap_caps_aligned_alloc(CONFIG_USB_ALIGN_SIZE, len, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
-        if (dma_buff == NULL) {
-            return RES_ERROR;
-        }
-        memcpy((uint8_t *)dma_buff, buff, len);
-    }
-
-    int ret = usbh_msc_scsi_write10(msc_class, sector, dma_buff, count);
-    if (dma_buff != buff) {
-        heap_caps_free((uint8_t *)dma_buff);
-    }
+    int ret = usbh_msc_scsi_write(msc_class, sector, buff, count);
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "usbh_msc_scsi_write10 failed (%d)", ret);
+        ESP_LOGE(TAG, "usbh_msc_scsi_write failed (%d)", ret);
         return RES_ERROR;
     }
     return RES_OK;
@@ -123,7 +94,7 @@ static DRESULT usb_disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
 
     switch (cmd) {
     case CTRL_SYNC:
-        return RES_OK;
+        return (usbh_msc_scsi_sync(msc_class) < 0) ? RES_ERROR : RES_OK;
     case GET_SECTOR_COUNT:
         *((DWORD *) buff) = msc_class->blocknum;
         return RES_OK;
@@ -44,10 +44,147 @@
 // #define CONFIG_USBHOST_PLATFORM_ASIX
 // #define CONFIG_USBHOST_PLATFORM_RTL8152
 
+// #define CONFIG_USBHOST_LWIP_RX_ZERO_COPY
+
+#ifdef CONFIG_USBHOST_LWIP_RX_ZERO_COPY
+#if !LWIP_SUPPORT_CUSTOM_PBUF
+#error CONFIG_USBHOST_LWIP_RX_ZERO_COPY needs LWIP_SUPPORT_CUSTOM_PBUF
+#endif
+
+#ifndef CONFIG_USBHOST_LWIP_RX_BUF_NUM
+#define CONFIG_USBHOST_LWIP_RX_BUF_NUM 4
+#endif
+
+#ifndef CONFIG_USBHOST_LWIP_RX_BUF_SIZE
+#define CONFIG_USBHOST_LWIP_RX_BUF_SIZE 2048
+#endif
+
+#ifndef CONFIG_USBHOST_LWIP_RX_PBUF_NUM
+#define CONFIG_USBHOST_LWIP_RX_PBUF_NUM 32
+#endif
+
+#define USBH_LWIP_RX_BUF_SIZE USB_ALIGN_UP(CONFIG_USBHOST_LWIP_RX_BUF_SIZE, CONFIG_USB_ALIGN_SIZE)
+#endif
+
 ip_addr_t g_ipaddr;
 ip_addr_t g_netmask;
 ip_addr_t g_gateway;
 
+#ifdef CONFIG_USBHOST_LWIP_RX_ZERO_COPY
+/* class drivers receive into these buffers, frames are handed to lwip as pbufs pointing into them */
+static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t g_usbh_lwip_rx_buf[CONFIG_USBHOST_LWIP_RX_BUF_NUM][USBH_LWIP_RX_BUF_SIZE];
+/* class driver and pbufs still using the buffer, 0 if free */
+static uint16_t g_usbh_lwip_rx_buf_ref[CONFIG_USBHOST_LWIP_RX_BUF_NUM];
+
+struct usbh_lwip_rx_pbuf {
+    struct pbuf_custom pc;
+    struct usbh_lwip_rx_pbuf *next;
+    uint8_t index;
+};
+
+static struct usbh_lwip_rx_pbuf g_usbh_lwip_rx_pbuf[CONFIG_USBHOST_LWIP_RX_PBUF_NUM];
+static struct usbh_lwip_rx_pbuf *g_usbh_lwip_rx_pbuf_free = NULL;
+static bool g_usbh_lwip_rx_pbuf_inited = false;
+
+static int usbh_lwip_rx_buf_index(uint8_t *buf)
+{
+    uintptr_t offset = (uintptr_t)buf - (uintptr_t)g_usbh_lwip_rx_buf;
+
+    if (((uintptr_t)buf < (uintptr_t)g_usbh_lwip_rx_buf) || (offset >= sizeof(g_usbh_lwip_rx_buf))) {
+        return -1;
+    }
+    return offset / USBH_LWIP_RX_BUF_SIZE;
+}
+
+/*
+ * Take a free rx buffer for one bulk in transfer, returns NULL if none is free or size is too
+ * large, the class driver then receives into its own buffer and frames are copied.
+ */
+uint8_t *usbh_eth_rxbuf_alloc(uint32_t size)
+{
+    uint8_t *buf = NULL;
+    size_t flags;
+
+    if (size > USBH_LWIP_RX_BUF_SIZE) {
+        return NULL;
+    }
+
+    flags = usb_osal_enter_critical_section();
+    if (!g_usbh_lwip_rx_pbuf_inited) {
+        for (uint32_t i = 0; i < CONFIG_USBHOST_LWIP_RX_PBUF_NUM; i++) {
+            g_usbh_lwip_rx_pbuf[i].next = g_usbh_lwip_rx_pbuf_free;
+            g_usbh_lwip_rx_pbuf_free = &g_usbh_lwip_rx_pbuf[i];
+        }
+        g_usbh_lwip_rx_pbuf_inited = true;
+    }
+
+    for (uint8_t i = 0; i < CONFIG_USBHOST_LWIP_RX_BUF_NUM; i++) {
+        if (g_usbh_lwip_rx_buf_ref[i] == 0) {
+            g_usbh_lwip_rx_buf_ref[i] = 1;
+            buf = g_usbh_lwip_rx_buf[i];
+            break;
+        }
+    }
+    usb_osal_leave_critical_section(flags);
+
+    return buf;
+}
+
+/* class driver is done with the buffer, it is reused after lwip frees the last pbuf in it */
+void usbh_eth_rxbuf_free(uint8_t *buf)
+{
+    int index = usbh_lwip_rx_buf_index(buf);
+    size_t flags;
+
+    if (index < 0) {
+        return;
+    }
+
+    flags = usb_osal_enter_critical_section();
+    g_usbh_lwip_rx_buf_ref[index]--;
+    usb_osal_leave_critical_section(flags);
+}
+
+static void usbh_lwip_rx_pbuf_free(struct pbuf *p)
+{
+    struct usbh_lwip_rx_pbuf *rx_pbuf = (struct usbh_lwip_rx_pbuf *)p;
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    g_usbh_lwip_rx_buf_ref[rx_pbuf->index]--;
+    rx_pbuf->next = g_usbh_lwip_rx_pbuf_free;
+    g_usbh_lwip_rx_pbuf_free = rx_pbuf;
+    usb_osal_leave_critical_section(flags);
+}
+
+static struct pbuf *usbh_lwip_rx_pbuf_alloc(uint8_t *buf, uint32_t len)
+{
+    struct usbh_lwip_rx_pbuf *rx_pbuf;
+    int index = usbh_lwip_rx_buf_index(buf);
+    size_t flags;
+
+    if (index < 0) {
+        return NULL;
+    }
+
+    flags = usb_osal_enter_critical_section();
+    rx_pbuf = g_usbh_lwip_rx_pbuf_free;
+    if (rx_pbuf) {
+        g_usbh_lwip_rx_pbuf_free = rx_pbuf->next;
+        g_usbh_lwip_rx_buf_ref[index]++;
+    }
+    usb_osal_leave_critical_section(flags);
+
+    if (rx_pbuf == NULL) {
+        return NULL;
+    }
+
+    rx_pbuf->index = index;
+    rx_pbuf->pc.custom_free_function = usbh_lwip_rx_pbuf_free;
+    return pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &rx_pbuf->pc, buf, len);
+}
+#endif
+
 void usbh_lwip_eth_output_common(struct pbuf *p, uint8_t *buf)
 {
     struct pbuf *q;
@@ -70,13 +207,26 @@ void usbh_lwip_eth_input_common(struct netif *netif, uint8_t *buf, uint32_t len)
     err_t err;
     struct pbuf *p;
 
-    p = pbuf_alloc(PBUF_RAW, len, type);
+#ifdef CONFIG_USBHOST_LWIP_RX_ZERO_COPY
+    /* frames in a pool buffer go up without copying, out of custom pbufs they are copied */
+    p = usbh_lwip_rx_pbuf_alloc(buf, len);
     if (p != NULL) {
-#if LWIP_TCPIP_CORE_LOCKING_INPUT
-        p->payload = buf;
-#else
-        usb_memcpy(p->payload, buf, len);
+        err = netif->input(p, netif);
+        if (err != ERR_OK) {
+            pbuf_free(p);
+        }
+        return;
+    }
+    type = PBUF_POOL;
 #endif
+
+    p = pbuf_alloc(PBUF_RAW, len, type);
+    if (p != NULL) {
+        if (type == PBUF_REF) {
+            p->payload = buf;
+        } else {
+            usb_memcpy(p->payload, buf, len);
+        }
         err = netif->input(p, netif);
         if (err != ERR_OK) {
             pbuf_free(p);
@@ -190,6 +190,9 @@ static int usbhost_ioctl(FAR struct inode *inode, int cmd, unsigned long arg)
     msc_class = (struct usbh_msc *)inode->i_private;
 
     if (msc_class->hport && msc_class->hport->connected) {
+        if (cmd == BIOC_FLUSH) {
+            return (usbh_msc_scsi_sync(msc_class) < 0) ? -EIO : OK;
+        }
         return -ENOTTY;
     } else {
         return -ENODEV;
@@ -35,30 +35,13 @@ static rt_ssize_t rt_udisk_read(rt_device_t dev, rt_off_t pos, void *buffer,
 {
     struct usbh_msc *msc_class = (struct usbh_msc *)dev->user_data;
     int ret;
-    rt_uint8_t *align_buf;
 
-    align_buf = (rt_uint8_t *)buffer;
-
-    if ((uint32_t)buffer & (CONFIG_USB_ALIGN_SIZE - 1)) {
-        align_buf = rt_malloc_align(size * msc_class->blocksize, CONFIG_USB_ALIGN_SIZE);
-        if (!align_buf) {
-            rt_kprintf("msc get align buf failed\n");
-            return 0;
-        }
-    } else {
-    }
-
-    ret = usbh_msc_scsi_read10(msc_class, pos, (uint8_t *)align_buf, size);
+    ret = usbh_msc_scsi_read(msc_class, pos, (uint8_t *)buffer, size);
     if (ret < 0) {
         rt_kprintf("usb mass_storage read failed\n");
         return 0;
     }
 
-    if ((uint32_t)buffer & (CONFIG_USB_ALIGN_SIZE - 1)) {
-        usb_memcpy(buffer, align_buf, size * msc_class->blocksize);
-        rt_free_align(align_buf);
-    }
-
     return size;
 }
 
@@ -67,30 +50,13 @@ static rt_ssize_t rt_udisk_write(rt_device_t dev, rt_off_t pos, const void *buff
 {
     struct usbh_msc *msc_class = (struct usbh_msc *)dev->user_data;
     int ret;
-    rt_uint8_t *align_buf;
-
-    align_buf = (rt_uint8_t *)buffer;
 
-    if ((uint32_t)buffer & (CONFIG_USB_ALIGN_SIZE - 1)) {
-        align_buf = rt_malloc_align(size * msc_class->blocksize, CONFIG_USB_ALIGN_SIZE);
-        if (!align_buf) {
-            rt_kprintf("msc get align buf failed\n");
-            return 0;
-        }
-
-        usb_memcpy(align_buf, buffer, size * msc_class->blocksize);
-    }
-
-    ret = usbh_msc_scsi_write10(msc_class, pos, (uint8_t *)align_buf, size);
+    ret = usbh_msc_scsi_write(msc_class, pos, (uint8_t *)buffer, size);
     if (ret < 0) {
         rt_kprintf("usb mass_storage write failed\n");
         return 0;
     }
 
-    if ((uint32_t)buffer & (CONFIG_USB_ALIGN_SIZE - 1)) {
-        rt_free_align(align_buf);
-    }
-
     return size;
 }
 
@@ -110,6 +76,10 @@ static rt_err_t rt_udisk_control(rt_device_t dev, int cmd, void *args)
         geometry->bytes_per_sector = msc_class->blocksize;
         geometry->block_size = msc_class->blocksize;
         geometry->sector_count = msc_class->blocknum;
+    } else if (cmd == RT_DEVICE_CTRL_BLK_SYNC) {
+        if (usbh_msc_scsi_sync(msc_class) < 0) {
+            return -RT_ERROR;
+        }
     }
 
     return RT_EOK;
@@ -71,32 +71,12 @@ static rt_ssize_t rt_usbh_serial_write(struct rt_device *dev,
                                        rt_size_t size)
 {
     struct usbh_serial *serial;
-    int ret = 0;
-    rt_uint8_t *align_buf;
 
     RT_ASSERT(dev != RT_NULL && dev->user_data != RT_NULL);
 
     serial = (struct usbh_serial *)dev->user_data;
 
-    align_buf = (rt_uint8_t *)buffer;
-
-    if ((uint32_t)buffer & (CONFIG_USB_ALIGN_SIZE - 1)) {
-        align_buf = rt_malloc_align(USB_ALIGN_UP(size, CONFIG_USB_ALIGN_SIZE), CONFIG_USB_ALIGN_SIZE);
-        if (!align_buf) {
-            USB_LOG_ERR("serial get align buf failed\n");
-            return 0;
-        }
-
-        usb_memcpy(align_buf, buffer, size);
-    }
-
-    ret = usbh_serial_write(serial, align_buf, size);
-
-    if ((uint32_t)buffer & (CONFIG_USB_ALIGN_SIZE - 1)) {
-        rt_free_align(align_buf);
-    }
-
-    return ret;
+    return usbh_serial_write(serial, buffer, size);
 }
 
 static rt_err_t rt_usbh_serial_control(struct rt_device *dev,
@@ -195,8 +195,9 @@ VOID _fx_usbh_msc_driver(FX_MEDIA *media_ptr)
     case FX_DRIVER_READ: {
         msc_class = (struct usbh_msc *)media_ptr->fx_media_driver_info;
 
-        ret = usbh_msc_scsi_read10(msc_class, media_ptr->fx_media_driver_logical_sector + media_ptr->fx_media_hidden_sectors, media_ptr->fx_media_driver_buffer,
-                                   media_ptr->fx_media_driver_sectors);
+        /* the media buffer needs no alignment, usbh_msc stages unaligned buffers itself */
+        ret = usbh_msc_scsi_read(msc_class, media_ptr->fx_media_driver_logical_sector + media_ptr->fx_media_hidden_sectors, media_ptr->fx_media_driver_buffer,
+                                 media_ptr->fx_media_driver_sectors);
 
         if (ret < 0) {
             media_ptr->fx_media_driver_status = FX_IO_ERROR;
@@ -210,8 +211,8 @@ VOID _fx_usbh_msc_driver(FX_MEDIA *media_ptr)
     case FX_DRIVER_WRITE: {
         msc_class = (struct usbh_msc *)media_ptr->fx_media_driver_info;
 
-        ret = usbh_msc_scsi_write10(msc_class, media_ptr->fx_media_driver_logical_sector + media_ptr->fx_media_hidden_sectors,
-                                    media_ptr->fx_media_driver_buffer, media_ptr->fx_media_driver_sectors);
+        ret = usbh_msc_scsi_write(msc_class, media_ptr->fx_media_driver_logical_sector + media_ptr->fx_media_hidden_sectors,
+                                  media_ptr->fx_media_driver_buffer, media_ptr->fx_media_driver_sectors);
         if (ret < 0) {
             media_ptr->fx_media_driver_status = FX_IO_ERROR;
             return;
@@ -222,6 +223,12 @@ VOID _fx_usbh_msc_driver(FX_MEDIA *media_ptr)
     }
 
     case FX_DRIVER_FLUSH: {
+        msc_class = (struct usbh_msc *)media_ptr->fx_media_driver_info;
+
+        if (usbh_msc_scsi_sync(msc_class) < 0) {
+            media_ptr->fx_media_driver_status = FX_IO_ERROR;
+            return;
+        }
         /* Return driver success.  */
         media_ptr->fx_media_driver_status = FX_SUCCESS;
         break;
@@ -234,7 +241,7 @@ VOID _fx_usbh_msc_driver(FX_MEDIA *media_ptr)
     }
 
     case FX_DRIVER_INIT: {
-        msc_class = usbh_find_class_instance(media_ptr->fx_media_name);
+        msc_class = usbh_msc_find(media_ptr->fx_media_name);
         if (!msc_class) {
             USB_LOG_ERR("No instance found for %s", media_ptr->fx_media_name);
             media_ptr->fx_media_driver_status = FX_MEDIA_INVALID;
@@ -253,8 +260,10 @@ VOID _fx_usbh_msc_driver(FX_MEDIA *media_ptr)
     }
 
     case FX_DRIVER_UNINIT: {
-        /* There is nothing to do in this case for the RAM driver.  For actual
-           devices some shutdown processing may be necessary.  */
+        msc_class = (struct usbh_msc *)media_ptr->fx_media_driver_info;
+
+        /* write back sectors still held in the msc cache */
+        usbh_msc_scsi_sync(msc_class);
 
         /* Successful driver request.  */
         media_ptr->fx_media_driver_status = FX_SUCCESS;
@@ -264,7 +273,7 @@ VOID _fx_usbh_msc_driver(FX_MEDIA *media_ptr)
     case FX_DRIVER_BOOT_READ: {
         msc_class = (struct usbh_msc *)media_ptr->fx_media_driver_info;
 
-        ret = usbh_msc_scsi_read10(msc_class, 0, media_ptr->fx_media_driver_buffer, 1);
+        ret = usbh_msc_scsi_read(msc_class, 0, media_ptr->fx_media_driver_buffer, 1);
         if (ret < 0) {
             media_ptr->fx_media_driver_status = FX_IO_ERROR;
             return;
@@ -278,7 +287,7 @@ VOID _fx_usbh_msc_driver(FX_MEDIA *media_ptr)
     case FX_DRIVER_BOOT_WRITE: {
         msc_class = (struct usbh_msc *)media_ptr->fx_media_driver_info;
 
-        ret = usbh_msc_scsi_write10(msc_class, 0, media_ptr->fx_media_driver_buffer, 1);
+        ret = usbh_msc_scsi_write(msc_class, 0, media_ptr->fx_media_driver_buffer, 1);
         if (ret < 0) {
             media_ptr->fx_media_driver_status = FX_IO_ERROR;
             return;
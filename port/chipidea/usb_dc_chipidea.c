@@ -111,6 +111,9 @@ struct chipidea_ep_state {
     uint8_t *xfer_buf;
     uint32_t xfer_len;
     uint32_t actual_xfer_len;
+    /* qtd ring used by usbd_ep_queue_write/usbd_ep_queue_read, one qtd per transfer */
+    uint8_t qtd_head;
+    uint8_t qtd_count;
 };
 
 /* Driver state */
@@ -440,6 +443,105 @@ static bool chipidea_start_xfer(uint8_t busid, uint8_t ep_addr, uint8_t *buffer,
     return true;
 }
 
+static int chipidea_queue_xfer(uint8_t busid, uint8_t ep_addr, uint8_t *buffer, uint32_t total_bytes)
+{
+    uint8_t const epnum = ep_addr & 0x0f;
+    uint8_t const dir = (ep_addr & 0x80) >> 7;
+    uint8_t const ep_idx = 2 * epnum + dir;
+    uint32_t const primebit = 1 << ep_idx2bit(ep_idx);
+    struct chipidea_ep_state *ep_state;
+    dcd_qhd_t *p_qhd;
+    dcd_qtd_t *p_qtd;
+    dcd_qtd_t *prev_p_qtd;
+    uint32_t ep_status;
+
+    if (dir) {
+        ep_state = &g_chipidea_udc[busid].in_ep[epnum];
+    } else {
+        ep_state = &g_chipidea_udc[busid].out_ep[epnum];
+    }
+
+    /* 5 pages cover 16KB at any offset */
+    if (epnum == 0 || ep_state->ep_type == USB_ENDPOINT_TYPE_ISOCHRONOUS || total_bytes > 0x4000) {
+        return -USB_ERR_NOTSUPP;
+    }
+    if (!ep_state->ep_enable) {
+        return -USB_ERR_NODEV;
+    }
+    if (ep_state->qtd_count >= QTD_COUNT_EACH_ENDPOINT) {
+        return -USB_ERR_NOMEM;
+    }
+
+    p_qhd = chipidea_qhd_get(busid, ep_idx);
+    p_qtd = chipidea_qtd_get(busid, ep_idx) + (ep_state->qtd_head + ep_state->qtd_count) % QTD_COUNT_EACH_ENDPOINT;
+
+    usb_qtd_init(p_qtd, (void *)buffer, total_bytes);
+    p_qtd->int_on_complete = true;
+    ep_state->qtd_count++;
+
+    if (ep_state->qtd_count > 1) {
+        prev_p_qtd = chipidea_qtd_get(busid, ep_idx) + (ep_state->qtd_head + ep_state->qtd_count - 2) % QTD_COUNT_EACH_ENDPOINT;
+        prev_p_qtd->next = (uint32_t)p_qtd;
+
+        /* Add dTD to a non-empty list, see "Executing A Transfer Descriptor" in RM */
+        if (USB_OTG_DEV->ENDPTPRIME & primebit) {
+            return 0;
+        }
+        do {
+            USB_OTG_DEV->USBCMD |= USB_USBCMD_ATDTW_MASK;
+            ep_status = USB_OTG_DEV->ENDPTSTAT & primebit;
+        } while (!(USB_OTG_DEV->USBCMD & USB_USBCMD_ATDTW_MASK));
+        USB_OTG_DEV->USBCMD &= ~USB_USBCMD_ATDTW_MASK;
+        if (ep_status) {
+            return 0;
+        }
+    }
+
+    p_qhd->qtd_overlay.next = (uint32_t)p_qtd;
+    chipidea_edpt_xfer(USB_OTG_DEV, ep_idx);
+    return 0;
+}
+
+/* report every retired qtd of the ring in order */
+static void chipidea_queue_complete(uint8_t busid, uint8_t ep_idx)
+{
+    uint8_t const ep_addr = (ep_idx / 2) | ((ep_idx & 0x01) ? 0x80 : 0);
+    struct chipidea_ep_state *ep_state;
+    dcd_qtd_t *p_qtd;
+    uint32_t transfer_len;
+
+    if (ep_addr & 0x80) {
+        ep_state = &g_chipidea_udc[busid].in_ep[ep_idx / 2];
+    } else {
+        ep_state = &g_chipidea_udc[busid].out_ep[ep_idx / 2];
+    }
+
+    while (ep_state->qtd_count) {
+        p_qtd = chipidea_qtd_get(busid, ep_idx) + ep_state->qtd_head;
+        if (p_qtd->active) {
+            break;
+        }
+        if (p_qtd->halted || p_qtd->xact_err || p_qtd->buffer_err) {
+            USB_LOG_ERR("usbd transfer error!\r\n");
+        }
+
+        transfer_len = p_qtd->expected_bytes - p_qtd->total_bytes;
+        if (!(ep_addr & 0x80)) {
+            usb_dcache_invalidate((uintptr_t)p_qtd->buffer[0], USB_ALIGN_UP(transfer_len, CONFIG_USB_ALIGN_SIZE));
+        }
+
+        /* slot can be reused by the completion callback */
+        ep_state->qtd_head = (ep_state->qtd_head + 1) % QTD_COUNT_EACH_ENDPOINT;
+        ep_state->qtd_count--;
+
+        if (ep_addr & 0x80) {
+            usbd_event_ep_in_complete_handler(busid, ep_addr, transfer_len);
+        } else {
+            usbd_event_ep_out_complete_handler(busid, ep_addr, transfer_len);
+        }
+    }
+}
+
 __WEAK void usb_dc_low_level_init(uint8_t busid)
 {
 }
@@ -543,10 +645,14 @@ int usbd_ep_open(uint8_t busid, const struct usb_endpoint_descriptor *ep)
         g_chipidea_udc[busid].out_ep[ep_idx].ep_mps = USB_GET_MAXPACKETSIZE(ep->wMaxPacketSize);
         g_chipidea_udc[busid].out_ep[ep_idx].ep_type = USB_GET_ENDPOINT_TYPE(ep->bmAttributes);
         g_chipidea_udc[busid].out_ep[ep_idx].ep_enable = true;
+        g_chipidea_udc[busid].out_ep[ep_idx].qtd_head = 0;
+        g_chipidea_udc[busid].out_ep[ep_idx].qtd_count = 0;
     } else {
         g_chipidea_udc[busid].in_ep[ep_idx].ep_mps = USB_GET_MAXPACKETSIZE(ep->wMaxPacketSize);
         g_chipidea_udc[busid].in_ep[ep_idx].ep_type = USB_GET_ENDPOINT_TYPE(ep->bmAttributes);
         g_chipidea_udc[busid].in_ep[ep_idx].ep_enable = true;
+        g_chipidea_udc[busid].in_ep[ep_idx].qtd_head = 0;
+        g_chipidea_udc[busid].in_ep[ep_idx].qtd_count = 0;
     }
 
     return 0;
@@ -558,8 +664,10 @@ int usbd_ep_close(uint8_t busid, const uint8_t ep)
 
     if (USB_EP_DIR_IS_OUT(ep)) {
         g_chipidea_udc[busid].out_ep[ep_idx].ep_enable = false;
+        g_chipidea_udc[busid].out_ep[ep_idx].qtd_count = 0;
     } else {
         g_chipidea_udc[busid].in_ep[ep_idx].ep_enable = false;
+        g_chipidea_udc[busid].in_ep[ep_idx].qtd_count = 0;
     }
 
     chipidea_edpt_close(USB_OTG_DEV, ep);
@@ -635,6 +743,34 @@ int usbd_ep_start_read(uint8_t busid, const uint8_t ep, uint8_t *data, uint32_t
     return 0;
 }
 
+int usbd_ep_queue_write(uint8_t busid, const uint8_t ep, const uint8_t *data, uint32_t data_len)
+{
+    if (!data && data_len) {
+        return -USB_ERR_INVAL;
+    }
+
+#ifdef CONFIG_USB_DCACHE_ENABLE
+    USB_ASSERT_MSG(!((uintptr_t)data % CONFIG_USB_ALIGN_SIZE), "data is not aligned %d", CONFIG_USB_ALIGN_SIZE);
+#endif
+
+    usb_dcache_clean((uintptr_t)data, USB_ALIGN_UP(data_len, CONFIG_USB_ALIGN_SIZE));
+    return chipidea_queue_xfer(busid, ep, (uint8_t *)data, data_len);
+}
+
+int usbd_ep_queue_read(uint8_t busid, const uint8_t ep, uint8_t *data, uint32_t data_len)
+{
+    if (!data && data_len) {
+        return -USB_ERR_INVAL;
+    }
+
+#ifdef CONFIG_USB_DCACHE_ENABLE
+    USB_ASSERT_MSG(!((uintptr_t)data % CONFIG_USB_ALIGN_SIZE), "data is not aligned %d", CONFIG_USB_ALIGN_SIZE);
+#endif
+
+    usb_dcache_invalidate((uintptr_t)data, USB_ALIGN_UP(data_len, CONFIG_USB_ALIGN_SIZE));
+    return chipidea_queue_xfer(busid, ep, data, data_len);
+}
+
 void USBD_IRQHandler(uint8_t busid)
 {
     uint32_t int_status;
@@ -696,6 +832,11 @@ void USBD_IRQHandler(uint8_t busid)
             USB_OTG_DEV->ENDPTCOMPLETE = edpt_complete;
             for (uint8_t ep_idx = 0; ep_idx < (CONFIG_USBDEV_EP_NUM * 2); ep_idx++) {
                 if (edpt_complete & (1 << ep_idx2bit(ep_idx))) {
+                    if ((ep_idx & 0x01) ? g_chipidea_udc[busid].in_ep[ep_idx / 2].qtd_count : g_chipidea_udc[busid].out_ep[ep_idx / 2].qtd_count) {
+                        chipidea_queue_complete(busid, ep_idx);
+                        continue;
+                    }
+
                     transfer_len = 0;
                     ep_cb_req = true;
 
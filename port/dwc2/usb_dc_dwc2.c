@@ -16,6 +16,10 @@
 #define USB_OTG_OUTEP(i) ((DWC2_OUTEndpointTypeDef *)(USBD_BASE + USB_OTG_OUT_ENDPOINT_BASE + ((i)*USB_OTG_EP_REG_SIZE)))
 #define USB_OTG_FIFO(i)  *(__IO uint32_t *)(USBD_BASE + USB_OTG_FIFO_BASE + ((i)*USB_OTG_FIFO_SIZE))
 
+#ifndef CONFIG_USB_DWC2_EP_QUEUE_DEPTH
+#define CONFIG_USB_DWC2_EP_QUEUE_DEPTH 4
+#endif
+
 /* Endpoint state */
 struct dwc2_ep_state {
     uint16_t ep_mps;    /* Endpoint max packet size */
@@ -24,6 +28,11 @@ struct dwc2_ep_state {
     uint8_t *xfer_buf;
     uint32_t xfer_len;
     uint32_t actual_xfer_len;
+    /* transfers from usbd_ep_queue_write/usbd_ep_queue_read, head is the one in progress */
+    uint8_t *queue_buf[CONFIG_USB_DWC2_EP_QUEUE_DEPTH];
+    uint32_t queue_len[CONFIG_USB_DWC2_EP_QUEUE_DEPTH];
+    uint8_t queue_head;
+    uint8_t queue_count;
 };
 
 /* Driver state */
@@ -689,6 +698,8 @@ int usbd_ep_open(uint8_t busid, const struct usb_endpoint_descriptor *ep)
     if (USB_EP_DIR_IS_OUT(ep->bEndpointAddress)) {
         g_dwc2_udc[busid].out_ep[ep_idx].ep_mps = USB_GET_MAXPACKETSIZE(ep->wMaxPacketSize);
         g_dwc2_udc[busid].out_ep[ep_idx].ep_type = USB_GET_ENDPOINT_TYPE(ep->bmAttributes);
+        g_dwc2_udc[busid].out_ep[ep_idx].queue_head = 0;
+        g_dwc2_udc[busid].out_ep[ep_idx].queue_count = 0;
 
         ep_mps = USB_GET_MAXPACKETSIZE(ep->wMaxPacketSize);
         if (ep_idx == 0) {
@@ -730,6 +741,8 @@ int usbd_ep_open(uint8_t busid, const struct usb_endpoint_descriptor *ep)
 
         g_dwc2_udc[busid].in_ep[ep_idx].ep_mps = USB_GET_MAXPACKETSIZE(ep->wMaxPacketSize);
         g_dwc2_udc[busid].in_ep[ep_idx].ep_type = USB_GET_ENDPOINT_TYPE(ep->bmAttributes);
+        g_dwc2_udc[busid].in_ep[ep_idx].queue_head = 0;
+        g_dwc2_udc[busid].in_ep[ep_idx].queue_count = 0;
 
         ep_mps = USB_GET_MAXPACKETSIZE(ep->wMaxPacketSize);
         if (ep_idx == 0) {
@@ -789,6 +802,7 @@ int usbd_ep_close(uint8_t busid, const uint8_t ep)
         USB_OTG_DEV->DEACHMSK &= ~(USB_OTG_DAINTMSK_OEPM & ((uint32_t)(1UL << (ep_idx & 0x07)) << 16));
         USB_OTG_DEV->DAINTMSK &= ~(USB_OTG_DAINTMSK_OEPM & ((uint32_t)(1UL << (ep_idx & 0x07)) << 16));
         USB_OTG_OUTEP(ep_idx)->DOEPCTL = 0;
+        g_dwc2_udc[busid].out_ep[ep_idx].queue_count = 0;
     } else {
         if (USB_OTG_INEP(ep_idx)->DIEPCTL & USB_OTG_DIEPCTL_EPENA) {
             USB_OTG_INEP(ep_idx)->DIEPCTL |= USB_OTG_DIEPCTL_SNAK;
@@ -809,6 +823,7 @@ int usbd_ep_close(uint8_t busid, const uint8_t ep)
         USB_OTG_DEV->DEACHMSK &= ~(USB_OTG_DAINTMSK_IEPM & (uint32_t)(1UL << (ep_idx & 0x07)));
         USB_OTG_DEV->DAINTMSK &= ~(USB_OTG_DAINTMSK_IEPM & (uint32_t)(1UL << (ep_idx & 0x07)));
         USB_OTG_INEP(ep_idx)->DIEPCTL = 0;
+        g_dwc2_udc[busid].in_ep[ep_idx].queue_count = 0;
     }
     return 0;
 }
@@ -1027,9 +1042,100 @@ int usbd_ep_start_read(uint8_t busid, const uint8_t ep, uint8_t *data, uint32_t
     return 0;
 }
 
+int usbd_ep_queue_write(uint8_t busid, const uint8_t ep, const uint8_t *data, uint32_t data_len)
+{
+    uint8_t ep_idx = USB_EP_GET_IDX(ep);
+    struct dwc2_ep_state *ep_state = &g_dwc2_udc[busid].in_ep[ep_idx];
+    uint8_t slot;
+    int ret;
+
+    /* one queued transfer must complete with one programming, see usbd_ep_start_write */
+    if (ep_idx == 0 || ep_state->ep_type == USB_ENDPOINT_TYPE_ISOCHRONOUS ||
+        data_len > 0x3FF * ep_state->ep_mps) {
+        return -USB_ERR_NOTSUPP;
+    }
+
+    if (ep_state->queue_count >= CONFIG_USB_DWC2_EP_QUEUE_DEPTH) {
+        return -USB_ERR_NOMEM;
+    }
+
+    slot = (ep_state->queue_head + ep_state->queue_count) % CONFIG_USB_DWC2_EP_QUEUE_DEPTH;
+    ep_state->queue_buf[slot] = (uint8_t *)data;
+    ep_state->queue_len[slot] = data_len;
+    ep_state->queue_count++;
+
+    if (ep_state->queue_count == 1) {
+        ret = usbd_ep_start_write(busid, ep, data, data_len);
+        if (ret < 0) {
+            ep_state->queue_count--;
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int usbd_ep_queue_read(uint8_t busid, const uint8_t ep, uint8_t *data, uint32_t data_len)
+{
+    uint8_t ep_idx = USB_EP_GET_IDX(ep);
+    struct dwc2_ep_state *ep_state = &g_dwc2_udc[busid].out_ep[ep_idx];
+    uint8_t slot;
+    int ret;
+
+    if (ep_idx == 0 || ep_state->ep_type == USB_ENDPOINT_TYPE_ISOCHRONOUS ||
+        data_len > 0x3FF * ep_state->ep_mps) {
+        return -USB_ERR_NOTSUPP;
+    }
+
+    if (ep_state->queue_count >= CONFIG_USB_DWC2_EP_QUEUE_DEPTH) {
+        return -USB_ERR_NOMEM;
+    }
+
+    slot = (ep_state->queue_head + ep_state->queue_count) % CONFIG_USB_DWC2_EP_QUEUE_DEPTH;
+    ep_state->queue_buf[slot] = data;
+    ep_state->queue_len[slot] = data_len;
+    ep_state->queue_count++;
+
+    if (ep_state->queue_count == 1) {
+        ret = usbd_ep_start_read(busid, ep, data, data_len);
+        if (ret < 0) {
+            ep_state->queue_count--;
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* drop the finished transfer and program the next queued one, before software sees the completion */
+static void dwc2_ep_queue_next(uint8_t busid, uint8_t ep)
+{
+    uint8_t ep_idx = USB_EP_GET_IDX(ep);
+    struct dwc2_ep_state *ep_state;
+
+    if (USB_EP_DIR_IS_OUT(ep)) {
+        ep_state = &g_dwc2_udc[busid].out_ep[ep_idx];
+    } else {
+        ep_state = &g_dwc2_udc[busid].in_ep[ep_idx];
+    }
+
+    if (ep_state->queue_count == 0) {
+        return;
+    }
+
+    ep_state->queue_head = (ep_state->queue_head + 1) % CONFIG_USB_DWC2_EP_QUEUE_DEPTH;
+    ep_state->queue_count--;
+
+    if (ep_state->queue_count) {
+        if (USB_EP_DIR_IS_OUT(ep)) {
+            usbd_ep_start_read(busid, ep, ep_state->queue_buf[ep_state->queue_head], ep_state->queue_len[ep_state->queue_head]);
+        } else {
+            usbd_ep_start_write(busid, ep, ep_state->queue_buf[ep_state->queue_head], ep_state->queue_len[ep_state->queue_head]);
+        }
+    }
+}
+
 void USBD_IRQHandler(uint8_t busid)
 {
-    uint32_t gint_status, temp, ep_idx, ep_intr, epint, read_count;
+    uint32_t gint_status, temp, ep_idx, ep_intr, epint, read_count, nbytes;
     gint_status = dwc2_get_glb_intstatus(busid);
 
     (void)read_count;
@@ -1101,7 +1207,9 @@ void USBD_IRQHandler(uint8_t busid)
                             if (g_dwc2_udc[busid].user_params.device_dma_enable) {
                                 usb_dcache_invalidate((uintptr_t)g_dwc2_udc[busid].out_ep[ep_idx].xfer_buf, USB_ALIGN_UP(g_dwc2_udc[busid].out_ep[ep_idx].actual_xfer_len, CONFIG_USB_ALIGN_SIZE));
                             }
-                            usbd_event_ep_out_complete_handler(busid, ep_idx, g_dwc2_udc[busid].out_ep[ep_idx].actual_xfer_len);
+                            nbytes = g_dwc2_udc[busid].out_ep[ep_idx].actual_xfer_len;
+                            dwc2_ep_queue_next(busid, ep_idx);
+                            usbd_event_ep_out_complete_handler(busid, ep_idx, nbytes);
                         }
                     }
                     // clang-format off
@@ -1138,7 +1246,9 @@ process_setup:
                         } else {
                             g_dwc2_udc[busid].in_ep[ep_idx].actual_xfer_len = g_dwc2_udc[busid].in_ep[ep_idx].xfer_len - ((USB_OTG_INEP(ep_idx)->DIEPTSIZ) & USB_OTG_DIEPTSIZ_XFRSIZ);
                             g_dwc2_udc[busid].in_ep[ep_idx].xfer_len = 0;
-                            usbd_event_ep_in_complete_handler(busid, ep_idx | 0x80, g_dwc2_udc[busid].in_ep[ep_idx].actual_xfer_len);
+                            nbytes = g_dwc2_udc[busid].in_ep[ep_idx].actual_xfer_len;
+                            dwc2_ep_queue_next(busid, ep_idx | 0x80);
+                            usbd_event_ep_in_complete_handler(busid, ep_idx | 0x80, nbytes);
                         }
                     }
                     if (!g_dwc2_udc[busid].user_params.device_dma_enable) {
@@ -28,6 +28,11 @@ struct dwc2_chan {
     usb_osal_sem_t waitsem;
     struct usbh_urb *urb;
     uint32_t iso_frame_idx;
+    uint32_t sg_idx;    /* current segment of sg urb */
+    uint32_t sg_offset; /* bytes done in current segment */
+    struct usbh_hubport *hport;      /* set while the channel is held by usbh_pipe_open */
+    struct usb_endpoint_descriptor *ep;
+    uint8_t data_toggle; /* toggle of the pipe between urbs */
 };
 
 struct dwc2_hcd {
@@ -45,6 +50,8 @@ struct dwc2_hcd {
 #define DWC2_EP0_STATE_INSTATUS  3
 #define DWC2_EP0_STATE_OUTSTATUS 4
 
+#define DWC2_PIPE_FREE_CHAN_MIN 2 /* channels usbh_pipe_open never takes */
+
 static inline int dwc2_reset(struct usbh_bus *bus)
 {
     volatile uint32_t count = 0U;
@@ -499,10 +506,39 @@ static void dwc2_chan_free(struct dwc2_chan *chan)
         chan->urb->hcpriv = NULL;
         chan->urb = NULL;
     }
-    chan->inuse = false;
+    /* a pipe channel only lets go of its urb */
+    if (chan->ep == NULL) {
+        chan->inuse = false;
+    }
     usb_osal_leave_critical_section(flags);
 }
 
+static struct dwc2_chan *dwc2_pipe_find(struct usbh_bus *bus, struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep)
+{
+    struct dwc2_chan *chan;
+
+    for (uint8_t chidx = 0; chidx < g_dwc2_hcd[bus->hcd.hcd_id].hw_params.host_channels; chidx++) {
+        chan = &g_dwc2_hcd[bus->hcd.hcd_id].chan_pool[chidx];
+        if (chan->inuse && (chan->hport == hport) && (chan->ep == ep)) {
+            return chan;
+        }
+    }
+    return NULL;
+}
+
+static void dwc2_chan_split_setup(struct usbh_bus *bus, struct dwc2_chan *chan, struct usbh_hubport *hport)
+{
+    chan->do_ssplit = 0;
+    chan->do_csplit = 0;
+
+    if (hport->speed != USB_SPEED_HIGH &&
+        usbh_get_port_speed(bus, 0) == USB_SPEED_HIGH) {
+        chan->do_ssplit = 1;
+        chan->hub_port = hport->port;
+        chan->hub_addr = hport->parent->hub_addr;
+    }
+}
+
 static uint16_t dwc2_calculate_packet_num(uint32_t input_size, uint8_t ep_addr, uint16_t ep_mps, uint32_t *output_size)
 {
     uint16_t num_packets;
@@ -616,13 +652,24 @@ static void dwc2_control_urb_init(struct usbh_bus *bus, uint8_t chidx, struct us
     }
 }
 
-static void dwc2_bulk_intr_urb_init(struct usbh_bus *bus, uint8_t chidx, struct usbh_urb *urb, uint8_t *buffer, uint32_t buflen)
+static void dwc2_bulk_intr_urb_init(struct usbh_bus *bus, uint8_t chidx, struct usbh_urb *urb)
 {
     struct dwc2_chan *chan;
+    uint8_t *buffer;
+    uint32_t buflen;
     uint32_t datalen;
 
     chan = &g_dwc2_hcd[bus->hcd.hcd_id].chan_pool[chidx];
 
+    /* continue where the last transfer of this urb stopped */
+    if (urb->num_sgs && !(urb->transfer_flags & USBH_URB_SG_BOUNCE)) {
+        buffer = urb->sg[chan->sg_idx].buffer + chan->sg_offset;
+        buflen = urb->sg[chan->sg_idx].length - chan->sg_offset;
+    } else {
+        buffer = urb->transfer_buffer + urb->actual_length;
+        buflen = urb->transfer_buffer_length;
+    }
+
     if (chan->do_ssplit) {
         if (buflen > USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize)) {
             datalen = USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize);
@@ -634,17 +681,50 @@ static void dwc2_bulk_intr_urb_init(struct usbh_bus *bus, uint8_t chidx, struct
     }
 
     chan->num_packets = dwc2_calculate_packet_num(datalen, urb->ep->bEndpointAddress, USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize), &chan->xferlen);
-    dwc2_chan_init(bus,
-                   chidx,
-                   urb->hport->dev_addr,
-                   urb->ep->bEndpointAddress,
-                   USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes),
-                   USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize),
-                   USB_GET_MULT(urb->ep->wMaxPacketSize) + 1,
-                   urb->hport->speed);
+    if (chan->ep) {
+        /* programmed by usbh_pipe_open, only the split phase changes */
+        if (chan->do_ssplit) {
+            dwc2_chan_splt_init(bus, chidx);
+        }
+    } else {
+        dwc2_chan_init(bus,
+                       chidx,
+                       urb->hport->dev_addr,
+                       urb->ep->bEndpointAddress,
+                       USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes),
+                       USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize),
+                       USB_GET_MULT(urb->ep->wMaxPacketSize) + 1,
+                       urb->hport->speed);
+    }
     dwc2_chan_transfer(bus, chidx, urb->ep->bEndpointAddress, buffer, chan->xferlen, chan->num_packets, urb->data_toggle == 0 ? HC_PID_DATA0 : HC_PID_DATA1);
 }
 
+/* account a finished channel transfer to the sg list, returns true if more segments are left */
+static bool dwc2_sg_urb_advance(struct dwc2_chan *chan, struct usbh_urb *urb, uint32_t count)
+{
+    if (!urb->num_sgs || (urb->transfer_flags & USBH_URB_SG_BOUNCE)) {
+        return false;
+    }
+
+    chan->sg_offset += count;
+    while ((chan->sg_idx < urb->num_sgs) && (chan->sg_offset >= urb->sg[chan->sg_idx].length)) {
+        chan->sg_offset = 0;
+        chan->sg_idx++;
+    }
+    return (chan->sg_idx < urb->num_sgs);
+}
+
+static void dwc2_sg_urb_dcache(struct usbh_urb *urb, bool invalidate)
+{
+    for (uint32_t i = 0; i < urb->num_sgs; i++) {
+        if (invalidate) {
+            usb_dcache_invalidate((uintptr_t)urb->sg[i].buffer, USB_ALIGN_UP(urb->sg[i].length, CONFIG_USB_ALIGN_SIZE));
+        } else {
+            usb_dcache_clean((uintptr_t)urb->sg[i].buffer, USB_ALIGN_UP(urb->sg[i].length, CONFIG_USB_ALIGN_SIZE));
+        }
+    }
+}
+
 #if 0
 static void dwc2_iso_urb_init(struct usbh_bus *bus, uint8_t chidx, struct usbh_urb *urb, struct usbh_iso_frame_packet *iso_packet)
 {
@@ -996,6 +1076,15 @@ int usbh_submit_urb(struct usbh_urb *urb)
         return -USB_ERR_BUSY;
     }
 
+#ifdef CONFIG_USB_DCACHE_ENABLE
+    ret = usbh_sg_urb_prepare(urb, CONFIG_USB_ALIGN_SIZE);
+#else
+    ret = usbh_sg_urb_prepare(urb, 4);
+#endif
+    if (ret < 0) {
+        return ret;
+    }
+
     if (urb->ep->bEndpointAddress & 0x80) {
         /* Check if pipe rx fifo is overflow */
         if (USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize) > (g_dwc2_hcd[bus->hcd.hcd_id].user_params.host_rx_fifo_size * 4)) {
@@ -1015,26 +1104,33 @@ int usbh_submit_urb(struct usbh_urb *urb)
         }
     }
 
-    chidx = dwc2_chan_alloc(bus);
-    if (chidx == -1) {
-        return -USB_ERR_NOMEM;
-    }
-
     flags = usb_osal_enter_critical_section();
 
-    chan = &g_dwc2_hcd[bus->hcd.hcd_id].chan_pool[chidx];
-    chan->chidx = chidx;
-    chan->urb = urb;
-    chan->do_ssplit = 0;
-
-    if (urb->hport->speed != USB_SPEED_HIGH &&
-        usbh_get_port_speed(bus, 0) == USB_SPEED_HIGH) {
-        chan->do_ssplit = 1;
+    chan = dwc2_pipe_find(bus, urb->hport, urb->ep);
+    if (chan) {
+        if (chan->urb) {
+            usb_osal_leave_critical_section(flags);
+            return -USB_ERR_BUSY;
+        }
+        chidx = chan->chidx;
         chan->do_csplit = 0;
-        chan->hub_port = urb->hport->port;
-        chan->hub_addr = urb->hport->parent->hub_addr;
+        urb->data_toggle = chan->data_toggle;
+    } else {
+        chidx = dwc2_chan_alloc(bus);
+        if (chidx == -1) {
+            usb_osal_leave_critical_section(flags);
+            return -USB_ERR_NOMEM;
+        }
+
+        chan = &g_dwc2_hcd[bus->hcd.hcd_id].chan_pool[chidx];
+        chan->chidx = chidx;
+        dwc2_chan_split_setup(bus, chan, urb->hport);
     }
 
+    chan->urb = urb;
+    chan->sg_idx = 0;
+    chan->sg_offset = 0;
+
     urb->hcpriv = chan;
     urb->errorcode = -USB_ERR_BUSY;
     urb->actual_length = 0;
@@ -1051,6 +1147,8 @@ int usbh_submit_urb(struct usbh_urb *urb)
                 usb_dcache_clean((uintptr_t)urb->transfer_buffer, USB_ALIGN_UP(urb->transfer_buffer_length, CONFIG_USB_ALIGN_SIZE));
             }
         }
+    } else if (urb->num_sgs && !(urb->transfer_flags & USBH_URB_SG_BOUNCE)) {
+        dwc2_sg_urb_dcache(urb, urb->ep->bEndpointAddress & 0x80);
     } else if (urb->transfer_buffer && (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) != USB_ENDPOINT_TYPE_ISOCHRONOUS)) {
         if (urb->ep->bEndpointAddress & 0x80) {
             usb_dcache_invalidate((uintptr_t)urb->transfer_buffer, USB_ALIGN_UP(urb->transfer_buffer_length, CONFIG_USB_ALIGN_SIZE));
@@ -1067,7 +1165,7 @@ int usbh_submit_urb(struct usbh_urb *urb)
             break;
         case USB_ENDPOINT_TYPE_BULK:
         case USB_ENDPOINT_TYPE_INTERRUPT:
-            dwc2_bulk_intr_urb_init(bus, chidx, urb, urb->transfer_buffer, urb->transfer_buffer_length);
+            dwc2_bulk_intr_urb_init(bus, chidx, urb);
             break;
         case USB_ENDPOINT_TYPE_ISOCHRONOUS:
             break;
@@ -1128,12 +1226,121 @@ int usbh_kill_urb(struct usbh_urb *urb)
     return 0;
 }
 
+int usbh_pipe_open(struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep)
+{
+    struct dwc2_chan *chan;
+    struct usbh_bus *bus;
+    uint8_t free_num = 0;
+    size_t flags;
+    int chidx;
+
+    if (!hport || !ep || !hport->bus) {
+        return -USB_ERR_INVAL;
+    }
+
+    bus = hport->bus;
+
+    if ((USB_GET_ENDPOINT_TYPE(ep->bmAttributes) != USB_ENDPOINT_TYPE_BULK) &&
+        (USB_GET_ENDPOINT_TYPE(ep->bmAttributes) != USB_ENDPOINT_TYPE_INTERRUPT)) {
+        return -USB_ERR_NOTSUPP;
+    }
+
+    flags = usb_osal_enter_critical_section();
+
+    if (dwc2_pipe_find(bus, hport, ep)) {
+        usb_osal_leave_critical_section(flags);
+        return 0;
+    }
+
+    /* leave channels for ep0 and for endpoints without a pipe */
+    for (chidx = 0; chidx < g_dwc2_hcd[bus->hcd.hcd_id].hw_params.host_channels; chidx++) {
+        if (!g_dwc2_hcd[bus->hcd.hcd_id].chan_pool[chidx].inuse) {
+            free_num++;
+        }
+    }
+    if (free_num <= DWC2_PIPE_FREE_CHAN_MIN) {
+        usb_osal_leave_critical_section(flags);
+        return -USB_ERR_NOMEM;
+    }
+
+    chidx = dwc2_chan_alloc(bus);
+    if (chidx == -1) {
+        usb_osal_leave_critical_section(flags);
+        return -USB_ERR_NOMEM;
+    }
+
+    chan = &g_dwc2_hcd[bus->hcd.hcd_id].chan_pool[chidx];
+    chan->chidx = chidx;
+    chan->urb = NULL;
+    chan->hport = hport;
+    chan->ep = ep;
+    chan->data_toggle = 0;
+    dwc2_chan_split_setup(bus, chan, hport);
+
+    dwc2_chan_init(bus,
+                   chidx,
+                   hport->dev_addr,
+                   ep->bEndpointAddress,
+                   USB_GET_ENDPOINT_TYPE(ep->bmAttributes),
+                   USB_GET_MAXPACKETSIZE(ep->wMaxPacketSize),
+                   USB_GET_MULT(ep->wMaxPacketSize) + 1,
+                   hport->speed);
+
+    usb_osal_leave_critical_section(flags);
+    return 0;
+}
+
+int usbh_pipe_close(struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep)
+{
+    struct dwc2_chan *chan;
+    struct usbh_urb *urb;
+    struct usbh_bus *bus;
+    size_t flags;
+
+    if (!hport || !ep || !hport->bus) {
+        return -USB_ERR_INVAL;
+    }
+
+    bus = hport->bus;
+
+    flags = usb_osal_enter_critical_section();
+
+    chan = dwc2_pipe_find(bus, hport, ep);
+    if (chan == NULL) {
+        usb_osal_leave_critical_section(flags);
+        return 0;
+    }
+
+    urb = chan->urb;
+    chan->hport = NULL;
+    chan->ep = NULL;
+
+    if (urb) {
+        /* frees the channel, or leaves it to the blocking waiter */
+        usbh_kill_urb(urb);
+    } else {
+        dwc2_chan_free(chan);
+    }
+
+    usb_osal_leave_critical_section(flags);
+    return 0;
+}
+
 static inline void dwc2_urb_waitup(struct usbh_urb *urb)
 {
     struct dwc2_chan *chan;
 
     chan = (struct dwc2_chan *)urb->hcpriv;
 
+    if (urb->errorcode == 0) {
+        usbh_sg_urb_done(urb);
+    }
+
+    if (chan->ep) {
+        /* the device restarts with DATA0 once the halt is cleared */
+        chan->data_toggle = (urb->errorcode == -USB_ERR_STALL) ? 0 : urb->data_toggle;
+    }
+
     if (urb->timeout) {
         usb_osal_sem_give(chan->waitsem);
     } else {
@@ -1196,10 +1403,19 @@ static void dwc2_inchan_irq_handler(struct usbh_bus *bus, uint8_t ch_num)
                 }
             } else if (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) == USB_ENDPOINT_TYPE_ISOCHRONOUS) {
             } else {
+                bool sg_more = dwc2_sg_urb_advance(chan, urb, count);
+
                 if (chan->do_ssplit && urb->transfer_buffer_length > 0 && (count == USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize))) {
-                    dwc2_bulk_intr_urb_init(bus, ch_num, urb, urb->transfer_buffer + urb->actual_length, urb->transfer_buffer_length);
+                    dwc2_bulk_intr_urb_init(bus, ch_num, urb);
+                } else if (sg_more && (count == chan->xferlen)) {
+                    /* no short packet, go on with the next segment */
+                    dwc2_bulk_intr_urb_init(bus, ch_num, urb);
                 } else {
-                    usb_dcache_invalidate((uintptr_t)urb->transfer_buffer, USB_ALIGN_UP(urb->actual_length, CONFIG_USB_ALIGN_SIZE));
+                    if (urb->num_sgs && !(urb->transfer_flags & USBH_URB_SG_BOUNCE)) {
+                        dwc2_sg_urb_dcache(urb, true);
+                    } else {
+                        usb_dcache_invalidate((uintptr_t)urb->transfer_buffer, USB_ALIGN_UP(urb->actual_length, CONFIG_USB_ALIGN_SIZE));
+                    }
                     urb->errorcode = 0;
                     dwc2_urb_waitup(urb);
                 }
@@ -1220,7 +1436,7 @@ static void dwc2_inchan_irq_handler(struct usbh_bus *bus, uint8_t ch_num)
                         break;
                     case USB_ENDPOINT_TYPE_BULK:
                         chan->do_csplit = 0;
-                        dwc2_bulk_intr_urb_init(bus, ch_num, urb, urb->transfer_buffer + urb->actual_length, urb->transfer_buffer_length);
+                        dwc2_bulk_intr_urb_init(bus, ch_num, urb);
                         break;
                     case USB_ENDPOINT_TYPE_INTERRUPT:
                         chan->do_csplit = 0;
@@ -1247,7 +1463,7 @@ static void dwc2_inchan_irq_handler(struct usbh_bus *bus, uint8_t ch_num)
                         break;
                     case USB_ENDPOINT_TYPE_BULK:
                     case USB_ENDPOINT_TYPE_INTERRUPT:
-                        dwc2_bulk_intr_urb_init(bus, ch_num, urb, urb->transfer_buffer + urb->actual_length, urb->transfer_buffer_length);
+                        dwc2_bulk_intr_urb_init(bus, ch_num, urb);
                         break;
 
                     default:
@@ -1265,7 +1481,7 @@ static void dwc2_inchan_irq_handler(struct usbh_bus *bus, uint8_t ch_num)
                         break;
                     case USB_ENDPOINT_TYPE_BULK:
                     case USB_ENDPOINT_TYPE_INTERRUPT:
-                        dwc2_bulk_intr_urb_init(bus, ch_num, urb, urb->transfer_buffer + urb->actual_length, urb->transfer_buffer_length);
+                        dwc2_bulk_intr_urb_init(bus, ch_num, urb);
                         break;
 
                     default:
@@ -1359,8 +1575,10 @@ static void dwc2_outchan_irq_handler(struct usbh_bus *bus, uint8_t ch_num)
                 }
             } else if (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) == USB_ENDPOINT_TYPE_ISOCHRONOUS) {
             } else {
-                if (chan->do_ssplit && urb->transfer_buffer_length > 0) {
-                    dwc2_bulk_intr_urb_init(bus, ch_num, urb, urb->transfer_buffer + urb->actual_length, urb->transfer_buffer_length);
+                bool sg_more = dwc2_sg_urb_advance(chan, urb, olen);
+
+                if ((chan->do_ssplit || sg_more) && urb->transfer_buffer_length > 0) {
+                    dwc2_bulk_intr_urb_init(bus, ch_num, urb);
                 } else {
                     urb->errorcode = 0;
                     dwc2_urb_waitup(urb);
@@ -1382,7 +1600,7 @@ static void dwc2_outchan_irq_handler(struct usbh_bus *bus, uint8_t ch_num)
                         break;
                     case USB_ENDPOINT_TYPE_BULK:
                         chan->do_csplit = 0;
-                        dwc2_bulk_intr_urb_init(bus, ch_num, urb, urb->transfer_buffer + urb->actual_length, urb->transfer_buffer_length);
+                        dwc2_bulk_intr_urb_init(bus, ch_num, urb);
                         break;
                     case USB_ENDPOINT_TYPE_INTERRUPT:
                         chan->do_csplit = 0;
@@ -1409,7 +1627,7 @@ static void dwc2_outchan_irq_handler(struct usbh_bus *bus, uint8_t ch_num)
                         break;
                     case USB_ENDPOINT_TYPE_BULK:
                     case USB_ENDPOINT_TYPE_INTERRUPT:
-                        dwc2_bulk_intr_urb_init(bus, ch_num, urb, urb->transfer_buffer + urb->actual_length, urb->transfer_buffer_length);
+                        dwc2_bulk_intr_urb_init(bus, ch_num, urb);
                         break;
 
                     default:
@@ -1427,7 +1645,7 @@ static void dwc2_outchan_irq_handler(struct usbh_bus *bus, uint8_t ch_num)
                         break;
                     case USB_ENDPOINT_TYPE_BULK:
                     case USB_ENDPOINT_TYPE_INTERRUPT:
-                        dwc2_bulk_intr_urb_init(bus, ch_num, urb, urb->transfer_buffer + urb->actual_length, urb->transfer_buffer_length);
+                        dwc2_bulk_intr_urb_init(bus, ch_num, urb);
                         break;
 
                     default:
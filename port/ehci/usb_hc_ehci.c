@@ -14,104 +14,190 @@
 #define EHCI_TUNE_MULT_HS 1 /* 1-3 transactions/uframe; 4.10.3 */
 #define EHCI_TUNE_MULT_TT 1
 
+#define EHCI_PIPE_FREE_QH_MIN 2 /* qhs usbh_pipe_open never takes */
+#define EHCI_IAA_TIMEOUT      100 /* ms an unlink waits for the async advance interrupt */
+
+#define EHCI_BW_UFRAME_USECS 100 /* periodic share of a uframe, 80% */
+#define EHCI_BW_TT_USECS     900 /* periodic share of a fs/ls frame behind a tt, 90% */
+
+#define EHCI_BIT_TIME(bytes) (7 * 8 * (uint32_t)(bytes) / 6) /* with worst case bit stuffing */
+#define EHCI_NS_TO_US(ns)    (((ns) + 999) / 1000)
+
+#define EHCI_HLP_TYPE(x) ((x) & 0x6)
+
 struct ehci_hcd g_ehci_hcd[CONFIG_USBHOST_MAX_BUS];
 
+#ifndef CONFIG_USB_EHCI_POOL_ARENA
 USB_NOCACHE_RAM_SECTION struct ehci_qh_hw ehci_qh_pool[CONFIG_USBHOST_MAX_BUS][CONFIG_USB_EHCI_QH_NUM];
 USB_NOCACHE_RAM_SECTION struct ehci_qtd_hw ehci_qtd_pool[CONFIG_USBHOST_MAX_BUS][CONFIG_USB_EHCI_QTD_NUM];
+#endif
 
 /* The head of the asynchronous queue */
 USB_NOCACHE_RAM_SECTION struct ehci_qh_hw g_async_qh_head[CONFIG_USBHOST_MAX_BUS];
-/* The head of the periodic queue */
+/* The periodic schedule of every frame ends at this qh */
 USB_NOCACHE_RAM_SECTION struct ehci_qh_hw g_periodic_qh_head[CONFIG_USBHOST_MAX_BUS];
 
+/* Inactive qtd, IN qtds point their alt_next_qtd here so that a short packet stops the queue */
+USB_NOCACHE_RAM_SECTION struct ehci_qtd_hw g_short_qtd[CONFIG_USBHOST_MAX_BUS];
+
 /* The frame list */
 USB_NOCACHE_RAM_SECTION uint32_t g_framelist[CONFIG_USBHOST_MAX_BUS][USB_ALIGN_UP(CONFIG_USB_EHCI_FRAME_LIST_SIZE, 1024)] __attribute__((aligned(4096)));
 
 static struct ehci_qtd_hw *ehci_qtd_alloc(struct usbh_bus *bus)
 {
+    struct ehci_hcd *hcd = &g_ehci_hcd[bus->hcd.hcd_id];
     struct ehci_qtd_hw *qtd;
     size_t flags;
 
     flags = usb_osal_enter_critical_section();
-    for (uint32_t i = 0; i < CONFIG_USB_EHCI_QTD_NUM; i++) {
-        qtd = &ehci_qtd_pool[bus->hcd.hcd_id][i];
-        if (!qtd->inuse) {
-            qtd->inuse = true;
-            usb_osal_leave_critical_section(flags);
-
-            memset(&qtd->hw, 0, sizeof(struct ehci_qtd));
-            qtd->hw.next_qtd = QTD_LIST_END;
-            qtd->hw.alt_next_qtd = QTD_LIST_END;
-            qtd->hw.token = QTD_TOKEN_STATUS_HALTED;
-            qtd->urb = NULL;
-            qtd->bufaddr = 0;
-            qtd->length = 0;
-
-            return qtd;
-        }
+    qtd = hcd->qtd_free;
+    if (qtd == NULL) {
+        hcd->qtd_stat.nomem++;
+        usb_osal_leave_critical_section(flags);
+        return NULL;
     }
+    hcd->qtd_free = qtd->next_free;
+    qtd->inuse = true;
+    ehci_pool_stat_get(&hcd->qtd_stat);
     usb_osal_leave_critical_section(flags);
-    return NULL;
+
+    memset(&qtd->hw, 0, sizeof(struct ehci_qtd));
+    qtd->hw.next_qtd = QTD_LIST_END;
+    qtd->hw.alt_next_qtd = QTD_LIST_END;
+    qtd->hw.token = QTD_TOKEN_STATUS_HALTED;
+    qtd->urb = NULL;
+    qtd->bufaddr = 0;
+    qtd->length = 0;
+
+    return qtd;
 }
 
 static void ehci_qtd_free(struct usbh_bus *bus, struct ehci_qtd_hw *qtd)
 {
+    struct ehci_hcd *hcd = &g_ehci_hcd[bus->hcd.hcd_id];
     size_t flags;
 
-    (void)bus;
-
     flags = usb_osal_enter_critical_section();
     qtd->inuse = false;
     qtd->urb = NULL;
+    qtd->next_free = hcd->qtd_free;
+    hcd->qtd_free = qtd;
+    hcd->qtd_stat.used--;
     usb_osal_leave_critical_section(flags);
 }
 
 static struct ehci_qh_hw *ehci_qh_alloc(struct usbh_bus *bus)
 {
+    struct ehci_hcd *hcd = &g_ehci_hcd[bus->hcd.hcd_id];
     struct ehci_qh_hw *qh;
     size_t flags;
 
     flags = usb_osal_enter_critical_section();
-    for (uint32_t i = 0; i < CONFIG_USB_EHCI_QH_NUM; i++) {
-        qh = &ehci_qh_pool[bus->hcd.hcd_id][i];
-        if (!qh->inuse) {
-            qh->inuse = true;
-            usb_osal_leave_critical_section(flags);
+    qh = hcd->qh_free;
+    if (qh == NULL) {
+        hcd->qh_stat.nomem++;
+        usb_osal_leave_critical_section(flags);
+        return NULL;
+    }
+    hcd->qh_free = qh->next_free;
+    qh->inuse = true;
+    ehci_pool_stat_get(&hcd->qh_stat);
+    usb_osal_leave_critical_section(flags);
+
+    memset(&qh->hw, 0, sizeof(struct ehci_qh));
+    qh->hw.hlp = QTD_LIST_END;
+    qh->hw.overlay.next_qtd = QTD_LIST_END;
+    qh->hw.overlay.alt_next_qtd = QTD_LIST_END;
+    qh->state = EHCI_QH_STATE_IDLE;
+    qh->waiting = false;
+    qh->opened = false;
+    qh->urb_num = 0;
+    qh->unlink_waiters = 0;
+    qh->first_qtd = QTD_LIST_END;
+    qh->dummy_qtd = QTD_LIST_END;
+    qh->hport = NULL;
+    qh->ep = NULL;
+
+    return qh;
+}
+
+static void ehci_qtd_chain_free(struct usbh_bus *bus, struct ehci_qtd_hw *qtd)
+{
+    struct ehci_qtd_hw *next;
+
+    while (qtd) {
+        next = EHCI_ADDR2QTD(qtd->hw.next_qtd);
+        ehci_qtd_free(bus, qtd);
+        qtd = next;
+    }
+}
+
+/* endpoint descriptors live in the config of their hport, their address alone spreads them well */
+static inline uint32_t ehci_qh_hash(struct usb_endpoint_descriptor *ep)
+{
+    return ((uintptr_t)ep >> 3) & (EHCI_QH_HASH_SIZE - 1);
+}
 
-            memset(&qh->hw, 0, sizeof(struct ehci_qh));
-            qh->hw.hlp = QTD_LIST_END;
-            qh->hw.overlay.next_qtd = QTD_LIST_END;
-            qh->hw.overlay.alt_next_qtd = QTD_LIST_END;
-            qh->urb = NULL;
-            qh->first_qtd = QTD_LIST_END;
-            qh->remove_in_iaad = 0;
+static struct ehci_qh_hw *ehci_qh_find(struct usbh_bus *bus, struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep)
+{
+    struct ehci_qh_hw *qh;
 
+    for (qh = g_ehci_hcd[bus->hcd.hcd_id].qh_hash[ehci_qh_hash(ep)]; qh; qh = qh->hash_next) {
+        if ((qh->hport == hport) && (qh->ep == ep)) {
             return qh;
         }
     }
-    usb_osal_leave_critical_section(flags);
     return NULL;
 }
 
+static void ehci_qh_hash_add(struct usbh_bus *bus, struct ehci_qh_hw *qh)
+{
+    struct ehci_qh_hw **head = &g_ehci_hcd[bus->hcd.hcd_id].qh_hash[ehci_qh_hash(qh->ep)];
+
+    qh->hash_next = *head;
+    *head = qh;
+}
+
+static void ehci_qh_hash_del(struct usbh_bus *bus, struct ehci_qh_hw *qh)
+{
+    struct ehci_qh_hw **link = &g_ehci_hcd[bus->hcd.hcd_id].qh_hash[ehci_qh_hash(qh->ep)];
+
+    while (*link) {
+        if (*link == qh) {
+            *link = qh->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    qh->hash_next = NULL;
+}
+
 static void ehci_qh_free(struct usbh_bus *bus, struct ehci_qh_hw *qh)
 {
-    struct ehci_qtd_hw *qtd;
     size_t flags;
 
     flags = usb_osal_enter_critical_section();
-    if (qh->urb) {
-        qh->urb->hcpriv = NULL;
-        qh->urb = NULL;
+    /* only the dummy qtd is left once the urb queue is empty */
+    ehci_qtd_chain_free(bus, EHCI_ADDR2QTD(qh->first_qtd));
+    if (qh->bw.period) {
+        ehci_periodic_bw_free(bus, &qh->bw);
     }
-    qtd = EHCI_ADDR2QTD(qh->first_qtd);
-
-    while (qtd) {
-        ehci_qtd_free(bus, qtd);
-        qtd = EHCI_ADDR2QTD(qtd->hw.next_qtd);
+    if (qh->ep && (USB_GET_ENDPOINT_TYPE(qh->ep->bmAttributes) != USB_ENDPOINT_TYPE_CONTROL)) {
+        ehci_qh_hash_del(bus, qh);
     }
 
-    qh->inuse = false;
+    qh->state = EHCI_QH_STATE_IDLE;
+    qh->waiting = false;
+    qh->opened = false;
+    qh->urb_num = 0;
     qh->first_qtd = QTD_LIST_END;
+    qh->dummy_qtd = QTD_LIST_END;
+    qh->hport = NULL;
+    qh->ep = NULL;
+    qh->inuse = false;
+    qh->next_free = g_ehci_hcd[bus->hcd.hcd_id].qh_free;
+    g_ehci_hcd[bus->hcd.hcd_id].qh_free = qh;
+    g_ehci_hcd[bus->hcd.hcd_id].qh_stat.used--;
     usb_osal_leave_critical_section(flags);
 }
 
@@ -137,8 +223,6 @@ static inline void ehci_qh_add_head(struct ehci_qh_hw *head, struct ehci_qh_hw *
     n->hw.hlp = head->hw.hlp;
     usb_ehci_qh_qtd_flush(n);
 
-    usb_dcache_flush((uintptr_t)n->urb->transfer_buffer, USB_ALIGN_UP(n->urb->transfer_buffer_length, CONFIG_USB_ALIGN_SIZE));
-
     head->hw.hlp = QH_HLP_QH(n);
 #if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
     usb_dcache_clean((uintptr_t)&head->hw, CONFIG_USB_EHCI_ALIGN_SIZE);
@@ -161,26 +245,259 @@ static inline void ehci_qh_remove(struct ehci_qh_hw *head, struct ehci_qh_hw *n)
     }
 }
 
-static int ehci_caculate_smask(int binterval)
+static void ehci_urb_dcache_flush(struct usbh_urb *urb)
+{
+    if (urb->num_sgs && !(urb->transfer_flags & USBH_URB_SG_BOUNCE)) {
+        for (uint32_t i = 0; i < urb->num_sgs; i++) {
+            usb_dcache_flush((uintptr_t)urb->sg[i].buffer, USB_ALIGN_UP(urb->sg[i].length, CONFIG_USB_ALIGN_SIZE));
+        }
+    } else {
+        usb_dcache_flush((uintptr_t)urb->transfer_buffer, USB_ALIGN_UP(urb->transfer_buffer_length, CONFIG_USB_ALIGN_SIZE));
+    }
+}
+
+/* hs bus time of one transaction, usb 2.0 5.11.3 */
+static uint16_t ehci_hs_usecs(uint32_t bytes, bool iso)
+{
+    uint32_t ns;
+
+    ns = ((iso ? (38 * 8 * 2083) : (55 * 8 * 2083)) + 2083 * (3 + EHCI_BIT_TIME(bytes))) / 1000 + 5;
+    return EHCI_NS_TO_US(ns);
+}
+
+/* fs/ls bus time of one transaction behind a tt, tt_think is in units of 8 fs bit times */
+static uint16_t ehci_tt_usecs(uint8_t speed, bool is_in, bool iso, uint32_t bytes, uint8_t tt_think)
+{
+    uint32_t ns;
+
+    if (speed == USB_SPEED_LOW) {
+        ns = (is_in ? 64060 : 64107) + 2 * 333 + 1000 +
+             ((is_in ? 67667 : 66700) * (31 + 10 * EHCI_BIT_TIME(bytes))) / 1000;
+    } else {
+        ns = (iso ? (is_in ? 7268 : 6265) : 9107) + 1000 +
+             (8354 * (31 + 10 * EHCI_BIT_TIME(bytes))) / 1000;
+    }
+    ns += (tt_think + 1) * 666;
+    return EHCI_NS_TO_US(ns);
+}
+
+static inline bool ehci_bw_in_frame(struct ehci_periodic_bw *bw, uint32_t frame)
+{
+    uint32_t frames = (bw->period >> 3) ? (bw->period >> 3) : 1;
+
+    return (frame % frames) == (uint32_t)(bw->phase >> 3);
+}
+
+/* split transactions shift their masks, given for a start in uframe 0, to the uframe of the phase */
+static void ehci_bw_set_phase(struct ehci_periodic_bw *bw, uint16_t phase, uint8_t split_smask, uint8_t split_cmask)
+{
+    uint8_t uframe = phase & 0x7;
+
+    bw->phase = phase;
+    bw->smask = 0;
+    bw->cmask = 0;
+
+    if (bw->tt_usecs) {
+        bw->smask = (uint8_t)(split_smask << uframe);
+        bw->cmask = (uint8_t)(split_cmask << uframe);
+    } else if (bw->period < 8) {
+        for (; uframe < 8; uframe += bw->period) {
+            bw->smask |= 1 << uframe;
+        }
+    } else {
+        bw->smask = 1 << uframe;
+    }
+}
+
+static uint32_t ehci_bw_tt_load(struct ehci_hcd *hcd, struct ehci_periodic_bw *bw, uint32_t frame)
+{
+    uint32_t usecs = 0;
+
+    for (struct ehci_periodic_bw *tmp = hcd->bw_list; tmp; tmp = tmp->next) {
+        if (tmp->tt_usecs && (tmp->tt_hub == bw->tt_hub) && (tmp->tt_port == bw->tt_port) && ehci_bw_in_frame(tmp, frame)) {
+            usecs += tmp->tt_usecs;
+        }
+    }
+    return usecs;
+}
+
+/* the load of the uframes bw touches plus its busiest tt frame once bw is added, -1 if it does not fit */
+static int ehci_bw_check(struct ehci_hcd *hcd, struct ehci_periodic_bw *bw)
+{
+    uint32_t usecs;
+    uint32_t hs_load = 0;
+    uint32_t tt_load = 0;
+
+    for (uint32_t frame = 0; frame < EHCI_BW_FRAMES; frame++) {
+        if (!ehci_bw_in_frame(bw, frame)) {
+            continue;
+        }
+
+        for (uint8_t uframe = 0; uframe < 8; uframe++) {
+            if (!((bw->smask | bw->cmask) & (1 << uframe))) {
+                continue;
+            }
+            usecs = hcd->bw_uframe[frame * 8 + uframe];
+            usecs += (bw->smask & (1 << uframe)) ? bw->usecs : 0;
+            usecs += (bw->cmask & (1 << uframe)) ? bw->c_usecs : 0;
+            if (usecs > EHCI_BW_UFRAME_USECS) {
+                return -1;
+            }
+            hs_load += usecs;
+        }
+
+        if (bw->tt_usecs) {
+            usecs = ehci_bw_tt_load(hcd, bw, frame) + bw->tt_usecs;
+            if (usecs > EHCI_BW_TT_USECS) {
+                return -1;
+            }
+            if (usecs > tt_load) {
+                tt_load = usecs;
+            }
+        }
+    }
+    return (int)(hs_load + tt_load);
+}
+
+static void ehci_bw_update(struct ehci_hcd *hcd, struct ehci_periodic_bw *bw, bool reserve)
+{
+    uint8_t usecs;
+
+    for (uint32_t frame = 0; frame < EHCI_BW_FRAMES; frame++) {
+        if (!ehci_bw_in_frame(bw, frame)) {
+            continue;
+        }
+
+        for (uint8_t uframe = 0; uframe < 8; uframe++) {
+            usecs = 0;
+            usecs += (bw->smask & (1 << uframe)) ? bw->usecs : 0;
+            usecs += (bw->cmask & (1 << uframe)) ? bw->c_usecs : 0;
+            if (reserve) {
+                hcd->bw_uframe[frame * 8 + uframe] += usecs;
+            } else {
+                hcd->bw_uframe[frame * 8 + uframe] -= usecs;
+            }
+        }
+    }
+}
+
+/*
+ * Reserve periodic bandwidth for ep and pick its phase: every phase the interval allows is tried
+ * and the one leaving the least loaded uframes (the least loaded tt frames for fs/ls endpoints
+ * behind a tt) wins. Intervals above EHCI_BW_FRAMES frames are polled every EHCI_BW_FRAMES frames.
+ */
+int ehci_periodic_bw_alloc(struct usbh_bus *bus, struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep, struct ehci_periodic_bw *bw)
 {
-    int order, interval;
+    struct ehci_hcd *hcd = &g_ehci_hcd[bus->hcd.hcd_id];
+    uint8_t ep_type = USB_GET_ENDPOINT_TYPE(ep->bmAttributes);
+    uint16_t ep_mps = USB_GET_MAXPACKETSIZE(ep->wMaxPacketSize);
+    uint8_t interval = ep->bInterval ? ep->bInterval : 1;
+    bool is_in = (ep->bEndpointAddress & 0x80) ? true : false;
+    bool iso = (ep_type == USB_ENDPOINT_TYPE_ISOCHRONOUS);
+    uint8_t split_smask = 0x01;
+    uint8_t split_cmask = 0x00;
+    uint32_t splits;
+    uint32_t period;
+    uint16_t best_phase = 0;
+    int best_load = -1;
+    int load;
+    size_t flags;
+
+    memset(bw, 0, sizeof(struct ehci_periodic_bw));
 
-    interval = 1;
-    while (binterval > 1) {
-        interval *= 2;
-        binterval--;
+    if (hport->speed == USB_SPEED_HIGH) {
+        period = 1 << (MIN(interval, 16) - 1);
+        bw->usecs = ehci_hs_usecs(ep_mps * (USB_GET_MULT(ep->wMaxPacketSize) + 1), iso);
+    } else {
+        if (iso) {
+            period = 1 << (MIN(interval, 16) - 1);
+        } else {
+            for (period = 1; (period * 2) <= interval; period *= 2) {
+            }
+        }
+        period *= 8;
+
+        /* the tt moves at most 188 bytes per uframe */
+        splits = (ep_mps + 187) / 188;
+        if (is_in) {
+            /* SSPLIT, then CSPLITs from 2 uframes later until the data is back */
+            bw->usecs = ehci_hs_usecs(1, false);
+            bw->c_usecs = ehci_hs_usecs(MIN(ep_mps, 188), iso) + ehci_hs_usecs(0, false);
+            split_cmask = iso ? (((1 << (splits + 1)) - 1) << 2) : 0x3c;
+        } else if (iso) {
+            /* one SSPLIT per 188 bytes carries the data, nothing to complete */
+            bw->usecs = ehci_hs_usecs(MIN(ep_mps, 188), iso) + ehci_hs_usecs(1, false);
+            split_smask = (1 << splits) - 1;
+        } else {
+            /* SSPLIT and the data, then CSPLITs for the handshake */
+            bw->usecs = ehci_hs_usecs(ep_mps, iso) + ehci_hs_usecs(1, false);
+            bw->c_usecs = ehci_hs_usecs(0, false);
+            split_cmask = 0x3c;
+        }
+        bw->tt_usecs = ehci_tt_usecs(hport->speed, is_in, iso, ep_mps, hport->parent->tt_think);
+        bw->tt_hub = hport->parent->hub_addr;
+        bw->tt_port = hport->parent->ismtt ? hport->port : 0;
     }
+    bw->period = MIN(period, EHCI_BW_UFRAMES);
+
+    /*
+     * The search runs with interrupts on and may see the load of others change under it,
+     * the phase it picks is checked again against the current load before it is taken.
+     */
+    while (1) {
+        best_load = -1;
+        for (uint16_t phase = 0; phase < bw->period; phase++) {
+            if (bw->tt_usecs && (((uint32_t)(split_smask | split_cmask) << (phase & 0x7)) > 0xff)) {
+                /* splits must not run into the next frame */
+                continue;
+            }
+            ehci_bw_set_phase(bw, phase, split_smask, split_cmask);
+            load = ehci_bw_check(hcd, bw);
+            if ((load >= 0) && ((best_load < 0) || (load < best_load))) {
+                best_load = load;
+                best_phase = phase;
+            }
+        }
+
+        if (best_load < 0) {
+            USB_LOG_ERR("No periodic bandwidth for ep 0x%02x of dev %u, interval %u\r\n",
+                        ep->bEndpointAddress, hport->dev_addr, ep->bInterval);
+            bw->period = 0;
+            return -USB_ERR_RANGE;
+        }
+
+        ehci_bw_set_phase(bw, best_phase, split_smask, split_cmask);
 
-    if (interval < 2) /* interval 1 */
-        return 0xFF;
-    if (interval < 4) /* interval 2 */
-        return 0x55;
-    if (interval < 8) /* interval 4 */
-        return 0x22;
-    for (order = 0; (interval > 1); order++) {
-        interval >>= 1;
+        flags = usb_osal_enter_critical_section();
+        if (ehci_bw_check(hcd, bw) >= 0) {
+            ehci_bw_update(hcd, bw, true);
+            bw->next = hcd->bw_list;
+            hcd->bw_list = bw;
+            usb_osal_leave_critical_section(flags);
+            return 0;
+        }
+        /* taken by another endpoint meanwhile */
+        usb_osal_leave_critical_section(flags);
     }
-    return (0x1 << (order % 8));
+}
+
+void ehci_periodic_bw_free(struct usbh_bus *bus, struct ehci_periodic_bw *bw)
+{
+    struct ehci_hcd *hcd = &g_ehci_hcd[bus->hcd.hcd_id];
+    struct ehci_periodic_bw **prev;
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    for (prev = &hcd->bw_list; *prev; prev = &(*prev)->next) {
+        if (*prev == bw) {
+            *prev = bw->next;
+            ehci_bw_update(hcd, bw, false);
+            break;
+        }
+    }
+    bw->period = 0;
+    bw->next = NULL;
+    usb_osal_leave_critical_section(flags);
 }
 
 static void ehci_qh_fill(struct ehci_qh_hw *qh,
@@ -189,7 +506,6 @@ static void ehci_qh_fill(struct ehci_qh_hw *qh,
                          uint8_t ep_type,
                          uint16_t ep_mps,
                          uint8_t ep_mult,
-                         uint8_t ep_interval,
                          uint8_t speed,
                          uint8_t hubaddr,
                          uint8_t hubport)
@@ -247,12 +563,6 @@ static void ehci_qh_fill(struct ehci_qh_hw *qh,
 
             epcap |= QH_EPCAPS_HUBADDR(hubaddr);
             epcap |= QH_EPCAPS_PORT(hubport);
-
-            if (ep_type == USB_ENDPOINT_TYPE_INTERRUPT) {
-                epcap |= QH_EPCAPS_SSMASK(2);
-                epcap |= QH_EPCAPS_SCMASK(0x78);
-            }
-
             break;
         case USB_SPEED_HIGH:
             epchar |= QH_EPCHAR_EPS_HIGH;
@@ -263,9 +573,8 @@ static void ehci_qh_fill(struct ehci_qh_hw *qh,
             } else if (ep_type == USB_ENDPOINT_TYPE_BULK) {
                 epcap |= QH_EPCAPS_MULT(EHCI_TUNE_MULT_HS);
             } else {
-                /* only for interrupt ep */
+                /* only for interrupt ep, the masks come from the bandwidth reservation */
                 epcap |= QH_EPCAPS_MULT(ep_mult);
-                epcap |= ehci_caculate_smask(ep_interval);
             }
             break;
 
@@ -325,34 +634,32 @@ static void ehci_qtd_fill(struct ehci_qtd_hw *qtd, uint32_t bufaddr, size_t bufl
     qtd->length = buflen;
 }
 
-static struct ehci_qh_hw *ehci_control_urb_init(struct usbh_bus *bus, struct usbh_urb *urb, struct usb_setup_packet *setup, uint8_t *buffer, uint32_t buflen)
+static int ehci_control_qtd_fill(struct usbh_bus *bus, struct usbh_urb *urb, struct ehci_qtd_hw **first, struct ehci_qtd_hw **last)
 {
-    struct ehci_qh_hw *qh = NULL;
+    struct usb_setup_packet *setup = urb->setup;
     struct ehci_qtd_hw *qtd_setup = NULL;
     struct ehci_qtd_hw *qtd_data = NULL;
     struct ehci_qtd_hw *qtd_status = NULL;
     uint32_t token;
-    size_t flags;
-
-    qh = ehci_qh_alloc(bus);
-    if (qh == NULL) {
-        return NULL;
-    }
 
     qtd_setup = ehci_qtd_alloc(bus);
     qtd_status = ehci_qtd_alloc(bus);
-    USB_ASSERT_MSG(qtd_setup && qtd_status, "ctrl qtd alloc failed");
+    if (setup->wLength > 0) {
+        qtd_data = ehci_qtd_alloc(bus);
+    }
 
-    ehci_qh_fill(qh,
-                 urb->hport->dev_addr,
-                 urb->ep->bEndpointAddress,
-                 USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes),
-                 USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize),
-                 0,
-                 0,
-                 urb->hport->speed,
-                 urb->hport->parent->hub_addr,
-                 urb->hport->port);
+    if (!qtd_setup || !qtd_status || (setup->wLength > 0 && !qtd_data)) {
+        if (qtd_setup) {
+            ehci_qtd_free(bus, qtd_setup);
+        }
+        if (qtd_status) {
+            ehci_qtd_free(bus, qtd_status);
+        }
+        if (qtd_data) {
+            ehci_qtd_free(bus, qtd_data);
+        }
+        return -USB_ERR_NOMEM;
+    }
 
     /* fill setup qtd */
     token = QTD_TOKEN_STATUS_ACTIVE |
@@ -365,9 +672,6 @@ static struct ehci_qh_hw *ehci_control_urb_init(struct usbh_bus *bus, struct usb
 
     /* fill data qtd */
     if (setup->wLength > 0) {
-        qtd_data = ehci_qtd_alloc(bus);
-        USB_ASSERT_MSG(qtd_data, "ctrl qtd alloc failed");
-
         if ((setup->bmRequestType & 0x80) == 0x80) {
             token = QTD_TOKEN_PID_IN;
         } else {
@@ -377,9 +681,9 @@ static struct ehci_qh_hw *ehci_control_urb_init(struct usbh_bus *bus, struct usb
                  QTD_TOKEN_PID_OUT |
                  QTD_TOKEN_TOGGLE |
                  ((uint32_t)EHCI_TUNE_CERR << QTD_TOKEN_CERR_SHIFT) |
-                 ((uint32_t)buflen << QTD_TOKEN_NBYTES_SHIFT);
+                 ((uint32_t)urb->transfer_buffer_length << QTD_TOKEN_NBYTES_SHIFT);
 
-        ehci_qtd_fill(qtd_data, (uintptr_t)buffer, buflen, token);
+        ehci_qtd_fill(qtd_data, (uintptr_t)urb->transfer_buffer, urb->transfer_buffer_length, token);
         qtd_data->urb = urb;
         qtd_setup->hw.next_qtd = EHCI_PTR2ADDR(qtd_data);
         qtd_data->hw.next_qtd = EHCI_PTR2ADDR(qtd_status);
@@ -403,322 +707,704 @@ static struct ehci_qh_hw *ehci_control_urb_init(struct usbh_bus *bus, struct usb
     qtd_status->urb = urb;
     qtd_status->hw.next_qtd = QTD_LIST_END;
 
-    /* update qh first qtd */
-    qh->hw.curr_qtd = EHCI_PTR2ADDR(qtd_setup);
-    qh->hw.overlay.next_qtd = EHCI_PTR2ADDR(qtd_setup);
+    *first = qtd_setup;
+    *last = qtd_status;
+    return 0;
+}
 
-    /* record qh first qtd */
-    qh->first_qtd = EHCI_PTR2ADDR(qtd_setup);
+static int ehci_data_qtd_fill(struct usbh_bus *bus, struct usbh_urb *urb, struct ehci_qtd_hw **first, struct ehci_qtd_hw **last)
+{
+    struct ehci_qtd_hw *qtd = NULL;
+    struct ehci_qtd_hw *prev_qtd = NULL;
+    struct usbh_sg single;
+    struct usbh_sg *sg;
+    uint32_t num_sgs;
+    uint8_t *buffer;
+    uint32_t buflen;
+    uint32_t xfer_len = 0;
+    uint32_t token;
 
-    flags = usb_osal_enter_critical_section();
+    *first = NULL;
 
-    qh->urb = urb;
-    urb->hcpriv = qh;
-    /* add qh into async list */
-    ehci_qh_add_head(&g_async_qh_head[bus->hcd.hcd_id], qh);
+    if (urb->num_sgs && !(urb->transfer_flags & USBH_URB_SG_BOUNCE)) {
+        sg = urb->sg;
+        num_sgs = urb->num_sgs;
+    } else {
+        single.buffer = urb->transfer_buffer;
+        single.length = urb->transfer_buffer_length;
+        sg = &single;
+        num_sgs = 1;
+    }
 
-    EHCI_HCOR->usbcmd |= EHCI_USBCMD_ASEN;
+    /* every segment gets its own qtds, no more than 16K each */
+    for (uint32_t i = 0; i < num_sgs; i++) {
+        buffer = sg[i].buffer;
+        buflen = sg[i].length;
 
-    usb_osal_leave_critical_section(flags);
-    return qh;
+        /* empty segments would send zlp */
+        if ((buflen == 0) && (urb->transfer_buffer_length > 0)) {
+            continue;
+        }
+
+        do {
+            qtd = ehci_qtd_alloc(bus);
+            if (qtd == NULL) {
+                ehci_qtd_chain_free(bus, *first);
+                return -USB_ERR_NOMEM;
+            }
+
+            if (buflen > 0x4000) {
+                xfer_len = 0x4000;
+                buflen -= 0x4000;
+            } else {
+                xfer_len = buflen;
+                buflen = 0;
+            }
+
+            if (urb->ep->bEndpointAddress & 0x80) {
+                token = QTD_TOKEN_PID_IN;
+            } else {
+                token = QTD_TOKEN_PID_OUT;
+            }
+
+            token |= QTD_TOKEN_STATUS_ACTIVE |
+                     ((uint32_t)EHCI_TUNE_CERR << QTD_TOKEN_CERR_SHIFT) |
+                     ((uint32_t)xfer_len << QTD_TOKEN_NBYTES_SHIFT);
+
+            ehci_qtd_fill(qtd, (uintptr_t)buffer, xfer_len, token);
+            qtd->urb = urb;
+            qtd->hw.next_qtd = QTD_LIST_END;
+            if (urb->ep->bEndpointAddress & 0x80) {
+                qtd->hw.alt_next_qtd = EHCI_PTR2ADDR(&g_short_qtd[bus->hcd.hcd_id]);
+            }
+            buffer += xfer_len;
+
+            if (prev_qtd) {
+                prev_qtd->hw.next_qtd = EHCI_PTR2ADDR(qtd);
+            } else {
+                *first = qtd;
+            }
+            prev_qtd = qtd;
+        } while (buflen > 0);
+    }
+
+    /* a short packet in the last qtd just moves the hc on to the next queued urb */
+    qtd->hw.alt_next_qtd = QTD_LIST_END;
+    qtd->hw.token |= QTD_TOKEN_IOC;
+
+    *last = qtd;
+    return 0;
 }
 
-static struct ehci_qh_hw *ehci_bulk_urb_init(struct usbh_bus *bus, struct usbh_urb *urb, uint8_t *buffer, uint32_t buflen)
+static int ehci_qh_create(struct usbh_bus *bus, struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep, uint8_t data_toggle, struct ehci_qh_hw **qh_out)
 {
-    struct ehci_qh_hw *qh = NULL;
-    struct ehci_qtd_hw *qtd = NULL;
-    struct ehci_qtd_hw *first_qtd = NULL;
-    struct ehci_qtd_hw *prev_qtd = NULL;
-    uint32_t xfer_len = 0;
-    uint32_t token;
-    size_t flags;
+    struct ehci_qh_hw *qh;
+    struct ehci_qtd_hw *dummy;
+    uint8_t ep_type = USB_GET_ENDPOINT_TYPE(ep->bmAttributes);
+    int ret;
 
     qh = ehci_qh_alloc(bus);
     if (qh == NULL) {
-        return NULL;
+        return -USB_ERR_NOMEM;
+    }
+
+    if (ep_type == USB_ENDPOINT_TYPE_INTERRUPT) {
+        ret = ehci_periodic_bw_alloc(bus, hport, ep, &qh->bw);
+        if (ret < 0) {
+            ehci_qh_free(bus, qh);
+            return ret;
+        }
+    }
+
+    dummy = ehci_qtd_alloc(bus);
+    if (dummy == NULL) {
+        ehci_qh_free(bus, qh);
+        return -USB_ERR_NOMEM;
     }
 
     ehci_qh_fill(qh,
-                 urb->hport->dev_addr,
-                 urb->ep->bEndpointAddress,
-                 USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes),
-                 USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize),
-                 0,
-                 0,
-                 urb->hport->speed,
-                 urb->hport->parent->hub_addr,
-                 urb->hport->port);
+                 hport->dev_addr,
+                 ep->bEndpointAddress,
+                 ep_type,
+                 USB_GET_MAXPACKETSIZE(ep->wMaxPacketSize),
+                 (ep_type == USB_ENDPOINT_TYPE_INTERRUPT) ? (USB_GET_MULT(ep->wMaxPacketSize) + 1) : 0,
+                 hport->speed,
+                 hport->parent->hub_addr,
+                 hport->port);
+
+    qh->hw.epcap |= QH_EPCAPS_SSMASK(qh->bw.smask) | QH_EPCAPS_SCMASK(qh->bw.cmask);
+    qh->hport = hport;
+    qh->ep = ep;
+    qh->first_qtd = EHCI_PTR2ADDR(dummy);
+    qh->dummy_qtd = EHCI_PTR2ADDR(dummy);
+
+    qh->hw.curr_qtd = qh->first_qtd;
+    qh->hw.overlay.next_qtd = qh->first_qtd;
+
+    /* the qh keeps the data toggle from now on */
+    if (data_toggle) {
+        qh->hw.overlay.token = QTD_TOKEN_TOGGLE;
+    } else {
+        qh->hw.overlay.token = 0;
+    }
 
-    while (1) {
-        qtd = ehci_qtd_alloc(bus);
-        USB_ASSERT_MSG(qtd, "bulk qtd alloc failed");
+    *qh_out = qh;
+    return 0;
+}
 
-        if (buflen > 0x4000) {
-            xfer_len = 0x4000;
-            buflen -= 0x4000;
-        } else {
-            xfer_len = buflen;
-            buflen = 0;
-        }
+/*
+ * Called with interrupts off and returns with them off. A new qh is built with interrupts on, the
+ * periodic bandwidth search is too long for the irq-off section, so another caller may have added
+ * a qh for the same endpoint meanwhile and that one is used instead.
+ */
+static int ehci_qh_find_or_create(struct usbh_bus *bus, struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep, uint8_t data_toggle, size_t *flags, struct ehci_qh_hw **qh_out)
+{
+    bool control = (USB_GET_ENDPOINT_TYPE(ep->bmAttributes) == USB_ENDPOINT_TYPE_CONTROL);
+    struct ehci_qh_hw *qh = NULL;
+    struct ehci_qh_hw *new_qh;
+    int ret;
 
-        if (urb->ep->bEndpointAddress & 0x80) {
-            token = QTD_TOKEN_PID_IN;
-        } else {
-            token = QTD_TOKEN_PID_OUT;
-        }
+    /* control urbs carry their own qh, ep0 changes address and mps while enumerating */
+    if (!control) {
+        qh = ehci_qh_find(bus, hport, ep);
+    }
+    if (qh) {
+        *qh_out = qh;
+        return 0;
+    }
 
-        token |= QTD_TOKEN_STATUS_ACTIVE |
-                 ((uint32_t)EHCI_TUNE_CERR << QTD_TOKEN_CERR_SHIFT) |
-                 ((uint32_t)xfer_len << QTD_TOKEN_NBYTES_SHIFT);
+    usb_osal_leave_critical_section(*flags);
+    ret = ehci_qh_create(bus, hport, ep, data_toggle, &new_qh);
+    *flags = usb_osal_enter_critical_section();
+    if (ret < 0) {
+        return ret;
+    }
 
-        if (buflen == 0) {
-            token |= QTD_TOKEN_IOC;
+    if (!control) {
+        qh = ehci_qh_find(bus, hport, ep);
+        if (qh) {
+            ehci_qh_free(bus, new_qh);
+            *qh_out = qh;
+            return 0;
         }
+        ehci_qh_hash_add(bus, new_qh);
+    }
 
-        ehci_qtd_fill(qtd, (uintptr_t)buffer, xfer_len, token);
-        qtd->urb = urb;
-        qtd->hw.next_qtd = QTD_LIST_END;
-        buffer += xfer_len;
+    *qh_out = new_qh;
+    return 0;
+}
 
-        if (prev_qtd) {
-            prev_qtd->hw.next_qtd = EHCI_PTR2ADDR(qtd);
-        } else {
-            first_qtd = qtd;
+static inline void ehci_periodic_link_clean(uint32_t *link)
+{
+#if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
+    usb_dcache_clean((uintptr_t)link & ~(CONFIG_USB_EHCI_ALIGN_SIZE - 1), CONFIG_USB_EHCI_ALIGN_SIZE);
+#else
+    (void)link;
+#endif
+}
+
+/*
+ * A frame list entry leads through the qhs polled in that frame, longest period first, down
+ * to the periodic head. Qhs with shorter periods form tails shared by several frames, so a qh
+ * goes in front of the first qh with a shorter period in each frame of its phase.
+ */
+static void ehci_periodic_link(struct usbh_bus *bus, struct ehci_qh_hw *qh)
+{
+    uint32_t frames = (qh->bw.period >> 3) ? (qh->bw.period >> 3) : 1;
+    struct ehci_qh_hw *here;
+    uint32_t *link;
+
+    for (uint32_t frame = qh->bw.phase >> 3; frame < CONFIG_USB_EHCI_FRAME_LIST_SIZE; frame += frames) {
+        link = &g_framelist[bus->hcd.hcd_id][frame];
+        here = NULL;
+        while (!(*link & QH_HLP_END)) {
+            if (EHCI_HLP_TYPE(*link) != EHCI_HLP_TYPE(QH_HLP_QH(0))) {
+                /* itds and sitds start with their next link pointer as well */
+                link = (uint32_t *)(uintptr_t)EHCI_PTR2ADDR(*link);
+                continue;
+            }
+            here = EHCI_ADDR2QH(*link);
+            if ((here == qh) || (here->bw.period < qh->bw.period)) {
+                break;
+            }
+            link = &here->hw.hlp;
+            here = NULL;
         }
-        prev_qtd = qtd;
 
-        if (buflen == 0) {
-            break;
+        /* already reached through a shared tail */
+        if (here == qh) {
+            continue;
         }
+
+        qh->hw.hlp = *link;
+        usb_ehci_qh_qtd_flush(qh);
+        *link = QH_HLP_QH(qh);
+        ehci_periodic_link_clean(link);
     }
+}
 
-    /* update qh first qtd */
-    qh->hw.curr_qtd = EHCI_PTR2ADDR(first_qtd);
-    qh->hw.overlay.next_qtd = EHCI_PTR2ADDR(first_qtd);
+static void ehci_periodic_unlink(struct usbh_bus *bus, struct ehci_qh_hw *qh)
+{
+    uint32_t frames = (qh->bw.period >> 3) ? (qh->bw.period >> 3) : 1;
+    uint32_t *link;
+
+    for (uint32_t frame = qh->bw.phase >> 3; frame < CONFIG_USB_EHCI_FRAME_LIST_SIZE; frame += frames) {
+        link = &g_framelist[bus->hcd.hcd_id][frame];
+        while (!(*link & QH_HLP_END)) {
+            if (EHCI_HLP_TYPE(*link) != EHCI_HLP_TYPE(QH_HLP_QH(0))) {
+                link = (uint32_t *)(uintptr_t)EHCI_PTR2ADDR(*link);
+                continue;
+            }
+            if (EHCI_ADDR2QH(*link) == qh) {
+                *link = qh->hw.hlp;
+                ehci_periodic_link_clean(link);
+                break;
+            }
+            link = &EHCI_ADDR2QH(*link)->hw.hlp;
+        }
+    }
+}
 
-    /* update data toggle */
-    if (urb->data_toggle) {
-        qh->hw.overlay.token = QTD_TOKEN_TOGGLE;
+static void ehci_qh_link(struct usbh_bus *bus, struct ehci_qh_hw *qh)
+{
+    if (USB_GET_ENDPOINT_TYPE(qh->ep->bmAttributes) == USB_ENDPOINT_TYPE_INTERRUPT) {
+        ehci_periodic_link(bus, qh);
+        EHCI_HCOR->usbcmd |= EHCI_USBCMD_PSEN;
     } else {
-        qh->hw.overlay.token = 0;
+        /* add qh into async list */
+        ehci_qh_add_head(&g_async_qh_head[bus->hcd.hcd_id], qh);
+        EHCI_HCOR->usbcmd |= EHCI_USBCMD_ASEN;
     }
+    qh->state = EHCI_QH_STATE_LINKED;
+}
 
-    /* record qh first qtd */
-    qh->first_qtd = EHCI_PTR2ADDR(first_qtd);
+static void ehci_async_unlink(struct usbh_bus *bus, struct ehci_qh_hw *qh)
+{
+    ehci_qh_remove(&g_async_qh_head[bus->hcd.hcd_id], qh);
 
-    flags = usb_osal_enter_critical_section();
+    /* the hc may still cache the qh, wait for an async advance before touching it again */
+    if (g_ehci_hcd[bus->hcd.hcd_id].iaa_pending) {
+        /* the doorbell in flight may be answered before the hc saw this removal */
+        qh->state = EHCI_QH_STATE_UNLINK_WAIT;
+    } else {
+        qh->state = EHCI_QH_STATE_UNLINK;
+        g_ehci_hcd[bus->hcd.hcd_id].iaa_pending = true;
+        EHCI_HCOR->usbcmd |= EHCI_USBCMD_IAAD;
+    }
+}
+
+static void ehci_qh_unlink(struct usbh_bus *bus, struct ehci_qh_hw *qh)
+{
+    if (USB_GET_ENDPOINT_TYPE(qh->ep->bmAttributes) == USB_ENDPOINT_TYPE_INTERRUPT) {
+        ehci_periodic_unlink(bus, qh);
+        qh->state = EHCI_QH_STATE_IDLE;
+        if (!qh->waiting) {
+            ehci_qh_free(bus, qh);
+        }
+        return;
+    }
 
-    qh->urb = urb;
+    ehci_async_unlink(bus, qh);
+}
+
+/*
+ * The chain of a qh always ends with an inactive dummy qtd, the hc may be parked on it.
+ * The first qtd of the urb is copied into the dummy and turned into the new dummy, the
+ * old dummy is activated last, so the hc either sees the whole urb or nothing of it.
+ */
+static void ehci_qh_urb_append(struct ehci_qh_hw *qh, struct usbh_urb *urb, struct ehci_qtd_hw *first, struct ehci_qtd_hw *last)
+{
+    struct ehci_qtd_hw *dummy = EHCI_ADDR2QTD(qh->dummy_qtd);
+    uint32_t token = first->hw.token;
+
+    dummy->hw.next_qtd = (first == last) ? EHCI_PTR2ADDR(first) : first->hw.next_qtd;
+    dummy->hw.alt_next_qtd = first->hw.alt_next_qtd;
+    memcpy(dummy->hw.bpl, first->hw.bpl, sizeof(dummy->hw.bpl));
+    dummy->urb = urb;
+    dummy->bufaddr = first->bufaddr;
+    dummy->length = first->length;
+
+    if (first != last) {
+        last->hw.next_qtd = EHCI_PTR2ADDR(first);
+    }
+
+    first->hw.next_qtd = QTD_LIST_END;
+    first->hw.alt_next_qtd = QTD_LIST_END;
+    first->hw.token = QTD_TOKEN_STATUS_HALTED;
+    first->urb = NULL;
+    first->bufaddr = 0;
+    first->length = 0;
+
+#if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
+    for (struct ehci_qtd_hw *qtd = EHCI_ADDR2QTD(dummy->hw.next_qtd); qtd; qtd = EHCI_ADDR2QTD(qtd->hw.next_qtd)) {
+        usb_dcache_clean((uintptr_t)&qtd->hw, CONFIG_USB_EHCI_ALIGN_SIZE);
+    }
+    usb_dcache_clean((uintptr_t)&dummy->hw, CONFIG_USB_EHCI_ALIGN_SIZE);
+#endif
+
+    dummy->hw.token = token;
+#if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
+    usb_dcache_clean((uintptr_t)&dummy->hw, CONFIG_USB_EHCI_ALIGN_SIZE);
+#endif
+
+    qh->dummy_qtd = EHCI_PTR2ADDR(first);
+    qh->urb_queue[qh->urb_num++] = urb;
     urb->hcpriv = qh;
-    /* add qh into async list */
-    ehci_qh_add_head(&g_async_qh_head[bus->hcd.hcd_id], qh);
+}
+
+static int ehci_urb_enqueue(struct usbh_bus *bus, struct usbh_urb *urb, struct ehci_qh_hw **qh_out)
+{
+    struct ehci_qh_hw *qh = NULL;
+    struct ehci_qtd_hw *first;
+    struct ehci_qtd_hw *last;
+    size_t flags;
+    int ret;
+
+    if (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) == USB_ENDPOINT_TYPE_CONTROL) {
+        ret = ehci_control_qtd_fill(bus, urb, &first, &last);
+    } else {
+        ret = ehci_data_qtd_fill(bus, urb, &first, &last);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    flags = usb_osal_enter_critical_section();
+
+    ret = ehci_qh_find_or_create(bus, urb->hport, urb->ep, urb->data_toggle, &flags, &qh);
+    if (ret < 0) {
+        usb_osal_leave_critical_section(flags);
+        ehci_qtd_chain_free(bus, first);
+        return ret;
+    }
+
+    if ((qh->urb_num == CONFIG_USB_EHCI_QH_URB_NUM) || (urb->timeout && qh->waiting)) {
+        usb_osal_leave_critical_section(flags);
+        ehci_qtd_chain_free(bus, first);
+        return -USB_ERR_BUSY;
+    }
 
-    EHCI_HCOR->usbcmd |= EHCI_USBCMD_ASEN;
+    if (urb->timeout) {
+        qh->waiting = true;
+    }
+
+    urb->errorcode = -USB_ERR_BUSY;
+    ehci_urb_dcache_flush(urb);
+    ehci_qh_urb_append(qh, urb, first, last);
+
+    /* a qh being unlinked for a kill is put back by the last killer */
+    if ((qh->state == EHCI_QH_STATE_IDLE) && !qh->unlink_waiters) {
+        ehci_qh_link(bus, qh);
+    }
 
     usb_osal_leave_critical_section(flags);
-    return qh;
+
+    *qh_out = qh;
+    return 0;
 }
 
-static struct ehci_qh_hw *ehci_intr_urb_init(struct usbh_bus *bus, struct usbh_urb *urb, uint8_t *buffer, uint32_t buflen)
+/* drop the reference of the blocking waiter, the qh goes away once it is off the schedule and empty */
+static void ehci_qh_put(struct usbh_bus *bus, struct ehci_qh_hw *qh)
 {
-    struct ehci_qh_hw *qh = NULL;
-    struct ehci_qtd_hw *qtd = NULL;
-    struct ehci_qtd_hw *first_qtd = NULL;
-    struct ehci_qtd_hw *prev_qtd = NULL;
-    uint32_t xfer_len = 0;
-    uint32_t token;
     size_t flags;
 
-    qh = ehci_qh_alloc(bus);
-    if (qh == NULL) {
-        return NULL;
+    flags = usb_osal_enter_critical_section();
+    qh->waiting = false;
+    if ((qh->state == EHCI_QH_STATE_IDLE) && (qh->urb_num == 0) && !qh->unlink_waiters) {
+        ehci_qh_free(bus, qh);
     }
+    usb_osal_leave_critical_section(flags);
+}
+
+/* point a halted or short-stopped overlay at the next queued qtd */
+static void ehci_qh_restart(struct ehci_qh_hw *qh, bool reset_toggle)
+{
+    uint32_t token;
+
+#if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
+    usb_dcache_invalidate((uintptr_t)&qh->hw, CONFIG_USB_EHCI_ALIGN_SIZE);
+#endif
+    token = reset_toggle ? 0 : (qh->hw.overlay.token & QTD_TOKEN_TOGGLE);
+
+    qh->hw.overlay.next_qtd = qh->first_qtd;
+    qh->hw.overlay.alt_next_qtd = QTD_LIST_END;
+    qh->hw.overlay.token = token;
+#if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
+    usb_dcache_clean((uintptr_t)&qh->hw, CONFIG_USB_EHCI_ALIGN_SIZE);
+#endif
+}
+
+static void ehci_urb_waitup(struct usbh_bus *bus, struct ehci_qh_hw *qh, struct usbh_urb *urb)
+{
+    (void)bus;
+
+    urb->hcpriv = NULL;
+
+    if (urb->errorcode == 0) {
+        usbh_sg_urb_done(urb);
+    }
+
+    if (urb->timeout) {
+        usb_osal_sem_give(qh->waitsem);
+    }
+
+    if (urb->complete) {
+        if (urb->errorcode < 0) {
+            urb->complete(urb->arg, urb->errorcode);
+        } else {
+            urb->complete(urb->arg, urb->actual_length);
+        }
+    }
+}
+
+/* reap finished urbs in submit order, the qh leaves the schedule once its queue is empty */
+static void ehci_check_qh(struct usbh_bus *bus, struct ehci_qh_hw *qh)
+{
+    struct usbh_urb *urb;
+    struct ehci_qtd_hw *qtd;
+    struct ehci_qtd_hw *next;
+    uint32_t token;
+    bool restart;
+
+    while (qh->urb_num) {
+        urb = qh->urb_queue[0];
+        qtd = EHCI_ADDR2QTD(qh->first_qtd);
+        token = 0;
+        restart = false;
+
+        while (qtd->urb == urb) {
+#if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
+            usb_dcache_invalidate((uintptr_t)&qtd->hw, CONFIG_USB_EHCI_ALIGN_SIZE);
+#endif
+            token = qtd->hw.token;
 
-    ehci_qh_fill(qh,
-                 urb->hport->dev_addr,
-                 urb->ep->bEndpointAddress,
-                 USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes),
-                 USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize),
-                 USB_GET_MULT(urb->ep->wMaxPacketSize) + 1,
-                 urb->ep->bInterval,
-                 urb->hport->speed,
-                 urb->hport->parent->hub_addr,
-                 urb->hport->port);
+            if (token & QTD_TOKEN_STATUS_ACTIVE) {
+                return;
+            }
 
-    while (1) {
-        qtd = ehci_qtd_alloc(bus);
-        USB_ASSERT_MSG(qtd, "intr qtd alloc failed");
+            if (token & QTD_TOKEN_STATUS_HALTED) {
+                restart = true;
+                break;
+            }
 
-        if (buflen > 0x4000) {
-            xfer_len = 0x4000;
-            buflen -= 0x4000;
-        } else {
-            xfer_len = buflen;
-            buflen = 0;
+            /* short packet, hc has moved to g_short_qtd and left the remaining qtds */
+            if ((qtd->hw.alt_next_qtd != QTD_LIST_END) && (token & QTD_TOKEN_NBYTES_MASK)) {
+                restart = true;
+                break;
+            }
+
+            qtd = EHCI_ADDR2QTD(qtd->hw.next_qtd);
         }
 
-        if (urb->ep->bEndpointAddress & 0x80) {
-            token = QTD_TOKEN_PID_IN;
+        if ((token & QTD_TOKEN_STATUS_HALTED) == 0) {
+            if (token & QTD_TOKEN_TOGGLE) {
+                urb->data_toggle = true;
+            } else {
+                urb->data_toggle = false;
+            }
+            urb->errorcode = 0;
         } else {
-            token = QTD_TOKEN_PID_OUT;
+            if (token & QTD_TOKEN_STATUS_BABBLE) {
+                urb->errorcode = -USB_ERR_BABBLE;
+                urb->data_toggle = 0;
+            } else if (token & (QTD_TOKEN_STATUS_DBERR | QTD_TOKEN_STATUS_XACTERR)) {
+                urb->errorcode = -USB_ERR_IO;
+            } else {
+                urb->errorcode = -USB_ERR_STALL;
+                urb->data_toggle = 0;
+            }
         }
 
-        token |= QTD_TOKEN_STATUS_ACTIVE |
-                 ((uint32_t)EHCI_TUNE_CERR << QTD_TOKEN_CERR_SHIFT) |
-                 ((uint32_t)xfer_len << QTD_TOKEN_NBYTES_SHIFT);
+        /* retire the qtds of this urb, the next urb (or the dummy) starts right after them */
+        qtd = EHCI_ADDR2QTD(qh->first_qtd);
+        while (qtd->urb == urb) {
+            next = EHCI_ADDR2QTD(qtd->hw.next_qtd);
+            urb->actual_length += (qtd->length - ((qtd->hw.token & QTD_TOKEN_NBYTES_MASK) >> QTD_TOKEN_NBYTES_SHIFT));
+            ehci_qtd_free(bus, qtd);
+            qtd = next;
+        }
+        qh->first_qtd = EHCI_PTR2ADDR(qtd);
 
-        if (buflen == 0) {
-            token |= QTD_TOKEN_IOC;
+        if (restart) {
+            ehci_qh_restart(qh, (urb->errorcode == -USB_ERR_STALL) || (urb->errorcode == -USB_ERR_BABBLE));
         }
 
-        ehci_qtd_fill(qtd, (uintptr_t)buffer, xfer_len, token);
-        qtd->urb = urb;
-        qtd->hw.next_qtd = QTD_LIST_END;
-        buffer += xfer_len;
+        qh->urb_num--;
+        memmove(&qh->urb_queue[0], &qh->urb_queue[1], qh->urb_num * sizeof(struct usbh_urb *));
 
-        if (prev_qtd) {
-            prev_qtd->hw.next_qtd = EHCI_PTR2ADDR(qtd);
-        } else {
-            first_qtd = qtd;
-        }
-        prev_qtd = qtd;
+        ehci_urb_waitup(bus, qh, urb);
 
-        if (buflen == 0) {
-            break;
+        /* the complete callback may have killed the rest of the queue */
+        if (qh->state != EHCI_QH_STATE_LINKED) {
+            return;
         }
     }
 
-    /* update qh first qtd */
-    qh->hw.curr_qtd = EHCI_PTR2ADDR(first_qtd);
-    qh->hw.overlay.next_qtd = EHCI_PTR2ADDR(first_qtd);
-
-    /* update data toggle */
-    if (urb->data_toggle) {
-        qh->hw.overlay.token = QTD_TOKEN_TOGGLE;
-    } else {
-        qh->hw.overlay.token = 0;
+    /* an open pipe stays on the schedule, parked on its dummy qtd */
+    if (!qh->opened) {
+        ehci_qh_unlink(bus, qh);
     }
-
-    /* record qh first qtd */
-    qh->first_qtd = EHCI_PTR2ADDR(first_qtd);
-
-    flags = usb_osal_enter_critical_section();
-
-    qh->urb = urb;
-    urb->hcpriv = qh;
-    /* add qh into periodic list */
-    ehci_qh_add_head(&g_periodic_qh_head[bus->hcd.hcd_id], qh);
-
-    EHCI_HCOR->usbcmd |= EHCI_USBCMD_PSEN;
-
-    usb_osal_leave_critical_section(flags);
-    return qh;
 }
 
-static void ehci_urb_waitup(struct usbh_bus *bus, struct usbh_urb *urb)
+/* called once the hc has answered the async advance doorbell */
+static void ehci_scan_unlink_list(struct usbh_bus *bus)
 {
     struct ehci_qh_hw *qh;
-
-    qh = (struct ehci_qh_hw *)urb->hcpriv;
-
-    qh->remove_in_iaad = 0;
-
-    if (urb->timeout) {
-        usb_osal_sem_give(qh->waitsem);
-    } else {
-        ehci_qh_free(bus, qh);
+    bool again = false;
+
+    g_ehci_hcd[bus->hcd.hcd_id].iaa_pending = false;
+
+    for (uint32_t i = 0; i < g_ehci_hcd[bus->hcd.hcd_id].qh_stat.num; i++) {
+        qh = &g_ehci_hcd[bus->hcd.hcd_id].qh_pool[i];
+        if (qh->state == EHCI_QH_STATE_UNLINK) {
+            if (qh->unlink_waiters) {
+                /* killers edit the qtd chain and relink the qh themselves */
+                qh->state = EHCI_QH_STATE_IDLE;
+                for (uint8_t j = 0; j < qh->unlink_waiters; j++) {
+                    usb_osal_sem_give(qh->unlinksem);
+                }
+            } else if (qh->urb_num || qh->opened) {
+                /* urbs were queued (or the pipe opened) while the qh was leaving, the overlay
+                 * is still valid and some of the urbs may have finished without being scanned.
+                 */
+                ehci_qh_link(bus, qh);
+                ehci_check_qh(bus, qh);
+            } else {
+                qh->state = EHCI_QH_STATE_IDLE;
+                if (!qh->waiting) {
+                    ehci_qh_free(bus, qh);
+                }
+            }
+        }
     }
 
-    if (urb->complete) {
-        if (urb->errorcode < 0) {
-            urb->complete(urb->arg, urb->errorcode);
-        } else {
-            urb->complete(urb->arg, urb->actual_length);
+    for (uint32_t i = 0; i < g_ehci_hcd[bus->hcd.hcd_id].qh_stat.num; i++) {
+        qh = &g_ehci_hcd[bus->hcd.hcd_id].qh_pool[i];
+        if (qh->state == EHCI_QH_STATE_UNLINK_WAIT) {
+            qh->state = EHCI_QH_STATE_UNLINK;
+            again = true;
         }
     }
+
+    if (again && !g_ehci_hcd[bus->hcd.hcd_id].iaa_pending) {
+        g_ehci_hcd[bus->hcd.hcd_id].iaa_pending = true;
+        EHCI_HCOR->usbcmd |= EHCI_USBCMD_IAAD;
+    }
 }
 
-static void ehci_qh_scan_qtds(struct usbh_bus *bus, struct ehci_qh_hw *qhead, struct ehci_qh_hw *qh)
+/*
+ * Get the qh out of the hc's hands before editing its qtd chain. Called and returning
+ * inside the critical section, which is left while the async advance interrupt is awaited.
+ */
+static int ehci_qh_unlink_wait(struct usbh_bus *bus, struct ehci_qh_hw *qh, size_t *flags)
 {
-    struct ehci_qtd_hw *qtd;
-
-    (void)bus;
+    int ret;
 
-    ehci_qh_remove(qhead, qh);
+    if (USB_GET_ENDPOINT_TYPE(qh->ep->bmAttributes) == USB_ENDPOINT_TYPE_INTERRUPT) {
+        if (qh->state == EHCI_QH_STATE_LINKED) {
+            ehci_periodic_unlink(bus, qh);
+        }
+        qh->state = EHCI_QH_STATE_IDLE;
+        return 0;
+    }
 
-    qtd = EHCI_ADDR2QTD(qh->first_qtd);
+    if (qh->state == EHCI_QH_STATE_LINKED) {
+        ehci_async_unlink(bus, qh);
+    }
 
-    while (qtd) {
-        qtd->urb->actual_length += (qtd->length - ((qtd->hw.token & QTD_TOKEN_NBYTES_MASK) >> QTD_TOKEN_NBYTES_SHIFT));
+    qh->unlink_waiters++;
+    while (qh->state != EHCI_QH_STATE_IDLE) {
+        usb_osal_leave_critical_section(*flags);
+        ret = usb_osal_sem_take(qh->unlinksem, EHCI_IAA_TIMEOUT);
+        *flags = usb_osal_enter_critical_section();
+        if ((ret < 0) && (qh->state != EHCI_QH_STATE_IDLE)) {
+            /* left to the unlink list, relinked by a later doorbell if still needed */
+            qh->unlink_waiters--;
+            return -USB_ERR_TIMEOUT;
+        }
+    }
+    qh->unlink_waiters--;
+    return 0;
+}
 
-        qtd = EHCI_ADDR2QTD(qtd->hw.next_qtd);
+/* back on the schedule or freed once the last thread editing an unlinked qh is done */
+static void ehci_qh_unlink_done(struct usbh_bus *bus, struct ehci_qh_hw *qh)
+{
+    if (qh->unlink_waiters) {
+        return;
+    }
+    if (qh->urb_num || qh->opened) {
+        ehci_qh_link(bus, qh);
+    } else if (!qh->waiting) {
+        ehci_qh_free(bus, qh);
     }
 }
 
-static void ehci_check_qh(struct usbh_bus *bus, struct ehci_qh_hw *qhead, struct ehci_qh_hw *qh)
+/* take the qtds of a killed urb out of the chain of an unlinked qh */
+static void ehci_qh_urb_dequeue(struct usbh_bus *bus, struct ehci_qh_hw *qh, struct usbh_urb *urb)
 {
-    struct usbh_urb *urb;
+    struct ehci_qtd_hw *prev = NULL;
     struct ehci_qtd_hw *qtd;
-    uint32_t token;
-
-    qtd = EHCI_ADDR2QTD(qh->first_qtd);
+    struct ehci_qtd_hw *next;
+    uint32_t curr;
+    bool in_overlay = false;
+    uint8_t index;
 
-    if (qtd == NULL) {
+    for (index = 0; index < qh->urb_num; index++) {
+        if (qh->urb_queue[index] == urb) {
+            break;
+        }
+    }
+    if (index == qh->urb_num) {
         return;
     }
 
-    while (qtd) {
 #if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
-        usb_dcache_invalidate((uintptr_t)&qtd->hw, CONFIG_USB_EHCI_ALIGN_SIZE);
+    usb_dcache_invalidate((uintptr_t)&qh->hw, CONFIG_USB_EHCI_ALIGN_SIZE);
 #endif
-        token = qtd->hw.token;
-
-        if (token & QTD_TOKEN_STATUS_ERRORS) {
-            break;
-        } else if (token & QTD_TOKEN_STATUS_ACTIVE) {
-            return;
-        }
+    curr = EHCI_PTR2ADDR(qh->hw.curr_qtd);
 
+    qtd = EHCI_ADDR2QTD(qh->first_qtd);
+    while (qtd->urb != urb) {
+        prev = qtd;
         qtd = EHCI_ADDR2QTD(qtd->hw.next_qtd);
     }
 
-    urb = qh->urb;
-
-    if ((token & QTD_TOKEN_STATUS_ERRORS) == 0) {
-        if (token & QTD_TOKEN_TOGGLE) {
-            urb->data_toggle = true;
-        } else {
-            urb->data_toggle = false;
-        }
-        urb->errorcode = 0;
-    } else {
-        if (token & QTD_TOKEN_STATUS_BABBLE) {
-            urb->errorcode = -USB_ERR_BABBLE;
-            urb->data_toggle = 0;
-        } else if (token & QTD_TOKEN_STATUS_HALTED) {
-            urb->errorcode = -USB_ERR_STALL;
-            urb->data_toggle = 0;
-        } else if (token & (QTD_TOKEN_STATUS_DBERR | QTD_TOKEN_STATUS_XACTERR)) {
-            urb->errorcode = -USB_ERR_IO;
+    next = qtd;
+    while (next->urb == urb) {
+        if ((EHCI_PTR2ADDR(next) == curr) || (EHCI_PTR2ADDR(next) == EHCI_PTR2ADDR(qh->hw.overlay.next_qtd))) {
+            in_overlay = true;
         }
+        next = EHCI_ADDR2QTD(next->hw.next_qtd);
     }
 
-    ehci_qh_scan_qtds(bus, qhead, qh);
-
-    if (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) == USB_ENDPOINT_TYPE_INTERRUPT) {
-        ehci_urb_waitup(bus, urb);
+    if (prev) {
+        prev->hw.next_qtd = EHCI_PTR2ADDR(next);
+#if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
+        usb_dcache_clean((uintptr_t)&prev->hw, CONFIG_USB_EHCI_ALIGN_SIZE);
+#endif
     } else {
-        qh->remove_in_iaad = 1;
+        qh->first_qtd = EHCI_PTR2ADDR(next);
+    }
 
-        EHCI_HCOR->usbcmd |= EHCI_USBCMD_IAAD;
+    while (qtd != next) {
+        struct ehci_qtd_hw *tmp = EHCI_ADDR2QTD(qtd->hw.next_qtd);
+        ehci_qtd_free(bus, qtd);
+        qtd = tmp;
     }
-}
 
-static void ehci_kill_qh(struct usbh_bus *bus, struct ehci_qh_hw *qhead, struct ehci_qh_hw *qh)
-{
-    (void)bus;
+    qh->urb_num--;
+    memmove(&qh->urb_queue[index], &qh->urb_queue[index + 1], (qh->urb_num - index) * sizeof(struct usbh_urb *));
 
-    ehci_qh_remove(qhead, qh);
+    /* the hc was working on (or about to fetch) the killed qtds, move it past them */
+    if (in_overlay) {
+        qh->hw.overlay.next_qtd = EHCI_PTR2ADDR(next);
+        qh->hw.overlay.alt_next_qtd = QTD_LIST_END;
+        qh->hw.overlay.token &= QTD_TOKEN_TOGGLE;
+#if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
+        usb_dcache_clean((uintptr_t)&qh->hw, CONFIG_USB_EHCI_ALIGN_SIZE);
+#endif
+    }
 }
 
 static int usbh_reset_port(struct usbh_bus *bus, const uint8_t port)
@@ -751,6 +1437,87 @@ static int usbh_reset_port(struct usbh_bus *bus, const uint8_t port)
     return 0;
 }
 
+/* carve the qh and qtd pools and thread every descriptor onto its free list */
+static int ehci_pool_init(struct usbh_bus *bus)
+{
+    struct ehci_hcd *hcd = &g_ehci_hcd[bus->hcd.hcd_id];
+    uint32_t qh_num;
+    uint32_t qtd_num;
+#ifdef CONFIG_USB_EHCI_POOL_ARENA
+    uintptr_t start;
+    uintptr_t end;
+    uint32_t size;
+    void *arena;
+
+    arena = usb_ehci_pool_arena(bus, &size);
+    if (arena == NULL) {
+        USB_LOG_ERR("No ehci pool arena\r\n");
+        return -USB_ERR_NOMEM;
+    }
+
+    start = USB_ALIGN_UP((uintptr_t)arena, CONFIG_USB_EHCI_ALIGN_SIZE);
+    end = (uintptr_t)arena + size;
+
+    /* the qhs bound how many endpoints can be active, every byte left goes to qtds */
+    qh_num = CONFIG_USB_EHCI_QH_NUM;
+    if ((end < start) || ((end - start) < (qh_num * sizeof(struct ehci_qh_hw)))) {
+        USB_LOG_ERR("ehci pool arena is too small\r\n");
+        return -USB_ERR_NOMEM;
+    }
+    hcd->qh_pool = (struct ehci_qh_hw *)start;
+    start += qh_num * sizeof(struct ehci_qh_hw);
+
+    qtd_num = (end - start) / sizeof(struct ehci_qtd_hw);
+    if (qtd_num < 9) {
+        USB_LOG_ERR("ehci pool arena is too small\r\n");
+        return -USB_ERR_NOMEM;
+    }
+    hcd->qtd_pool = (struct ehci_qtd_hw *)start;
+#else
+    qh_num = CONFIG_USB_EHCI_QH_NUM;
+    qtd_num = CONFIG_USB_EHCI_QTD_NUM;
+    hcd->qh_pool = ehci_qh_pool[bus->hcd.hcd_id];
+    hcd->qtd_pool = ehci_qtd_pool[bus->hcd.hcd_id];
+#endif
+
+    memset(hcd->qh_pool, 0, sizeof(struct ehci_qh_hw) * qh_num);
+    memset(hcd->qtd_pool, 0, sizeof(struct ehci_qtd_hw) * qtd_num);
+
+    memset(hcd->qh_hash, 0, sizeof(hcd->qh_hash));
+    hcd->qh_free = NULL;
+    for (uint32_t i = qh_num; i > 0; i--) {
+        hcd->qh_pool[i - 1].next_free = hcd->qh_free;
+        hcd->qh_free = &hcd->qh_pool[i - 1];
+    }
+
+    hcd->qtd_free = NULL;
+    for (uint32_t i = qtd_num; i > 0; i--) {
+        hcd->qtd_pool[i - 1].next_free = hcd->qtd_free;
+        hcd->qtd_free = &hcd->qtd_pool[i - 1];
+    }
+
+    hcd->qh_stat.num = qh_num;
+    hcd->qtd_stat.num = qtd_num;
+#ifdef CONFIG_USB_EHCI_ISO
+    ehci_iso_pool_init(bus);
+#endif
+    return 0;
+}
+
+void usb_ehci_get_pool_stat(uint8_t busid, struct ehci_pool_stat *qh_stat, struct ehci_pool_stat *qtd_stat)
+{
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    if (qh_stat) {
+        memcpy(qh_stat, &g_ehci_hcd[busid].qh_stat, sizeof(struct ehci_pool_stat));
+    }
+    if (qtd_stat) {
+        memcpy(qtd_stat, &g_ehci_hcd[busid].qtd_stat, sizeof(struct ehci_pool_stat));
+    }
+    usb_osal_leave_critical_section(flags);
+}
+
 __WEAK void usb_hc_low_level_init(struct usbh_bus *bus)
 {
     (void)bus;
@@ -777,29 +1544,33 @@ int usb_hc_init(struct usbh_bus *bus)
     bus->hcd.roothub.speed = USB_SPEED_HIGH;
 
     memset(&g_ehci_hcd[bus->hcd.hcd_id], 0, sizeof(struct ehci_hcd));
-    memset(ehci_qh_pool[bus->hcd.hcd_id], 0, sizeof(struct ehci_qh_hw) * CONFIG_USB_EHCI_QH_NUM);
-    memset(ehci_qtd_pool[bus->hcd.hcd_id], 0, sizeof(struct ehci_qtd_hw) * CONFIG_USB_EHCI_QTD_NUM);
 
-    for (uint8_t index = 0; index < CONFIG_USB_EHCI_QH_NUM; index++) {
-        qh = &ehci_qh_pool[bus->hcd.hcd_id][index];
+    if (ehci_pool_init(bus) < 0) {
+        return -USB_ERR_NOMEM;
+    }
+
+    for (uint32_t index = 0; index < g_ehci_hcd[bus->hcd.hcd_id].qh_stat.num; index++) {
+        qh = &g_ehci_hcd[bus->hcd.hcd_id].qh_pool[index];
         if ((uint32_t)&qh->hw % 32) {
             USB_LOG_ERR("struct ehci_qh_hw is not align 32\r\n");
             return -USB_ERR_INVAL;
         }
     }
 
-    for (uint8_t index = 0; index < CONFIG_USB_EHCI_QTD_NUM; index++) {
-        qtd = &ehci_qtd_pool[bus->hcd.hcd_id][index];
+    for (uint32_t index = 0; index < g_ehci_hcd[bus->hcd.hcd_id].qtd_stat.num; index++) {
+        qtd = &g_ehci_hcd[bus->hcd.hcd_id].qtd_pool[index];
         if ((uint32_t)&qtd->hw % 32) {
             USB_LOG_ERR("struct ehci_qtd_hw is not align 32\r\n");
             return -USB_ERR_INVAL;
         }
     }
 
-    for (uint8_t index = 0; index < CONFIG_USB_EHCI_QH_NUM; index++) {
-        qh = &ehci_qh_pool[bus->hcd.hcd_id][index];
+    for (uint32_t index = 0; index < g_ehci_hcd[bus->hcd.hcd_id].qh_stat.num; index++) {
+        qh = &g_ehci_hcd[bus->hcd.hcd_id].qh_pool[index];
         qh->waitsem = usb_osal_sem_create(0);
         USB_ASSERT(qh->waitsem != NULL);
+        qh->unlinksem = usb_osal_sem_create(0);
+        USB_ASSERT(qh->unlinksem != NULL);
     }
 
     memset(&g_async_qh_head[bus->hcd.hcd_id], 0, sizeof(struct ehci_qh_hw));
@@ -810,6 +1581,11 @@ int usb_hc_init(struct usbh_bus *bus)
     g_async_qh_head[bus->hcd.hcd_id].hw.overlay.token = QTD_TOKEN_STATUS_HALTED;
     g_async_qh_head[bus->hcd.hcd_id].first_qtd = QTD_LIST_END;
 
+    memset(&g_short_qtd[bus->hcd.hcd_id], 0, sizeof(struct ehci_qtd_hw));
+    g_short_qtd[bus->hcd.hcd_id].hw.next_qtd = QTD_LIST_END;
+    g_short_qtd[bus->hcd.hcd_id].hw.alt_next_qtd = QTD_LIST_END;
+    g_short_qtd[bus->hcd.hcd_id].hw.token = QTD_TOKEN_STATUS_HALTED;
+
     memset(g_framelist[bus->hcd.hcd_id], 0, sizeof(uint32_t) * CONFIG_USB_EHCI_FRAME_LIST_SIZE);
 
     memset(&g_periodic_qh_head[bus->hcd.hcd_id], 0, sizeof(struct ehci_qh_hw));
@@ -827,6 +1603,7 @@ int usb_hc_init(struct usbh_bus *bus)
 #if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
     usb_dcache_clean((uintptr_t)&g_async_qh_head[bus->hcd.hcd_id].hw, CONFIG_USB_EHCI_ALIGN_SIZE);
     usb_dcache_clean((uintptr_t)&g_periodic_qh_head[bus->hcd.hcd_id].hw, CONFIG_USB_EHCI_ALIGN_SIZE);
+    usb_dcache_clean((uintptr_t)&g_short_qtd[bus->hcd.hcd_id].hw, CONFIG_USB_EHCI_ALIGN_SIZE);
     usb_dcache_clean((uintptr_t)g_framelist[bus->hcd.hcd_id], sizeof(uint32_t) * CONFIG_USB_EHCI_FRAME_LIST_SIZE);
 #endif
 
@@ -973,9 +1750,10 @@ int usb_hc_deinit(struct usbh_bus *bus)
     EHCI_HCOR->usbsts = EHCI_HCOR->usbsts;
     EHCI_HCOR->usbcmd |= EHCI_USBCMD_HCRESET;
 
-    for (uint8_t index = 0; index < CONFIG_USB_EHCI_QH_NUM; index++) {
-        qh = &ehci_qh_pool[bus->hcd.hcd_id][index];
+    for (uint32_t index = 0; index < g_ehci_hcd[bus->hcd.hcd_id].qh_stat.num; index++) {
+        qh = &g_ehci_hcd[bus->hcd.hcd_id].qh_pool[index];
         usb_osal_sem_delete(qh->waitsem);
+        usb_osal_sem_delete(qh->unlinksem);
     }
 
 #ifdef CONFIG_USB_EHCI_WITH_OHCI
@@ -1192,12 +1970,24 @@ int usbh_roothub_control(struct usbh_bus *bus, struct usb_setup_packet *setup, u
     return 0;
 }
 
+/* find active hubport in roothub */
+static struct usbh_hubport *ehci_roothub_port(struct usbh_hubport *hport)
+{
+    struct usbh_hub *hub;
+
+    hub = hport->parent;
+    while (!hub->is_roothub) {
+        hport = hub->parent;
+        hub = hub->parent->parent;
+    }
+    return hport;
+}
+
 int usbh_submit_urb(struct usbh_urb *urb)
 {
     struct ehci_qh_hw *qh = NULL;
     size_t flags;
     int ret = 0;
-    struct usbh_hub *hub;
     struct usbh_hubport *hport;
     struct usbh_bus *bus;
 
@@ -1212,13 +2002,7 @@ int usbh_submit_urb(struct usbh_urb *urb)
 #endif
     bus = urb->hport->bus;
 
-    /* find active hubport in roothub */
-    hport = urb->hport;
-    hub = urb->hport->parent;
-    while (!hub->is_roothub) {
-        hport = hub->parent;
-        hub = hub->parent->parent;
-    }
+    hport = ehci_roothub_port(urb->hport);
 
 #ifdef CONFIG_USB_EHCI_WITH_OHCI
     if (EHCI_HCOR->portsc[hport->port - 1] & EHCI_PORTSC_OWNER) {
@@ -1234,40 +2018,40 @@ int usbh_submit_urb(struct usbh_urb *urb)
         return -USB_ERR_BUSY;
     }
 
+#ifdef CONFIG_USB_DCACHE_ENABLE
+    ret = usbh_sg_urb_prepare(urb, CONFIG_USB_ALIGN_SIZE);
+#else
+    ret = usbh_sg_urb_prepare(urb, 1);
+#endif
+    if (ret < 0) {
+        return ret;
+    }
+
     flags = usb_osal_enter_critical_section();
 
     urb->hcpriv = NULL;
-    urb->errorcode = -USB_ERR_BUSY;
     urb->actual_length = 0;
 
     usb_osal_leave_critical_section(flags);
 
     switch (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes)) {
         case USB_ENDPOINT_TYPE_CONTROL:
-            qh = ehci_control_urb_init(bus, urb, urb->setup, urb->transfer_buffer, urb->transfer_buffer_length);
-            if (qh == NULL) {
-                return -USB_ERR_NOMEM;
-            }
-            break;
         case USB_ENDPOINT_TYPE_BULK:
-            qh = ehci_bulk_urb_init(bus, urb, urb->transfer_buffer, urb->transfer_buffer_length);
-            if (qh == NULL) {
-                return -USB_ERR_NOMEM;
-            }
-            break;
         case USB_ENDPOINT_TYPE_INTERRUPT:
-            qh = ehci_intr_urb_init(bus, urb, urb->transfer_buffer, urb->transfer_buffer_length);
-            if (qh == NULL) {
-                return -USB_ERR_NOMEM;
+            ret = ehci_urb_enqueue(bus, urb, &qh);
+            if (ret < 0) {
+                return ret;
             }
             break;
         case USB_ENDPOINT_TYPE_ISOCHRONOUS:
+            /* iso urbs complete only through their callback, there is no qh to wait on */
 #ifdef CONFIG_USB_EHCI_ISO
-            ret = ehci_iso_urb_init(bus, urb);
+            return ehci_iso_urb_init(bus, urb);
+#else
+            return -USB_ERR_NOTSUPP;
 #endif
-            break;
         default:
-            break;
+            return -USB_ERR_INVAL;
     }
 
     if (urb->timeout > 0) {
@@ -1278,13 +2062,15 @@ int usbh_submit_urb(struct usbh_urb *urb)
         }
         urb->timeout = 0;
         ret = urb->errorcode;
-        /* we can free qh when waitsem is done */
-        ehci_qh_free(bus, qh);
+        ehci_qh_put(bus, qh);
     }
     return ret;
 errout_timeout:
     urb->timeout = 0;
     usbh_kill_urb(urb);
+    /* the urb may have completed between the timeout and the kill */
+    usb_osal_sem_reset(qh->waitsem);
+    ehci_qh_put(bus, qh);
     return ret;
 }
 
@@ -1293,7 +2079,6 @@ int usbh_kill_urb(struct usbh_urb *urb)
     struct ehci_qh_hw *qh;
     struct usbh_bus *bus;
     size_t flags;
-    bool remove_in_iaad = false;
 
     if (!urb || !urb->hport || !urb->hcpriv || !urb->hport->bus) {
         return -USB_ERR_INVAL;
@@ -1309,93 +2094,179 @@ int usbh_kill_urb(struct usbh_urb *urb)
 
     flags = usb_osal_enter_critical_section();
 
-    EHCI_HCOR->usbcmd &= ~(EHCI_USBCMD_PSEN | EHCI_USBCMD_ASEN);
+    /* completed while we were getting here */
+    if (urb->hcpriv == NULL) {
+        usb_osal_leave_critical_section(flags);
+        return -USB_ERR_INVAL;
+    }
 
-    if ((USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) == USB_ENDPOINT_TYPE_CONTROL) || (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) == USB_ENDPOINT_TYPE_BULK)) {
-        qh = EHCI_ADDR2QH(g_async_qh_head[bus->hcd.hcd_id].hw.hlp);
-        while ((qh != &g_async_qh_head[bus->hcd.hcd_id]) && qh) {
-            if (qh->urb == urb) {
-                remove_in_iaad = true;
-                ehci_kill_qh(bus, &g_async_qh_head[bus->hcd.hcd_id], qh);
-            }
-            qh = EHCI_ADDR2QH(qh->hw.hlp);
-        }
-    } else if (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) == USB_ENDPOINT_TYPE_INTERRUPT) {
-        qh = EHCI_ADDR2QH(g_periodic_qh_head[bus->hcd.hcd_id].hw.hlp);
-        while (qh) {
-            if (qh->urb == urb) {
-                ehci_kill_qh(bus, &g_periodic_qh_head[bus->hcd.hcd_id], qh);
-            }
-            qh = EHCI_ADDR2QH(qh->hw.hlp);
-        }
-    } else {
+    if (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) == USB_ENDPOINT_TYPE_ISOCHRONOUS) {
 #ifdef CONFIG_USB_EHCI_ISO
+        EHCI_HCOR->usbcmd &= ~(EHCI_USBCMD_PSEN | EHCI_USBCMD_ASEN);
         ehci_kill_iso_urb(bus, urb);
         EHCI_HCOR->usbcmd |= (EHCI_USBCMD_PSEN | EHCI_USBCMD_ASEN);
+#endif
         usb_osal_leave_critical_section(flags);
         return 0;
-#endif
     }
 
-    EHCI_HCOR->usbcmd |= (EHCI_USBCMD_PSEN | EHCI_USBCMD_ASEN);
-
     qh = (struct ehci_qh_hw *)urb->hcpriv;
-    qh->remove_in_iaad = 0;
+
+    if (ehci_qh_unlink_wait(bus, qh, &flags) < 0) {
+        USB_LOG_ERR("iaad timeout\r\n");
+        usb_osal_leave_critical_section(flags);
+        return -USB_ERR_TIMEOUT;
+    }
+
+    /* given back by a pipe close while we slept */
+    if (urb->hcpriv == NULL) {
+        ehci_qh_unlink_done(bus, qh);
+        usb_osal_leave_critical_section(flags);
+        return -USB_ERR_INVAL;
+    }
+
+    ehci_qh_urb_dequeue(bus, qh, urb);
+    ehci_qh_unlink_done(bus, qh);
+
+    urb->hcpriv = NULL;
     urb->errorcode = -USB_ERR_SHUTDOWN;
 
     if (urb->timeout) {
         usb_osal_sem_give(qh->waitsem);
-    } else {
-        ehci_qh_free(bus, qh);
     }
 
-    if (remove_in_iaad) {
-        volatile uint32_t timeout = 0;
-        EHCI_HCOR->usbsts = EHCI_USBSTS_IAA;
-        EHCI_HCOR->usbcmd |= EHCI_USBCMD_IAAD;
-        while (!(EHCI_HCOR->usbsts & EHCI_USBSTS_IAA)) {
-            timeout++;
-            if (timeout > 200000) {
-                USB_LOG_ERR("iaad timeout\r\n");
-                usb_osal_leave_critical_section(flags);
-                return -USB_ERR_TIMEOUT;
-            }
+    if (urb->complete) {
+        urb->complete(urb->arg, urb->errorcode);
+    }
+
+    usb_osal_leave_critical_section(flags);
+
+    return 0;
+}
+
+int usbh_pipe_open(struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep)
+{
+    struct ehci_qh_hw *qh;
+    struct usbh_bus *bus;
+    size_t flags;
+    int ret;
+
+    if (!hport || !ep || !hport->bus) {
+        return -USB_ERR_INVAL;
+    }
+
+    bus = hport->bus;
+
+#ifdef CONFIG_USB_EHCI_WITH_OHCI
+    if (EHCI_HCOR->portsc[ehci_roothub_port(hport)->port - 1] & EHCI_PORTSC_OWNER) {
+        return 0;
+    }
+#endif
+
+    if ((USB_GET_ENDPOINT_TYPE(ep->bmAttributes) != USB_ENDPOINT_TYPE_BULK) &&
+        (USB_GET_ENDPOINT_TYPE(ep->bmAttributes) != USB_ENDPOINT_TYPE_INTERRUPT)) {
+        return -USB_ERR_NOTSUPP;
+    }
+
+    flags = usb_osal_enter_critical_section();
+
+    qh = ehci_qh_find(bus, hport, ep);
+    if (qh == NULL) {
+        /* leave qhs for ep0 and for endpoints without a pipe */
+        if ((g_ehci_hcd[bus->hcd.hcd_id].qh_stat.num - g_ehci_hcd[bus->hcd.hcd_id].qh_stat.used) <= EHCI_PIPE_FREE_QH_MIN) {
+            usb_osal_leave_critical_section(flags);
+            return -USB_ERR_NOMEM;
+        }
+
+        ret = ehci_qh_find_or_create(bus, hport, ep, 0, &flags, &qh);
+        if (ret < 0) {
+            usb_osal_leave_critical_section(flags);
+            return ret;
         }
-        EHCI_HCOR->usbsts = EHCI_USBSTS_IAA;
     }
 
-    if (urb->complete) {
-        urb->complete(urb->arg, urb->errorcode);
+    qh->opened = true;
+    if (qh->state == EHCI_QH_STATE_IDLE) {
+        ehci_qh_link(bus, qh);
     }
 
     usb_osal_leave_critical_section(flags);
+    return 0;
+}
+
+int usbh_pipe_close(struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep)
+{
+    struct usbh_urb *urb_queue[CONFIG_USB_EHCI_QH_URB_NUM];
+    struct ehci_qh_hw *qh;
+    struct usbh_bus *bus;
+    uint8_t urb_num;
+    size_t flags;
+
+    if (!hport || !ep || !hport->bus) {
+        return -USB_ERR_INVAL;
+    }
+
+    bus = hport->bus;
+
+    flags = usb_osal_enter_critical_section();
 
+    qh = ehci_qh_find(bus, hport, ep);
+    if ((qh == NULL) || !qh->opened) {
+        usb_osal_leave_critical_section(flags);
+        return 0;
+    }
+
+    qh->opened = false;
+
+    if (ehci_qh_unlink_wait(bus, qh, &flags) < 0) {
+        USB_LOG_ERR("iaad timeout\r\n");
+        usb_osal_leave_critical_section(flags);
+        return -USB_ERR_TIMEOUT;
+    }
+
+    /* give back what is still queued once the qh is gone, the callbacks may submit again */
+    urb_num = qh->urb_num;
+    memcpy(urb_queue, qh->urb_queue, urb_num * sizeof(struct usbh_urb *));
+    while (qh->urb_num) {
+        ehci_qh_urb_dequeue(bus, qh, qh->urb_queue[0]);
+    }
+
+    ehci_qh_unlink_done(bus, qh);
+
+    for (uint8_t i = 0; i < urb_num; i++) {
+        urb_queue[i]->errorcode = -USB_ERR_SHUTDOWN;
+        ehci_urb_waitup(bus, qh, urb_queue[i]);
+    }
+
+    usb_osal_leave_critical_section(flags);
     return 0;
 }
 
 static void ehci_scan_async_list(struct usbh_bus *bus)
 {
     struct ehci_qh_hw *qh;
+    struct ehci_qh_hw *next;
 
     qh = EHCI_ADDR2QH(g_async_qh_head[bus->hcd.hcd_id].hw.hlp);
     while ((qh != &g_async_qh_head[bus->hcd.hcd_id]) && qh) {
-        if (qh->urb) {
-            ehci_check_qh(bus, &g_async_qh_head[bus->hcd.hcd_id], qh);
+        next = EHCI_ADDR2QH(qh->hw.hlp);
+        if (qh->urb_num) {
+            ehci_check_qh(bus, qh);
         }
-        qh = EHCI_ADDR2QH(qh->hw.hlp);
+        qh = next;
     }
 }
 
+/* the frame list is a tree, walk the pool instead of the links */
 static void ehci_scan_periodic_list(struct usbh_bus *bus)
 {
     struct ehci_qh_hw *qh;
 
-    qh = EHCI_ADDR2QH(g_periodic_qh_head[bus->hcd.hcd_id].hw.hlp);
-    while (qh) {
-        if (qh->urb) {
-            ehci_check_qh(bus, &g_periodic_qh_head[bus->hcd.hcd_id], qh);
+    for (uint32_t i = 0; i < g_ehci_hcd[bus->hcd.hcd_id].qh_stat.num; i++) {
+        qh = &g_ehci_hcd[bus->hcd.hcd_id].qh_pool[i];
+        if (qh->inuse && qh->bw.period && (qh->state == EHCI_QH_STATE_LINKED) && qh->urb_num) {
+            ehci_check_qh(bus, qh);
         }
-        qh = EHCI_ADDR2QH(qh->hw.hlp);
     }
 }
 
@@ -1445,12 +2316,7 @@ void USBH_IRQHandler(uint8_t busid)
     }
 
     if (usbsts & EHCI_USBSTS_IAA) {
-        for (uint8_t index = 0; index < CONFIG_USB_EHCI_QH_NUM; index++) {
-            struct ehci_qh_hw *qh = &ehci_qh_pool[bus->hcd.hcd_id][index];
-            if (qh->remove_in_iaad) {
-                ehci_urb_waitup(bus, qh->urb);
-            }
-        }
+        ehci_scan_unlink_list(bus);
     }
 
     if (usbsts & EHCI_USBSTS_FATAL) {
@@ -24,12 +24,18 @@
 #ifndef CONFIG_USB_EHCI_QTD_NUM
 #define CONFIG_USB_EHCI_QTD_NUM (CONFIG_USB_EHCI_QH_NUM * 3)
 #endif
+#ifndef CONFIG_USB_EHCI_QH_URB_NUM
+#define CONFIG_USB_EHCI_QH_URB_NUM 4
+#endif
 #ifndef CONFIG_USB_EHCI_ITD_NUM
 #define CONFIG_USB_EHCI_ITD_NUM 5
 #endif
 #ifndef CONFIG_USB_EHCI_ISO_NUM
 #define CONFIG_USB_EHCI_ISO_NUM 4
 #endif
+#ifndef CONFIG_USB_EHCI_ITD_POOL_NUM
+#define CONFIG_USB_EHCI_ITD_POOL_NUM (CONFIG_USB_EHCI_ISO_NUM * CONFIG_USB_EHCI_ITD_NUM)
+#endif
 
 #if CONFIG_USB_ALIGN_SIZE <= 32
 #define CONFIG_USB_EHCI_ALIGN_SIZE 32
@@ -43,6 +49,34 @@
 #error CONFIG_USB_EHCI_QTD_NUM is too small, recommand CONFIG_USB_EHCI_QH_NUM * 3
 #endif
 
+#define EHCI_QH_STATE_IDLE        0 /* not in any schedule */
+#define EHCI_QH_STATE_LINKED      1
+#define EHCI_QH_STATE_UNLINK      2 /* removed from async list, doorbell rung */
+#define EHCI_QH_STATE_UNLINK_WAIT 3 /* removed from async list, needs the next doorbell */
+
+#define EHCI_QH_HASH_SIZE 16 /* buckets of the endpoint to qh lookup, a power of 2 */
+
+#define EHCI_BW_FRAMES  32 /* periodic bandwidth is budgeted over this many frames */
+#define EHCI_BW_UFRAMES (EHCI_BW_FRAMES * 8)
+
+#if CONFIG_USB_EHCI_FRAME_LIST_SIZE < EHCI_BW_FRAMES
+#error CONFIG_USB_EHCI_FRAME_LIST_SIZE is too small
+#endif
+
+/* periodic bandwidth held by an interrupt qh or an iso stream */
+struct ehci_periodic_bw {
+    uint16_t period;   /* in uframes, 0 if nothing is reserved */
+    uint16_t phase;    /* first uframe polled, frame * 8 + uframe */
+    uint8_t smask;
+    uint8_t cmask;
+    uint16_t usecs;    /* hs time in each smask uframe */
+    uint16_t c_usecs;  /* hs time in each cmask uframe */
+    uint16_t tt_usecs; /* fs/ls time on the tt, 0 for hs endpoints */
+    uint8_t tt_hub;
+    uint8_t tt_port;   /* 0 unless the hub has one tt per port */
+    struct ehci_periodic_bw *next;
+};
+
 struct ehci_qtd_hw {
     struct ehci_qtd hw;
 #if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE) && (CONFIG_USB_ALIGN_SIZE == 64)
@@ -52,6 +86,7 @@ struct ehci_qtd_hw {
     struct usbh_urb *urb;
     uintptr_t bufaddr;
     uint32_t length;
+    struct ehci_qtd_hw *next_free;
 } __attribute__((aligned(CONFIG_USB_EHCI_ALIGN_SIZE)));
 
 struct ehci_qh_hw {
@@ -60,41 +95,109 @@ struct ehci_qh_hw {
     uint16_t pad[16];
 #endif
     bool inuse;
-    uint32_t first_qtd;
-    struct usbh_urb *urb;
+    uint8_t state;
+    bool waiting;    /* a blocking urb is queued, the waiter frees the qh */
+    bool opened;     /* held on the schedule by usbh_pipe_open */
+    uint8_t urb_num;
+    uint8_t unlink_waiters; /* threads sleeping until the hc has dropped the qh, the last one relinks it */
+    uint32_t first_qtd; /* first qtd of urb_queue[0], or the dummy qtd */
+    uint32_t dummy_qtd; /* inactive qtd at the tail of the chain */
+    struct usbh_hubport *hport;
+    struct usb_endpoint_descriptor *ep;
+    struct usbh_urb *urb_queue[CONFIG_USB_EHCI_QH_URB_NUM];
     usb_osal_sem_t waitsem;
-    uint8_t remove_in_iaad;
+    usb_osal_sem_t unlinksem; /* given by the async advance interrupt to unlink_waiters */
+    struct ehci_qh_hw *next_free;
+    struct ehci_qh_hw *hash_next; /* next qh in the bucket of its endpoint */
+    struct ehci_periodic_bw bw;
 } __attribute__((aligned(CONFIG_USB_EHCI_ALIGN_SIZE)));
 
+/* one frame of an iso stream, an itd for hs endpoints or a sitd for fs/ls endpoints behind a tt */
 struct ehci_itd_hw {
-    struct ehci_itd hw;
+    union {
+        struct ehci_itd itd;
+        struct ehci_sitd sitd;
+    } hw;
     struct usbh_urb *urb;
-    uint16_t start_frame;
-    uint8_t mf_unmask;
-    uint8_t mf_valid;
-    uint32_t pkt_idx[8];
-    bool dir_in;
+    uint16_t start_frame; /* frame the descriptor is linked in */
+    uint8_t mf_mask;      /* uframes carrying a packet, bit 0 for a sitd */
+    uint32_t pkt_idx[8];  /* iso_packet index of each uframe */
+    bool inuse;
+    struct ehci_itd_hw *next_free;
 } __attribute__((aligned(CONFIG_USB_EHCI_ALIGN_SIZE)));
 
+/* iso stream of one endpoint, descriptors from the bus itd pool form a ring scheduled up to CONFIG_USB_EHCI_ITD_NUM frames ahead */
 struct ehci_iso_hw {
-    struct ehci_itd_hw itd_pool[CONFIG_USB_EHCI_ITD_NUM];
-    uint32_t itd_num;
+    struct ehci_itd_hw *itd_ring[CONFIG_USB_EHCI_ITD_NUM];
+    uint32_t itd_num;  /* descriptors linked, the oldest at itd_head */
+    uint32_t itd_head;
+    struct usbh_hubport *hport;
+    struct usb_endpoint_descriptor *ep;
+    struct ehci_periodic_bw bw;
+    uint16_t interval;    /* uframes between packets */
+    uint16_t next_uframe; /* uframe of the next packet, in frindex units */
+    uint32_t next_packet; /* next iso_packet of urb_queue[urb_sched] to schedule */
+    uint32_t pkt_done;    /* completed iso_packets of urb_queue[0] */
+    uint8_t urb_sched;
+    uint8_t urb_num;
+    struct usbh_urb *urb_queue[CONFIG_USB_EHCI_QH_URB_NUM];
+    uint32_t missed; /* times the stream fell behind the frame counter and was moved ahead */
+    struct ehci_iso_hw *next; /* next active stream, or next free one */
+};
+
+struct ehci_pool_stat {
+    uint32_t num;      /* descriptors in the pool */
+    uint32_t used;
+    uint32_t used_max; /* high-water mark since init */
+    uint32_t nomem;    /* allocations that found the pool empty */
 };
 
 struct ehci_hcd {
-    bool ehci_iso_used[CONFIG_USB_EHCI_ISO_NUM];
     bool ppc;      /* Port Power Control */
     bool has_tt;   /* if use tt instead of Companion Controller */
     uint8_t n_cc;  /* Number of Companion Controller */
     uint8_t n_pcc; /* Number of ports supported per companion host controller */
     uint8_t n_ports;
     uint8_t hcor_offset;
+    bool iaa_pending; /* async advance doorbell rung and not answered yet */
+    struct ehci_qh_hw *qh_pool;
+    struct ehci_qtd_hw *qtd_pool;
+    struct ehci_qh_hw *qh_free;
+    struct ehci_qtd_hw *qtd_free;
+    struct ehci_pool_stat qh_stat;
+    struct ehci_pool_stat qtd_stat;
+    struct ehci_itd_hw *itd_free;
+    struct ehci_pool_stat itd_stat;
+    struct ehci_iso_hw *iso_free;
+    struct ehci_iso_hw *iso_list; /* streams with urbs queued or descriptors linked */
+    struct ehci_qh_hw *qh_hash[EHCI_QH_HASH_SIZE]; /* qhs of bulk and interrupt endpoints */
+    uint8_t bw_uframe[EHCI_BW_UFRAMES]; /* reserved hs usecs of each uframe */
+    struct ehci_periodic_bw *bw_list;
 };
 
 extern struct ehci_hcd g_ehci_hcd[CONFIG_USBHOST_MAX_BUS];
 extern uint32_t g_framelist[CONFIG_USBHOST_MAX_BUS][USB_ALIGN_UP(CONFIG_USB_EHCI_FRAME_LIST_SIZE, 1024)];
 extern uint8_t usbh_get_port_speed(struct usbh_bus *bus, const uint8_t port);
 
+#ifdef CONFIG_USB_EHCI_POOL_ARENA
+/* Provided by the glue: non-cacheable memory the qh and qtd pools of the bus are carved from */
+void *usb_ehci_pool_arena(struct usbh_bus *bus, uint32_t *size);
+#endif
+void usb_ehci_get_pool_stat(uint8_t busid, struct ehci_pool_stat *qh_stat, struct ehci_pool_stat *qtd_stat);
+
+static inline void ehci_pool_stat_get(struct ehci_pool_stat *stat)
+{
+    stat->used++;
+    if (stat->used > stat->used_max) {
+        stat->used_max = stat->used;
+    }
+}
+
+int ehci_periodic_bw_alloc(struct usbh_bus *bus, struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep, struct ehci_periodic_bw *bw);
+void ehci_periodic_bw_free(struct usbh_bus *bus, struct ehci_periodic_bw *bw);
+
+void ehci_iso_pool_init(struct usbh_bus *bus);
+void usb_ehci_get_itd_pool_stat(uint8_t busid, struct ehci_pool_stat *itd_stat);
 int ehci_iso_urb_init(struct usbh_bus *bus, struct usbh_urb *urb);
 void ehci_kill_iso_urb(struct usbh_bus *bus, struct usbh_urb *urb);
 void ehci_scan_isochronous_list(struct usbh_bus *bus);
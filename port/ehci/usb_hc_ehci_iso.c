@@ -0,0 +1,666 @@
+/*
+ * Copyright (c) 2026, sakumisu
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include "usb_hc_ehci.h"
+
+#ifdef CONFIG_USB_EHCI_ISO
+
+#define EHCI_FRAME_MASK (EHCI_FRINDEX_MASK >> 3) /* frame numbers wrap together with frindex */
+
+struct ehci_iso_hw g_ehci_iso_hw[CONFIG_USBHOST_MAX_BUS][CONFIG_USB_EHCI_ISO_NUM];
+USB_NOCACHE_RAM_SECTION struct ehci_itd_hw ehci_itd_pool[CONFIG_USBHOST_MAX_BUS][CONFIG_USB_EHCI_ITD_POOL_NUM];
+
+/* the iso code runs with interrupts off or from the irq, the pools need no locking of their own */
+static struct ehci_itd_hw *ehci_itd_alloc(struct usbh_bus *bus)
+{
+    struct ehci_hcd *hcd = &g_ehci_hcd[bus->hcd.hcd_id];
+    struct ehci_itd_hw *itd;
+
+    itd = hcd->itd_free;
+    if (itd == NULL) {
+        hcd->itd_stat.nomem++;
+        return NULL;
+    }
+    hcd->itd_free = itd->next_free;
+    itd->inuse = true;
+    ehci_pool_stat_get(&hcd->itd_stat);
+    return itd;
+}
+
+static void ehci_itd_free(struct usbh_bus *bus, struct ehci_itd_hw *itd)
+{
+    struct ehci_hcd *hcd = &g_ehci_hcd[bus->hcd.hcd_id];
+
+    itd->inuse = false;
+    itd->urb = NULL;
+    itd->next_free = hcd->itd_free;
+    hcd->itd_free = itd;
+    hcd->itd_stat.used--;
+}
+
+void ehci_iso_pool_init(struct usbh_bus *bus)
+{
+    struct ehci_hcd *hcd = &g_ehci_hcd[bus->hcd.hcd_id];
+    struct ehci_itd_hw *itd_pool = ehci_itd_pool[bus->hcd.hcd_id];
+    struct ehci_iso_hw *iso_pool = g_ehci_iso_hw[bus->hcd.hcd_id];
+
+    memset(itd_pool, 0, sizeof(ehci_itd_pool[0]));
+    memset(iso_pool, 0, sizeof(g_ehci_iso_hw[0]));
+
+    hcd->itd_free = NULL;
+    for (uint32_t i = CONFIG_USB_EHCI_ITD_POOL_NUM; i > 0; i--) {
+        itd_pool[i - 1].next_free = hcd->itd_free;
+        hcd->itd_free = &itd_pool[i - 1];
+    }
+    hcd->itd_stat.num = CONFIG_USB_EHCI_ITD_POOL_NUM;
+
+    hcd->iso_free = NULL;
+    hcd->iso_list = NULL;
+    for (uint32_t i = CONFIG_USB_EHCI_ISO_NUM; i > 0; i--) {
+        iso_pool[i - 1].next = hcd->iso_free;
+        hcd->iso_free = &iso_pool[i - 1];
+    }
+}
+
+void usb_ehci_get_itd_pool_stat(uint8_t busid, struct ehci_pool_stat *itd_stat)
+{
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    memcpy(itd_stat, &g_ehci_hcd[busid].itd_stat, sizeof(struct ehci_pool_stat));
+    usb_osal_leave_critical_section(flags);
+}
+
+static inline bool ehci_iso_is_split(struct ehci_iso_hw *stream)
+{
+    return stream->bw.tt_usecs ? true : false;
+}
+
+static inline uint32_t ehci_iso_pkt_per_frame(uint16_t interval)
+{
+    return (interval < 8) ? (8 / interval) : 1;
+}
+
+/* uframes the hc may already have fetched ahead of frindex, plus one frame of margin */
+static uint16_t ehci_iso_threshold(struct usbh_bus *bus)
+{
+    uint32_t ist = (EHCI_HCCR->hccparams & EHCI_HCCPARAMS_IST_MASK) >> EHCI_HCCPARAMS_IST_SHIFT;
+
+    if (ist & 0x8) {
+        return ((ist & 0x7) + 1) * 8 + 8;
+    }
+    return ist + 8;
+}
+
+/* first uframe of the reserved phase far enough ahead of the hc, packets of a frame always start at its first slot */
+static void ehci_iso_stream_anchor(struct usbh_bus *bus, struct ehci_iso_hw *stream)
+{
+    uint16_t align = MAX(stream->bw.period, 8);
+    uint16_t uframe;
+
+    uframe = (EHCI_HCOR->frindex & EHCI_FRINDEX_MASK) + ehci_iso_threshold(bus);
+    uframe = (uframe + align - 1) & ~(align - 1);
+    stream->next_uframe = (uframe + stream->bw.phase) & EHCI_FRINDEX_MASK;
+}
+
+/* page select of a transaction in the itd, the transaction may continue on the next page pointer */
+static int ehci_itd_page(uint32_t *pages, uint8_t *page_num, uint32_t addr, uint32_t len)
+{
+    uint32_t first = addr & ~0xfff;
+    uint32_t last = (addr + (len ? (len - 1) : 0)) & ~0xfff;
+    uint8_t i;
+
+    for (i = 0; i < *page_num; i++) {
+        if (pages[i] == first) {
+            break;
+        }
+    }
+    if (i == *page_num) {
+        if (*page_num == 7) {
+            return -1;
+        }
+        pages[(*page_num)++] = first;
+    }
+
+    if (last != first) {
+        if ((i + 1) < *page_num) {
+            if (pages[i + 1] != last) {
+                return -1;
+            }
+        } else {
+            if (*page_num == 7) {
+                return -1;
+            }
+            pages[(*page_num)++] = last;
+        }
+    }
+    return i;
+}
+
+static int ehci_iso_urb_check(struct usbh_urb *urb)
+{
+    struct usb_endpoint_descriptor *ep = urb->ep;
+    uint32_t max_len = USB_GET_MAXPACKETSIZE(ep->wMaxPacketSize);
+    uint32_t pkt_per_frame = 1;
+    uint32_t pages[7];
+    uint8_t page_num;
+    uint16_t interval;
+
+    if (urb->timeout || (urb->num_of_iso_packets == 0)) {
+        return -USB_ERR_INVAL;
+    }
+
+    if (urb->hport->speed == USB_SPEED_HIGH) {
+        max_len *= (USB_GET_MULT(ep->wMaxPacketSize) + 1);
+        interval = 1 << (MIN(MAX(ep->bInterval, 1), 16) - 1);
+        pkt_per_frame = ehci_iso_pkt_per_frame(interval);
+    }
+
+    if (urb->transfer_flags & USBH_URB_ISO_RING) {
+        /* a packet must not be re-armed while it is still in flight */
+        if ((urb->num_of_iso_packets < (CONFIG_USB_EHCI_ITD_NUM * pkt_per_frame)) ||
+            (urb->num_of_iso_packets % pkt_per_frame)) {
+            return -USB_ERR_INVAL;
+        }
+    }
+
+    for (uint32_t i = 0; i < urb->num_of_iso_packets; i++) {
+        if (urb->iso_packet[i].transfer_buffer_length > max_len) {
+            return -USB_ERR_INVAL;
+        }
+
+        if (urb->hport->speed != USB_SPEED_HIGH) {
+            continue;
+        }
+
+        /* the packets sharing an itd must fit in its seven page pointers */
+        if ((i % pkt_per_frame) == 0) {
+            page_num = 0;
+        }
+        if (ehci_itd_page(pages, &page_num, (uint32_t)(uintptr_t)urb->iso_packet[i].transfer_buffer,
+                          urb->iso_packet[i].transfer_buffer_length) < 0) {
+            return -USB_ERR_INVAL;
+        }
+    }
+    return 0;
+}
+
+static void ehci_iso_itd_fill(struct ehci_iso_hw *stream, struct ehci_itd_hw *itd, struct usbh_urb *urb)
+{
+    struct usbh_iso_frame_packet *pkt;
+    uint32_t pages[7] = { 0 };
+    uint8_t page_num = 0;
+    uint32_t addr;
+    uint8_t uframe = 0;
+    int pg;
+
+    memset(&itd->hw, 0, sizeof(itd->hw));
+
+    while ((stream->next_uframe >> 3) == itd->start_frame) {
+        pkt = &urb->iso_packet[stream->next_packet];
+        addr = (uint32_t)(uintptr_t)pkt->transfer_buffer;
+
+        pg = ehci_itd_page(pages, &page_num, addr, pkt->transfer_buffer_length);
+        if (pg < 0) {
+            /*
+             * out of page pointers, packets grouped differently than ehci_iso_urb_check saw them
+             * (resumed after a kill, or an urb ending mid frame). The rest of the frame goes into
+             * a second itd linked to the same frame, the first packet of an itd always fits.
+             */
+            break;
+        }
+        uframe = stream->next_uframe & 0x7;
+        itd->hw.itd.tscl[uframe] = ITD_TSCL_STATUS_ACTIVE |
+                                   (pkt->transfer_buffer_length << ITD_TSCL_LENGTH_SHIFT) |
+                                   ((uint32_t)pg << ITD_TSCL_PG_SHIFT) |
+                                   (addr & ITD_TSCL_XOFFS_MASK);
+        usb_dcache_flush((uintptr_t)pkt->transfer_buffer, USB_ALIGN_UP(pkt->transfer_buffer_length, CONFIG_USB_ALIGN_SIZE));
+
+        itd->pkt_idx[uframe] = stream->next_packet;
+        itd->mf_mask |= (1 << uframe);
+
+        stream->next_uframe = (stream->next_uframe + stream->interval) & EHCI_FRINDEX_MASK;
+        if (++stream->next_packet == urb->num_of_iso_packets) {
+            if (!(urb->transfer_flags & USBH_URB_ISO_RING)) {
+                break;
+            }
+            stream->next_packet = 0;
+        }
+    }
+    itd->hw.itd.tscl[uframe] |= ITD_TSCL_IOC;
+
+    itd->hw.itd.bpl[0] = pages[0] |
+                         ((stream->ep->bEndpointAddress & 0xf) << ITD_BUFPTR0_ENDPT_SHIFT) |
+                         (stream->hport->dev_addr << ITD_BUFPTR0_DEVADDR_SHIFT);
+    itd->hw.itd.bpl[1] = pages[1] |
+                         ((stream->ep->bEndpointAddress & 0x80) ? ITD_BUFPTR1_DIRIN : ITD_BUFPTR1_DIROUT) |
+                         USB_GET_MAXPACKETSIZE(stream->ep->wMaxPacketSize);
+    itd->hw.itd.bpl[2] = pages[2] | (USB_GET_MULT(stream->ep->wMaxPacketSize) + 1);
+    for (uint8_t i = 3; i < 7; i++) {
+        itd->hw.itd.bpl[i] = pages[i];
+    }
+}
+
+static void ehci_iso_sitd_fill(struct ehci_iso_hw *stream, struct ehci_itd_hw *itd, struct usbh_urb *urb)
+{
+    struct usbh_iso_frame_packet *pkt = &urb->iso_packet[stream->next_packet];
+    uint32_t addr = (uint32_t)(uintptr_t)pkt->transfer_buffer;
+    uint32_t tcount;
+
+    memset(&itd->hw, 0, sizeof(itd->hw));
+
+    itd->hw.sitd.epchar = ((stream->ep->bEndpointAddress & 0x80) ? SITD_EPCHAR_DIRIN : SITD_EPCHAR_DIROUT) |
+                          (stream->hport->port << SITD_EPCHAR_PORT_SHIFT) |
+                          (stream->hport->parent->hub_addr << SITD_EPCHAR_HUBADDR_SHIFT) |
+                          ((stream->ep->bEndpointAddress & 0xf) << SITD_EPCHAR_ENDPT_SHIFT) |
+                          (stream->hport->dev_addr << SITD_EPCHAR_DEVADDR_SHIFT);
+    itd->hw.sitd.mfsc = SITD_MFSC_SSMASK(stream->bw.smask) | SITD_MFSC_SCMASK(stream->bw.cmask);
+    itd->hw.sitd.tsc = SITD_TSC_IOC | (pkt->transfer_buffer_length << SITD_TSC_NBYTES_SHIFT) | SITD_TSC_STATUS_ACTIVE;
+    itd->hw.sitd.bpl[0] = addr;
+    itd->hw.sitd.bpl[1] = (addr & ~0xfff) + 0x1000;
+    if (!(stream->ep->bEndpointAddress & 0x80)) {
+        /* one start-split per 188 bytes */
+        tcount = MAX((pkt->transfer_buffer_length + 187) / 188, 1);
+        itd->hw.sitd.bpl[1] |= (tcount << SITD_BPL1_TCOUNT_SHIFT) | ((tcount > 1) ? SITD_BPL1_TP_BEGIN : SITD_BPL1_TP_ALL);
+    }
+    itd->hw.sitd.blp = SITD_BLP_END;
+    usb_dcache_flush((uintptr_t)pkt->transfer_buffer, USB_ALIGN_UP(pkt->transfer_buffer_length, CONFIG_USB_ALIGN_SIZE));
+
+    itd->pkt_idx[0] = stream->next_packet;
+    itd->mf_mask = 0x01;
+
+    stream->next_uframe = (stream->next_uframe + stream->interval) & EHCI_FRINDEX_MASK;
+    if ((++stream->next_packet == urb->num_of_iso_packets) && (urb->transfer_flags & USBH_URB_ISO_RING)) {
+        stream->next_packet = 0;
+    }
+}
+
+/* itds and sitds sit in front of the qhs of their frame, their first word is the next link pointer */
+static void ehci_iso_link(struct usbh_bus *bus, struct ehci_iso_hw *stream, struct ehci_itd_hw *itd)
+{
+    uint32_t *link = &g_framelist[bus->hcd.hcd_id][itd->start_frame & (CONFIG_USB_EHCI_FRAME_LIST_SIZE - 1)];
+
+    itd->hw.itd.nlp = *link;
+#if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
+    usb_dcache_clean((uintptr_t)&itd->hw, USB_ALIGN_UP(sizeof(itd->hw), CONFIG_USB_EHCI_ALIGN_SIZE));
+#endif
+    *link = ehci_iso_is_split(stream) ? QH_HLP_SITD(itd) : QH_HLP_ITD(itd);
+#if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
+    usb_dcache_clean((uintptr_t)link & ~(CONFIG_USB_EHCI_ALIGN_SIZE - 1), CONFIG_USB_EHCI_ALIGN_SIZE);
+#endif
+}
+
+static void ehci_iso_unlink(struct usbh_bus *bus, struct ehci_itd_hw *itd)
+{
+    uint32_t *link = &g_framelist[bus->hcd.hcd_id][itd->start_frame & (CONFIG_USB_EHCI_FRAME_LIST_SIZE - 1)];
+
+    while (!(*link & QH_HLP_END) && ((*link & 0x6) != QH_HLP_QH(0))) {
+        if (EHCI_PTR2ADDR(*link) == EHCI_PTR2ADDR(itd)) {
+            *link = itd->hw.itd.nlp;
+#if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
+            usb_dcache_clean((uintptr_t)link & ~(CONFIG_USB_EHCI_ALIGN_SIZE - 1), CONFIG_USB_EHCI_ALIGN_SIZE);
+#endif
+            return;
+        }
+        link = (uint32_t *)(uintptr_t)EHCI_PTR2ADDR(*link);
+    }
+}
+
+/* keep CONFIG_USB_EHCI_ITD_NUM frames of the queued urbs on the schedule */
+static void ehci_iso_stream_fill(struct usbh_bus *bus, struct ehci_iso_hw *stream)
+{
+    struct ehci_itd_hw *itd;
+    struct usbh_urb *urb;
+    uint16_t ahead;
+
+    while ((stream->itd_num < CONFIG_USB_EHCI_ITD_NUM) && (stream->urb_sched < stream->urb_num)) {
+        urb = stream->urb_queue[stream->urb_sched];
+
+        ahead = (stream->next_uframe - (EHCI_HCOR->frindex & EHCI_FRINDEX_MASK)) & EHCI_FRINDEX_MASK;
+        if ((ahead < ehci_iso_threshold(bus)) || (ahead > (EHCI_FRINDEX_MASK >> 1))) {
+            /* fell behind the hc, the packets go out later instead of being dropped */
+            ehci_iso_stream_anchor(bus, stream);
+            stream->missed++;
+        } else if ((ahead >> 3) >= (CONFIG_USB_EHCI_FRAME_LIST_SIZE - 1)) {
+            /* long intervals, the frame list slot would be reached a lap early */
+            break;
+        }
+
+        if (stream->next_packet == 0) {
+            urb->start_frame = (stream->next_uframe >> 3) & 0x3ff;
+        }
+
+        /* pool shared by every stream of the bus, a short one is retried from the next scan */
+        itd = ehci_itd_alloc(bus);
+        if (itd == NULL) {
+            break;
+        }
+        stream->itd_ring[(stream->itd_head + stream->itd_num) % CONFIG_USB_EHCI_ITD_NUM] = itd;
+        itd->urb = urb;
+        itd->start_frame = stream->next_uframe >> 3;
+        itd->mf_mask = 0;
+        if (ehci_iso_is_split(stream)) {
+            ehci_iso_sitd_fill(stream, itd, urb);
+        } else {
+            ehci_iso_itd_fill(stream, itd, urb);
+        }
+        ehci_iso_link(bus, stream, itd);
+        stream->itd_num++;
+
+        if (!(urb->transfer_flags & USBH_URB_ISO_RING) && (stream->next_packet == urb->num_of_iso_packets)) {
+            /* the next urb starts with a frame of its own */
+            if ((stream->next_uframe >> 3) == itd->start_frame) {
+                stream->next_uframe = (((itd->start_frame + 1) << 3) + (stream->bw.phase % stream->interval)) & EHCI_FRINDEX_MASK;
+            }
+            stream->next_packet = 0;
+            stream->urb_sched++;
+        }
+    }
+}
+
+static void ehci_iso_packet_status(struct ehci_iso_hw *stream, struct ehci_itd_hw *itd, uint8_t uframe, struct usbh_iso_frame_packet *pkt)
+{
+    uint32_t status;
+    uint32_t remain;
+
+    pkt->actual_length = 0;
+    if (ehci_iso_is_split(stream)) {
+        status = itd->hw.sitd.tsc;
+        remain = (status & SITD_TSC_NBYTES_MASK) >> SITD_TSC_NBYTES_SHIFT;
+
+        if (status & SITD_TSC_STATUS_ACTIVE) {
+            pkt->errorcode = -USB_ERR_IO; /* frame went by before the descriptor was seen */
+        } else if (status & SITD_TSC_STATUS_BABBLE) {
+            pkt->errorcode = -USB_ERR_BABBLE;
+        } else if (status & (SITD_TSC_STATUS_MMF | SITD_TSC_STATUS_XACTERR | SITD_TSC_STATUS_DBERROR | SITD_TSC_STATUS_ERR)) {
+            pkt->errorcode = -USB_ERR_IO;
+        } else {
+            pkt->errorcode = 0;
+            pkt->actual_length = pkt->transfer_buffer_length - MIN(remain, pkt->transfer_buffer_length);
+        }
+    } else {
+        status = itd->hw.itd.tscl[uframe];
+
+        if (status & ITD_TSCL_STATUS_ACTIVE) {
+            pkt->errorcode = -USB_ERR_IO;
+        } else if (status & ITD_TSCL_STATUS_BABBLE) {
+            pkt->errorcode = -USB_ERR_BABBLE;
+        } else if (status & (ITD_TSCL_STATUS_XACTERR | ITD_TSCL_STATUS_DBERROR)) {
+            pkt->errorcode = -USB_ERR_IO;
+        } else {
+            pkt->errorcode = 0;
+            if (stream->ep->bEndpointAddress & 0x80) {
+                /* the hc writes back the bytes received */
+                pkt->actual_length = (status & ITD_TSCL_LENGTH_MASK) >> ITD_TSCL_LENGTH_SHIFT;
+            } else {
+                pkt->actual_length = pkt->transfer_buffer_length;
+            }
+        }
+    }
+
+    if ((stream->ep->bEndpointAddress & 0x80) && pkt->actual_length) {
+        usb_dcache_invalidate((uintptr_t)pkt->transfer_buffer, USB_ALIGN_UP(pkt->actual_length, CONFIG_USB_ALIGN_SIZE));
+    }
+}
+
+static void ehci_iso_urb_giveback(struct usbh_bus *bus, struct ehci_iso_hw *stream, uint8_t idx, int errorcode)
+{
+    struct usbh_urb *urb = stream->urb_queue[idx];
+
+    (void)bus;
+
+    stream->urb_num--;
+    memmove(&stream->urb_queue[idx], &stream->urb_queue[idx + 1], (stream->urb_num - idx) * sizeof(struct usbh_urb *));
+    if (idx == 0) {
+        stream->pkt_done = 0;
+    }
+
+    urb->hcpriv = NULL;
+    urb->errorcode = errorcode;
+    if (urb->complete) {
+        if (errorcode < 0) {
+            urb->complete(urb->arg, errorcode);
+        } else {
+            urb->complete(urb->arg, urb->actual_length);
+        }
+    }
+}
+
+static void ehci_iso_stream_free(struct usbh_bus *bus, struct ehci_iso_hw *stream)
+{
+    struct ehci_hcd *hcd = &g_ehci_hcd[bus->hcd.hcd_id];
+    struct ehci_iso_hw **prev;
+
+    ehci_periodic_bw_free(bus, &stream->bw);
+    stream->hport = NULL;
+    stream->ep = NULL;
+
+    for (prev = &hcd->iso_list; *prev; prev = &(*prev)->next) {
+        if (*prev == stream) {
+            *prev = stream->next;
+            break;
+        }
+    }
+    stream->next = hcd->iso_free;
+    hcd->iso_free = stream;
+}
+
+static void ehci_iso_stream_scan(struct usbh_bus *bus, struct ehci_iso_hw *stream)
+{
+    struct ehci_itd_hw *itd;
+    struct usbh_urb *urb;
+    uint16_t frame;
+    bool active;
+
+    while (stream->itd_num) {
+        itd = stream->itd_ring[stream->itd_head];
+        urb = itd->urb;
+
+#if defined(CONFIG_USB_EHCI_DESC_DCACHE_ENABLE)
+        usb_dcache_invalidate((uintptr_t)&itd->hw, USB_ALIGN_UP(sizeof(itd->hw), CONFIG_USB_EHCI_ALIGN_SIZE));
+#endif
+        active = false;
+        for (uint8_t uframe = 0; uframe < 8; uframe++) {
+            if (itd->mf_mask & (1 << uframe)) {
+                if (ehci_iso_is_split(stream)) {
+                    active |= (itd->hw.sitd.tsc & SITD_TSC_STATUS_ACTIVE) ? true : false;
+                } else {
+                    active |= (itd->hw.itd.tscl[uframe] & ITD_TSCL_STATUS_ACTIVE) ? true : false;
+                }
+            }
+        }
+
+        /* still active in a frame the hc has left means it was never executed */
+        frame = ((EHCI_HCOR->frindex & EHCI_FRINDEX_MASK) >> 3);
+        frame = (frame - itd->start_frame) & EHCI_FRAME_MASK;
+        if (active && ((frame == 0) || (frame > (EHCI_FRAME_MASK >> 1)))) {
+            break;
+        }
+
+        ehci_iso_unlink(bus, itd);
+
+        for (uint8_t uframe = 0; uframe < 8; uframe++) {
+            if (!(itd->mf_mask & (1 << uframe))) {
+                continue;
+            }
+
+            ehci_iso_packet_status(stream, itd, uframe, &urb->iso_packet[itd->pkt_idx[uframe]]);
+            if (urb->transfer_flags & USBH_URB_ISO_RING) {
+                if (urb->iso_complete) {
+                    urb->iso_complete(urb->arg, &urb->iso_packet[itd->pkt_idx[uframe]], itd->pkt_idx[uframe]);
+                }
+            } else {
+                urb->actual_length += urb->iso_packet[itd->pkt_idx[uframe]].actual_length;
+                stream->pkt_done++;
+            }
+        }
+
+        stream->itd_head = (stream->itd_head + 1) % CONFIG_USB_EHCI_ITD_NUM;
+        stream->itd_num--;
+        ehci_itd_free(bus, itd);
+
+        if (!(urb->transfer_flags & USBH_URB_ISO_RING) && (stream->pkt_done == urb->num_of_iso_packets)) {
+            stream->urb_sched--;
+            ehci_iso_urb_giveback(bus, stream, 0, 0);
+        }
+    }
+
+    ehci_iso_stream_fill(bus, stream);
+
+    if ((stream->urb_num == 0) && (stream->itd_num == 0)) {
+        ehci_iso_stream_free(bus, stream);
+    }
+}
+
+static struct ehci_iso_hw *ehci_iso_stream_find(struct usbh_bus *bus, struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep)
+{
+    struct ehci_iso_hw *stream;
+
+    for (stream = g_ehci_hcd[bus->hcd.hcd_id].iso_list; stream; stream = stream->next) {
+        if ((stream->hport == hport) && (stream->ep == ep)) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+/* called with interrupts off and returns with them off, the bandwidth is reserved with interrupts on */
+static int ehci_iso_stream_create(struct usbh_bus *bus, struct usbh_hubport *hport, struct usb_endpoint_descriptor *ep, size_t *flags, struct ehci_iso_hw **stream_out)
+{
+    struct ehci_hcd *hcd = &g_ehci_hcd[bus->hcd.hcd_id];
+    struct ehci_iso_hw *stream = hcd->iso_free;
+    struct ehci_iso_hw *other;
+    uint8_t interval = MIN(MAX(ep->bInterval, 1), 16);
+    int ret;
+
+    if (stream == NULL) {
+        return -USB_ERR_NOMEM;
+    }
+    hcd->iso_free = stream->next;
+    memset(stream, 0, sizeof(struct ehci_iso_hw));
+
+    usb_osal_leave_critical_section(*flags);
+    ret = ehci_periodic_bw_alloc(bus, hport, ep, &stream->bw);
+    *flags = usb_osal_enter_critical_section();
+
+    /* a submit for the same endpoint may have created one meanwhile */
+    other = ehci_iso_stream_find(bus, hport, ep);
+    if ((ret < 0) || other) {
+        if (ret == 0) {
+            ehci_periodic_bw_free(bus, &stream->bw);
+        }
+        stream->next = hcd->iso_free;
+        hcd->iso_free = stream;
+        if (other) {
+            *stream_out = other;
+            return 0;
+        }
+        return ret;
+    }
+
+    stream->hport = hport;
+    stream->ep = ep;
+    stream->interval = (hport->speed == USB_SPEED_HIGH) ? (1 << (interval - 1)) : ((1 << (interval - 1)) * 8);
+    ehci_iso_stream_anchor(bus, stream);
+    stream->next = hcd->iso_list;
+    hcd->iso_list = stream;
+
+    *stream_out = stream;
+    return 0;
+}
+
+int ehci_iso_urb_init(struct usbh_bus *bus, struct usbh_urb *urb)
+{
+    struct ehci_iso_hw *stream;
+    size_t flags;
+    int ret;
+
+    ret = ehci_iso_urb_check(urb);
+    if (ret < 0) {
+        return ret;
+    }
+
+    flags = usb_osal_enter_critical_section();
+
+    stream = ehci_iso_stream_find(bus, urb->hport, urb->ep);
+    if (stream == NULL) {
+        ret = ehci_iso_stream_create(bus, urb->hport, urb->ep, &flags, &stream);
+        if (ret < 0) {
+            usb_osal_leave_critical_section(flags);
+            return ret;
+        }
+    }
+
+    /* a ring owns its endpoint */
+    if ((stream->urb_num == CONFIG_USB_EHCI_QH_URB_NUM) ||
+        (stream->urb_num && ((urb->transfer_flags & USBH_URB_ISO_RING) ||
+                             (stream->urb_queue[0]->transfer_flags & USBH_URB_ISO_RING)))) {
+        usb_osal_leave_critical_section(flags);
+        return -USB_ERR_BUSY;
+    }
+
+    for (uint32_t i = 0; i < urb->num_of_iso_packets; i++) {
+        urb->iso_packet[i].actual_length = 0;
+        urb->iso_packet[i].errorcode = -USB_ERR_BUSY;
+    }
+    urb->hcpriv = stream;
+    urb->errorcode = -USB_ERR_BUSY;
+    stream->urb_queue[stream->urb_num++] = urb;
+
+    ehci_iso_stream_fill(bus, stream);
+    EHCI_HCOR->usbcmd |= EHCI_USBCMD_PSEN;
+
+    usb_osal_leave_critical_section(flags);
+    return 0;
+}
+
+/* called with the periodic schedule stopped, the urbs queued behind are scheduled again */
+void ehci_kill_iso_urb(struct usbh_bus *bus, struct usbh_urb *urb)
+{
+    struct ehci_iso_hw *stream = (struct ehci_iso_hw *)urb->hcpriv;
+    uint8_t idx;
+
+    for (idx = 0; idx < stream->urb_num; idx++) {
+        if (stream->urb_queue[idx] == urb) {
+            break;
+        }
+    }
+    if (idx == stream->urb_num) {
+        return;
+    }
+
+    while (stream->itd_num) {
+        ehci_iso_unlink(bus, stream->itd_ring[stream->itd_head]);
+        ehci_itd_free(bus, stream->itd_ring[stream->itd_head]);
+        stream->itd_head = (stream->itd_head + 1) % CONFIG_USB_EHCI_ITD_NUM;
+        stream->itd_num--;
+    }
+
+    ehci_iso_urb_giveback(bus, stream, idx, -USB_ERR_SHUTDOWN);
+
+    /* packets of urb_queue[0] that already completed are not sent again */
+    stream->urb_sched = 0;
+    stream->next_packet = stream->pkt_done;
+    if (stream->urb_num) {
+        ehci_iso_stream_anchor(bus, stream);
+        ehci_iso_stream_fill(bus, stream);
+    } else {
+        ehci_iso_stream_free(bus, stream);
+    }
+}
+
+void ehci_scan_isochronous_list(struct usbh_bus *bus)
+{
+    struct ehci_iso_hw *stream;
+    struct ehci_iso_hw *next;
+
+    /* a stream that goes idle leaves the list while it is scanned */
+    for (stream = g_ehci_hcd[bus->hcd.hcd_id].iso_list; stream; stream = next) {
+        next = stream->next;
+        ehci_iso_stream_scan(bus, stream);
+    }
+}
+
+#endif
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2025, sakumisu
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include "usbd_core.h"
+#include "usb_loopback.h"
+
+#undef USB_DBG_TAG
+#define USB_DBG_TAG "usbd_loopback"
+#include "usb_log.h"
+
+struct usb_loopback_udc g_loopback_udc[CONFIG_USBDEV_MAX_BUS];
+
+int usb_dc_init(uint8_t busid)
+{
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    memset(&g_loopback_udc[busid], 0, sizeof(struct usb_loopback_udc));
+    g_loopback_udc[busid].attached = true;
+    usb_osal_leave_critical_section(flags);
+
+    usbd_event_connect_handler(busid);
+    usb_loopback_hc_port_change(busid);
+    return 0;
+}
+
+int usb_dc_deinit(uint8_t busid)
+{
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    g_loopback_udc[busid].attached = false;
+    for (uint8_t i = 0; i < CONFIG_USB_LOOPBACK_EP_NUM; i++) {
+        g_loopback_udc[busid].in_ep[i].ep_busy = false;
+        g_loopback_udc[busid].out_ep[i].ep_busy = false;
+    }
+    usb_osal_leave_critical_section(flags);
+
+    usb_loopback_hc_port_change(busid);
+    usbd_event_disconnect_handler(busid);
+    return 0;
+}
+
+int usbd_set_address(uint8_t busid, const uint8_t addr)
+{
+    g_loopback_udc[busid].dev_addr = addr;
+    return 0;
+}
+
+int usbd_set_remote_wakeup(uint8_t busid)
+{
+    (void)busid;
+    return -1;
+}
+
+uint8_t usbd_get_port_speed(uint8_t busid)
+{
+    (void)busid;
+#ifdef CONFIG_USB_HS
+    return USB_SPEED_HIGH;
+#else
+    return USB_SPEED_FULL;
+#endif
+}
+
+int usbd_ep_open(uint8_t busid, const struct usb_endpoint_descriptor *ep)
+{
+    uint8_t ep_idx = USB_EP_GET_IDX(ep->bEndpointAddress);
+    struct usb_loopback_ep *ep_state;
+    size_t flags;
+
+    if (ep_idx >= CONFIG_USB_LOOPBACK_EP_NUM) {
+        USB_LOG_ERR("Ep addr %02x overflow\r\n", ep->bEndpointAddress);
+        return -1;
+    }
+
+    if (USB_EP_DIR_IS_OUT(ep->bEndpointAddress)) {
+        ep_state = &g_loopback_udc[busid].out_ep[ep_idx];
+    } else {
+        ep_state = &g_loopback_udc[busid].in_ep[ep_idx];
+    }
+
+    flags = usb_osal_enter_critical_section();
+    ep_state->ep_mps = USB_GET_MAXPACKETSIZE(ep->wMaxPacketSize);
+    ep_state->ep_type = USB_GET_ENDPOINT_TYPE(ep->bmAttributes);
+    ep_state->ep_enable = true;
+    ep_state->ep_stalled = false;
+    ep_state->ep_busy = false;
+    usb_osal_leave_critical_section(flags);
+    return 0;
+}
+
+int usbd_ep_close(uint8_t busid, const uint8_t ep)
+{
+    uint8_t ep_idx = USB_EP_GET_IDX(ep);
+    struct usb_loopback_ep *ep_state;
+    size_t flags;
+
+    if (USB_EP_DIR_IS_OUT(ep)) {
+        ep_state = &g_loopback_udc[busid].out_ep[ep_idx];
+    } else {
+        ep_state = &g_loopback_udc[busid].in_ep[ep_idx];
+    }
+
+    flags = usb_osal_enter_critical_section();
+    ep_state->ep_enable = false;
+    ep_state->ep_busy = false;
+    usb_osal_leave_critical_section(flags);
+    return 0;
+}
+
+int usbd_ep_set_stall(uint8_t busid, const uint8_t ep)
+{
+    uint8_t ep_idx = USB_EP_GET_IDX(ep);
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    if (ep_idx == 0) {
+        /* ep0 stall is answered in both directions until next setup */
+        g_loopback_udc[busid].in_ep[0].ep_stalled = true;
+        g_loopback_udc[busid].out_ep[0].ep_stalled = true;
+    } else if (USB_EP_DIR_IS_OUT(ep)) {
+        g_loopback_udc[busid].out_ep[ep_idx].ep_stalled = true;
+    } else {
+        g_loopback_udc[busid].in_ep[ep_idx].ep_stalled = true;
+    }
+    usb_osal_leave_critical_section(flags);
+
+    usb_loopback_run(busid);
+    return 0;
+}
+
+int usbd_ep_clear_stall(uint8_t busid, const uint8_t ep)
+{
+    uint8_t ep_idx = USB_EP_GET_IDX(ep);
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    if (USB_EP_DIR_IS_OUT(ep)) {
+        g_loopback_udc[busid].out_ep[ep_idx].ep_stalled = false;
+    } else {
+        g_loopback_udc[busid].in_ep[ep_idx].ep_stalled = false;
+    }
+    usb_osal_leave_critical_section(flags);
+
+    usb_loopback_run(busid);
+    return 0;
+}
+
+int usbd_ep_is_stalled(uint8_t busid, const uint8_t ep, uint8_t *stalled)
+{
+    uint8_t ep_idx = USB_EP_GET_IDX(ep);
+
+    if (USB_EP_DIR_IS_OUT(ep)) {
+        *stalled = g_loopback_udc[busid].out_ep[ep_idx].ep_stalled;
+    } else {
+        *stalled = g_loopback_udc[busid].in_ep[ep_idx].ep_stalled;
+    }
+    return 0;
+}
+
+int usbd_ep_start_write(uint8_t busid, const uint8_t ep, const uint8_t *data, uint32_t data_len)
+{
+    uint8_t ep_idx = USB_EP_GET_IDX(ep);
+    struct usb_loopback_ep *ep_state;
+    size_t flags;
+
+    if (!data && data_len) {
+        return -1;
+    }
+
+    ep_state = &g_loopback_udc[busid].in_ep[ep_idx];
+    if (!ep_state->ep_enable) {
+        return -2;
+    }
+
+    flags = usb_osal_enter_critical_section();
+    ep_state->xfer_buf = (uint8_t *)data;
+    ep_state->xfer_len = data_len;
+    ep_state->actual_xfer_len = 0;
+    ep_state->ep_busy = true;
+    usb_osal_leave_critical_section(flags);
+
+    usb_loopback_run(busid);
+    return 0;
+}
+
+int usbd_ep_start_read(uint8_t busid, const uint8_t ep, uint8_t *data, uint32_t data_len)
+{
+    uint8_t ep_idx = USB_EP_GET_IDX(ep);
+    struct usb_loopback_ep *ep_state;
+    size_t flags;
+
+    if (!data && data_len) {
+        return -1;
+    }
+
+    ep_state = &g_loopback_udc[busid].out_ep[ep_idx];
+    if (!ep_state->ep_enable) {
+        return -2;
+    }
+
+    flags = usb_osal_enter_critical_section();
+    ep_state->xfer_buf = data;
+    ep_state->xfer_len = data_len;
+    ep_state->actual_xfer_len = 0;
+    ep_state->ep_busy = true;
+    usb_osal_leave_critical_section(flags);
+
+    usb_loopback_run(busid);
+    return 0;
+}
+
+void usb_loopback_dc_bus_reset(uint8_t busid)
+{
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    for (uint8_t i = 0; i < CONFIG_USB_LOOPBACK_EP_NUM; i++) {
+        memset(&g_loopback_udc[busid].in_ep[i], 0, sizeof(struct usb_loopback_ep));
+        memset(&g_loopback_udc[busid].out_ep[i], 0, sizeof(struct usb_loopback_ep));
+    }
+    usb_osal_leave_critical_section(flags);
+
+    usbd_event_reset_handler(busid);
+}
+
+void USBD_IRQHandler(uint8_t busid)
+{
+    usb_loopback_run(busid);
+}
@@ -0,0 +1,705 @@
+/*
+ * Copyright (c) 2025, sakumisu
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include "usbh_core.h"
+#include "usbh_hub.h"
+#include "usb_dc.h"
+#include "usb_loopback.h"
+
+#undef USB_DBG_TAG
+#define USB_DBG_TAG "usbh_loopback"
+#include "usb_log.h"
+
+typedef enum {
+    USB_EP0_STATE_SETUP = 0x0, /**< SETUP DATA */
+    USB_EP0_STATE_IN_DATA,     /**< IN DATA */
+    USB_EP0_STATE_IN_STATUS,   /**< IN status*/
+    USB_EP0_STATE_OUT_DATA,    /**< OUT DATA */
+    USB_EP0_STATE_OUT_STATUS,  /**< OUT status */
+} ep0_state_t;
+
+struct loopback_pipe {
+    usb_dlist_t list;
+    bool inuse;
+    bool waiter;              /* submitted with timeout, the submitter owns and frees the pipe */
+    uint8_t ep0_state;
+    uint32_t ep0_data_len;    /* data stage bytes transferred */
+    usb_osal_sem_t waitsem;
+    struct usbh_urb *urb;
+};
+
+struct loopback_hcd {
+    volatile bool port_csc;
+    volatile bool port_pec;
+    volatile bool port_pe;
+    volatile bool port_prc;
+    bool running;
+    bool pending;
+    bool inited;
+    usb_dlist_t urb_list;
+    struct loopback_pipe pipe_pool[CONFIG_USB_LOOPBACK_PIPE_NUM];
+} g_loopback_hcd[CONFIG_USBHOST_MAX_BUS];
+
+/* Device side work collected while the link is locked, dispatched after unlock */
+struct loopback_event {
+    bool setup;
+    uint8_t setup_packet[8];
+    uint8_t ep;
+    bool ep_complete;
+    uint32_t nbytes;
+    struct loopback_pipe *done;
+    struct usbh_urb *urb;
+};
+
+static struct loopback_pipe *loopback_pipe_alloc(struct usbh_bus *bus)
+{
+    struct loopback_pipe *pipe;
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    for (uint8_t i = 0; i < CONFIG_USB_LOOPBACK_PIPE_NUM; i++) {
+        pipe = &g_loopback_hcd[bus->hcd.hcd_id].pipe_pool[i];
+        if (!pipe->inuse) {
+            pipe->inuse = true;
+            usb_osal_leave_critical_section(flags);
+            /* drop a late wakeup left by a timed out transfer */
+            usb_osal_sem_reset(pipe->waitsem);
+            return pipe;
+        }
+    }
+    usb_osal_leave_critical_section(flags);
+    return NULL;
+}
+
+static void loopback_pipe_free(struct loopback_pipe *pipe)
+{
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    if (pipe->urb) {
+        pipe->urb->hcpriv = NULL;
+        pipe->urb = NULL;
+    }
+    pipe->inuse = false;
+    usb_osal_leave_critical_section(flags);
+}
+
+static inline bool loopback_device_attached(uint8_t busid)
+{
+    return (busid < CONFIG_USBDEV_MAX_BUS) && g_loopback_udc[busid].attached;
+}
+
+/*
+ * Move data from a device IN endpoint into the host buffer. Device transfers that are not a
+ * multiple of mps (or zlp) end with a short packet and terminate the host transfer as well.
+ *
+ * return 1 on progress, 0 on nak, -USB_ERR_STALL on stall.
+ */
+static int loopback_xfer_in(uint8_t busid, uint8_t ep_idx, uint8_t *buf, uint32_t buflen, uint32_t *actual, bool *done, struct loopback_event *evt)
+{
+    struct usb_loopback_ep *ep = &g_loopback_udc[busid].in_ep[ep_idx];
+    uint32_t len;
+
+    if (ep->ep_stalled) {
+        return -USB_ERR_STALL;
+    }
+    if (!ep->ep_enable || !ep->ep_busy) {
+        return 0;
+    }
+
+    len = MIN(ep->xfer_len - ep->actual_xfer_len, buflen - *actual);
+    if (len) {
+        memcpy(buf + *actual, ep->xfer_buf + ep->actual_xfer_len, len);
+    }
+    ep->actual_xfer_len += len;
+    *actual += len;
+
+    if (ep->actual_xfer_len == ep->xfer_len) {
+        if ((ep->xfer_len == 0) || (ep->ep_mps == 0) || (ep->xfer_len % ep->ep_mps) || (*actual == buflen)) {
+            *done = true;
+        }
+        ep->ep_busy = false;
+        evt->ep = ep_idx | 0x80;
+        evt->ep_complete = true;
+        evt->nbytes = ep->actual_xfer_len;
+    } else {
+        /* host buffer is full, the rest is left for next transfer */
+        *done = true;
+    }
+    return 1;
+}
+
+/*
+ * Move data from the host buffer into a device OUT endpoint. Device transfers complete on
+ * a short packet (or zlp) or when the device buffer is full.
+ *
+ * return 1 on progress, 0 on nak, -USB_ERR_STALL on stall.
+ */
+static int loopback_xfer_out(uint8_t busid, uint8_t ep_idx, uint8_t *buf, uint32_t buflen, uint32_t *actual, bool *done, struct loopback_event *evt)
+{
+    struct usb_loopback_ep *ep = &g_loopback_udc[busid].out_ep[ep_idx];
+    uint32_t len;
+    bool short_packet = false;
+
+    if (ep->ep_stalled) {
+        return -USB_ERR_STALL;
+    }
+    if (!ep->ep_enable || !ep->ep_busy) {
+        return 0;
+    }
+
+    len = MIN(ep->xfer_len - ep->actual_xfer_len, buflen - *actual);
+    if (len) {
+        memcpy(ep->xfer_buf + ep->actual_xfer_len, buf + *actual, len);
+    }
+    ep->actual_xfer_len += len;
+    *actual += len;
+
+    if (*actual == buflen) {
+        *done = true;
+        if ((buflen == 0) || (ep->ep_mps == 0) || (buflen % ep->ep_mps)) {
+            short_packet = true;
+        }
+    }
+
+    if (short_packet || (ep->actual_xfer_len == ep->xfer_len)) {
+        ep->ep_busy = false;
+        evt->ep = ep_idx;
+        evt->ep_complete = true;
+        evt->nbytes = ep->actual_xfer_len;
+    }
+    return 1;
+}
+
+static int loopback_control_step(uint8_t busid, struct loopback_pipe *pipe, bool *done, struct loopback_event *evt)
+{
+    struct usbh_urb *urb = pipe->urb;
+    struct usb_setup_packet *setup = urb->setup;
+    uint32_t buflen = MIN(setup->wLength, urb->transfer_buffer_length);
+    uint32_t zero = 0;
+    bool stage_done = false;
+    int ret = 0;
+
+    switch (pipe->ep0_state) {
+        case USB_EP0_STATE_SETUP:
+            /* setup always wins, it clears ep0 stall and aborts the previous control transfer */
+            g_loopback_udc[busid].in_ep[0].ep_stalled = false;
+            g_loopback_udc[busid].out_ep[0].ep_stalled = false;
+            g_loopback_udc[busid].in_ep[0].ep_busy = false;
+            g_loopback_udc[busid].out_ep[0].ep_busy = false;
+
+            memcpy(evt->setup_packet, setup, 8);
+            evt->setup = true;
+            urb->actual_length = 8;
+
+            if (setup->wLength) {
+                if (setup->bmRequestType & 0x80) {
+                    pipe->ep0_state = USB_EP0_STATE_IN_DATA;
+                } else {
+                    pipe->ep0_state = USB_EP0_STATE_OUT_DATA;
+                }
+            } else {
+                pipe->ep0_state = USB_EP0_STATE_IN_STATUS;
+            }
+            return 1;
+        case USB_EP0_STATE_IN_DATA:
+            ret = loopback_xfer_in(busid, 0, urb->transfer_buffer, buflen, &pipe->ep0_data_len, &stage_done, evt);
+            if (stage_done) {
+                pipe->ep0_state = USB_EP0_STATE_OUT_STATUS;
+            }
+            break;
+        case USB_EP0_STATE_OUT_DATA:
+            ret = loopback_xfer_out(busid, 0, urb->transfer_buffer, buflen, &pipe->ep0_data_len, &stage_done, evt);
+            if (stage_done) {
+                pipe->ep0_state = USB_EP0_STATE_IN_STATUS;
+            }
+            break;
+        case USB_EP0_STATE_IN_STATUS:
+            ret = loopback_xfer_in(busid, 0, NULL, 0, &zero, &stage_done, evt);
+            *done = stage_done;
+            break;
+        case USB_EP0_STATE_OUT_STATUS:
+            ret = loopback_xfer_out(busid, 0, NULL, 0, &zero, &stage_done, evt);
+            *done = stage_done;
+            break;
+        default:
+            break;
+    }
+
+    urb->actual_length = 8 + pipe->ep0_data_len;
+    return ret;
+}
+
+static int loopback_pipe_step(uint8_t busid, struct loopback_pipe *pipe, struct loopback_event *evt)
+{
+    struct usbh_urb *urb = pipe->urb;
+    uint8_t ep_idx = USB_EP_GET_IDX(urb->ep->bEndpointAddress);
+    bool done = false;
+    int ret;
+
+    if (!loopback_device_attached(busid) || !g_loopback_hcd[busid].port_pe) {
+        ret = -USB_ERR_NOTCONN;
+    } else if (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) == USB_ENDPOINT_TYPE_CONTROL) {
+        ret = loopback_control_step(busid, pipe, &done, evt);
+    } else if (ep_idx >= CONFIG_USB_LOOPBACK_EP_NUM) {
+        ret = -USB_ERR_INVAL;
+    } else if (urb->ep->bEndpointAddress & 0x80) {
+        ret = loopback_xfer_in(busid, ep_idx, urb->transfer_buffer, urb->transfer_buffer_length, &urb->actual_length, &done, evt);
+    } else {
+        ret = loopback_xfer_out(busid, ep_idx, urb->transfer_buffer, urb->transfer_buffer_length, &urb->actual_length, &done, evt);
+    }
+
+    if (ret < 0) {
+        urb->errorcode = ret;
+        done = true;
+    } else if (done) {
+        urb->errorcode = 0;
+    }
+
+    if (done) {
+        usb_dlist_remove(&pipe->list);
+        evt->done = pipe;
+        evt->urb = urb;
+        return 1;
+    }
+
+    return ret;
+}
+
+static void loopback_urb_waitup(struct loopback_pipe *pipe, struct usbh_urb *urb)
+{
+    if (urb->errorcode == 0) {
+        usbh_sg_urb_done(urb);
+    }
+
+    if (pipe->waiter) {
+        usb_osal_sem_give(pipe->waitsem);
+    } else {
+        loopback_pipe_free(pipe);
+    }
+
+    if (urb->complete) {
+        if (urb->errorcode < 0) {
+            urb->complete(urb->arg, urb->errorcode);
+        } else {
+            urb->complete(urb->arg, urb->actual_length);
+        }
+    }
+}
+
+static void loopback_process(uint8_t busid)
+{
+    struct loopback_pipe *pipe;
+    struct loopback_event evt;
+    bool progress;
+    size_t flags;
+
+    do {
+        progress = false;
+        memset(&evt, 0, sizeof(struct loopback_event));
+
+        flags = usb_osal_enter_critical_section();
+        usb_dlist_for_each_entry(pipe, &g_loopback_hcd[busid].urb_list, list)
+        {
+            if (loopback_pipe_step(busid, pipe, &evt) != 0) {
+                progress = true;
+                break;
+            }
+        }
+        usb_osal_leave_critical_section(flags);
+
+        if (evt.setup) {
+            usbd_event_ep0_setup_complete_handler(busid, evt.setup_packet);
+        }
+        if (evt.ep_complete) {
+            if (evt.ep & 0x80) {
+                usbd_event_ep_in_complete_handler(busid, evt.ep, evt.nbytes);
+            } else {
+                usbd_event_ep_out_complete_handler(busid, evt.ep, evt.nbytes);
+            }
+        }
+        if (evt.done) {
+            loopback_urb_waitup(evt.done, evt.urb);
+        }
+    } while (progress);
+}
+
+void usb_loopback_run(uint8_t busid)
+{
+    size_t flags;
+
+    if (busid >= CONFIG_USBHOST_MAX_BUS) {
+        return;
+    }
+
+    /* only one context runs the link at a time, others just leave a request behind */
+    flags = usb_osal_enter_critical_section();
+    g_loopback_hcd[busid].pending = true;
+    if (g_loopback_hcd[busid].running) {
+        usb_osal_leave_critical_section(flags);
+        return;
+    }
+    g_loopback_hcd[busid].running = true;
+    while (g_loopback_hcd[busid].pending) {
+        g_loopback_hcd[busid].pending = false;
+        usb_osal_leave_critical_section(flags);
+
+        loopback_process(busid);
+
+        flags = usb_osal_enter_critical_section();
+    }
+    g_loopback_hcd[busid].running = false;
+    usb_osal_leave_critical_section(flags);
+}
+
+void usb_loopback_hc_port_change(uint8_t busid)
+{
+    struct usbh_bus *bus;
+    size_t flags;
+
+    if (busid >= CONFIG_USBHOST_MAX_BUS) {
+        return;
+    }
+
+    bus = &g_usbhost_bus[busid];
+
+    flags = usb_osal_enter_critical_section();
+    if (!g_loopback_hcd[busid].inited) {
+        usb_osal_leave_critical_section(flags);
+        return;
+    }
+    g_loopback_hcd[busid].port_csc = 1;
+    g_loopback_hcd[busid].port_pec = 1;
+    g_loopback_hcd[busid].port_pe = loopback_device_attached(busid);
+    usb_osal_leave_critical_section(flags);
+
+    bus->hcd.roothub.int_buffer[0] = (1 << 1);
+    usbh_hub_thread_wakeup(&bus->hcd.roothub);
+
+    /* fail transfers that are still queued for a removed device */
+    usb_loopback_run(busid);
+}
+
+int usb_hc_init(struct usbh_bus *bus)
+{
+    struct loopback_hcd *hcd = &g_loopback_hcd[bus->hcd.hcd_id];
+
+    memset(hcd, 0, sizeof(struct loopback_hcd));
+    usb_dlist_init(&hcd->urb_list);
+
+    for (uint8_t i = 0; i < CONFIG_USB_LOOPBACK_PIPE_NUM; i++) {
+        hcd->pipe_pool[i].waitsem = usb_osal_sem_create(0);
+        if (hcd->pipe_pool[i].waitsem == NULL) {
+            USB_LOG_ERR("Failed to create waitsem\r\n");
+            return -USB_ERR_NOMEM;
+        }
+    }
+
+    hcd->inited = true;
+
+    if (loopback_device_attached(bus->hcd.hcd_id)) {
+        usb_loopback_hc_port_change(bus->hcd.hcd_id);
+    }
+    return 0;
+}
+
+/* give every queued urb back with -USB_ERR_SHUTDOWN, like usbh_kill_urb does for one */
+static void loopback_urb_flush(struct loopback_hcd *hcd)
+{
+    struct loopback_pipe *pipe;
+    struct usbh_urb *urb;
+    size_t flags;
+
+    while (1) {
+        flags = usb_osal_enter_critical_section();
+        pipe = usb_dlist_first_entry_or_null(&hcd->urb_list, struct loopback_pipe, list);
+        if (pipe == NULL) {
+            usb_osal_leave_critical_section(flags);
+            break;
+        }
+        usb_dlist_remove(&pipe->list);
+        urb = pipe->urb;
+        urb->errorcode = -USB_ERR_SHUTDOWN;
+        usb_osal_leave_critical_section(flags);
+
+        loopback_urb_waitup(pipe, urb);
+    }
+}
+
+static bool loopback_pipe_busy(struct loopback_hcd *hcd)
+{
+    for (uint8_t i = 0; i < CONFIG_USB_LOOPBACK_PIPE_NUM; i++) {
+        if (hcd->pipe_pool[i].inuse) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int usb_hc_deinit(struct usbh_bus *bus)
+{
+    struct loopback_hcd *hcd = &g_loopback_hcd[bus->hcd.hcd_id];
+    volatile uint32_t timeout = 0;
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+    hcd->inited = false;
+    hcd->port_pe = 0;
+    usb_osal_leave_critical_section(flags);
+
+    loopback_urb_flush(hcd);
+
+    /* woken submitters free their pipe, the semaphores must outlive that */
+    while (loopback_pipe_busy(hcd)) {
+        usb_osal_msleep(1);
+        timeout++;
+        if (timeout > 100) {
+            return -USB_ERR_TIMEOUT;
+        }
+    }
+
+    for (uint8_t i = 0; i < CONFIG_USB_LOOPBACK_PIPE_NUM; i++) {
+        if (hcd->pipe_pool[i].waitsem) {
+            usb_osal_sem_delete(hcd->pipe_pool[i].waitsem);
+        }
+    }
+    return 0;
+}
+
+uint16_t usbh_get_frame_number(struct usbh_bus *bus)
+{
+    (void)bus;
+    return 0;
+}
+
+int usbh_roothub_control(struct usbh_bus *bus, struct usb_setup_packet *setup, uint8_t *buf)
+{
+    struct loopback_hcd *hcd = &g_loopback_hcd[bus->hcd.hcd_id];
+    uint8_t nports;
+    uint8_t port;
+    uint32_t status;
+
+    nports = 1;
+    port = setup->wIndex;
+    if (setup->bmRequestType & USB_REQUEST_RECIPIENT_DEVICE) {
+        switch (setup->bRequest) {
+            case HUB_REQUEST_CLEAR_FEATURE:
+                switch (setup->wValue) {
+                    case HUB_FEATURE_HUB_C_LOCALPOWER:
+                        break;
+                    case HUB_FEATURE_HUB_C_OVERCURRENT:
+                        break;
+                    default:
+                        return -USB_ERR_NOTSUPP;
+                }
+                break;
+            case HUB_REQUEST_SET_FEATURE:
+                switch (setup->wValue) {
+                    case HUB_FEATURE_HUB_C_LOCALPOWER:
+                        break;
+                    case HUB_FEATURE_HUB_C_OVERCURRENT:
+                        break;
+                    default:
+                        return -USB_ERR_NOTSUPP;
+                }
+                break;
+            case HUB_REQUEST_GET_DESCRIPTOR:
+                break;
+            case HUB_REQUEST_GET_STATUS:
+                memset(buf, 0, 4);
+                break;
+            default:
+                break;
+        }
+    } else if (setup->bmRequestType & USB_REQUEST_RECIPIENT_OTHER) {
+        switch (setup->bRequest) {
+            case HUB_REQUEST_CLEAR_FEATURE:
+                if (!port || port > nports) {
+                    return -USB_ERR_INVAL;
+                }
+
+                switch (setup->wValue) {
+                    case HUB_PORT_FEATURE_ENABLE:
+                        hcd->port_pe = 0;
+                        break;
+                    case HUB_PORT_FEATURE_SUSPEND:
+                    case HUB_PORT_FEATURE_C_SUSPEND:
+                        break;
+                    case HUB_PORT_FEATURE_POWER:
+                        break;
+                    case HUB_PORT_FEATURE_C_CONNECTION:
+                        hcd->port_csc = 0;
+                        break;
+                    case HUB_PORT_FEATURE_C_ENABLE:
+                        hcd->port_pec = 0;
+                        break;
+                    case HUB_PORT_FEATURE_C_OVER_CURREN:
+                        break;
+                    case HUB_PORT_FEATURE_C_RESET:
+                        hcd->port_prc = 0;
+                        break;
+                    default:
+                        return -USB_ERR_NOTSUPP;
+                }
+                break;
+            case HUB_REQUEST_SET_FEATURE:
+                if (!port || port > nports) {
+                    return -USB_ERR_INVAL;
+                }
+
+                switch (setup->wValue) {
+                    case HUB_PORT_FEATURE_SUSPEND:
+                        break;
+                    case HUB_PORT_FEATURE_POWER:
+                        break;
+                    case HUB_PORT_FEATURE_RESET:
+                        if (loopback_device_attached(bus->hcd.hcd_id)) {
+                            usb_loopback_dc_bus_reset(bus->hcd.hcd_id);
+                            hcd->port_pe = 1;
+                        }
+                        hcd->port_prc = 1;
+                        break;
+
+                    default:
+                        return -USB_ERR_NOTSUPP;
+                }
+                break;
+            case HUB_REQUEST_GET_STATUS:
+                if (!port || port > nports) {
+                    return -USB_ERR_INVAL;
+                }
+
+                status = 0;
+                if (hcd->port_csc) {
+                    status |= (1 << HUB_PORT_FEATURE_C_CONNECTION);
+                }
+                if (hcd->port_pec) {
+                    status |= (1 << HUB_PORT_FEATURE_C_ENABLE);
+                }
+                if (hcd->port_prc) {
+                    status |= (1 << HUB_PORT_FEATURE_C_RESET);
+                }
+
+                if (loopback_device_attached(bus->hcd.hcd_id)) {
+                    status |= (1 << HUB_PORT_FEATURE_CONNECTION);
+                    if (hcd->port_pe) {
+                        status |= (1 << HUB_PORT_FEATURE_ENABLE);
+                    }
+                    if (usbd_get_port_speed(bus->hcd.hcd_id) == USB_SPEED_HIGH) {
+                        status |= (1 << HUB_PORT_FEATURE_HIGHSPEED);
+                    }
+                }
+
+                status |= (1 << HUB_PORT_FEATURE_POWER);
+                memcpy(buf, &status, 4);
+                break;
+            default:
+                break;
+        }
+    }
+    return 0;
+}
+
+int usbh_submit_urb(struct usbh_urb *urb)
+{
+    struct loopback_pipe *pipe;
+    struct usbh_bus *bus;
+    size_t flags;
+    int ret = 0;
+
+    if (!urb || !urb->hport || !urb->ep || !urb->hport->bus) {
+        return -USB_ERR_INVAL;
+    }
+
+    bus = urb->hport->bus;
+
+    if (!urb->hport->connected || !g_loopback_hcd[bus->hcd.hcd_id].port_pe) {
+        return -USB_ERR_NOTCONN;
+    }
+
+    if (urb->errorcode == -USB_ERR_BUSY) {
+        return -USB_ERR_BUSY;
+    }
+
+    if (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) == USB_ENDPOINT_TYPE_ISOCHRONOUS) {
+        return -USB_ERR_NOTSUPP;
+    }
+
+    ret = usbh_sg_urb_prepare(urb, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    pipe = loopback_pipe_alloc(bus);
+    if (pipe == NULL) {
+        return -USB_ERR_NOMEM;
+    }
+
+    flags = usb_osal_enter_critical_section();
+
+    pipe->urb = urb;
+    pipe->waiter = (urb->timeout > 0);
+    pipe->ep0_state = USB_EP0_STATE_SETUP;
+    pipe->ep0_data_len = 0;
+
+    urb->hcpriv = pipe;
+    urb->errorcode = -USB_ERR_BUSY;
+    urb->actual_length = 0;
+
+    usb_dlist_insert_before(&g_loopback_hcd[bus->hcd.hcd_id].urb_list, &pipe->list);
+    usb_osal_leave_critical_section(flags);
+
+    usb_loopback_run(bus->hcd.hcd_id);
+
+    if (pipe->waiter) {
+        /* wait until timeout or sem give */
+        ret = usb_osal_sem_take(pipe->waitsem, urb->timeout);
+        if (ret < 0) {
+            goto errout_timeout;
+        }
+        urb->timeout = 0;
+        ret = urb->errorcode;
+        /* we can free pipe when waitsem is done */
+        loopback_pipe_free(pipe);
+    }
+    return ret;
+errout_timeout:
+    urb->timeout = 0;
+    usbh_kill_urb(urb);
+    loopback_pipe_free(pipe);
+    return ret;
+}
+
+int usbh_kill_urb(struct usbh_urb *urb)
+{
+    struct loopback_pipe *pipe;
+    size_t flags;
+
+    if (!urb || !urb->hcpriv || !urb->hport->bus) {
+        return -USB_ERR_INVAL;
+    }
+
+    flags = usb_osal_enter_critical_section();
+
+    pipe = (struct loopback_pipe *)urb->hcpriv;
+    if (urb->errorcode != -USB_ERR_BUSY) {
+        /* already completed */
+        usb_osal_leave_critical_section(flags);
+        return 0;
+    }
+
+    usb_dlist_remove(&pipe->list);
+    urb->errorcode = -USB_ERR_SHUTDOWN;
+
+    usb_osal_leave_critical_section(flags);
+
+    loopback_urb_waitup(pipe, urb);
+    return 0;
+}
+
+void USBH_IRQHandler(uint8_t busid)
+{
+    usb_loopback_run(busid);
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2025, sakumisu
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef USB_LOOPBACK_H
+#define USB_LOOPBACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Software loopback controller.
+ *
+ * Device bus N is wired to roothub port 1 of host bus N, both sides live in the same process
+ * and data is moved with memcpy. All device and host events of one link are dispatched from
+ * usb_loopback_run(), which is serialized per link, so it behaves like a single usb irq.
+ */
+
+#ifndef CONFIG_USB_LOOPBACK_EP_NUM
+#define CONFIG_USB_LOOPBACK_EP_NUM 16
+#endif
+
+#ifndef CONFIG_USB_LOOPBACK_PIPE_NUM
+#define CONFIG_USB_LOOPBACK_PIPE_NUM 16
+#endif
+
+/* Endpoint state */
+struct usb_loopback_ep {
+    uint16_t ep_mps;    /* Endpoint max packet size */
+    uint8_t ep_type;    /* Endpoint type */
+    bool ep_enable;     /* Endpoint is opened */
+    bool ep_stalled;    /* Endpoint stall flag */
+    bool ep_busy;       /* Transfer is armed by usbd_ep_start_write/usbd_ep_start_read */
+    uint8_t *xfer_buf;
+    uint32_t xfer_len;
+    uint32_t actual_xfer_len;
+};
+
+/* Device side state */
+struct usb_loopback_udc {
+    bool attached;
+    uint8_t dev_addr;
+    struct usb_loopback_ep in_ep[CONFIG_USB_LOOPBACK_EP_NUM];  /*!< IN endpoint parameters*/
+    struct usb_loopback_ep out_ep[CONFIG_USB_LOOPBACK_EP_NUM]; /*!< OUT endpoint parameters */
+};
+
+extern struct usb_loopback_udc g_loopback_udc[];
+
+/* called by host side, implemented in usb_dc_loopback.c */
+void usb_loopback_dc_bus_reset(uint8_t busid);
+
+/* called by device side, implemented in usb_hc_loopback.c */
+void usb_loopback_hc_port_change(uint8_t busid);
+void usb_loopback_run(uint8_t busid);
+
+#endif /* USB_LOOPBACK_H */
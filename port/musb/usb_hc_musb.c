@@ -162,6 +162,8 @@ struct musb_pipe {
     volatile uint8_t ep0_state;
     usb_osal_sem_t waitsem;
     struct usbh_urb *urb;
+    uint32_t sg_idx;    /* current segment of sg urb */
+    uint32_t sg_offset; /* bytes done in current segment */
 };
 
 struct musb_hcd {
@@ -262,6 +264,58 @@ static void musb_read_packet(struct usbh_bus *bus, uint8_t ep_idx, uint8_t *buff
     }
 }
 
+/* fifo access of bulk and intr urbs, packets of sg urbs are gathered from or scattered to the segments */
+static void musb_urb_packet(struct usbh_bus *bus, uint8_t ep_idx, struct usbh_urb *urb, uint8_t *buffer, uint32_t len, bool read)
+{
+    struct musb_pipe *pipe = (struct musb_pipe *)urb->hcpriv;
+    uint32_t idx;
+    uint32_t offset;
+    uint32_t n;
+
+    if (urb->num_sgs == 0) {
+        if (read) {
+            musb_read_packet(bus, ep_idx, buffer, len);
+        } else {
+            musb_write_packet(bus, ep_idx, buffer, len);
+        }
+        return;
+    }
+
+    idx = pipe->sg_idx;
+    offset = pipe->sg_offset;
+    while (len && (idx < urb->num_sgs)) {
+        n = MIN(len, urb->sg[idx].length - offset);
+        if (read) {
+            musb_read_packet(bus, ep_idx, urb->sg[idx].buffer + offset, n);
+        } else {
+            musb_write_packet(bus, ep_idx, urb->sg[idx].buffer + offset, n);
+        }
+        len -= n;
+        offset += n;
+        if (offset == urb->sg[idx].length) {
+            idx++;
+            offset = 0;
+        }
+    }
+}
+
+static void musb_urb_advance(struct usbh_urb *urb, uint32_t size)
+{
+    struct musb_pipe *pipe = (struct musb_pipe *)urb->hcpriv;
+
+    if (urb->num_sgs) {
+        pipe->sg_offset += size;
+        while ((pipe->sg_idx < urb->num_sgs) && (pipe->sg_offset >= urb->sg[pipe->sg_idx].length)) {
+            pipe->sg_offset -= urb->sg[pipe->sg_idx].length;
+            pipe->sg_idx++;
+        }
+    } else {
+        urb->transfer_buffer += size;
+    }
+    urb->transfer_buffer_length -= size;
+    urb->actual_length += size;
+}
+
 static uint32_t musb_get_fifo_size(uint16_t mps, uint16_t *used)
 {
     uint32_t size;
@@ -407,7 +461,7 @@ int musb_bulk_urb_init(struct usbh_bus *bus, uint8_t chidx, struct usbh_urb *urb
             buflen = USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize);
         }
 
-        musb_write_packet(bus, chidx, buffer, buflen);
+        musb_urb_packet(bus, chidx, urb, buffer, buflen, false);
         HWREGB(USB_TXCSRH_BASE(chidx)) |= USB_TXCSRH1_MODE;
         HWREGB(USB_TXCSRL_BASE(chidx)) = USB_TXCSRL1_TXRDY;
 
@@ -480,7 +534,7 @@ int musb_intr_urb_init(struct usbh_bus *bus, uint8_t chidx, struct usbh_urb *urb
             buflen = USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize);
         }
 
-        musb_write_packet(bus, chidx, buffer, buflen);
+        musb_urb_packet(bus, chidx, urb, buffer, buflen, false);
         HWREGB(USB_TXCSRH_BASE(chidx)) |= USB_TXCSRH1_MODE;
         HWREGB(USB_TXCSRL_BASE(chidx)) = USB_TXCSRL1_TXRDY;
 
@@ -762,6 +816,13 @@ int usbh_submit_urb(struct usbh_urb *urb)
         return -USB_ERR_BUSY;
     }
 
+    /* sg is done by pio, no bounce buffer is needed */
+    if (urb->num_sgs &&
+        (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) != USB_ENDPOINT_TYPE_BULK) &&
+        (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) != USB_ENDPOINT_TYPE_INTERRUPT)) {
+        return -USB_ERR_NOTSUPP;
+    }
+
     bus = urb->hport->bus;
 
     if (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) == USB_ENDPOINT_TYPE_CONTROL) {
@@ -778,6 +839,8 @@ int usbh_submit_urb(struct usbh_urb *urb)
     pipe = &g_musb_hcd[bus->hcd.hcd_id].pipe_pool[chidx];
     pipe->chidx = chidx;
     pipe->urb = urb;
+    pipe->sg_idx = 0;
+    pipe->sg_offset = 0;
 
     urb->hcpriv = pipe;
     urb->errorcode = -USB_ERR_BUSY;
@@ -1100,16 +1163,14 @@ void USBH_IRQHandler(uint8_t busid)
                         size = USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize);
                     }
 
-                    urb->transfer_buffer += size;
-                    urb->transfer_buffer_length -= size;
-                    urb->actual_length += size;
+                    musb_urb_advance(urb, size);
 
                     if (urb->transfer_buffer_length == 0) {
                         //HWREGH(USB_BASE + MUSB_TXIE_OFFSET) &= ~(1 << ep_idx);
                         urb->errorcode = 0;
                         musb_urb_waitup(urb);
                     } else {
-                        musb_write_packet(bus, ep_idx, urb->transfer_buffer, MIN(urb->transfer_buffer_length, USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize)));
+                        musb_urb_packet(bus, ep_idx, urb, urb->transfer_buffer, MIN(urb->transfer_buffer_length, USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize)), false);
                         HWREGB(USB_TXCSRL_BASE(ep_idx)) = USB_TXCSRL1_TXRDY;
                     }
                 }
@@ -1145,13 +1206,11 @@ void USBH_IRQHandler(uint8_t busid)
                 if (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) != USB_ENDPOINT_TYPE_ISOCHRONOUS) {
                     size = HWREGH(USB_RXCOUNT_BASE(ep_idx));
 
-                    musb_read_packet(bus, ep_idx, urb->transfer_buffer, size);
+                    musb_urb_packet(bus, ep_idx, urb, urb->transfer_buffer, size, true);
 
                     HWREGB(USB_RXCSRL_BASE(ep_idx)) &= ~USB_RXCSRL1_RXRDY;
 
-                    urb->transfer_buffer += size;
-                    urb->transfer_buffer_length -= size;
-                    urb->actual_length += size;
+                    musb_urb_advance(urb, size);
 
                     if ((size < USB_GET_MAXPACKETSIZE(urb->ep->wMaxPacketSize)) || (urb->transfer_buffer_length == 0)) {
                         //HWREGH(USB_BASE + MUSB_RXIE_OFFSET) &= ~(1 << ep_idx);
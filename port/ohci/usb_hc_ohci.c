@@ -268,6 +268,14 @@ int ohci_roothub_control(struct usbh_bus *bus, struct usb_setup_packet *setup, u
 
 int ohci_submit_urb(struct usbh_urb *urb)
 {
+    int ret;
+
+    /* no sg support in the td chain, lists always go through the bounce buffer */
+    ret = usbh_sg_urb_prepare(urb, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
     return -USB_ERR_NOTSUPP;
 }
 
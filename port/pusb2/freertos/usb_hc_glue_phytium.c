@@ -23,6 +23,15 @@
 
 #include "usbh_core.h"
 
+/* struct usbh_urb layout the prebuilt libpusb2_hc was compiled with, raise it when linking a rebuilt library */
+#ifndef CONFIG_USB_PUSB2_HC_URB_LAYOUT
+#define CONFIG_USB_PUSB2_HC_URB_LAYOUT 1
+#endif
+
+#if CONFIG_USB_PUSB2_HC_URB_LAYOUT != USBH_URB_LAYOUT_VERSION
+#error "libpusb2_hc was compiled for another struct usbh_urb layout, rebuild it against common/usb_hc.h"
+#endif
+
 /************************** Constant Definitions *****************************/
 #define USB_MEMP_TOTAL_SIZE     SZ_1M
 
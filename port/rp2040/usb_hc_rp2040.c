@@ -509,6 +509,11 @@ int usbh_submit_urb(struct usbh_urb *urb)
         return -USB_ERR_BUSY;
     }
 
+    ret = usbh_sg_urb_prepare(urb, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
     bus = urb->hport->bus;
 
     if (USB_GET_ENDPOINT_TYPE(urb->ep->bmAttributes) == USB_ENDPOINT_TYPE_CONTROL) {
@@ -617,6 +622,12 @@ static void rp2040_urb_waitup(struct usbh_urb *urb)
 
     pipe = (struct rp2040_pipe *)urb->hcpriv;
 
+    if (urb->num_sgs && (urb->errorcode == 0)) {
+        /* transfer_buffer has been moved along with the data, rewind it to the bounce buffer */
+        urb->transfer_buffer -= urb->actual_length;
+        usbh_sg_urb_done(urb);
+    }
+
     if (urb->timeout) {
         usb_osal_sem_give(pipe->waitsem);
     } else {
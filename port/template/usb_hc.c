@@ -120,6 +120,17 @@ int usbh_roothub_control(struct usbh_bus *bus, struct usb_setup_packet *setup, u
 
 int usbh_submit_urb(struct usbh_urb *urb)
 {
+    int ret;
+
+    /*
+     * pass the dma alignment if the controller can chain urb->sg itself, 0 bounces every list.
+     * Call usbh_sg_urb_done() before the urb is given back.
+     */
+    ret = usbh_sg_urb_prepare(urb, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
     return -USB_ERR_NOTSUPP;
 }
 
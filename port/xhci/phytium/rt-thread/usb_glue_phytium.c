@@ -13,6 +13,15 @@
 
 #include "usb_config.h"
 
+/* struct usbh_urb layout the prebuilt libxhci was compiled with, raise it when linking a rebuilt library */
+#ifndef CONFIG_USB_XHCI_HC_URB_LAYOUT
+#define CONFIG_USB_XHCI_HC_URB_LAYOUT 1
+#endif
+
+#if CONFIG_USB_XHCI_HC_URB_LAYOUT != USBH_URB_LAYOUT_VERSION
+#error "libxhci was compiled for another struct usbh_urb layout, rebuild it against common/usb_hc.h"
+#endif
+
 void usb_hc_setup_xhci_interrupt(uint32_t id);
 void usb_hc_revoke_xhci_interrupt(uint32_t id);
 
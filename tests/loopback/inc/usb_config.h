@@ -0,0 +1,14 @@
+/*
+ * Copyright (c) 2025, sakumisu
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef LOOPBACK_USB_CONFIG_H
+#define LOOPBACK_USB_CONFIG_H
+
+/* the defaults of the template, only what the loopback tests need differs */
+#define CONFIG_USB_DBG_LEVEL USB_DBG_WARNING
+
+#include "cherryusb_config_template.h"
+
+#endif